@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <inttypes.h>
+#include <sys/epoll.h>
+
+#include <log/log.h>
+
+#include "AcquireFenceWaiter.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+
+namespace {
+constexpr char kClass[] = "AcquireFenceWaiter";
+constexpr int kMaxEvents = 8;
+}  // namespace
+
+AcquireFenceWaiter::AcquireFenceWaiter()
+        : mEpollFd(epoll_create1(EPOLL_CLOEXEC)) {
+    LOG_ALWAYS_FATAL_IF(!mEpollFd.ok(), "epoll_create1 failed with %s (%d)",
+                        strerror(errno), errno);
+}
+
+int64_t AcquireFenceWaiter::wait(const Span<CachedStreamBuffer* const> csbs,
+                                 const unsigned timeoutMs) {
+    using namespace std::chrono_literals;
+    const auto start = std::chrono::steady_clock::now();
+    const int epollFd = mEpollFd.get();
+
+    size_t nPending = 0;
+    for (CachedStreamBuffer* csb : csbs) {
+        const int fence = csb->getAcquireFence();
+        if (fence >= 0) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = csb;
+
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fence, &ev)) {
+                ALOGE("%s:%s:%d epoll_ctl failed with %s (%d)",
+                      kClass, __func__, __LINE__, strerror(errno), errno);
+            } else {
+                ++nPending;
+            }
+        }
+    }
+
+    if (nPending > 0) {
+        const auto deadline = start + 1ms * timeoutMs;
+        struct epoll_event events[kMaxEvents];
+
+        while (nPending > 0) {
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                break;
+            }
+
+            const int remainingMs = (deadline - now + 999us) / 1ms;
+            const int n = epoll_wait(epollFd, events, kMaxEvents, remainingMs);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                } else {
+                    ALOGE("%s:%s:%d epoll_wait failed with %s (%d)",
+                          kClass, __func__, __LINE__, strerror(errno), errno);
+                    break;
+                }
+            }
+
+            for (int i = 0; i < n; ++i) {
+                CachedStreamBuffer* csb = static_cast<CachedStreamBuffer*>(events[i].data.ptr);
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, csb->getAcquireFence(), nullptr);
+                --nPending;
+
+                // a fence in the error state is not a reason to write into the buffer
+                if (events[i].events & EPOLLERR) {
+                    ALOGE("%s:%s:%d streamId=%d bufferId=%" PRId64 ": the "
+                          "acquire fence is in the error state",
+                          kClass, __func__, __LINE__,
+                          csb->getStreamId(), csb->getBufferId());
+                } else {
+                    csb->resetAcquireFence();
+                }
+            }
+        }
+
+        if (nPending > 0) {
+            for (CachedStreamBuffer* csb : csbs) {
+                const int fence = csb->getAcquireFence();
+                if (fence >= 0) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, fence, nullptr);
+                }
+            }
+        }
+    }
+
+    return (std::chrono::steady_clock::now() - start) / 1ns;
+}
+
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+
+#include "CachedStreamBuffer.h"
+#include "Span.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+
+// Waits for acquire fences of several buffers at once using epoll. Fences
+// which signal are dropped from their buffers (see
+// `CachedStreamBuffer::getAcquireFence`), the others are left intact to be
+// returned to the framework as release fences.
+struct AcquireFenceWaiter {
+    AcquireFenceWaiter();
+
+    // Returns the time spent waiting in nanoseconds.
+    int64_t wait(Span<CachedStreamBuffer* const> csbs, unsigned timeoutMs);
+
+private:
+    base::unique_fd mEpollFd;
+
+    AcquireFenceWaiter(const AcquireFenceWaiter&) = delete;
+    AcquireFenceWaiter& operator=(const AcquireFenceWaiter&) = delete;
+};
+
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -41,6 +41,20 @@ template <class T> struct BlockingQueue {
         }
     }
 
+    // Either moves all of `xs[0..n)` into the queue or none of them.
+    bool putAll(T* xs, const size_t n)  {
+        std::lock_guard lock(mtx);
+        if (cancelled) {
+            return false;
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                queue.push_back(std::move(xs[i]));
+            }
+            available.notify_one();
+            return true;
+        }
+    }
+
     std::optional<T> get() {
         std::unique_lock lock(mtx);
         while (true) {
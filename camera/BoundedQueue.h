@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+
+// A lock free queue over a ring of `N` slots (Vyukov's bounded MPMC queue).
+// Only the slots are preallocated, `T` moves in and out of them with its own
+// heap storage. `put` and `tryGet` never take a lock unless the queue is
+// full, `get` sleeps on a condition variable only if the queue is empty.
+// Only one thread is expected to block in `get`, any thread may call `tryGet`.
+template <class T, size_t N> struct BoundedQueue {
+    static_assert((N >= 2) && ((N & (N - 1)) == 0), "N must be a power of two");
+
+    BoundedQueue() {
+        for (size_t i = 0; i < N; ++i) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool put(T* x) {
+        return putAll(x, 1) == 1;
+    }
+
+    // Moves `xs[0..n)` into the queue and wakes the consumer once, returns
+    // how many were put (less than `n` only if cancelled), the rest stay in
+    // `xs`. Waits for the consumer if the queue is full.
+    size_t putAll(T* xs, const size_t n) {
+        size_t i = 0;
+        while ((i < n) && !cancelled.load(std::memory_order_relaxed) &&
+                putOrWait(&xs[i])) {
+            ++i;
+        }
+
+        if (i > 0) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (consumerWaiting.load(std::memory_order_relaxed)) {
+                std::lock_guard lock(mtx);
+                available.notify_one();
+            }
+        }
+
+        return i;
+    }
+
+    std::optional<T> get() {
+        while (true) {
+            std::optional<T> x = tryGet();
+            if (x) {
+                return x;
+            }
+
+            std::unique_lock lock(mtx);
+            consumerWaiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            x = pop();
+            if (x || cancelled.load(std::memory_order_relaxed)) {
+                consumerWaiting.store(false, std::memory_order_relaxed);
+                if (x) {
+                    notifySpaceAvailable(true);
+                }
+                return x;
+            }
+
+            available.wait(lock);
+            consumerWaiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    std::optional<T> tryGet() {
+        std::optional<T> x = pop();
+        if (x) {
+            notifySpaceAvailable(false);
+        }
+        return x;
+    }
+
+    void cancel() {
+        std::lock_guard lock(mtx);
+        cancelled.store(true, std::memory_order_relaxed);
+        available.notify_one();
+        spaceAvailable.notify_all();
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue(BoundedQueue&&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(BoundedQueue&&) = delete;
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::optional<T> pop() {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & (N - 1)];
+            const size_t seq = slot.seq.load(std::memory_order_acquire);
+            const intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    T x = std::move(slot.value);
+                    slot.seq.store(pos + N, std::memory_order_release);
+                    return x;
+                }
+            } else if (diff < 0) {
+                return std::nullopt;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // false if cancelled while the queue is full, `*x` is not moved then
+    bool putOrWait(T* x) {
+        using namespace std::chrono_literals;
+
+        while (!tryPut(x)) {
+            std::unique_lock lock(mtx);
+            if (cancelled.load(std::memory_order_relaxed)) {
+                return false;
+            }
+
+            producersWaiting.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const bool put = tryPut(x);
+            if (!put) {
+                // the consumer could still sleep on what was put before,
+                // it notifies back, the timeout only bounds the wait.
+                available.notify_one();
+                spaceAvailable.wait_for(lock, 10ms);
+            }
+            producersWaiting.fetch_sub(1, std::memory_order_relaxed);
+
+            if (put) {
+                return true;
+            }
+        }
+
+        return true;
+    }
+
+    // wakes producers waiting for a slot, pass `locked` if `mtx` is held
+    void notifySpaceAvailable(const bool locked) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (producersWaiting.load(std::memory_order_relaxed)) {
+            if (locked) {
+                spaceAvailable.notify_all();
+            } else {
+                std::lock_guard lock(mtx);
+                spaceAvailable.notify_all();
+            }
+        }
+    }
+
+    bool tryPut(T* x) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & (N - 1)];
+            const size_t seq = slot.seq.load(std::memory_order_acquire);
+            const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(*x);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    Slot slots[N];
+    alignas(64) std::atomic<size_t> head = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+    std::atomic<bool> consumerWaiting = false;
+    std::atomic<int> producersWaiting = 0;
+    std::atomic<bool> cancelled = false;
+    std::condition_variable available;
+    std::condition_variable spaceAvailable;  // for producers of a full queue
+    std::mutex mtx;
+};
+
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -159,6 +159,12 @@ StreamBuffer CachedStreamBuffer::finish(const bool success) {
     return sb;
 }
 
+void CachedStreamBuffer::discard() {
+    LOG_ALWAYS_FATAL_IF(mProcessed);
+    mAcquireFence.reset();
+    mProcessed = true;
+}
+
 }  // namespace implementation
 }  // namespace provider
 }  // namespace camera
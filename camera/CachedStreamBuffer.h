@@ -42,6 +42,9 @@ struct CachedStreamBuffer {
 
     void importAcquireFence(const NativeHandle& fence);
     bool waitAcquireFence(unsigned timeoutMs);
+    // -1 if there is no fence or it has signaled already
+    int getAcquireFence() const { return mAcquireFence.get(); }
+    void resetAcquireFence() { mAcquireFence.reset(); }
 
     // this methods are used by cameras to save on lookups by `getStreamId()`
     void setStreamInfo(const void* ptr) { mStreamInfoPtr = ptr; }
@@ -50,6 +53,9 @@ struct CachedStreamBuffer {
     }
 
     StreamBuffer finish(bool success);
+    // undoes the update for a request which was not accepted, the framework
+    // did not hand the buffer over and nothing is returned
+    void discard();
 
 private:
     const native_handle_t* mBuffer;  // owned by this class
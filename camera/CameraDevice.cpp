@@ -16,7 +16,9 @@
 
 #define FAILURE_DEBUG_PREFIX "CameraDevice"
 
+#include <algorithm>
 #include <charconv>
+#include <iterator>
 #include <string_view>
 
 #include <system/camera_metadata.h>
@@ -47,6 +49,29 @@ const uint32_t kExtraResultKeys[] = {
     ANDROID_STATISTICS_SCENE_FLICKER,
 };
 
+// constrained high-speed video runs at 120 or 240 fps
+constexpr int32_t kHighSpeedMinFps = 120;
+constexpr int32_t kHighSpeedPreviewFps = 30;
+
+// YUV reprocessing (see hw::Reprocessor)
+constexpr int32_t kReprocessMaxCaptureStall = 2;
+const uint32_t kExtraRequestKeys[] = {
+    ANDROID_REPROCESS_EFFECTIVE_EXPOSURE_FACTOR,
+};
+
+// RAW16 (row major 3x3, 1/10000 units): XYZ (D65) to linear sRGB and
+// linear sRGB to XYZ (D50)
+const camera_metadata_rational_t kXyzToSrgb[9] = {
+    {32406, 10000}, {-15372, 10000}, {-4986, 10000},
+    {-9689, 10000}, {18758, 10000}, {415, 10000},
+    {557, 10000}, {-2040, 10000}, {10570, 10000},
+};
+const camera_metadata_rational_t kSrgbToXyzD50[9] = {
+    {4361, 10000}, {3851, 10000}, {1431, 10000},
+    {2225, 10000}, {7169, 10000}, {606, 10000},
+    {139, 10000}, {971, 10000}, {7141, 10000},
+};
+
 std::vector<uint32_t> getSortedKeys(const CameraMetadataMap& m) {
     std::vector<uint32_t> keys;
     keys.reserve(m.size());
@@ -88,8 +113,42 @@ CameraDevice::CameraDevice(HwCameraFactoryProduct hwCamera)
 CameraDevice::~CameraDevice() {}
 
 ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
+    std::lock_guard<std::mutex> lock(mMetadataCacheMtx);
+
+    if (!mCameraCharacteristics) {
+        mCameraCharacteristics = serializeCameraMetadataMap(constructCameraCharacteristics());
+        if (!mCameraCharacteristics) {
+            return toScopedAStatus(FAILURE(Status::INTERNAL_ERROR));
+        }
+    }
+
+    *metadata = mCameraCharacteristics.value();
+    return ScopedAStatus::ok();
+}
+
+std::optional<CameraMetadata> CameraDevice::getDefaultRequestSettings(const RequestTemplate tpl) {
+    const size_t i = static_cast<size_t>(tpl) - static_cast<size_t>(RequestTemplate::PREVIEW);
+    if (i >= std::size(mDefaultRequestSettings)) {
+        return serializeCameraMetadataMap(constructDefaultRequestSettings(tpl));
+    }
+
+    std::lock_guard<std::mutex> lock(mMetadataCacheMtx);
+
+    std::optional<CameraMetadata>& cached = mDefaultRequestSettings[i];
+    if (!cached) {
+        cached = serializeCameraMetadataMap(constructDefaultRequestSettings(tpl));
+    }
+
+    return cached;
+}
+
+CameraMetadataMap CameraDevice::constructCameraCharacteristics() const {
     CameraMetadataMap m;
 
+    const auto supportedFormats = mHwCamera->getSupportedPixelFormats();
+    const bool supportsRaw16 = std::find(supportedFormats.begin(), supportedFormats.end(),
+                                         PixelFormat::RAW16) != supportedFormats.end();
+
     {
         m[ANDROID_COLOR_CORRECTION_AVAILABLE_ABERRATION_MODES]
             .add(ANDROID_COLOR_CORRECTION_ABERRATION_MODE_OFF);
@@ -142,6 +201,20 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
         m[ANDROID_CONTROL_AVAILABLE_MODES]
             .add<uint8_t>(ANDROID_CONTROL_MODE_OFF)
             .add<uint8_t>(ANDROID_CONTROL_MODE_AUTO);
+        {
+            // (width, height, fpsMin, fpsMax, batchSizeMax): [30, fps] for
+            // preview and [fps, fps] for recording
+            auto& configs = m[ANDROID_CONTROL_AVAILABLE_HIGH_SPEED_VIDEO_CONFIGURATIONS];
+            for (const hw::HighSpeedVideoConfig& c : mHwCamera->getHighSpeedVideoConfigs()) {
+                for (int32_t fps = kHighSpeedMinFps; fps <= c.maxFps; fps *= 2) {
+                    for (const int32_t fpsMin : {kHighSpeedPreviewFps, fps}) {
+                        configs.add<int32_t>(c.size.width).add<int32_t>(c.size.height)
+                            .add<int32_t>(fpsMin).add<int32_t>(fps)
+                            .add<int32_t>(fps / kHighSpeedPreviewFps);
+                    }
+                }
+            }
+        }
         {
             const auto zoomRatioRange = mHwCamera->getZoomRatioRange();
             m[ANDROID_CONTROL_ZOOM_RATIO_RANGE]
@@ -150,8 +223,10 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
         }
     }
     {   // ANDROID_EDGE_...
+        // ZERO_SHUTTER_LAG is required with YUV_REPROCESSING
         m[ANDROID_EDGE_AVAILABLE_EDGE_MODES]
-            .add<uint8_t>(ANDROID_EDGE_MODE_OFF);
+            .add<uint8_t>(ANDROID_EDGE_MODE_OFF)
+            .add<uint8_t>(ANDROID_EDGE_MODE_ZERO_SHUTTER_LAG);
     }
     {   // ANDROID_FLASH_INFO_...
         const auto supportedFlashStrength = mHwCamera->getSupportedFlashStrength();
@@ -205,8 +280,10 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
             ANDROID_LENS_INFO_FOCUS_DISTANCE_CALIBRATION_APPROXIMATE;
     }
     {   // ANDROID_NOISE_REDUCTION_...
+        // ZERO_SHUTTER_LAG is required with YUV_REPROCESSING
         m[ANDROID_NOISE_REDUCTION_AVAILABLE_NOISE_REDUCTION_MODES]
-            .add<uint8_t>(ANDROID_NOISE_REDUCTION_MODE_OFF);
+            .add<uint8_t>(ANDROID_NOISE_REDUCTION_MODE_OFF)
+            .add<uint8_t>(ANDROID_NOISE_REDUCTION_MODE_ZERO_SHUTTER_LAG);
     }
     {   // ANDROID_REQUEST_...
         {
@@ -217,17 +294,28 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
                 .add<int32_t>(std::get<2>(maxNumOutputStreams));
         }
 
-        m[ANDROID_REQUEST_MAX_NUM_INPUT_STREAMS] = int32_t(0);
+        m[ANDROID_REQUEST_MAX_NUM_INPUT_STREAMS] = int32_t(1);
         m[ANDROID_REQUEST_PIPELINE_MAX_DEPTH] = mHwCamera->getPipelineMaxDepth();
         m[ANDROID_REQUEST_PARTIAL_RESULT_COUNT] = int32_t(1);
-        m[ANDROID_REQUEST_AVAILABLE_CAPABILITIES]
+        auto& capabilities = m[ANDROID_REQUEST_AVAILABLE_CAPABILITIES]
             .add(ANDROID_REQUEST_AVAILABLE_CAPABILITIES_BACKWARD_COMPATIBLE)
-            .add(ANDROID_REQUEST_AVAILABLE_CAPABILITIES_READ_SENSOR_SETTINGS);
+            .add(ANDROID_REQUEST_AVAILABLE_CAPABILITIES_READ_SENSOR_SETTINGS)
+            .add(ANDROID_REQUEST_AVAILABLE_CAPABILITIES_OFFLINE_PROCESSING)
+            .add(ANDROID_REQUEST_AVAILABLE_CAPABILITIES_YUV_REPROCESSING);
+        if (mHwCamera->getHighSpeedVideoConfigs().size() > 0) {
+            capabilities.add(ANDROID_REQUEST_AVAILABLE_CAPABILITIES_CONSTRAINED_HIGH_SPEED_VIDEO);
+        }
+        if (supportsRaw16) {
+            capabilities.add(ANDROID_REQUEST_AVAILABLE_CAPABILITIES_RAW);
+        }
+    }
+    {   // ANDROID_REPROCESS_...
+        m[ANDROID_REPROCESS_MAX_CAPTURE_STALL] = kReprocessMaxCaptureStall;
     }
     {   // ANDROID_SCALER_...
         {
             auto& v = m[ANDROID_SCALER_AVAILABLE_FORMATS];
-            for (const auto fmt : mHwCamera->getSupportedPixelFormats()) {
+            for (const auto fmt : supportedFormats) {
                 v.add(fmt);
             }
         }
@@ -243,6 +331,11 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
 
         m[ANDROID_SCALER_AVAILABLE_MAX_DIGITAL_ZOOM] =
             float(mHwCamera->getMaxDigitalZoom());
+        m[ANDROID_SCALER_AVAILABLE_INPUT_OUTPUT_FORMATS_MAP]
+            .add<int32_t>(static_cast<int32_t>(PixelFormat::YCBCR_420_888))
+            .add<int32_t>(2)
+            .add<int32_t>(static_cast<int32_t>(PixelFormat::BLOB))
+            .add<int32_t>(static_cast<int32_t>(PixelFormat::YCBCR_420_888));
 
         {
             auto& streamConfigurations = m[ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS];
@@ -251,10 +344,13 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
 
             const int64_t minFrameDurationNs = mHwCamera->getMinFrameDurationNs();
             const int64_t stallFrameDurationNs = mHwCamera->getStallFrameDurationNs();
-            const auto supportedFormats = mHwCamera->getSupportedPixelFormats();
 
             for (const auto& res : mHwCamera->getSupportedResolutions()) {
                 for (const auto fmt : supportedFormats) {
+                    if (fmt == PixelFormat::RAW16) {
+                        continue;  // below
+                    }
+
                     const int32_t fmti = static_cast<int32_t>(fmt);
 
                     streamConfigurations
@@ -270,6 +366,30 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
                         .add<int64_t>(res.width).add<int64_t>(res.height)
                         .add<int64_t>((fmt == PixelFormat::BLOB) ? stallFrameDurationNs : 0);
                 }
+
+                streamConfigurations
+                    .add<int32_t>(static_cast<int32_t>(PixelFormat::YCBCR_420_888))
+                    .add<int32_t>(res.width).add<int32_t>(res.height)
+                    .add<int32_t>(ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS_INPUT);
+            }
+
+            if (supportsRaw16) {
+                // RAW16 is the whole pixel array only
+                const int32_t fmti = static_cast<int32_t>(PixelFormat::RAW16);
+                const auto sensorSize = mHwCamera->getSensorSize();
+
+                streamConfigurations
+                    .add<int32_t>(fmti)
+                    .add<int32_t>(sensorSize.width).add<int32_t>(sensorSize.height)
+                    .add<int32_t>(ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS_OUTPUT);
+                minFrameDurations
+                    .add<int64_t>(fmti)
+                    .add<int64_t>(sensorSize.width).add<int64_t>(sensorSize.height)
+                    .add<int64_t>(minFrameDurationNs);
+                stallDurations
+                    .add<int64_t>(fmti)
+                    .add<int64_t>(sensorSize.width).add<int64_t>(sensorSize.height)
+                    .add<int64_t>(0);
             }
         }
 
@@ -309,8 +429,27 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
                 .add<int32_t>(senitivityRange.second);
         }
 
-        m[ANDROID_SENSOR_INFO_COLOR_FILTER_ARRANGEMENT] =
-            ANDROID_SENSOR_INFO_COLOR_FILTER_ARRANGEMENT_RGB;
+        if (supportsRaw16) {
+            // RAW16 frames are mosaicked from sRGB ones, the sensor is sRGB
+            m[ANDROID_SENSOR_INFO_COLOR_FILTER_ARRANGEMENT] =
+                ANDROID_SENSOR_INFO_COLOR_FILTER_ARRANGEMENT_RGGB;
+            m[ANDROID_SENSOR_INFO_WHITE_LEVEL] = int32_t(hw::HwCamera::kRawWhiteLevel);
+            m[ANDROID_SENSOR_BLACK_LEVEL_PATTERN]
+                .add<int32_t>(0).add<int32_t>(0).add<int32_t>(0).add<int32_t>(0);
+            m[ANDROID_SENSOR_REFERENCE_ILLUMINANT1] = ANDROID_SENSOR_REFERENCE_ILLUMINANT1_D65;
+
+            auto& calibration = m[ANDROID_SENSOR_CALIBRATION_TRANSFORM1];
+            auto& colorTransform = m[ANDROID_SENSOR_COLOR_TRANSFORM1];
+            auto& forwardMatrix = m[ANDROID_SENSOR_FORWARD_MATRIX1];
+            for (int i = 0; i < 9; ++i) {
+                calibration.add<camera_metadata_rational_t>({(i % 4) ? 0 : 1, 1});  // identity
+                colorTransform.add<camera_metadata_rational_t>(kXyzToSrgb[i]);
+                forwardMatrix.add<camera_metadata_rational_t>(kSrgbToXyzD50[i]);
+            }
+        } else {
+            m[ANDROID_SENSOR_INFO_COLOR_FILTER_ARRANGEMENT] =
+                ANDROID_SENSOR_INFO_COLOR_FILTER_ARRANGEMENT_RGB;
+        }
 
         {
             const auto exposureTimeRange = mHwCamera->getSensorExposureTimeRange();
@@ -361,6 +500,10 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
     {
         CameraMetadataMap r = constructDefaultRequestSettings(RequestTemplate::PREVIEW);
 
+        for (const uint32_t key : kExtraRequestKeys) {
+            r[key];
+        }
+
         {
             const std::vector<uint32_t> keys = getSortedKeys(r);
             CameraMetadataValue& val = m[ANDROID_REQUEST_AVAILABLE_REQUEST_KEYS];
@@ -372,6 +515,11 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
         for (const uint32_t key : kExtraResultKeys) {
             r[key];
         }
+        if (supportsRaw16) {
+            for (const uint32_t key : metadataGetRawCaptureResultTags()) {
+                r[key];
+            }
+        }
 
         {
             const std::vector<uint32_t> keys = getSortedKeys(r);
@@ -382,13 +530,7 @@ ScopedAStatus CameraDevice::getCameraCharacteristics(CameraMetadata* metadata) {
         }
     }
 
-    auto maybeMetadata = serializeCameraMetadataMap(m);
-    if (maybeMetadata) {
-        *metadata = std::move(maybeMetadata.value());
-        return ScopedAStatus::ok();
-    } else {
-        return toScopedAStatus(Status::INTERNAL_ERROR);
-    }
+    return m;
 }
 
 ScopedAStatus CameraDevice::getPhysicalCameraCharacteristics(
@@ -463,7 +605,8 @@ CameraMetadataMap CameraDevice::constructDefaultRequestSettings(const RequestTem
     m[ANDROID_CONTROL_VIDEO_STABILIZATION_MODE] = ANDROID_CONTROL_VIDEO_STABILIZATION_MODE_OFF;
     m[ANDROID_CONTROL_ZOOM_RATIO] = float(mHwCamera->getZoomRatioRange().first);
 
-    m[ANDROID_EDGE_MODE] = ANDROID_EDGE_MODE_OFF;
+    m[ANDROID_EDGE_MODE] = (tpl == RequestTemplate::ZERO_SHUTTER_LAG) ?
+        ANDROID_EDGE_MODE_ZERO_SHUTTER_LAG : ANDROID_EDGE_MODE_OFF;
 
     m[ANDROID_FLASH_MODE] = ANDROID_FLASH_MODE_OFF;
 
@@ -480,7 +623,8 @@ CameraMetadataMap CameraDevice::constructDefaultRequestSettings(const RequestTem
     m[ANDROID_LENS_OPTICAL_STABILIZATION_MODE] =
         ANDROID_LENS_OPTICAL_STABILIZATION_MODE_OFF;
 
-    m[ANDROID_NOISE_REDUCTION_MODE] = ANDROID_NOISE_REDUCTION_MODE_OFF;
+    m[ANDROID_NOISE_REDUCTION_MODE] = (tpl == RequestTemplate::ZERO_SHUTTER_LAG) ?
+        ANDROID_NOISE_REDUCTION_MODE_ZERO_SHUTTER_LAG : ANDROID_NOISE_REDUCTION_MODE_OFF;
 
     m[ANDROID_SENSOR_TEST_PATTERN_MODE] = ANDROID_SENSOR_TEST_PATTERN_MODE_OFF;
 
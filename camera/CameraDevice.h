@@ -17,6 +17,7 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
 #include <optional>
 
 #include <aidl/android/hardware/camera/device/BnCameraDevice.h>
@@ -63,6 +64,8 @@ struct CameraDevice : public BnCameraDevice {
     ScopedAStatus turnOnTorchWithStrengthLevel(int32_t strength) override;
     ScopedAStatus getTorchStrengthLevel(int32_t* strength) override;
 
+    // serialized once per template (PREVIEW...MANUAL) and cached
+    std::optional<CameraMetadata> getDefaultRequestSettings(RequestTemplate tpl);
     CameraMetadataMap constructDefaultRequestSettings(RequestTemplate tpl) const;
 
     static std::string getPhysicalId(int index);
@@ -71,8 +74,17 @@ struct CameraDevice : public BnCameraDevice {
 private:
     friend struct CameraProvider;
 
+    CameraMetadataMap constructCameraCharacteristics() const;
+
     hw::HwCameraFactoryProduct mHwCamera;
     std::weak_ptr<CameraDevice> mSelf;
+
+    // the static metadata does not change for the lifetime of mHwCamera
+    std::optional<CameraMetadata> mCameraCharacteristics;
+    std::optional<CameraMetadata> mDefaultRequestSettings[
+        static_cast<int>(RequestTemplate::MANUAL) -
+        static_cast<int>(RequestTemplate::PREVIEW) + 1];
+    std::mutex mMetadataCacheMtx;
 };
 
 }  // namespace implementation
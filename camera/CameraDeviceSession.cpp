@@ -18,19 +18,25 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
 #include <memory>
 
+#include <android-base/properties.h>
 #include <log/log.h>
 #include <aidlcommonsupport/NativeHandle.h>
 #include <utils/ThreadDefs.h>
 
+#include <aidl/android/hardware/camera/device/BufferStatus.h>
 #include <aidl/android/hardware/camera/device/ErrorCode.h>
+#include <aidl/android/hardware/camera/device/StreamConfigurationMode.h>
 #include <aidl/android/hardware/graphics/common/Dataspace.h>
 
 #include "debug.h"
 #include "CameraDeviceSession.h"
 #include "CameraDevice.h"
+#include "cpu_budget.h"
 #include "metadata_utils.h"
 
 #include <system/camera_metadata.h>
@@ -42,8 +48,14 @@ namespace provider {
 namespace implementation {
 
 using aidl::android::hardware::camera::common::Status;
+using aidl::android::hardware::camera::device::BufferStatus;
 using aidl::android::hardware::camera::device::CaptureResult;
 using aidl::android::hardware::camera::device::ErrorCode;
+using aidl::android::hardware::camera::device::NotifyMsg;
+using aidl::android::hardware::camera::device::OfflineRequest;
+using aidl::android::hardware::camera::device::OfflineStream;
+using aidl::android::hardware::camera::device::Stream;
+using aidl::android::hardware::camera::device::StreamConfigurationMode;
 using aidl::android::hardware::camera::device::StreamRotation;
 using aidl::android::hardware::camera::device::StreamType;
 
@@ -54,6 +66,15 @@ constexpr char kClass[] = "CameraDeviceSession";
 
 constexpr int64_t kOneSecondNs = 1000000000;
 constexpr size_t kMsgQueueSize = 256 * 1024;
+constexpr int32_t kMaxReprocessInputBuffers = 2;
+constexpr unsigned kReprocessInputFenceTimeoutMs = 500;
+constexpr int32_t kHighSpeedBatchFps = 30;  // batches are `maxFps / 30` requests
+constexpr int64_t kMaxDroppedFrames = 4;  // the capture thread resyncs if behind more
+constexpr int64_t kFetchLatencyEwmaWeight = 8;
+constexpr size_t kMaxResultBatchSize = 16;
+constexpr int kDefaultResultBatchWindowUs = 1000;
+constexpr int kMaxResultBatchWindowUs = 10000;  // the latency bound
+constexpr char kResultBatchWindowProp[] = "vendor.qemu.camera.result_batch_window_us";
 
 struct timespec timespecAddNanos(const struct timespec t, const int64_t addNs) {
     const lldiv_t r = lldiv(t.tv_nsec + addNs, kOneSecondNs);
@@ -76,17 +97,17 @@ const char* pixelFormatToStr(const PixelFormat fmt, char* buf, int bufSz) {
     case PixelFormat::YCBCR_420_888: return "YCBCR_420_888";
     case PixelFormat::RGBA_8888: return "RGBA_8888";
     case PixelFormat::BLOB: return "BLOB";
+    case PixelFormat::Y8: return "Y8";
+    case PixelFormat::RAW16: return "RAW16";
     default:
         snprintf(buf, bufSz, "0x%x", static_cast<uint32_t>(fmt));
         return buf;
     }
 }
 
-void notifyError(ICameraDeviceCallback* cb,
-                 const int32_t frameNumber,
-                 const int32_t errorStreamId,
-                 const ErrorCode err) {
-    using aidl::android::hardware::camera::device::NotifyMsg;
+NotifyMsg makeErrorMsg(const int32_t frameNumber,
+                       const int32_t errorStreamId,
+                       const ErrorCode err) {
     using aidl::android::hardware::camera::device::ErrorMsg;
     using NotifyMsgTag = NotifyMsg::Tag;
 
@@ -100,13 +121,10 @@ void notifyError(ICameraDeviceCallback* cb,
         msg.set<NotifyMsgTag::error>(errorMsg);
     }
 
-    cb->notify({msg});
+    return msg;
 }
 
-void notifyShutter(ICameraDeviceCallback* cb,
-                   const int32_t frameNumber,
-                   const int64_t timestamp) {
-    using aidl::android::hardware::camera::device::NotifyMsg;
+NotifyMsg makeShutterMsg(const int32_t frameNumber, const int64_t timestamp) {
     using aidl::android::hardware::camera::device::ShutterMsg;
     using NotifyMsgTag = NotifyMsg::Tag;
 
@@ -119,7 +137,7 @@ void notifyShutter(ICameraDeviceCallback* cb,
         msg.set<NotifyMsgTag::shutter>(shutterMsg);
     }
 
-    cb->notify({msg});
+    return msg;
 }
 
 CaptureResult makeCaptureResult(const int frameNumber,
@@ -134,6 +152,27 @@ CaptureResult makeCaptureResult(const int frameNumber,
     cr.partialResult = cr.result.metadata.empty() ? 0 : 1;
     return cr;
 }
+
+// Reprocess settings are usually the capture result of the input image,
+// its shutter timestamp is reused.
+int64_t getReprocessTimestamp(const CameraMetadata& settings, const int64_t def) {
+    if (settings.metadata.empty()) {
+        return def;
+    }
+
+    camera_metadata_ro_entry_t entry;
+    if (find_camera_metadata_ro_entry(
+            reinterpret_cast<const camera_metadata_t*>(settings.metadata.data()),
+            ANDROID_SENSOR_TIMESTAMP, &entry) || (entry.data.i64[0] <= 0)) {
+        return def;
+    } else {
+        return entry.data.i64[0];
+    }
+}
+
+size_t getNumBuffers(const hw::HwCaptureRequest& req) {
+    return req.buffers.size() + (req.inputBuffer ? 1 : 0);
+}
 }  // namespace
 
 CameraDeviceSession::CameraDeviceSession(
@@ -144,9 +183,16 @@ CameraDeviceSession::CameraDeviceSession(
          , mCb(std::move(cb))
          , mHwCamera(hwCamera)
          , mRequestQueue(kMsgQueueSize, false)
-         , mResultQueue(kMsgQueueSize, false) {
+         , mResultQueue(kMsgQueueSize, false)
+         , mResultBatchWindow(base::GetIntProperty(kResultBatchWindowProp,
+                                                   kDefaultResultBatchWindowUs,
+                                                   0, kMaxResultBatchWindowUs))
+         , mFrameTimingStats(hwCamera.getFrameTimingStats()) {
     LOG_ALWAYS_FATAL_IF(!mRequestQueue.isValid());
     LOG_ALWAYS_FATAL_IF(!mResultQueue.isValid());
+    mFrameTimingStats.reset();
+    cpu_budget::addCamera();
+    mResultThread = std::thread(&CameraDeviceSession::resultThreadLoop, this);
     mCaptureThread = std::thread(&CameraDeviceSession::captureThreadLoop, this);
     mDelayedCaptureThread = std::thread(&CameraDeviceSession::delayedCaptureThreadLoop, this);
 }
@@ -158,6 +204,14 @@ CameraDeviceSession::~CameraDeviceSession() {
     mDelayedCaptureResults.cancel();
     mCaptureThread.join();
     mDelayedCaptureThread.join();
+
+    {
+        std::lock_guard<std::mutex> lock(mPendingResultsMtx);
+        mResultThreadStopping = true;
+        mPendingResultsCv.notify_one();
+    }
+    mResultThread.join();
+    cpu_budget::removeCamera();
 }
 
 ScopedAStatus CameraDeviceSession::close() {
@@ -210,12 +264,43 @@ ScopedAStatus CameraDeviceSession::configureStreams(
         return toScopedAStatus(status);
     }
 
+    mHighSpeedMaxFps = getHighSpeedMaxFps(cfg, mHwCamera);
+    mHwCamera.setHighSpeedMaxFps(mHighSpeedMaxFps);
+
     const size_t nStreams = cfg.streams.size();
     LOG_ALWAYS_FATAL_IF(halStreams.size() != nStreams);
 
-    if (mHwCamera.configure(cfg.sessionParams, nStreams,
-                            cfg.streams.data(), halStreams.data())) {
+    // the input (reprocessing) stream is not seen by mHwCamera
+    std::vector<Stream> hwStreams;
+    std::vector<HalStream> hwHalStreams;
+    hwStreams.reserve(nStreams);
+    hwHalStreams.reserve(nStreams);
+    for (size_t i = 0; i < nStreams; ++i) {
+        if (cfg.streams[i].streamType != StreamType::INPUT) {
+            hwStreams.push_back(cfg.streams[i]);
+            hwHalStreams.push_back(halStreams[i]);
+        }
+    }
+
+    if (mReprocessor.configure(nStreams, cfg.streams.data(), halStreams.data()) &&
+            mHwCamera.configure(cfg.sessionParams, hwStreams.size(),
+                                hwStreams.data(), hwHalStreams.data())) {
         mStreamBufferCache.clearStreamInfo();
+
+        mOfflineStreamIds.clear();
+        for (const HalStream& hs : halStreams) {
+            mStreamBufferCache.reserve(hs.id, hs.maxBuffers);
+            if (hs.supportOffline) {
+                mOfflineStreamIds.push_back(hs.id);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mFlushingStreamsMtx);
+            mFlushingStreamIds.clear();
+            mStreamConfigCounter = cfg.streamConfigCounter;
+        }
+
         *halStreamsOut = std::move(halStreams);
         return ScopedAStatus::ok();
     } else {
@@ -226,8 +311,7 @@ ScopedAStatus CameraDeviceSession::configureStreams(
 ScopedAStatus CameraDeviceSession::constructDefaultRequestSettings(
         const RequestTemplate tpl,
         CameraMetadata* metadata) {
-    auto maybeMetadata = serializeCameraMetadataMap(
-        mParent->constructDefaultRequestSettings(tpl));
+    auto maybeMetadata = mParent->getDefaultRequestSettings(tpl);
 
     if (maybeMetadata) {
         *metadata = std::move(maybeMetadata.value());
@@ -266,36 +350,157 @@ ScopedAStatus CameraDeviceSession::processCaptureRequest(
         const std::vector<CaptureRequest>& requests,
         const std::vector<BufferCache>& cachesToRemove,
         int32_t* countOut) {
-    for (const BufferCache& bc : cachesToRemove) {
-        mStreamBufferCache.remove(bc.bufferId);
+    if (mOffline) {
+        *countOut = 0;
+        return toScopedAStatus(FAILURE(Status::ILLEGAL_ARGUMENT));
     }
 
-    int count = 0;
+    ScopedFrameStage stage(mFrameTimingStats, FrameStage::SubmitRequests);
+
+    mStreamBufferCache.remove(cachesToRemove);
+
+    // Requests before the first bad one are accepted. They are counted as
+    // in flight and put to the capture thread together.
+    Status status = Status::OK;
+    size_t numBuffers = 0;
+    std::vector<HwCaptureRequest> batch;
+    batch.reserve(requests.size());
     for (const CaptureRequest& r : requests) {
-        const Status s = processOneCaptureRequest(r);
-        if (s == Status::OK) {
-            ++count;
+        HwCaptureRequest& hwReq = batch.emplace_back();
+        status = processOneCaptureRequest(r, &hwReq);
+        if (status == Status::OK) {
+            numBuffers += getNumBuffers(hwReq);
         } else {
-            *countOut = count;
-            return toScopedAStatus(s);
+            batch.pop_back();
+            break;
         }
     }
 
+    mNumBuffersInFlight.fetch_add(numBuffers);
+
+    const size_t batchSize = batch.size();
+    const size_t count = mCaptureRequests.putAll(batch.data(), batchSize);
+    if (count < batchSize) {
+        // not accepted, as if they were never sent: no results or errors
+        size_t numRejectedBuffers = 0;
+        for (size_t i = count; i < batchSize; ++i) {
+            numRejectedBuffers += discardCaptureRequest(&batch[i]);
+        }
+        notifyBuffersReturned(numRejectedBuffers);
+        status = FAILURE(Status::INTERNAL_ERROR);
+    }
+
     *countOut = count;
-    return ScopedAStatus::ok();
+    return toScopedAStatus(status);
 }
 
 ScopedAStatus CameraDeviceSession::signalStreamFlush(
-        const std::vector<int32_t>& /*streamIds*/,
-        const int32_t /*streamConfigCounter*/) {
-    return toScopedAStatus(FAILURE(Status::OPERATION_NOT_SUPPORTED));
+        const std::vector<int32_t>& streamIds,
+        const int32_t streamConfigCounter) {
+    bool added = false;
+    {
+        std::lock_guard<std::mutex> lock(mFlushingStreamsMtx);
+        if (streamConfigCounter < mStreamConfigCounter) {
+            // the streams were reconfigured already
+            return ScopedAStatus::ok();
+        }
+
+        for (const int32_t streamId : streamIds) {
+            if (std::find(mFlushingStreamIds.begin(), mFlushingStreamIds.end(),
+                          streamId) == mFlushingStreamIds.end()) {
+                mFlushingStreamIds.push_back(streamId);
+                added = true;
+            }
+        }
+    }
+
+    // the capture thread returns buffers of already queued requests while
+    // it waits for the next frame
+    if (added) {
+        {
+            std::lock_guard<std::mutex> lock(mFrameSleepMtx);
+            mStreamFlushPending = true;
+        }
+        mFrameSleepCv.notify_all();
+    }
+
+    return ScopedAStatus::ok();
 }
 
 ScopedAStatus CameraDeviceSession::switchToOffline(
-        const std::vector<int32_t>& /*streamsToKeep*/,
-        CameraOfflineSessionInfo* /*offlineSessionInfo*/,
-        std::shared_ptr<ICameraOfflineSession>* /*session*/) {
-    return toScopedAStatus(FAILURE(Status::OPERATION_NOT_SUPPORTED));
+        const std::vector<int32_t>& streamsToKeep,
+        CameraOfflineSessionInfo* offlineSessionInfo,
+        std::shared_ptr<ICameraOfflineSession>* session) {
+    for (const int32_t streamId : streamsToKeep) {
+        if (std::find(mOfflineStreamIds.begin(), mOfflineStreamIds.end(),
+                      streamId) == mOfflineStreamIds.end()) {
+            return toScopedAStatus(FAILURE(Status::ILLEGAL_ARGUMENT));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mFrameSleepMtx);
+        mOffline = true;
+    }
+    mFrameSleepCv.notify_all();
+
+    std::vector<DelayedCaptureResult> offlineResults;
+    {
+        // the frame being captured could produce more delayed results,
+        // the capture thread returns all requests after this point.
+        std::lock_guard<std::mutex> lock(mCaptureMtx);
+
+        while (true) {
+            std::optional<DelayedCaptureResult> maybeDCR = mDelayedCaptureResults.tryGet();
+            if (!maybeDCR.has_value()) {
+                break;
+            }
+
+            DelayedCaptureResult& dcr = maybeDCR.value();
+            // reprocessing reads the input buffer which stays in this session
+            if (!dcr.inputBuffer &&
+                    (std::find(streamsToKeep.begin(), streamsToKeep.end(),
+                               dcr.delayedBuffer.streamId) != streamsToKeep.end())) {
+                offlineResults.push_back(std::move(dcr));
+            } else {
+                returnDelayedResult(std::move(dcr), false, nullptr);
+            }
+        }
+    }
+
+    // a delayed result could be processing on mDelayedCaptureThread, it must
+    // not use the buffers after they move to the offline session.
+    waitBuffersInFlight(offlineResults.size());
+    notifyBuffersReturned(offlineResults.size());
+
+    CameraOfflineSessionInfo info;
+    for (const int32_t streamId : streamsToKeep) {
+        OfflineStream os;
+        os.id = streamId;
+        os.numOutstandingBuffers = std::count_if(
+            offlineResults.begin(), offlineResults.end(),
+            [streamId](const DelayedCaptureResult& dcr){
+                return dcr.delayedBuffer.streamId == streamId;
+            });
+        os.circulatingBufferIds = mStreamBufferCache.getBufferIds(streamId);
+        info.offlineStreams.push_back(std::move(os));
+    }
+
+    for (const DelayedCaptureResult& dcr : offlineResults) {
+        if (info.offlineRequests.empty() ||
+                (info.offlineRequests.back().frameNumber != dcr.frameNumber)) {
+            OfflineRequest req;
+            req.frameNumber = dcr.frameNumber;
+            info.offlineRequests.push_back(std::move(req));
+        }
+        info.offlineRequests.back().pendingStreams.push_back(dcr.delayedBuffer.streamId);
+    }
+
+    *session = ndk::SharedRefBase::make<CameraOfflineSession>(
+        mParent, mStreamBufferCache.extractStreams(streamsToKeep),
+        std::move(offlineResults));
+    *offlineSessionInfo = std::move(info);
+    return ScopedAStatus::ok();
 }
 
 ScopedAStatus CameraDeviceSession::repeatingRequestEnd(
@@ -316,12 +521,31 @@ void CameraDeviceSession::closeImpl() {
 }
 
 void CameraDeviceSession::flushImpl(const std::chrono::steady_clock::time_point start) {
-    mFlushing = true;
+    {
+        std::lock_guard<std::mutex> lock(mFrameSleepMtx);
+        mFlushing = true;
+    }
+    mFrameSleepCv.notify_all();
+    mHwCamera.setAborting(true);
+
+    // requests the capture thread has not picked yet are returned right away
+    while (true) {
+        std::optional<HwCaptureRequest> maybeReq = mCaptureRequests.tryGet();
+        if (maybeReq.has_value()) {
+            disposeCaptureRequest(std::move(maybeReq.value()));
+        } else {
+            break;
+        }
+    }
+
     waitFlushingDone(start);
+    mHwCamera.setAborting(false);
     mFlushing = false;
 }
 
-int CameraDeviceSession::waitFlushingDone(const std::chrono::steady_clock::time_point start) {
+// Returns the number of buffers which did not come back in time, they are
+// reported and left in flight: a stuck buffer is not worth the provider.
+size_t CameraDeviceSession::waitFlushingDone(const std::chrono::steady_clock::time_point start) {
     std::unique_lock<std::mutex> lock(mNumBuffersInFlightMtx);
     if (mNumBuffersInFlight == 0) {
         return 0;
@@ -329,27 +553,28 @@ int CameraDeviceSession::waitFlushingDone(const std::chrono::steady_clock::time_
 
     using namespace std::chrono_literals;
     constexpr int kRecommendedDeadlineMs = 100;
-    constexpr int kFatalDeadlineMs = 1000;
-    const auto fatalDeadline = start + (1ms * kFatalDeadlineMs);
+    constexpr int kMaxDeadlineMs = 1000;
+    const auto maxDeadline = start + (1ms * kMaxDeadlineMs);
 
     const auto checkIfNoBuffersInFlight = [this](){ return mNumBuffersInFlight == 0; };
 
-    if (mNoBuffersInFlight.wait_until(lock, fatalDeadline, checkIfNoBuffersInFlight)) {
+    if (mNoBuffersInFlight.wait_until(lock, maxDeadline, checkIfNoBuffersInFlight)) {
         const int waitedForMs = (std::chrono::steady_clock::now() - start) / 1ms;
 
         if (waitedForMs > kRecommendedDeadlineMs) {
             ALOGW("%s:%s:%d: flushing took %dms, Android "
                   "recommends %dms latency and requires no more than %dms",
                   kClass, __func__, __LINE__, waitedForMs, kRecommendedDeadlineMs,
-                  kFatalDeadlineMs);
+                  kMaxDeadlineMs);
         }
 
-        return waitedForMs;
+        return 0;
     } else {
-        LOG_ALWAYS_FATAL("%s:%s:%d: %zu buffers are still in "
-                         "flight after %dms of waiting, some buffers might have "
-                         "leaked", kClass, __func__, __LINE__, mNumBuffersInFlight,
-                         kFatalDeadlineMs);
+        const size_t numLeaked = mNumBuffersInFlight.load();
+        ALOGE("%s:%s:%d: %zu buffers are still in flight after %dms of "
+              "waiting, some buffers might have leaked", kClass, __func__, __LINE__,
+              numLeaked, kMaxDeadlineMs);
+        return numLeaked;
     }
 }
 
@@ -365,14 +590,16 @@ CameraDeviceSession::configureStreamsStatic(const StreamConfiguration& cfg,
         return {FAILURE(Status::ILLEGAL_ARGUMENT), {}};
     }
 
+    const int32_t highSpeedMaxFps = getHighSpeedMaxFps(cfg, hwCamera);
+    if (highSpeedMaxFps < 0) {
+        return {FAILURE(Status::ILLEGAL_ARGUMENT), {}};
+    }
+
     std::vector<HalStream> halStreams;
     halStreams.reserve(streamsSize);
+    bool hasInputStream = false;
 
     for (const auto& s : cfg.streams) {
-        if (s.streamType == StreamType::INPUT) {
-            return {FAILURE(Status::OPERATION_NOT_SUPPORTED), {}};
-        }
-
         if (s.width <= 0) {
             return {FAILURE(Status::ILLEGAL_ARGUMENT), {}};
         }
@@ -390,6 +617,27 @@ CameraDeviceSession::configureStreamsStatic(const StreamConfiguration& cfg,
         }
 
         HalStream hs;
+        if (s.streamType == StreamType::INPUT) {
+            // only YUV reprocessing, see Reprocessor
+            if (hasInputStream || (s.format != PixelFormat::YCBCR_420_888) ||
+                    (s.width & 1) || (s.height & 1)) {
+                return {FAILURE(Status::OPERATION_NOT_SUPPORTED), {}};
+            }
+            hasInputStream = true;
+
+            hs.id = s.id;
+            hs.overrideFormat = s.format;
+            hs.producerUsage = static_cast<BufferUsage>(0);
+            hs.consumerUsage = BufferUsage::CPU_READ_OFTEN;
+            hs.overrideDataSpace = s.dataSpace;
+            hs.maxBuffers = kMaxReprocessInputBuffers;
+            hs.physicalCameraId = s.physicalCameraId;
+            hs.supportOffline = false;
+
+            halStreams.push_back(std::move(hs));
+            continue;
+        }
+
         std::tie(hs.overrideFormat, hs.producerUsage,
                  hs.overrideDataSpace, hs.maxBuffers) =
             hwCamera.overrideStreamParams(s.format, s.usage, s.dataSpace);
@@ -427,10 +675,17 @@ CameraDeviceSession::configureStreamsStatic(const StreamConfiguration& cfg,
             }
         }
 
+        if (highSpeedMaxFps > 0) {
+            // two batches in flight
+            hs.maxBuffers = std::max(hs.maxBuffers,
+                                     2 * highSpeedMaxFps / kHighSpeedBatchFps);
+        }
+
         hs.id = s.id;
         hs.consumerUsage = static_cast<BufferUsage>(0);
         hs.physicalCameraId = s.physicalCameraId;
-        hs.supportOffline = false;
+        // only delayed (JPEG) results could finish in an offline session
+        hs.supportOffline = (hs.overrideFormat == PixelFormat::BLOB);
 
         halStreams.push_back(std::move(hs));
     }
@@ -438,13 +693,53 @@ CameraDeviceSession::configureStreamsStatic(const StreamConfiguration& cfg,
     return {Status::OK, std::move(halStreams)};
 }
 
-Status CameraDeviceSession::processOneCaptureRequest(const CaptureRequest& request) {
-    // If inputBuffer is valid, the request is for reprocessing
-    if (!isAidlNativeHandleEmpty(request.inputBuffer.buffer)) {
-        return FAILURE(Status::OPERATION_NOT_SUPPORTED);
+// 0 for regular sessions, -1 if a constrained high-speed one is not supported
+int32_t CameraDeviceSession::getHighSpeedMaxFps(const StreamConfiguration& cfg,
+                                                const hw::HwCamera& hwCamera) {
+    if (cfg.operationMode != StreamConfigurationMode::CONSTRAINED_HIGH_SPEED_MODE) {
+        return 0;
+    }
+
+    // preview and/or recording, both of the same size
+    if (cfg.streams.empty() || (cfg.streams.size() > 2)) {
+        return FAILURE(-1);
     }
 
-    if (request.inputWidth || request.inputHeight) {
+    const Stream& s0 = cfg.streams.front();
+    for (const Stream& s : cfg.streams) {
+        if ((s.streamType != StreamType::OUTPUT) ||
+                (s.format != PixelFormat::IMPLEMENTATION_DEFINED) ||
+                (s.width != s0.width) || (s.height != s0.height)) {
+            return FAILURE(-1);
+        }
+    }
+
+    for (const hw::HighSpeedVideoConfig& c : hwCamera.getHighSpeedVideoConfigs()) {
+        if ((c.size.width == s0.width) && (c.size.height == s0.height)) {
+            return c.maxFps;
+        }
+    }
+
+    return FAILURE(-1);
+}
+
+Status CameraDeviceSession::processOneCaptureRequest(const CaptureRequest& request,
+                                                     HwCaptureRequest* hwReq) {
+    // If inputBuffer is valid, the request is for reprocessing
+    const bool reprocess = (request.inputBuffer.bufferId != 0);
+    if (reprocess) {
+        if (!mReprocessor.hasInputStream() ||
+                (request.inputBuffer.streamId != mReprocessor.getInputStreamId())) {
+            return FAILURE(Status::ILLEGAL_ARGUMENT);
+        }
+
+        const Rect<uint16_t> inputSize = mReprocessor.getInputSize();
+        if ((request.inputWidth || request.inputHeight) &&
+                ((request.inputWidth != inputSize.width) ||
+                 (request.inputHeight != inputSize.height))) {
+            return FAILURE(Status::ILLEGAL_ARGUMENT);
+        }
+    } else if (request.inputWidth || request.inputHeight) {
         return FAILURE(Status::OPERATION_NOT_SUPPORTED);
     }
 
@@ -458,8 +753,6 @@ Status CameraDeviceSession::processOneCaptureRequest(const CaptureRequest& reque
         return FAILURE(Status::ILLEGAL_ARGUMENT);
     }
 
-    HwCaptureRequest hwReq;
-
     if (request.fmqSettingsSize < 0) {
         return FAILURE(Status::ILLEGAL_ARGUMENT);
     } else if (request.fmqSettingsSize > 0) {
@@ -469,32 +762,34 @@ Status CameraDeviceSession::processOneCaptureRequest(const CaptureRequest& reque
         if (mRequestQueue.read(
                 reinterpret_cast<int8_t*>(tmp.metadata.data()),
                 request.fmqSettingsSize)) {
-            hwReq.metadataUpdate = std::move(tmp);
+            hwReq->metadataUpdate = std::move(tmp);
         } else {
             return FAILURE(Status::INTERNAL_ERROR);
         }
     } else if (!request.settings.metadata.empty()) {
-        hwReq.metadataUpdate = request.settings;
+        hwReq->metadataUpdate = request.settings;
     }
 
-    hwReq.buffers.resize(outputBuffersSize);
-    for (size_t i = 0; i < outputBuffersSize; ++i) {
-        hwReq.buffers[i] = mStreamBufferCache.update(request.outputBuffers[i]);
-    }
+    if (reprocess) {
+        // reprocess settings are not applied to mHwCamera, they describe
+        // the input image and go into the result.
+        if (hwReq->metadataUpdate.metadata.empty()) {
+            hwReq->metadataUpdate = mLastReprocessSettings;
+        } else {
+            mLastReprocessSettings = hwReq->metadataUpdate;
+        }
 
-    {
-        std::lock_guard<std::mutex> guard(mNumBuffersInFlightMtx);
-        mNumBuffersInFlight += outputBuffersSize;
+        hwReq->inputBuffer = mStreamBufferCache.update(request.inputBuffer);
     }
 
-    hwReq.frameNumber = request.frameNumber;
-
-    if (mCaptureRequests.put(&hwReq)) {
-        return Status::OK;
-    } else {
-        disposeCaptureRequest(std::move(hwReq));
-        return FAILURE(Status::INTERNAL_ERROR);
+    hwReq->buffers.resize(outputBuffersSize);
+    for (size_t i = 0; i < outputBuffersSize; ++i) {
+        hwReq->buffers[i] = mStreamBufferCache.update(request.outputBuffers[i]);
     }
+
+    hwReq->frameNumber = request.frameNumber;
+    hwReq->requestTime = std::chrono::steady_clock::now();
+    return Status::OK;
 }
 
 void CameraDeviceSession::captureThreadLoop() {
@@ -503,11 +798,16 @@ void CameraDeviceSession::captureThreadLoop() {
     struct timespec nextFrameT;
     clock_gettime(CLOCK_MONOTONIC, &nextFrameT);
     while (true) {
-        std::optional<HwCaptureRequest> maybeReq = mCaptureRequests.get();
+        std::optional<HwCaptureRequest> maybeReq = popCaptureRequest(true);
         if (maybeReq.has_value()) {
             HwCaptureRequest& req = maybeReq.value();
-            if (mFlushing) {
+            std::lock_guard<std::mutex> lock(mCaptureMtx);
+            if (mFlushing || mOffline) {
                 disposeCaptureRequest(std::move(req));
+            } else if (req.inputBuffer) {
+                reprocessOneFrame(std::move(req));  // does not take a frame slot
+            } else if (mHighSpeedMaxFps > 0) {
+                nextFrameT = captureFrameBatch(nextFrameT, std::move(req));
             } else {
                 nextFrameT = captureOneFrame(nextFrameT, std::move(req));
             }
@@ -517,125 +817,499 @@ void CameraDeviceSession::captureThreadLoop() {
     }
 }
 
+// Requests the capture thread took from mCaptureRequests ahead of time (see
+// returnFlushingStreamBuffers) go first.
+std::optional<hw::HwCaptureRequest> CameraDeviceSession::popCaptureRequest(const bool wait) {
+    if (!mPendingRequests.empty()) {
+        std::optional<HwCaptureRequest> req(std::move(mPendingRequests.front()));
+        mPendingRequests.pop_front();
+        return req;
+    }
+
+    return wait ? mCaptureRequests.get() : mCaptureRequests.tryGet();
+}
+
+// `held` are the requests the capture thread sleeps for, their buffers of
+// signalStreamFlush'ed streams are returned without waiting for the frame.
+bool CameraDeviceSession::sleepUntilNextFrame(const struct timespec nextFrameT,
+                                              const Span<HwCaptureRequest> held) {
+    using namespace std::chrono_literals;
+
+    // CLOCK_MONOTONIC is what steady_clock uses
+    const std::chrono::steady_clock::time_point deadline(1ns * timespec2nanos(nextFrameT));
+
+    ScopedFrameStage stage(mFrameTimingStats, FrameStage::Sleep);
+    std::unique_lock<std::mutex> lock(mFrameSleepMtx);
+    while (true) {
+        const bool woken = mFrameSleepCv.wait_until(lock, deadline, [this](){
+            return mFlushing || mOffline || mStreamFlushPending;
+        });
+
+        if (!woken) {
+            return true;
+        } else if (mFlushing || mOffline) {
+            return false;
+        }
+
+        mStreamFlushPending = false;
+        lock.unlock();
+        returnFlushingStreamBuffers(held);
+        lock.lock();
+    }
+}
+
+void CameraDeviceSession::returnFlushingStreamBuffers(Span<HwCaptureRequest> held) {
+    // the queue can't be walked in place, its requests keep their order here
+    while (true) {
+        std::optional<HwCaptureRequest> maybeReq = mCaptureRequests.tryGet();
+        if (maybeReq.has_value()) {
+            mPendingRequests.push_back(std::move(maybeReq.value()));
+        } else {
+            break;
+        }
+    }
+
+    const auto returnBuffers = [this](HwCaptureRequest& req){
+        std::vector<StreamBuffer> flushed = takeFlushingStreamBuffers(&req);
+        if (!flushed.empty()) {
+            consumeCaptureResult(makeCaptureResult(req.frameNumber, {},
+                                                   std::move(flushed)));
+        }
+    };
+
+    for (HwCaptureRequest& req : held) {
+        returnBuffers(req);
+    }
+    for (HwCaptureRequest& req : mPendingRequests) {
+        returnBuffers(req);
+    }
+}
+
+bool CameraDeviceSession::isStreamFlushing(const int32_t streamId) {
+    std::lock_guard<std::mutex> lock(mFlushingStreamsMtx);
+    return std::find(mFlushingStreamIds.begin(), mFlushingStreamIds.end(),
+                     streamId) != mFlushingStreamIds.end();
+}
+
+std::vector<StreamBuffer>
+CameraDeviceSession::takeFlushingStreamBuffers(HwCaptureRequest* req) {
+    std::vector<StreamBuffer> flushed;
+
+    std::lock_guard<std::mutex> lock(mFlushingStreamsMtx);
+    if (mFlushingStreamIds.empty()) {
+        return flushed;
+    }
+
+    const auto isFlushing = [this](const CachedStreamBuffer* csb){
+        return std::find(mFlushingStreamIds.begin(), mFlushingStreamIds.end(),
+                         csb->getStreamId()) != mFlushingStreamIds.end();
+    };
+
+    auto& buffers = req->buffers;
+    const auto keepEnd = std::stable_partition(
+        buffers.begin(), buffers.end(),
+        [&isFlushing](const CachedStreamBuffer* csb){ return !isFlushing(csb); });
+
+    for (auto i = keepEnd; i != buffers.end(); ++i) {
+        flushed.push_back((*i)->finish(false));
+    }
+    buffers.erase(keepEnd, buffers.end());
+
+    return flushed;
+}
+
+// The host takes the picture somewhere in the middle of the frame fetch
+// (`HwCamera::processCaptureRequest`) which can take several milliseconds.
+// The fetch starts early by half of its expected latency to be centered on
+// the frame time, the frame is stamped with the middle of the actual fetch.
 struct timespec CameraDeviceSession::captureOneFrame(struct timespec nextFrameT,
                                                      HwCaptureRequest req) {
+    const int64_t frameNs = timespec2nanos(nextFrameT);
+    const int64_t leadNs = std::min(mFetchLatencyNs, mLastFrameDurationNs) / 2;
+
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
-    if (std::make_pair(now.tv_sec, now.tv_nsec) <
-            std::make_pair(nextFrameT.tv_sec, nextFrameT.tv_nsec)) {
-        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &nextFrameT, nullptr);
+    const int64_t nowNs = timespec2nanos(now);
+    if (nowNs < (frameNs - leadNs)) {
+        if (!sleepUntilNextFrame(timespecAddNanos({0, 0}, frameNs - leadNs), {&req, 1})) {
+            disposeCaptureRequest(std::move(req));
+            return nextFrameT;
+        }
+    } else if ((mLastFrameDurationNs > 0) &&
+               (nowNs < (frameNs + kMaxDroppedFrames * mLastFrameDurationNs))) {
+        // The host fell behind: the frame slots we missed are dropped, the
+        // next frames stay on the same time grid.
+        const int64_t droppedFrames = (nowNs - frameNs) / mLastFrameDurationNs;
+        if (droppedFrames > 0) {
+            nextFrameT = timespecAddNanos(nextFrameT, droppedFrames * mLastFrameDurationNs);
+            mFrameTimingStats.addDroppedFrames(droppedFrames);
+        }
     } else {
-        nextFrameT = now;
+        nextFrameT = now;  // the first frame or no requests for a while
     }
 
-    const int32_t frameNumber = req.frameNumber;
-    const int64_t shutterTimestampNs = timespec2nanos(nextFrameT);
+    return captureFrame(nextFrameT, std::move(req), true);
+}
 
-    notifyShutter(&*mCb, frameNumber, shutterTimestampNs);
+// Constrained high-speed sessions get `maxFps / 30` requests per
+// processCaptureRequest call. The capture thread wakes up once per batch,
+// when its last frame is due, and captures the frames back to back.
+struct timespec CameraDeviceSession::captureFrameBatch(struct timespec nextFrameT,
+                                                       HwCaptureRequest req) {
+    const size_t maxBatchSize = std::max(mHighSpeedMaxFps / kHighSpeedBatchFps, 1);
+
+    mFrameBatch.clear();
+    mFrameBatch.push_back(std::move(req));
+    while (mFrameBatch.size() < maxBatchSize) {
+        std::optional<HwCaptureRequest> maybeReq = popCaptureRequest(false);
+        if (maybeReq.has_value()) {
+            mFrameBatch.push_back(std::move(maybeReq.value()));
+        } else {
+            break;
+        }
+    }
+
+    const int64_t batchSpanNs = int64_t(mFrameBatch.size() - 1) * mLastFrameDurationNs;
+    const int64_t wakeupNs = timespec2nanos(nextFrameT) + batchSpanNs;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t nowNs = timespec2nanos(now);
+    if (nowNs < wakeupNs) {
+        if (!sleepUntilNextFrame(timespecAddNanos(nextFrameT, batchSpanNs),
+                                 {mFrameBatch.begin(), mFrameBatch.end()})) {
+            for (HwCaptureRequest& r : mFrameBatch) {
+                disposeCaptureRequest(std::move(r));
+            }
+            return nextFrameT;
+        }
+    } else {
+        nextFrameT = timespecAddNanos({0, 0}, nowNs - batchSpanNs);
+    }
+
+    for (HwCaptureRequest& r : mFrameBatch) {
+        if (mFlushing) {
+            disposeCaptureRequest(std::move(r));
+        } else {
+            nextFrameT = captureFrame(nextFrameT, std::move(r), false);
+        }
+    }
+
+    return nextFrameT;
+}
+
+// `fetchTimestamp` stamps the frame with the middle of the fetch instead of
+// `nextFrameT`. The shutter is sent after the fetch, still before the result.
+struct timespec CameraDeviceSession::captureFrame(struct timespec nextFrameT,
+                                                  HwCaptureRequest req,
+                                                  const bool fetchTimestamp) {
+    const int32_t frameNumber = req.frameNumber;
+    std::vector<StreamBuffer> flushedBuffers = takeFlushingStreamBuffers(&req);
+
+    struct timespec fetchStart;
+    clock_gettime(CLOCK_MONOTONIC, &fetchStart);
+
+    auto [frameDurationNs, metadata, outputBuffers, delayedOutputBuffers] = [&](){
+        ScopedFrameStage stage(mFrameTimingStats, FrameStage::ProcessCaptureRequest);
+        return mHwCamera.processCaptureRequest(std::move(req.metadataUpdate),
+                                               {req.buffers.begin(), req.buffers.end()});
+    }();
+
+    struct timespec fetchEnd;
+    clock_gettime(CLOCK_MONOTONIC, &fetchEnd);
+    const int64_t fetchStartNs = timespec2nanos(fetchStart);
+    const int64_t fetchLatencyNs = timespec2nanos(fetchEnd) - fetchStartNs;
+    mFetchLatencyNs = (mFetchLatencyNs > 0) ?
+        (mFetchLatencyNs + (fetchLatencyNs - mFetchLatencyNs) / kFetchLatencyEwmaWeight) :
+        fetchLatencyNs;
+    mFrameTimingStats.setFetchLatencyNs(mFetchLatencyNs);
+
+    const int64_t shutterTimestampNs = fetchTimestamp ?
+        (fetchStartNs + fetchLatencyNs / 2) : timespec2nanos(nextFrameT);
+    if (mLastShutterTimestampNs > 0) {
+        const int64_t intervalNs = shutterTimestampNs - mLastShutterTimestampNs;
+        mFrameTimingStats.add(FrameStage::ShutterInterval, intervalNs);
+
+        // dropped frames are counted separately
+        if ((mLastFrameDurationNs > 0) &&
+                (intervalNs < (kMaxDroppedFrames + 1) * mLastFrameDurationNs)) {
+            const int64_t numFrames = std::max<int64_t>(
+                (intervalNs + mLastFrameDurationNs / 2) / mLastFrameDurationNs, 1);
+            mFrameTimingStats.add(FrameStage::ShutterJitter,
+                                  std::abs(intervalNs - numFrames * mLastFrameDurationNs));
+        }
+    }
+    mLastShutterTimestampNs = shutterTimestampNs;
 
-    auto [frameDurationNs, metadata, outputBuffers, delayedOutputBuffers] =
-        mHwCamera.processCaptureRequest(std::move(req.metadataUpdate),
-                                        {req.buffers.begin(), req.buffers.end()});
+    notify(makeShutterMsg(frameNumber, shutterTimestampNs));
 
     for (hw::DelayedStreamBuffer& dsb : delayedOutputBuffers) {
         DelayedCaptureResult dcr;
         dcr.delayedBuffer = std::move(dsb);
+        dcr.requestTime = req.requestTime;
         dcr.frameNumber = frameNumber;
         if (!mDelayedCaptureResults.put(&dcr)) {
-            // `delayedBuffer(false)` only releases the buffer (fast).
-            outputBuffers.push_back(dcr.delayedBuffer(false));
+            // `process(false, ...)` only releases the buffer (fast).
+            outputBuffers.push_back(dcr.delayedBuffer.process(false, nullptr));
         }
     }
 
+    outputBuffers.insert(outputBuffers.end(),
+                         std::make_move_iterator(flushedBuffers.begin()),
+                         std::make_move_iterator(flushedBuffers.end()));
+
     metadataSetShutterTimestamp(&metadata, shutterTimestampNs);
     consumeCaptureResult(makeCaptureResult(frameNumber,
         std::move(metadata), std::move(outputBuffers)));
 
     if (frameDurationNs > 0) {
         nextFrameT = timespecAddNanos(nextFrameT, frameDurationNs);
+        mLastFrameDurationNs = frameDurationNs;
     } else {
-        notifyError(&*mCb, frameNumber, -1, ErrorCode::ERROR_DEVICE);
+        notify(makeErrorMsg(frameNumber, -1, ErrorCode::ERROR_DEVICE));
     }
 
     return nextFrameT;
 }
 
+// Reprocess requests do not involve the host and are not paced by the frame
+// duration, they are processed as soon as the capture thread gets to them.
+void CameraDeviceSession::reprocessOneFrame(HwCaptureRequest req) {
+    CachedStreamBuffer* const input = req.inputBuffer;
+    if (!input->waitAcquireFence(kReprocessInputFenceTimeoutMs)) {
+        disposeCaptureRequest(std::move(req));
+        return;
+    }
+
+    static const uint32_t kResultTags[] = {ANDROID_SENSOR_TIMESTAMP};
+    std::optional<CameraMetadata> maybeMetadata =
+        metadataBuildCaptureResultTemplate(req.metadataUpdate, kResultTags);
+    if (!maybeMetadata) {
+        disposeCaptureRequest(std::move(req));
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const int32_t frameNumber = req.frameNumber;
+    const int64_t shutterTimestampNs =
+        getReprocessTimestamp(req.metadataUpdate, timespec2nanos(now));
+
+    notify(makeShutterMsg(frameNumber, shutterTimestampNs));
+
+    std::vector<StreamBuffer> flushedBuffers = takeFlushingStreamBuffers(&req);
+
+    auto [outputBuffers, delayedOutputBuffers] = [&](){
+        ScopedFrameStage stage(mFrameTimingStats, FrameStage::ProcessCaptureRequest);
+        return mReprocessor.process(req.metadataUpdate, input,
+                                    {req.buffers.begin(), req.buffers.end()},
+                                    mHwCamera);
+    }();
+
+    // the input buffer is returned with the last delayed result, the delayed
+    // results are queued all together so it is returned now only if none were.
+    const size_t delayedOutputBuffersSize = delayedOutputBuffers.size();
+    std::vector<DelayedCaptureResult> dcrs(delayedOutputBuffersSize);
+    for (size_t i = 0; i < delayedOutputBuffersSize; ++i) {
+        DelayedCaptureResult& dcr = dcrs[i];
+        dcr.delayedBuffer = std::move(delayedOutputBuffers[i]);
+        dcr.requestTime = req.requestTime;
+        dcr.inputBuffer = input;
+        dcr.returnInputBuffer = (i == (delayedOutputBuffersSize - 1));
+        dcr.frameNumber = frameNumber;
+    }
+
+    bool returnInputBuffer = true;
+    if (delayedOutputBuffersSize > 0) {
+        if (mDelayedCaptureResults.putAll(dcrs.data(), delayedOutputBuffersSize)) {
+            returnInputBuffer = false;
+        } else {
+            for (DelayedCaptureResult& dcr : dcrs) {
+                outputBuffers.push_back(dcr.delayedBuffer.process(false, nullptr));
+            }
+        }
+    }
+
+    outputBuffers.insert(outputBuffers.end(),
+                         std::make_move_iterator(flushedBuffers.begin()),
+                         std::make_move_iterator(flushedBuffers.end()));
+
+    CameraMetadata& metadata = maybeMetadata.value();
+    metadataSetShutterTimestamp(&metadata, shutterTimestampNs);
+    CaptureResult cr = makeCaptureResult(frameNumber, std::move(metadata),
+                                         std::move(outputBuffers));
+    if (returnInputBuffer) {
+        cr.inputBuffer = input->finish(true);
+    }
+
+    consumeCaptureResult(std::move(cr));
+}
+
 void CameraDeviceSession::delayedCaptureThreadLoop() {
     while (true) {
         std::optional<DelayedCaptureResult> maybeDCR = mDelayedCaptureResults.get();
         if (maybeDCR.has_value()) {
-            const DelayedCaptureResult& dcr = maybeDCR.value();
+            DelayedCaptureResult& dcr = maybeDCR.value();
 
             // `dcr.delayedBuffer(true)` is expected to be slow, so we do not
             // produce too much IPC traffic here. This also returns buffes to
             // the framework earlier to reuse in capture requests.
-            std::vector<StreamBuffer> outputBuffers(1);
-            outputBuffers.front() = dcr.delayedBuffer(!mFlushing);
-            consumeCaptureResult(makeCaptureResult(dcr.frameNumber,
-                {}, std::move(outputBuffers)));
+            const bool ok = !mFlushing && !isStreamFlushing(dcr.delayedBuffer.streamId);
+            returnDelayedResult(std::move(dcr), ok, &mFlushing);
         } else {
             break;
         }
     }
 }
 
+void CameraDeviceSession::returnDelayedResult(DelayedCaptureResult dcr, const bool ok,
+                                              const std::atomic<bool>* const abort) {
+    std::vector<StreamBuffer> outputBuffers(1);
+    outputBuffers.front() = dcr.delayedBuffer.process(ok, abort);
+
+    if (outputBuffers.front().status == BufferStatus::OK) {
+        using namespace std::chrono_literals;
+        mFrameTimingStats.add(
+            dcr.inputBuffer ? FrameStage::ReprocessToJpeg : FrameStage::CaptureToJpeg,
+            (std::chrono::steady_clock::now() - dcr.requestTime) / 1ns);
+    }
+
+    CaptureResult cr = makeCaptureResult(dcr.frameNumber, {}, std::move(outputBuffers));
+    if (dcr.returnInputBuffer) {
+        cr.inputBuffer = dcr.inputBuffer->finish(true);
+    }
+
+    consumeCaptureResult(std::move(cr));
+}
+
+size_t CameraDeviceSession::discardCaptureRequest(HwCaptureRequest* req) {
+    for (CachedStreamBuffer* csb : req->buffers) {
+        csb->discard();
+    }
+    if (req->inputBuffer) {
+        req->inputBuffer->discard();
+    }
+
+    return getNumBuffers(*req);
+}
+
 void CameraDeviceSession::disposeCaptureRequest(HwCaptureRequest req) {
-    notifyError(&*mCb, req.frameNumber, -1, ErrorCode::ERROR_REQUEST);
+    notify(makeErrorMsg(req.frameNumber, -1, ErrorCode::ERROR_REQUEST));
 
     const size_t reqBuffersSize = req.buffers.size();
+    std::vector<StreamBuffer> outputBuffers(reqBuffersSize);
 
-    {
-        std::vector<StreamBuffer> outputBuffers(reqBuffersSize);
+    for (size_t i = 0; i < reqBuffersSize; ++i) {
+        CachedStreamBuffer* csb = req.buffers[i];
+        LOG_ALWAYS_FATAL_IF(!csb);  // otherwise mNumBuffersInFlight will be hard
+        outputBuffers[i] = csb->finish(false);
+    }
 
-        for (size_t i = 0; i < reqBuffersSize; ++i) {
-            CachedStreamBuffer* csb = req.buffers[i];
-            LOG_ALWAYS_FATAL_IF(!csb);  // otherwise mNumBuffersInFlight will be hard
-            outputBuffers[i] = csb->finish(false);
-        }
+    CaptureResult cr = makeCaptureResult(req.frameNumber, {}, std::move(outputBuffers));
+    if (req.inputBuffer) {
+        cr.inputBuffer = req.inputBuffer->finish(false);
+    }
 
-        std::vector<CaptureResult> crs(1);
-        crs.front() = makeCaptureResult(req.frameNumber, {},
-                                        std::move(outputBuffers));
+    consumeCaptureResult(std::move(cr));
+}
 
-        std::lock_guard<std::mutex> guard(mResultQueueMutex);
-        mCb->processCaptureResult(std::move(crs));
+void CameraDeviceSession::notify(NotifyMsg msg) {
+    std::lock_guard<std::mutex> lock(mPendingResultsMtx);
+    if (mPendingResults.notifyMsgs.empty() && mPendingResults.results.empty()) {
+        mPendingResults.since = std::chrono::steady_clock::now();
+        mPendingResultsCv.notify_one();
     }
-
-    notifyBuffersReturned(reqBuffersSize);
+    mPendingResults.notifyMsgs.push_back(std::move(msg));
 }
 
 void CameraDeviceSession::consumeCaptureResult(CaptureResult cr) {
-    const size_t numBuffers = cr.outputBuffers.size();
+    const size_t numBuffers = cr.outputBuffers.size() + (cr.inputBuffer.bufferId ? 1 : 0);
 
-    {
-        std::lock_guard<std::mutex> guard(mResultQueueMutex);
-        const size_t metadataSize = cr.result.metadata.size();
-        if ((metadataSize > 0) && mResultQueue.write(
-                reinterpret_cast<int8_t*>(cr.result.metadata.data()),
-                metadataSize)) {
-            cr.fmqResultSize = metadataSize;
-            cr.result.metadata.clear();
+    std::lock_guard<std::mutex> lock(mPendingResultsMtx);
+    if (mPendingResults.notifyMsgs.empty() && mPendingResults.results.empty()) {
+        mPendingResults.since = std::chrono::steady_clock::now();
+        mPendingResultsCv.notify_one();
+    }
+    mPendingResults.results.push_back(std::move(cr));
+    mPendingResults.numBuffers += numBuffers;
+    if (mPendingResults.results.size() == kMaxResultBatchSize) {
+        mPendingResultsCv.notify_one();
+    }
+}
+
+// Sends what was queued by `notify` and `consumeCaptureResult` once the
+// oldest of it waited for mResultBatchWindow: one `notify` call (shutters
+// go before their results) and one `processCaptureResult` call per batch.
+void CameraDeviceSession::resultThreadLoop() {
+    setThreadPriority(SP_FOREGROUND, ANDROID_PRIORITY_VIDEO);
+
+    std::unique_lock<std::mutex> lock(mPendingResultsMtx);
+    while (true) {
+        if (mPendingResults.notifyMsgs.empty() && mPendingResults.results.empty()) {
+            if (mResultThreadStopping) {
+                break;
+            } else {
+                mPendingResultsCv.wait(lock);
+            }
+        } else {
+            const auto deadline = mPendingResults.since + mResultBatchWindow;
+            if (mResultThreadStopping ||
+                    (mPendingResults.results.size() >= kMaxResultBatchSize) ||
+                    (std::chrono::steady_clock::now() >= deadline)) {
+                PendingResults batch = std::move(mPendingResults);
+                mPendingResults = {};
+                lock.unlock();
+                sendResults(std::move(batch));
+                lock.lock();
+            } else {
+                mPendingResultsCv.wait_until(lock, deadline);
+            }
         }
+    }
+}
 
-        std::vector<CaptureResult> crs(1);
-        crs.front() = std::move(cr);
-        mCb->processCaptureResult(std::move(crs));
+void CameraDeviceSession::sendResults(PendingResults batch) {
+    if (!batch.notifyMsgs.empty()) {
+        ScopedFrameStage stage(mFrameTimingStats, FrameStage::NotifyCallback);
+        mCb->notify(std::move(batch.notifyMsgs));
     }
 
-    notifyBuffersReturned(numBuffers);
+    if (!batch.results.empty()) {
+        {
+            ScopedFrameStage stage(mFrameTimingStats, FrameStage::ResultFmqWrite);
+            for (CaptureResult& cr : batch.results) {
+                const size_t metadataSize = cr.result.metadata.size();
+                if ((metadataSize > 0) && mResultQueue.write(
+                        reinterpret_cast<int8_t*>(cr.result.metadata.data()),
+                        metadataSize)) {
+                    cr.fmqResultSize = metadataSize;
+                    cr.result.metadata.clear();
+                }
+            }
+        }
+
+        ScopedFrameStage stage(mFrameTimingStats, FrameStage::ResultCallback);
+        mCb->processCaptureResult(std::move(batch.results));
+    }
+
+    notifyBuffersReturned(batch.numBuffers);
+}
+
+void CameraDeviceSession::waitBuffersInFlight(const size_t n) {
+    std::unique_lock<std::mutex> lock(mNumBuffersInFlightMtx);
+    mNoBuffersInFlight.wait(lock, [this, n](){ return mNumBuffersInFlight <= n; });
 }
 
 void CameraDeviceSession::notifyBuffersReturned(const size_t numBuffersToReturn) {
     std::lock_guard<std::mutex> guard(mNumBuffersInFlightMtx);
-    LOG_ALWAYS_FATAL_IF(mNumBuffersInFlight < numBuffersToReturn,
+    const size_t numBuffersInFlight = mNumBuffersInFlight.fetch_sub(numBuffersToReturn);
+    LOG_ALWAYS_FATAL_IF(numBuffersInFlight < numBuffersToReturn,
                         "mNumBuffersInFlight=%zu numBuffersToReturn=%zu",
-                        mNumBuffersInFlight, numBuffersToReturn);
+                        numBuffersInFlight, numBuffersToReturn);
 
-    mNumBuffersInFlight -= numBuffersToReturn;
-
-    if (mNumBuffersInFlight == 0) {
-        mNoBuffersInFlight.notify_all();
-    }
+    // `switchToOffline` waits for a nonzero count
+    mNoBuffersInFlight.notify_all();
 }
 
 }  // namespace implementation
@@ -25,11 +25,15 @@
 
 #include <aidl/android/hardware/camera/common/Status.h>
 #include <aidl/android/hardware/camera/device/BnCameraDeviceSession.h>
+#include <aidl/android/hardware/camera/device/NotifyMsg.h>
 
 #include <fmq/AidlMessageQueue.h>
 
 #include "BlockingQueue.h"
+#include "BoundedQueue.h"
+#include "CameraOfflineSession.h"
 #include "HwCamera.h"
+#include "Reprocessor.h"
 #include "StreamBufferCache.h"
 
 namespace android {
@@ -49,6 +53,7 @@ using aidl::android::hardware::camera::device::CaptureResult;
 using aidl::android::hardware::camera::device::HalStream;
 using aidl::android::hardware::camera::device::ICameraDeviceCallback;
 using aidl::android::hardware::camera::device::ICameraOfflineSession;
+using aidl::android::hardware::camera::device::NotifyMsg;
 using aidl::android::hardware::camera::device::RequestTemplate;
 using aidl::android::hardware::camera::device::StreamBuffer;
 using aidl::android::hardware::camera::device::StreamConfiguration;
@@ -100,46 +105,101 @@ private:
     using MetadataQueue = AidlMessageQueue<int8_t, SynchronizedReadWrite>;
     using HwCaptureRequest = hw::HwCaptureRequest;
 
-    struct DelayedCaptureResult {
-        hw::DelayedStreamBuffer delayedBuffer;
-        int frameNumber;
+    // see resultThreadLoop
+    struct PendingResults {
+        std::vector<NotifyMsg> notifyMsgs;
+        std::vector<CaptureResult> results;
+        size_t numBuffers = 0;
+        std::chrono::steady_clock::time_point since;
     };
 
     void closeImpl();
     void flushImpl(std::chrono::steady_clock::time_point start);
-    int waitFlushingDone(std::chrono::steady_clock::time_point start);
+    size_t waitFlushingDone(std::chrono::steady_clock::time_point start);
     static std::pair<Status, std::vector<HalStream>>
         configureStreamsStatic(const StreamConfiguration& cfg,
                                hw::HwCamera& hwCamera);
-    Status processOneCaptureRequest(const CaptureRequest& request);
+    static int32_t getHighSpeedMaxFps(const StreamConfiguration& cfg,
+                                      const hw::HwCamera& hwCamera);
+    Status processOneCaptureRequest(const CaptureRequest& request,
+                                    HwCaptureRequest* hwReq);
     void captureThreadLoop();
     void delayedCaptureThreadLoop();
-    bool popCaptureRequest(HwCaptureRequest* req);
+    std::optional<HwCaptureRequest> popCaptureRequest(bool wait);
+    bool sleepUntilNextFrame(struct timespec nextFrameT, Span<HwCaptureRequest> held);
+    void returnFlushingStreamBuffers(Span<HwCaptureRequest> held);
+    bool isStreamFlushing(int32_t streamId);
+    std::vector<StreamBuffer> takeFlushingStreamBuffers(HwCaptureRequest* req);
     struct timespec captureOneFrame(struct timespec nextFrameT, HwCaptureRequest req);
+    struct timespec captureFrameBatch(struct timespec nextFrameT, HwCaptureRequest req);
+    struct timespec captureFrame(struct timespec nextFrameT, HwCaptureRequest req,
+                                 bool fetchTimestamp);
+    void reprocessOneFrame(HwCaptureRequest req);
+    void returnDelayedResult(DelayedCaptureResult dcr, bool ok,
+                             const std::atomic<bool>* abort);
+    size_t discardCaptureRequest(HwCaptureRequest* req);
     void disposeCaptureRequest(HwCaptureRequest req);
+    void notify(NotifyMsg msg);
     void consumeCaptureResult(CaptureResult cr);
+    void resultThreadLoop();
+    void sendResults(PendingResults batch);
     void notifyBuffersReturned(size_t n);
+    void waitBuffersInFlight(size_t n);
 
     const std::shared_ptr<CameraDevice> mParent;
     const std::shared_ptr<ICameraDeviceCallback> mCb;
     hw::HwCamera& mHwCamera;
     MetadataQueue mRequestQueue;
     MetadataQueue mResultQueue;
-    std::mutex mResultQueueMutex;
 
     StreamBufferCache mStreamBufferCache;
-
-    BlockingQueue<HwCaptureRequest> mCaptureRequests;
+    hw::Reprocessor mReprocessor;
+    CameraMetadata mLastReprocessSettings;  // for requests without settings
+    std::vector<int32_t> mOfflineStreamIds;
+
+    // signalStreamFlush'ed streams, until the next configureStreams
+    std::vector<int32_t> mFlushingStreamIds;
+    int32_t mStreamConfigCounter = 0;
+    std::mutex mFlushingStreamsMtx;
+
+    // constrained high-speed sessions, 0 otherwise
+    int32_t mHighSpeedMaxFps = 0;
+    // the capture thread's state
+    std::vector<HwCaptureRequest> mFrameBatch;
+    std::deque<HwCaptureRequest> mPendingRequests;  // taken from mCaptureRequests
+    int64_t mLastFrameDurationNs = 0;
+    int64_t mLastShutterTimestampNs = 0;
+    int64_t mFetchLatencyNs = 0;  // EWMA of HwCamera::processCaptureRequest
+
+    BoundedQueue<HwCaptureRequest, 64> mCaptureRequests;
     BlockingQueue<DelayedCaptureResult> mDelayedCaptureResults;
 
-    size_t mNumBuffersInFlight = 0;
+    // incremented without the mutex, it only guards mNoBuffersInFlight
+    std::atomic<size_t> mNumBuffersInFlight = 0;
     std::condition_variable mNoBuffersInFlight;
     std::mutex mNumBuffersInFlightMtx;
 
+    std::condition_variable mFrameSleepCv;
+    std::mutex mFrameSleepMtx;
+    bool mStreamFlushPending = false;  // guarded by mFrameSleepMtx
+
+    // held by the capture thread while it works on a request
+    std::mutex mCaptureMtx;
+
+    PendingResults mPendingResults;
+    const std::chrono::microseconds mResultBatchWindow;
+    std::condition_variable mPendingResultsCv;
+    std::mutex mPendingResultsMtx;
+    bool mResultThreadStopping = false;
+
+    std::thread mResultThread;
     std::thread mCaptureThread;
     std::thread mDelayedCaptureThread;
 
+    FrameTimingStats& mFrameTimingStats;  // owned by mHwCamera
+
     std::atomic<bool> mFlushing = false;
+    std::atomic<bool> mOffline = false;
 };
 
 }  // namespace implementation
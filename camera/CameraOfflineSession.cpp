@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define FAILURE_DEBUG_PREFIX "CameraOfflineSession"
+
+#include <log/log.h>
+#include <utils/ThreadDefs.h>
+
+#include "debug.h"
+#include "CameraOfflineSession.h"
+#include "CameraDevice.h"
+#include "utils.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+
+using aidl::android::hardware::camera::common::Status;
+using aidl::android::hardware::camera::device::CaptureResult;
+
+namespace {
+constexpr char kClass[] = "CameraOfflineSession";
+
+// delayed results carry no metadata
+constexpr size_t kMsgQueueSize = 16 * 1024;
+}  // namespace
+
+CameraOfflineSession::CameraOfflineSession(
+        std::shared_ptr<CameraDevice> parent,
+        std::unique_ptr<StreamBufferCache> streamBufferCache,
+        std::vector<DelayedCaptureResult> delayedCaptureResults)
+         : mParent(std::move(parent))
+         , mStreamBufferCache(std::move(streamBufferCache))
+         , mResultQueue(kMsgQueueSize, false) {
+    LOG_ALWAYS_FATAL_IF(!mResultQueue.isValid());
+
+    for (DelayedCaptureResult& dcr : delayedCaptureResults) {
+        LOG_ALWAYS_FATAL_IF(!mDelayedCaptureResults.put(&dcr));
+    }
+
+    mDelayedCaptureThread =
+        std::thread(&CameraOfflineSession::delayedCaptureThreadLoop, this);
+}
+
+CameraOfflineSession::~CameraOfflineSession() {
+    closeImpl();
+}
+
+ScopedAStatus CameraOfflineSession::close() {
+    closeImpl();
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus CameraOfflineSession::getCaptureResultMetadataQueue(
+        MQDescriptor<int8_t, SynchronizedReadWrite>* desc) {
+    *desc = mResultQueue.dupeDesc();
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus CameraOfflineSession::setCallback(
+        const std::shared_ptr<ICameraOfflineSessionCallback>& cb) {
+    if (!cb) {
+        return toScopedAStatus(FAILURE(Status::ILLEGAL_ARGUMENT));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mCbMtx);
+        mCb = cb;
+    }
+    mCbCv.notify_all();
+    return ScopedAStatus::ok();
+}
+
+void CameraOfflineSession::closeImpl() {
+    {
+        std::lock_guard<std::mutex> lock(mCbMtx);
+        mClosing = true;
+    }
+    mCbCv.notify_all();
+
+    // the remaining results are returned as errors
+    mDelayedCaptureResults.cancel();
+    if (mDelayedCaptureThread.joinable()) {
+        mDelayedCaptureThread.join();
+    }
+}
+
+void CameraOfflineSession::delayedCaptureThreadLoop() {
+    setThreadPriority(SP_BACKGROUND, ANDROID_PRIORITY_BACKGROUND);
+
+    while (true) {
+        std::optional<DelayedCaptureResult> maybeDCR = mDelayedCaptureResults.get();
+        if (maybeDCR.has_value()) {
+            const DelayedCaptureResult& dcr = maybeDCR.value();
+
+            std::vector<CaptureResult> crs(1);
+            CaptureResult& cr = crs.front();
+            cr.frameNumber = dcr.frameNumber;
+            cr.outputBuffers.push_back(dcr.delayedBuffer.process(!mClosing, &mClosing));
+            cr.inputBuffer.streamId = -1;
+            cr.inputBuffer.bufferId = 0;
+            cr.partialResult = 0;
+
+            // encoding does not wait for the callback, only delivery does
+            const std::shared_ptr<ICameraOfflineSessionCallback> cb = waitForCallback();
+            if (cb) {
+                cb->processCaptureResult(std::move(crs));
+            } else {
+                ALOGW("%s:%s:%d closed before the callback was set, dropping "
+                      "frameNumber=%d", kClass, __func__, __LINE__,
+                      dcr.frameNumber);
+            }
+        } else {
+            break;
+        }
+    }
+}
+
+std::shared_ptr<ICameraOfflineSessionCallback> CameraOfflineSession::waitForCallback() {
+    std::unique_lock<std::mutex> lock(mCbMtx);
+    mCbCv.wait(lock, [this](){ return mCb || mClosing; });
+    return mCb;
+}
+
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <aidl/android/hardware/camera/device/BnCameraOfflineSession.h>
+#include <aidl/android/hardware/camera/device/ICameraOfflineSessionCallback.h>
+
+#include <fmq/AidlMessageQueue.h>
+
+#include "BlockingQueue.h"
+#include "HwCamera.h"
+#include "StreamBufferCache.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+
+using aidl::android::hardware::camera::device::BnCameraOfflineSession;
+using aidl::android::hardware::camera::device::ICameraOfflineSessionCallback;
+
+using aidl::android::hardware::common::fmq::MQDescriptor;
+using aidl::android::hardware::common::fmq::SynchronizedReadWrite;
+
+using ndk::ScopedAStatus;
+
+struct CameraDevice;
+
+struct DelayedCaptureResult {
+    hw::DelayedStreamBuffer delayedBuffer;
+    std::chrono::steady_clock::time_point requestTime;
+    // YUV reprocessing: `delayedBuffer` reads `inputBuffer`, the last delayed
+    // result of the request returns it. Reprocessing never goes offline.
+    CachedStreamBuffer* inputBuffer = nullptr;
+    bool returnInputBuffer = false;
+    int frameNumber;
+};
+
+// Finishes delayed (JPEG) captures moved out of a CameraDeviceSession by
+// `switchToOffline` so the camera could be closed and reopened meanwhile.
+struct CameraOfflineSession : public BnCameraOfflineSession {
+    CameraOfflineSession(std::shared_ptr<CameraDevice> parent,
+                         std::unique_ptr<StreamBufferCache> streamBufferCache,
+                         std::vector<DelayedCaptureResult> delayedCaptureResults);
+    ~CameraOfflineSession() override;
+
+    ScopedAStatus close() override;
+    ScopedAStatus getCaptureResultMetadataQueue(
+        MQDescriptor<int8_t, SynchronizedReadWrite>* desc) override;
+    ScopedAStatus setCallback(
+        const std::shared_ptr<ICameraOfflineSessionCallback>& cb) override;
+
+private:
+    using MetadataQueue = AidlMessageQueue<int8_t, SynchronizedReadWrite>;
+
+    void closeImpl();
+    void delayedCaptureThreadLoop();
+    std::shared_ptr<ICameraOfflineSessionCallback> waitForCallback();
+
+    // keeps the HwCamera (delayed results refer to it) alive
+    const std::shared_ptr<CameraDevice> mParent;
+    const std::unique_ptr<StreamBufferCache> mStreamBufferCache;
+    MetadataQueue mResultQueue;
+
+    BlockingQueue<DelayedCaptureResult> mDelayedCaptureResults;
+
+    std::shared_ptr<ICameraOfflineSessionCallback> mCb;
+    std::condition_variable mCbCv;
+    std::mutex mCbMtx;
+
+    std::thread mDelayedCaptureThread;
+
+    std::atomic<bool> mClosing = false;
+};
+
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
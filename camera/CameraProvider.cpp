@@ -15,11 +15,18 @@
  */
 
 #include <inttypes.h>
+#include <string.h>
 
+#include <algorithm>
+#include <charconv>
+#include <string>
+
+#include <android-base/file.h>
 #include <log/log.h>
 
 #include "CameraProvider.h"
 #include "CameraDevice.h"
+#include "CameraDeviceSession.h"
 #include "HwCamera.h"
 #include "debug.h"
 
@@ -31,10 +38,28 @@ namespace implementation {
 
 using aidl::android::hardware::camera::common::Status;
 
+namespace {
+// Concurrent sessions are limited to s1440p streams, the CPUs for their
+// conversions and JPEG encodes are shared equally (see cpu_budget.h).
+constexpr int32_t kMaxConcurrentStreamWidth = 1920;
+constexpr int32_t kMaxConcurrentStreamHeight = 1440;
+}  // namespace
+
 CameraProvider::CameraProvider(const int deviceIdBase,
                                Span<const hw::HwCameraFactory> availableCameras)
         : mDeviceIdBase(deviceIdBase)
-        , mAvailableCameras(availableCameras) {}
+        , mAvailableCameras(availableCameras) {
+    mAvailableCameraInfos.reserve(mAvailableCameras.size());
+    for (const hw::HwCameraFactory& factory : mAvailableCameras) {
+        AvailableCamera info = {nullptr, false};
+        hw::HwCameraFactoryProduct hwCamera = factory();
+        if (hwCamera) {
+            info.isBackFacing = hwCamera->isBackFacing();
+            info.device = ndk::SharedRefBase::make<CameraDevice>(std::move(hwCamera));
+        }
+        mAvailableCameraInfos.push_back(std::move(info));
+    }
+}
 
 CameraProvider::~CameraProvider() {}
 
@@ -74,6 +99,14 @@ ScopedAStatus CameraProvider::getCameraDeviceInterface(
         if (hwCamera) {
             auto p = ndk::SharedRefBase::make<CameraDevice>(std::move(hwCamera));
             p->mSelf = p;
+
+            {
+                std::lock_guard<std::mutex> lock(mDevicesMtx);
+                mDevices.erase(std::remove_if(mDevices.begin(), mDevices.end(),
+                    [](const auto& d){ return d.second.expired(); }), mDevices.end());
+                mDevices.push_back({maybeIndex.value(), p});
+            }
+
             *device = std::move(p);
             return ScopedAStatus::ok();
         } else {
@@ -88,19 +121,104 @@ ScopedAStatus CameraProvider::notifyDeviceStateChange(const int64_t /*deviceStat
     return ScopedAStatus::ok();
 }
 
+// Every camera has its own host channel and its own session threads (one
+// JPEG encode at a time), a front and a back camera can stream together.
 ScopedAStatus CameraProvider::getConcurrentCameraIds(
         std::vector<ConcurrentCameraIdCombination>* concurrentCameraIds) {
-    *concurrentCameraIds = {};
+    std::vector<int> front;
+    std::vector<int> back;
+    for (int i = 0; i < mAvailableCameraInfos.size(); ++i) {
+        const AvailableCamera& info = mAvailableCameraInfos[i];
+        if (info.device) {
+            (info.isBackFacing ? back : front).push_back(mDeviceIdBase + i);
+        }
+    }
+
+    concurrentCameraIds->clear();
+    for (const int f : front) {
+        for (const int b : back) {
+            ConcurrentCameraIdCombination c;
+            c.combination = {std::to_string(f), std::to_string(b)};
+            concurrentCameraIds->push_back(std::move(c));
+        }
+    }
+
     return ScopedAStatus::ok();
 }
 
 ScopedAStatus CameraProvider::isConcurrentStreamCombinationSupported(
-        const std::vector<CameraIdAndStreamCombination>& /*configs*/,
+        const std::vector<CameraIdAndStreamCombination>& configs,
         bool* support) {
     *support = false;
+    if (configs.size() > 2) {
+        return ScopedAStatus::ok();
+    }
+
+    int numBackFacing = 0;
+    for (const CameraIdAndStreamCombination& config : configs) {
+        int id;
+        const std::string& str = config.cameraId;
+        const auto r = std::from_chars(str.data(), str.data() + str.size(), id, 10);
+        const int index = id - mDeviceIdBase;
+        if ((r.ec != std::errc()) || (r.ptr != (str.data() + str.size())) ||
+                (index < 0) || (index >= mAvailableCameras.size())) {
+            return toScopedAStatus(FAILURE(Status::ILLEGAL_ARGUMENT));
+        }
+
+        const AvailableCamera& info = mAvailableCameraInfos[index];
+        if (!info.device) {
+            return toScopedAStatus(FAILURE(Status::INTERNAL_ERROR));
+        }
+
+        for (const auto& stream : config.streamConfiguration.streams) {
+            if ((stream.width > kMaxConcurrentStreamWidth) ||
+                    (stream.height > kMaxConcurrentStreamHeight)) {
+                return ScopedAStatus::ok();
+            }
+        }
+
+        bool streamsSupported = false;
+        if (!info.device->isStreamCombinationSupported(config.streamConfiguration,
+                                                       &streamsSupported).isOk() ||
+                !streamsSupported) {
+            return ScopedAStatus::ok();
+        }
+
+        numBackFacing += info.isBackFacing ? 1 : 0;
+    }
+
+    // one camera of each facing, see getConcurrentCameraIds
+    *support = (configs.size() < 2) || (numBackFacing == 1);
     return ScopedAStatus::ok();
 }
 
+// `--reset` starts a new measurement window after dumping, e.g. to compare
+// stream configurations or host loads with the same session.
+binder_status_t CameraProvider::dump(const int fd,
+                                     const char** args,
+                                     const uint32_t numArgs) {
+    const bool reset = std::any_of(args, args + numArgs, [](const char* arg){
+        return !strcmp(arg, "--reset");
+    });
+
+    std::lock_guard<std::mutex> lock(mDevicesMtx);
+
+    for (const auto& [id, weakDevice] : mDevices) {
+        const std::shared_ptr<CameraDevice> device = weakDevice.lock();
+        if (device) {
+            FrameTimingStats& stats = device->mHwCamera->getFrameTimingStats();
+            base::WriteStringToFd("  " + CameraDevice::getPhysicalId(id) +
+                                  " frame timings:\n", fd);
+            stats.dump(fd);
+            if (reset) {
+                stats.reset();
+            }
+        }
+    }
+
+    return STATUS_OK;
+}
+
 }  // namespace implementation
 }  // namespace provider
 }  // namespace camera
@@ -17,6 +17,9 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #include <aidl/android/hardware/camera/provider/BnCameraProvider.h>
 #include <aidl/android/hardware/camera/provider/ICameraProviderCallback.h>
@@ -38,6 +41,8 @@ using aidl::android::hardware::camera::provider::ConcurrentCameraIdCombination;
 using aidl::android::hardware::camera::provider::ICameraProviderCallback;
 using ndk::ScopedAStatus;
 
+struct CameraDevice;
+
 struct CameraProvider : public BnCameraProvider {
     CameraProvider(int deviceIdBase, Span<const hw::HwCameraFactory> availableCameras);
     ~CameraProvider() override;
@@ -56,10 +61,22 @@ struct CameraProvider : public BnCameraProvider {
             const std::vector<CameraIdAndStreamCombination>& in_configs,
             bool* support) override;
 
+    binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
+
 private:
+    struct AvailableCamera {
+        std::shared_ptr<CameraDevice> device;  // for static queries, never opened
+        bool isBackFacing;
+    };
+
     const int mDeviceIdBase;
     const Span<const hw::HwCameraFactory> mAvailableCameras;
+    std::vector<AvailableCamera> mAvailableCameraInfos;  // built once, same indices
     std::shared_ptr<ICameraProviderCallback> mCallback;
+
+    // {deviceId, device} for `dump`
+    std::vector<std::pair<int, std::weak_ptr<CameraDevice>>> mDevices;
+    std::mutex mDevicesMtx;
 };
 
 }  // namespace implementation
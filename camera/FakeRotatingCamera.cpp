@@ -24,6 +24,7 @@
 #include <ui/GraphicBufferMapper.h>
 
 #include <gralloc_cb_bp.h>
+#include <libyuv/planar_functions.h>
 #include <qemu_pipe_bp.h>
 
 #define GL_GLEXT_PROTOTYPES
@@ -41,6 +42,7 @@
 #include "FakeRotatingCamera.h"
 #include "jpeg.h"
 #include "metadata_utils.h"
+#include "SoftwareRenderer.h"
 #include "utils.h"
 #include "yuv.h"
 
@@ -59,6 +61,8 @@ constexpr char kClass[] = "FakeRotatingCamera";
 constexpr int kMinFPS = 2;
 constexpr int kMedFPS = 15;
 constexpr int kMaxFPS = 30;
+constexpr int kHighSpeedFPS = 120;
+constexpr int kHighSpeedMaxFPS = 240;
 constexpr int64_t kOneSecondNs = 1000000000;
 
 constexpr int64_t kMinFrameDurationNs = kOneSecondNs / kMaxFPS;
@@ -79,24 +83,31 @@ constexpr bool usageTest(const BufferUsage a, const BufferUsage b) {
     return (static_cast<uint64_t>(a) & static_cast<uint64_t>(b)) != 0;
 }
 
-constexpr uint16_t toR5G6B5(float r, float g, float b) {
-    return uint16_t(b * 31) | (uint16_t(g * 63) << 5) | (uint16_t(r * 31) << 11);
-}
-
 constexpr uint32_t toR8G8B8A8(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     return uint32_t(r) | (uint32_t(g) << 8) | (uint32_t(b) << 16) | (uint32_t(a) << 24);
 }
 
+// R5G6B5 precision, expanded to R8G8B8A8 as GL does
+constexpr uint32_t toR5G6B5(float r, float g, float b) {
+    const uint32_t r5 = r * 31;
+    const uint32_t g6 = g * 63;
+    const uint32_t b5 = b * 31;
+    return toR8G8B8A8((r5 << 3) | (r5 >> 2), (g6 << 2) | (g6 >> 4),
+                      (b5 << 3) | (b5 >> 2), 255);
+}
+
+constexpr float kClearColor[4] = {0.2, 0.3, 0.2, 1.0};
+
 constexpr double degrees2rad(const double degrees) {
     return degrees * M_PI / 180.0;
 }
 
 // This texture is useful to debug camera orientation and image aspect ratio
-abc3d::AutoTexture loadTestPatternTextureA() {
-    constexpr uint16_t B = toR5G6B5(.4, .4, .4);
-    constexpr uint16_t R = toR5G6B5( 1, .1, .1);
+SoftwareRenderer::Texture loadTestPatternTextureA() {
+    constexpr uint32_t B = toR5G6B5(.4, .4, .4);
+    constexpr uint32_t R = toR5G6B5( 1, .1, .1);
 
-    static const uint16_t texels[] = {
+    static const uint32_t texels[] = {
         B, R, R, R, R, R, B, B,
         R, B, B, B, B, B, R, B,
         B, B, B, B, B, B, R, B,
@@ -107,16 +118,16 @@ abc3d::AutoTexture loadTestPatternTextureA() {
         B, R, R, R, R, R, B, R,
     };
 
-    abc3d::AutoTexture tex(GL_TEXTURE_2D, GL_RGB, 8, 8,
-                           GL_RGB, GL_UNSIGNED_SHORT_5_6_5, texels);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
+    SoftwareRenderer::Texture tex;
+    tex.texels.assign(std::begin(texels), std::end(texels));
+    tex.width = 8;
+    tex.height = 8;
+    tex.linear = false;
     return tex;
 }
 
 // This texture is useful to debug camera dataspace
-abc3d::AutoTexture loadTestPatternTextureColors() {
+SoftwareRenderer::Texture loadTestPatternTextureColors() {
     static const uint32_t texels[] = {
         toR8G8B8A8(32, 0, 0, 255), toR8G8B8A8(64, 0, 0, 255), toR8G8B8A8(96, 0, 0, 255), toR8G8B8A8(128, 0, 0, 255),
         toR8G8B8A8(160, 0, 0, 255), toR8G8B8A8(192, 0, 0, 255), toR8G8B8A8(224, 0, 0, 255), toR8G8B8A8(255, 0, 0, 255),
@@ -143,17 +154,17 @@ abc3d::AutoTexture loadTestPatternTextureColors() {
         toR8G8B8A8(128, 128, 128, 255), toR8G8B8A8(160, 160, 160, 255), toR8G8B8A8(192, 192, 192, 255), toR8G8B8A8(224, 224, 224, 255),
     };
 
-    abc3d::AutoTexture tex(GL_TEXTURE_2D, GL_RGBA, 8, 8,
-                           GL_RGBA, GL_UNSIGNED_BYTE, texels);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
+    SoftwareRenderer::Texture tex;
+    tex.texels.assign(std::begin(texels), std::end(texels));
+    tex.width = 8;
+    tex.height = 8;
+    tex.linear = false;
     return tex;
 }
 
 // This texture is used to pass CtsVerifier
-abc3d::AutoTexture loadTestPatternTextureAcircles() {
-    constexpr uint16_t kPalette[] = {
+SoftwareRenderer::Texture loadTestPatternTextureAcircles() {
+    constexpr uint32_t kPalette[] = {
         toR5G6B5(0, 0, 0),
         toR5G6B5(.25, .25, .25),
         toR5G6B5(.5, .5, .5),
@@ -161,7 +172,7 @@ abc3d::AutoTexture loadTestPatternTextureAcircles() {
         toR5G6B5(1, 1, 1),
     };
 
-    std::vector<uint16_t> texels;
+    std::vector<uint32_t> texels;
     texels.reserve(kAcirclesPatternWidth * kAcirclesPatternWidth);
 
     auto i = std::begin(kAcirclesPatternRLE);
@@ -170,7 +181,7 @@ abc3d::AutoTexture loadTestPatternTextureAcircles() {
         const unsigned x = *i;
         ++i;
         unsigned n;
-        uint16_t color;
+        uint32_t color;
         if (x & 1) {
             n = (x >> 3) + 1;
             color = kPalette[(x >> 1) & 3];
@@ -186,16 +197,15 @@ abc3d::AutoTexture loadTestPatternTextureAcircles() {
         texels.insert(texels.end(), n, color);
     }
 
-    abc3d::AutoTexture tex(GL_TEXTURE_2D, GL_RGB,
-                           kAcirclesPatternWidth, kAcirclesPatternWidth,
-                           GL_RGB, GL_UNSIGNED_SHORT_5_6_5, texels.data());
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
+    SoftwareRenderer::Texture tex;
+    tex.texels = std::move(texels);
+    tex.width = kAcirclesPatternWidth;
+    tex.height = kAcirclesPatternWidth;
+    tex.linear = true;
     return tex;
 }
 
-abc3d::AutoTexture loadTestPatternTexture() {
+SoftwareRenderer::Texture loadTestPatternTexture() {
     std::string valueStr =
         base::GetProperty("vendor.qemu.FakeRotatingCamera.scene", "");
     if (valueStr.empty()) {
@@ -212,23 +222,251 @@ abc3d::AutoTexture loadTestPatternTexture() {
     }
 }
 
+abc3d::AutoTexture uploadTexture(const SoftwareRenderer::Texture& texture) {
+    abc3d::AutoTexture tex(GL_TEXTURE_2D, GL_RGBA, texture.width, texture.height,
+                           GL_RGBA, GL_UNSIGNED_BYTE, texture.texels.data());
+    const GLint filter = texture.linear ? GL_LINEAR : GL_NEAREST;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+
+    return tex;
+}
+
+// SwiftShader, Mesa's llvmpipe/softpipe or no GL at all
+bool isGlRendererSoftware() {
+    abc3d::EglContext context;
+    const abc3d::EglCurrentContext currentContext = context.init();
+    if (!currentContext.ok()) {
+        return true;
+    }
+
+    const char* renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    if (!renderer) {
+        return FAILURE(true);
+    }
+
+    ALOGD("%s:%s:%d GL_RENDERER='%s'", kClass, __func__, __LINE__, renderer);
+    return strcasestr(renderer, "swiftshader") || strcasestr(renderer, "llvmpipe") ||
+           strcasestr(renderer, "softpipe");
+}
+
+bool useSoftwareRenderer() {
+    const std::string valueStr =
+        base::GetProperty("vendor.qemu.FakeRotatingCamera.renderer", "");
+    if (valueStr == "cpu") {
+        return true;
+    } else if (valueStr == "gl") {
+        return false;
+    } else {
+        static const bool isSoftware = isGlRendererSoftware();
+        return isSoftware;
+    }
+}
+
+using PackedYuvLayout = FakeRotatingCamera::PackedYuvLayout;
+
+// The packed buffer holds four 8bit samples per RGBA texel, planar chroma
+// rows are split in halves of `width / 8` texels.
+bool canPackYuv(const Rect<uint16_t> size) {
+    return ((size.width % 8) == 0) && ((size.height % 2) == 0);
+}
+
+Rect<uint16_t> getPackedYuvSize(const Rect<uint16_t> size) {
+    return {static_cast<uint16_t>(size.width / 4),
+            static_cast<uint16_t>(size.height + size.height / 2)};
+}
+
+PackedYuvLayout getPackedYuvLayout(const android_ycbcr& ycbcr) {
+    const uint8_t* const cb = static_cast<const uint8_t*>(ycbcr.cb);
+    const uint8_t* const cr = static_cast<const uint8_t*>(ycbcr.cr);
+
+    if (ycbcr.chroma_step == 2) {
+        if (cr == (cb + 1)) {
+            return PackedYuvLayout::NV12;
+        } else if (cb == (cr + 1)) {
+            return PackedYuvLayout::NV21;
+        }
+    }
+
+    return PackedYuvLayout::Planar;
+}
+
+// `height` rows of Y followed by `height / 2` rows of chroma, each row is
+// `width` bytes and starts `packedStride` bytes after the previous one.
+void copyPackedYuv(const Rect<uint16_t> size, const uint8_t* packed,
+                   const size_t packedStride, const PackedYuvLayout layout,
+                   const android_ycbcr& ycbcr) {
+    const size_t width = size.width;
+    const size_t height = size.height;
+    const size_t chromaWidth = width / 2;
+    const size_t chromaStep = ycbcr.chroma_step;
+
+    uint8_t* y = static_cast<uint8_t*>(ycbcr.y);
+    for (size_t row = 0; row < height; ++row, y += ycbcr.ystride, packed += packedStride) {
+        memcpy(y, packed, width);
+    }
+
+    uint8_t* cb = static_cast<uint8_t*>(ycbcr.cb);
+    uint8_t* cr = static_cast<uint8_t*>(ycbcr.cr);
+    for (size_t row = height / 2; row > 0; --row, cb += ycbcr.cstride,
+                                           cr += ycbcr.cstride, packed += packedStride) {
+        switch (layout) {
+        case PackedYuvLayout::NV12:
+            memcpy(cb, packed, width);
+            break;
+
+        case PackedYuvLayout::NV21:
+            memcpy(cr, packed, width);
+            break;
+
+        case PackedYuvLayout::Planar:
+            if (chromaStep == 1) {
+                memcpy(cb, packed, chromaWidth);
+                memcpy(cr, packed + chromaWidth, chromaWidth);
+            } else {
+                for (size_t i = 0; i < chromaWidth; ++i) {
+                    cb[i * chromaStep] = packed[i];
+                    cr[i * chromaStep] = packed[chromaWidth + i];
+                }
+            }
+            break;
+        }
+    }
+}
+
+// The scene only depends on the sensor orientation, sensor noise below this
+// (radians) does not move it by a pixel.
+constexpr float kFrameCacheRotationTolerance = 1e-4f;
+
+bool isSameCameraPosition(const float a[3], const float b[3]) {
+    return (std::abs(a[0] - b[0]) < kFrameCacheRotationTolerance) &&
+           (std::abs(a[1] - b[1]) < kFrameCacheRotationTolerance) &&
+           (std::abs(a[2] - b[2]) < kFrameCacheRotationTolerance);
+}
+
+size_t getCachedFrameSize(const Rect<uint16_t> size) {
+    return size_t(size.width) * size.height * 3 / 2;
+}
+
+// A tightly packed image in `data` with the chroma layout of `like`, copies
+// between them are plane copies.
+android_ycbcr initCachedFrame(const Rect<uint16_t> size, const android_ycbcr& like,
+                              uint8_t* data) {
+    const size_t width = size.width;
+    const size_t height = size.height;
+    uint8_t* const chroma = data + width * height;
+
+    android_ycbcr ycbcr;
+    ycbcr.y = data;
+    ycbcr.ystride = width;
+
+    switch (getPackedYuvLayout(like)) {
+    case PackedYuvLayout::NV12:
+        ycbcr.cb = chroma;
+        ycbcr.cr = chroma + 1;
+        ycbcr.cstride = width;
+        ycbcr.chroma_step = 2;
+        break;
+
+    case PackedYuvLayout::NV21:
+        ycbcr.cr = chroma;
+        ycbcr.cb = chroma + 1;
+        ycbcr.cstride = width;
+        ycbcr.chroma_step = 2;
+        break;
+
+    case PackedYuvLayout::Planar:
+        ycbcr.cb = chroma;
+        ycbcr.cr = chroma + (width / 2) * (height / 2);
+        ycbcr.cstride = width / 2;
+        ycbcr.chroma_step = 1;
+        break;
+    }
+
+    return ycbcr;
+}
+
+void copyYcbcr(const Rect<uint16_t> size, const android_ycbcr& src,
+               const android_ycbcr& dst) {
+    const int width = size.width;
+    const int height = size.height;
+    const int chromaWidth = width / 2;
+    const int chromaHeight = height / 2;
+
+    libyuv::CopyPlane(static_cast<const uint8_t*>(src.y), src.ystride,
+                      static_cast<uint8_t*>(dst.y), dst.ystride, width, height);
+
+    const PackedYuvLayout layout = getPackedYuvLayout(src);
+    if ((layout == getPackedYuvLayout(dst)) && (src.chroma_step == dst.chroma_step)) {
+        switch (layout) {
+        case PackedYuvLayout::NV12:
+            libyuv::CopyPlane(static_cast<const uint8_t*>(src.cb), src.cstride,
+                              static_cast<uint8_t*>(dst.cb), dst.cstride,
+                              width, chromaHeight);
+            return;
+
+        case PackedYuvLayout::NV21:
+            libyuv::CopyPlane(static_cast<const uint8_t*>(src.cr), src.cstride,
+                              static_cast<uint8_t*>(dst.cr), dst.cstride,
+                              width, chromaHeight);
+            return;
+
+        case PackedYuvLayout::Planar:
+            if (src.chroma_step == 1) {
+                libyuv::CopyPlane(static_cast<const uint8_t*>(src.cb), src.cstride,
+                                  static_cast<uint8_t*>(dst.cb), dst.cstride,
+                                  chromaWidth, chromaHeight);
+                libyuv::CopyPlane(static_cast<const uint8_t*>(src.cr), src.cstride,
+                                  static_cast<uint8_t*>(dst.cr), dst.cstride,
+                                  chromaWidth, chromaHeight);
+                return;
+            }
+            break;
+        }
+    }
+
+    for (int row = 0; row < chromaHeight; ++row) {
+        const uint8_t* srcCb = static_cast<const uint8_t*>(src.cb) + row * src.cstride;
+        const uint8_t* srcCr = static_cast<const uint8_t*>(src.cr) + row * src.cstride;
+        uint8_t* dstCb = static_cast<uint8_t*>(dst.cb) + row * dst.cstride;
+        uint8_t* dstCr = static_cast<uint8_t*>(dst.cr) + row * dst.cstride;
+
+        for (int i = 0; i < chromaWidth; ++i, srcCb += src.chroma_step, srcCr += src.chroma_step,
+                                              dstCb += dst.chroma_step, dstCr += dst.chroma_step) {
+            *dstCb = *srcCb;
+            *dstCr = *srcCr;
+        }
+    }
+}
+
 bool compressNV21IntoJpeg(const Rect<uint16_t> imageSize,
                           const uint8_t* nv21data,
                           const CameraMetadata& metadata,
                           const native_handle_t* jpegBuffer,
-                          const size_t jpegBufferSize) {
+                          const size_t jpegBufferSize,
+                          const std::atomic<bool>* abort) {
     const android_ycbcr imageYcbcr = yuv::NV21init(imageSize.width, imageSize.height,
                                                    const_cast<uint8_t*>(nv21data));
 
     return HwCamera::compressJpeg(imageSize, imageYcbcr, metadata,
-                                  jpegBuffer, jpegBufferSize);
+                                  jpegBuffer, jpegBufferSize, abort);
 }
 
 }  // namespace
 
 FakeRotatingCamera::FakeRotatingCamera(const bool isBackFacing)
         : mIsBackFacing(isBackFacing)
-        , mAFStateMachine(200, 1, 2) {}
+        , mUseSoftwareRenderer(useSoftwareRenderer())
+        , mAFStateMachine(200, 1, 2)
+        , mJpegImagePool(std::make_shared<YuvImagePool>()) {
+    if (mUseSoftwareRenderer) {
+        mSoftwareRenderer.init(loadTestPatternTexture(),
+                               toR8G8B8A8(kClearColor[0] * 255 + .5f,
+                                          kClearColor[1] * 255 + .5f,
+                                          kClearColor[2] * 255 + .5f,
+                                          kClearColor[3] * 255 + .5f));
+    }
+}
 
 FakeRotatingCamera::~FakeRotatingCamera() {
     closeImpl(true);
@@ -238,8 +476,8 @@ std::tuple<PixelFormat, BufferUsage, Dataspace, int32_t>
 FakeRotatingCamera::overrideStreamParams(const PixelFormat format,
                                          const BufferUsage usage,
                                          const Dataspace dataspace) const {
-    constexpr BufferUsage kRgbaExtraUsage = usageOr(BufferUsage::CAMERA_OUTPUT,
-                                                    BufferUsage::GPU_RENDER_TARGET);
+    const BufferUsage rgbaExtraUsage = usageOr(BufferUsage::CAMERA_OUTPUT,
+        mUseSoftwareRenderer ? BufferUsage::CPU_WRITE_OFTEN : BufferUsage::GPU_RENDER_TARGET);
     constexpr BufferUsage kYuvExtraUsage = usageOr(BufferUsage::CAMERA_OUTPUT,
                                                    BufferUsage::CPU_WRITE_OFTEN);
     constexpr BufferUsage kBlobExtraUsage = usageOr(BufferUsage::CAMERA_OUTPUT,
@@ -255,12 +493,12 @@ FakeRotatingCamera::overrideStreamParams(const PixelFormat format,
             return {PixelFormat::YCBCR_420_888, usageOr(usage, kYuvExtraUsage),
                     Dataspace::JFIF, 8};
         } else {
-            return {PixelFormat::RGBA_8888, usageOr(usage, kRgbaExtraUsage),
+            return {PixelFormat::RGBA_8888, usageOr(usage, rgbaExtraUsage),
                     Dataspace::UNKNOWN, 4};
         }
 
     case PixelFormat::RGBA_8888:
-        return {PixelFormat::RGBA_8888, usageOr(usage, kRgbaExtraUsage),
+        return {PixelFormat::RGBA_8888, usageOr(usage, rgbaExtraUsage),
                 Dataspace::UNKNOWN, (usageTest(usage, BufferUsage::VIDEO_ENCODER) ? 8 : 4)};
 
     case PixelFormat::BLOB:
@@ -295,8 +533,9 @@ bool FakeRotatingCamera::configure(const CameraMetadata& sessionParams,
         }
     }
 
-    const abc3d::EglCurrentContext currentContext = initOpenGL();
-    if (!currentContext.ok()) {
+    const abc3d::EglCurrentContext currentContext =
+        mUseSoftwareRenderer ? abc3d::EglCurrentContext() : initOpenGL();
+    if (!mUseSoftwareRenderer && !currentContext.ok()) {
         return FAILURE(false);
     }
 
@@ -311,11 +550,41 @@ bool FakeRotatingCamera::configure(const CameraMetadata& sessionParams,
         si.pixelFormat = halStreams->overrideFormat;
         si.blobBufferSize = streams->bufferSize;
 
-        if (si.pixelFormat != PixelFormat::RGBA_8888) {
-            const native_handle_t* buffer;
-            GraphicBufferAllocator& gba = GraphicBufferAllocator::get();
-            uint32_t stride;
+        if (mUseSoftwareRenderer || (si.pixelFormat == PixelFormat::RGBA_8888)) {
+            continue;
+        }
 
+        const native_handle_t* buffer;
+        GraphicBufferAllocator& gba = GraphicBufferAllocator::get();
+        uint32_t stride;
+
+        if (canPackYuv(si.size)) {
+            const Rect<uint16_t> packedSize = getPackedYuvSize(si.size);
+            abc3d::AutoTexture sceneTexture(GL_TEXTURE_2D, GL_RGBA,
+                                            si.size.width, si.size.height,
+                                            GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            // GL_LINEAR averages 2x2 blocks for chroma, NPOT textures
+            // require GL_CLAMP_TO_EDGE.
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+            if (sceneTexture.ok() &&
+                    (gba.allocate(packedSize.width, packedSize.height,
+                        static_cast<int>(PixelFormat::RGBA_8888), 1,
+                        static_cast<uint64_t>(usageOr(BufferUsage::GPU_RENDER_TARGET,
+                                                      usageOr(BufferUsage::CPU_READ_OFTEN,
+                                                              BufferUsage::CAMERA_OUTPUT))),
+                        &buffer, &stride, kClass) == NO_ERROR)) {
+                si.packedYuvBuffer.reset(buffer);
+                si.packedYuvStride = stride;
+                si.sceneTexture = std::move(sceneTexture);
+            } else {
+                mStreamInfoCache.clear();
+                return FAILURE(false);
+            }
+        } else {
             if (gba.allocate(si.size.width, si.size.height,
                     static_cast<int>(PixelFormat::RGBA_8888), 1,
                     static_cast<uint64_t>(usageOr(BufferUsage::GPU_RENDER_TARGET,
@@ -348,7 +617,7 @@ abc3d::EglCurrentContext FakeRotatingCamera::initOpenGL() {
         return abc3d::EglCurrentContext();
     }
 
-    abc3d::AutoTexture testPatternTexture = loadTestPatternTexture();
+    abc3d::AutoTexture testPatternTexture = uploadTexture(loadTestPatternTexture());
     if (!testPatternTexture.ok()) {
         return abc3d::EglCurrentContext();
     }
@@ -403,6 +672,98 @@ void main() {
         return abc3d::EglCurrentContext();
     }
 
+    // Converts `u_scene` into the layout of `StreamInfo::packedYuvBuffer`:
+    // each RGBA texel holds four consecutive bytes of Y or chroma, JFIF math.
+    const char kYuvVertexShaderStr[] = R"CODE(
+attribute vec2 a_position;
+void main() {
+    gl_Position = vec4(a_position, 0.0, 1.0);
+}
+)CODE";
+    abc3d::AutoShader yuvVertexShader;
+    if (!yuvVertexShader.compile(GL_VERTEX_SHADER, kYuvVertexShaderStr)) {
+        return abc3d::EglCurrentContext();
+    }
+
+    const char kYuvFragmentShaderStr[] = R"CODE(
+#ifdef GL_FRAGMENT_PRECISION_HIGH
+precision highp float;
+#else
+precision mediump float;
+#endif
+uniform sampler2D u_scene;
+uniform vec2 u_sceneSize;
+uniform int u_layout;  // PackedYuvLayout
+const vec3 kY = vec3(0.299, 0.587, 0.114);
+const vec3 kCb = vec3(-0.168736, -0.331264, 0.5);
+const vec3 kCr = vec3(0.5, -0.418688, -0.081312);
+
+vec3 scene(float x, float y) {
+    return texture2D(u_scene, vec2(x, y) / u_sceneSize).rgb;
+}
+
+float luma(float x, float y) {
+    return dot(kY, scene(x + 0.5, y + 0.5));
+}
+
+// sampling at the corner of four texels with GL_LINEAR averages them
+vec2 chroma(float cx, float cy) {
+    vec3 rgb = scene(2.0 * cx + 1.0, 2.0 * cy + 1.0);
+    return vec2(dot(kCb, rgb), dot(kCr, rgb)) + 0.5;
+}
+
+void main() {
+    float x = floor(gl_FragCoord.x);
+    float y = floor(gl_FragCoord.y);
+    if (y < u_sceneSize.y) {
+        float x4 = 4.0 * x;
+        gl_FragColor = vec4(luma(x4, y), luma(x4 + 1.0, y),
+                            luma(x4 + 2.0, y), luma(x4 + 3.0, y));
+    } else if (u_layout == 0) {
+        float cy = y - u_sceneSize.y;
+        float planeTexels = u_sceneSize.x / 8.0;
+        bool isCr = (x >= planeTexels);
+        float cx = 4.0 * (isCr ? (x - planeTexels) : x);
+        vec2 c0 = chroma(cx, cy);
+        vec2 c1 = chroma(cx + 1.0, cy);
+        vec2 c2 = chroma(cx + 2.0, cy);
+        vec2 c3 = chroma(cx + 3.0, cy);
+        gl_FragColor = isCr ? vec4(c0.y, c1.y, c2.y, c3.y) : vec4(c0.x, c1.x, c2.x, c3.x);
+    } else {
+        float cy = y - u_sceneSize.y;
+        vec2 c0 = chroma(2.0 * x, cy);
+        vec2 c1 = chroma(2.0 * x + 1.0, cy);
+        gl_FragColor = (u_layout == 1) ? vec4(c0, c1) : vec4(c0.yx, c1.yx);
+    }
+}
+)CODE";
+    abc3d::AutoShader yuvFragmentShader;
+    if (!yuvFragmentShader.compile(GL_FRAGMENT_SHADER, kYuvFragmentShaderStr)) {
+        return abc3d::EglCurrentContext();
+    }
+
+    abc3d::AutoProgram yuvProgram;
+    if (!yuvProgram.link(yuvVertexShader.get(), yuvFragmentShader.get())) {
+        return abc3d::EglCurrentContext();
+    }
+
+    const GLint yuvProgramAttrPositionLoc = yuvProgram.getAttribLocation("a_position");
+    if (yuvProgramAttrPositionLoc < 0) {
+        return abc3d::EglCurrentContext();
+    }
+    const GLint yuvProgramUniformSceneLoc = yuvProgram.getUniformLocation("u_scene");
+    if (yuvProgramUniformSceneLoc < 0) {
+        return abc3d::EglCurrentContext();
+    }
+    const GLint yuvProgramUniformSceneSizeLoc = yuvProgram.getUniformLocation("u_sceneSize");
+    if (yuvProgramUniformSceneSizeLoc < 0) {
+        return abc3d::EglCurrentContext();
+    }
+    const GLint yuvProgramUniformLayoutLoc = yuvProgram.getUniformLocation("u_layout");
+    if (yuvProgramUniformLayoutLoc < 0) {
+        return abc3d::EglCurrentContext();
+    }
+
     mEglContext = std::move(context);
     mGlTestPatternTexture = std::move(testPatternTexture);
     mGlProgramAttrPositionLoc = programAttrPositionLoc;
@@ -410,6 +771,11 @@ void main() {
     mGlProgramUniformTextureLoc = programUniformTextureLoc;
     mGlProgramUniformPvmMatrixLoc = programUniformPvmMatrixLoc;
     mGlProgram = std::move(program);
+    mGlYuvProgramAttrPositionLoc = yuvProgramAttrPositionLoc;
+    mGlYuvProgramUniformSceneLoc = yuvProgramUniformSceneLoc;
+    mGlYuvProgramUniformSceneSizeLoc = yuvProgramUniformSceneSizeLoc;
+    mGlYuvProgramUniformLayoutLoc = yuvProgramUniformLayoutLoc;
+    mGlYuvProgram = std::move(yuvProgram);
 
     return std::move(currentContext);
 }
@@ -417,10 +783,13 @@ void main() {
 void FakeRotatingCamera::closeImpl(const bool everything) {
     {
         const abc3d::EglCurrentContext currentContext = mEglContext.getCurrentContext();
-        LOG_ALWAYS_FATAL_IF(!mStreamInfoCache.empty() && !currentContext.ok());
+        LOG_ALWAYS_FATAL_IF(!mUseSoftwareRenderer && !mStreamInfoCache.empty() &&
+                            !currentContext.ok());
         mStreamInfoCache.clear();
+        mJpegImagePool->clear();
 
         if (everything) {
+            mGlYuvProgram.clear();
             mGlProgram.clear();
             mGlTestPatternTexture.clear();
         }
@@ -432,6 +801,39 @@ void FakeRotatingCamera::closeImpl(const bool everything) {
     }
 }
 
+std::vector<uint8_t> FakeRotatingCamera::YuvImagePool::get(const size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto i = images.begin(); i != images.end(); ++i) {
+            if (i->capacity() >= size) {
+                std::vector<uint8_t> image = std::move(*i);
+                images.erase(i);
+                image.resize(size);
+                return image;
+            }
+        }
+    }
+
+    return std::vector<uint8_t>(size);
+}
+
+void FakeRotatingCamera::YuvImagePool::put(std::vector<uint8_t> image) {
+    // one image is compressed while the next one is captured
+    constexpr size_t kMaxImages = 2;
+
+    if (!image.empty()) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (images.size() < kMaxImages) {
+            images.push_back(std::move(image));
+        }
+    }
+}
+
+void FakeRotatingCamera::YuvImagePool::clear() {
+    std::lock_guard<std::mutex> lock(mtx);
+    images.clear();
+}
+
 std::tuple<int64_t, CameraMetadata,
            std::vector<StreamBuffer>, std::vector<DelayedStreamBuffer>>
 FakeRotatingCamera::processCaptureRequest(CameraMetadata metadataUpdate,
@@ -445,8 +847,15 @@ FakeRotatingCamera::processCaptureRequest(CameraMetadata metadataUpdate,
     std::vector<DelayedStreamBuffer> delayedOutputBuffers;
     outputBuffers.reserve(csbsSize);
 
-    const abc3d::EglCurrentContext currentContext = mEglContext.getCurrentContext();
-    if (!currentContext.ok()) {
+    // JPEG frames are rendered into intermediate buffers which do not depend
+    // on acquire fences, other buffers are rendered into once their fences
+    // signal (awaited all together).
+    std::vector<CachedStreamBuffer*> fencedCsbs;
+    fencedCsbs.reserve(csbsSize);
+
+    const abc3d::EglCurrentContext currentContext = mUseSoftwareRenderer ?
+        abc3d::EglCurrentContext() : mEglContext.getCurrentContext();
+    if (!mUseSoftwareRenderer && !currentContext.ok()) {
         goto fail;
     }
 
@@ -487,10 +896,26 @@ FakeRotatingCamera::processCaptureRequest(CameraMetadata metadataUpdate,
             }
         }
 
-        if (si) {
-            captureFrame(*si, renderParams, csb, &outputBuffers, &delayedOutputBuffers);
-        } else {
+        if (!si) {
             outputBuffers.push_back(csb->finish(false));
+        } else if (si->pixelFormat == PixelFormat::BLOB) {
+            delayedOutputBuffers.push_back(captureFrameJpeg(*si, renderParams, csb));
+        } else {
+            fencedCsbs.push_back(csb);
+        }
+    }
+
+    if (!fencedCsbs.empty()) {
+        waitAcquireFences({fencedCsbs.begin(), fencedCsbs.end()},
+                          mFrameDurationNs / 2000000);
+
+        for (CachedStreamBuffer* csb : fencedCsbs) {
+            if (csb->getAcquireFence() >= 0) {
+                outputBuffers.push_back(csb->finish(FAILURE(false)));
+            } else {
+                captureFrame(*csb->getStreamInfo<StreamInfo>(), renderParams, csb,
+                             &outputBuffers, &delayedOutputBuffers);
+            }
         }
     }
 
@@ -539,48 +964,42 @@ void FakeRotatingCamera::captureFrame(const StreamInfo& si,
 bool FakeRotatingCamera::captureFrameRGBA(const StreamInfo& si,
                                             const RenderParams& renderParams,
                                             CachedStreamBuffer* csb) const {
-    if (!csb->waitAcquireFence(mFrameDurationNs / 2000000)) {
-        return FAILURE(false);
-    }
-
-    return renderIntoRGBA(si, renderParams, csb->getBuffer());
-}
-
-bool FakeRotatingCamera::captureFrameYUV(const StreamInfo& si,
-                                         const RenderParams& renderParams,
-                                         CachedStreamBuffer* csb) const {
-    LOG_ALWAYS_FATAL_IF(!si.rgbaBuffer);
-    if (!renderIntoRGBA(si, renderParams, si.rgbaBuffer.get())) {
-        return false;
+    if (!mUseSoftwareRenderer) {
+        return renderIntoRGBA(si, renderParams, csb->getBuffer());
     }
 
-    if (!csb->waitAcquireFence(mFrameDurationNs / 2000000)) {
-        return false;
+    const cb_handle_t* const cb = cb_handle_t::from(csb->getBuffer());
+    if (!cb) {
+        return FAILURE(false);
     }
 
     void* rgba = nullptr;
-    if (GraphicBufferMapper::get().lock(
-            si.rgbaBuffer.get(), static_cast<uint32_t>(BufferUsage::CPU_READ_OFTEN),
-            {si.size.width, si.size.height}, &rgba) != NO_ERROR) {
+    if (!grallocLock(csb->getBuffer(), BufferUsage::CPU_WRITE_OFTEN, si.size, &rgba)) {
         return FAILURE(false);
     }
 
+    float pvMatrix44[16];
+    getPvMatrix(si.size, renderParams, pvMatrix44);
+    mSoftwareRenderer.renderRGBA(pvMatrix44, si.size, static_cast<uint32_t*>(rgba),
+                                 cb->stride);
+
+    grallocUnlock(csb->getBuffer());
+    return true;
+}
+
+bool FakeRotatingCamera::captureFrameYUV(const StreamInfo& si,
+                                         const RenderParams& renderParams,
+                                         CachedStreamBuffer* csb) const {
     android_ycbcr ycbcr;
-    if (GraphicBufferMapper::get().lockYCbCr(
-            csb->getBuffer(), static_cast<uint32_t>(BufferUsage::CPU_WRITE_OFTEN),
-            {si.size.width, si.size.height}, &ycbcr) != NO_ERROR) {
-        LOG_ALWAYS_FATAL_IF(GraphicBufferMapper::get().unlock(si.rgbaBuffer.get()) != NO_ERROR);
+    if (!grallocLockYCbCr(csb->getBuffer(), BufferUsage::CPU_WRITE_OFTEN,
+                          si.size, &ycbcr)) {
         return FAILURE(false);
     }
 
-    const bool converted = conv::rgba2yuv(si.size.width, si.size.height,
-                                          static_cast<const uint32_t*>(rgba),
-                                          ycbcr);
-
-    LOG_ALWAYS_FATAL_IF(GraphicBufferMapper::get().unlock(csb->getBuffer()) != NO_ERROR);
-    LOG_ALWAYS_FATAL_IF(GraphicBufferMapper::get().unlock(si.rgbaBuffer.get()) != NO_ERROR);
+    const bool rendered = renderYcbcr(si, renderParams, ycbcr);
 
-    return converted;
+    grallocUnlock(csb->getBuffer());
+    return rendered;
 }
 
 DelayedStreamBuffer FakeRotatingCamera::captureFrameJpeg(const StreamInfo& si,
@@ -592,48 +1011,42 @@ DelayedStreamBuffer FakeRotatingCamera::captureFrameJpeg(const StreamInfo& si,
     const uint32_t jpegBufferSize = si.blobBufferSize;
     const int64_t frameDurationNs = mFrameDurationNs;
     CameraMetadata metadata = mCaptureResultMetadata;
+    FrameTimingStats* const stats = &mFrameTimingStats;
+    std::shared_ptr<YuvImagePool> imagePool = mJpegImagePool;
 
-    return [csb, imageSize, nv21data = std::move(nv21data), metadata = std::move(metadata),
-            jpegBufferSize, frameDurationNs](const bool ok) -> StreamBuffer {
+    auto process = [csb, imageSize, nv21data = std::move(nv21data),
+                    metadata = std::move(metadata), jpegBufferSize, frameDurationNs,
+                    stats, imagePool = std::move(imagePool)]
+                   (const bool ok, const std::atomic<bool>* const abort) mutable -> StreamBuffer {
         StreamBuffer sb;
         if (ok && !nv21data.empty() && csb->waitAcquireFence(frameDurationNs / 1000000)) {
+            ScopedFrameStage stage(*stats, FrameStage::JpegEncode);
             sb = csb->finish(compressNV21IntoJpeg(imageSize, nv21data.data(), metadata,
-                                                  csb->getBuffer(), jpegBufferSize));
+                                                  csb->getBuffer(), jpegBufferSize,
+                                                  abort));
         } else {
             sb = csb->finish(false);
         }
 
+        imagePool->put(std::move(nv21data));
         return sb;
     };
+
+    return {std::move(process), csb->getStreamId()};
 }
 
 std::vector<uint8_t>
 FakeRotatingCamera::captureFrameForCompressing(const StreamInfo& si,
                                                const RenderParams& renderParams) const {
-    if (!renderIntoRGBA(si, renderParams, si.rgbaBuffer.get())) {
-        return {};
-    }
-
-    void* rgba = nullptr;
-    if (GraphicBufferMapper::get().lock(
-            si.rgbaBuffer.get(), static_cast<uint32_t>(BufferUsage::CPU_READ_OFTEN),
-            {si.size.width, si.size.height}, &rgba) != NO_ERROR) {
-        return {};
-    }
-
-    std::vector<uint8_t> nv21data(yuv::NV21size(si.size.width, si.size.height));
+    std::vector<uint8_t> nv21data =
+        mJpegImagePool->get(yuv::NV21size(si.size.width, si.size.height));
     const android_ycbcr ycbcr = yuv::NV21init(si.size.width, si.size.height,
                                               nv21data.data());
 
-    const bool converted = conv::rgba2yuv(si.size.width, si.size.height,
-                                          static_cast<const uint32_t*>(rgba),
-                                          ycbcr);
-
-    LOG_ALWAYS_FATAL_IF(GraphicBufferMapper::get().unlock(si.rgbaBuffer.get()) != NO_ERROR);
-
-    if (converted) {
+    if (renderYcbcr(si, renderParams, ycbcr)) {
         return nv21data;
     } else {
+        mJpegImagePool->put(std::move(nv21data));
         return {};
     }
 }
@@ -642,43 +1055,7 @@ bool FakeRotatingCamera::drawScene(const Rect<uint16_t> imageSize,
                                    const RenderParams& renderParams,
                                    const bool isHardwareBuffer) const {
     float pvMatrix44[16];
-    {
-        float projectionMatrix44[16];
-        float viewMatrix44[16];
-
-        // This matrix takes into account specific behaviors below:
-        // * The Y axis if rendering int0 AHardwareBuffer goes down while it
-        //   goes up everywhere else (e.g. when rendering to `EGLSurface`).
-        // * We set `sensorOrientation=90` because a lot of places in Android and
-        //   3Ps assume this and don't work properly with `sensorOrientation=0`.
-        const float workaroundMatrix44[16] = {
-            0, (isHardwareBuffer ? -1.0f : 1.0f), 0, 0,
-           -1,                                 0, 0, 0,
-            0,                                 0, 1, 0,
-            0,                                 0, 0, 1,
-        };
-
-        {
-            constexpr double kNear = 1.0;
-            constexpr double kFar = 10.0;
-
-            // We use `height` to calculate `right` because the image is 90degrees
-            // rotated (sensorOrientation=90).
-            const double right = kNear * (.5 * getSensorSize().height / getSensorDPI() / getDefaultFocalLength());
-            const double top = right / imageSize.width * imageSize.height;
-            abc3d::frustum(pvMatrix44, -right, right, -top, top,
-                           kNear, kFar);
-        }
-
-        abc3d::mulM44(projectionMatrix44, pvMatrix44, workaroundMatrix44);
-
-        {
-            const auto& cam = renderParams.cameraParams;
-            abc3d::lookAtXyzRot(viewMatrix44, cam.pos3, cam.rotXYZ3);
-        }
-
-        abc3d::mulM44(pvMatrix44, projectionMatrix44, viewMatrix44);
-    }
+    getPvMatrix(imageSize, renderParams, pvMatrix44, isHardwareBuffer);
 
     glViewport(0, 0, imageSize.width, imageSize.height);
     const bool result = drawSceneImpl(pvMatrix44);
@@ -686,6 +1063,47 @@ bool FakeRotatingCamera::drawScene(const Rect<uint16_t> imageSize,
     return result;
 }
 
+void FakeRotatingCamera::getPvMatrix(const Rect<uint16_t> imageSize,
+                                     const RenderParams& renderParams,
+                                     float pvMatrix44[],
+                                     const bool isHardwareBuffer) const {
+    float projectionMatrix44[16];
+    float viewMatrix44[16];
+
+    // This matrix takes into account specific behaviors below:
+    // * The Y axis if rendering int0 AHardwareBuffer goes down while it
+    //   goes up everywhere else (e.g. when rendering to `EGLSurface`).
+    // * We set `sensorOrientation=90` because a lot of places in Android and
+    //   3Ps assume this and don't work properly with `sensorOrientation=0`.
+    const float workaroundMatrix44[16] = {
+        0, (isHardwareBuffer ? -1.0f : 1.0f), 0, 0,
+       -1,                                 0, 0, 0,
+        0,                                 0, 1, 0,
+        0,                                 0, 0, 1,
+    };
+
+    {
+        constexpr double kNear = 1.0;
+        constexpr double kFar = 10.0;
+
+        // We use `height` to calculate `right` because the image is 90degrees
+        // rotated (sensorOrientation=90).
+        const double right = kNear * (.5 * getSensorSize().height / getSensorDPI() / getDefaultFocalLength());
+        const double top = right / imageSize.width * imageSize.height;
+        abc3d::frustum(pvMatrix44, -right, right, -top, top,
+                       kNear, kFar);
+    }
+
+    abc3d::mulM44(projectionMatrix44, pvMatrix44, workaroundMatrix44);
+
+    {
+        const auto& cam = renderParams.cameraParams;
+        abc3d::lookAtXyzRot(viewMatrix44, cam.pos3, cam.rotXYZ3);
+    }
+
+    abc3d::mulM44(pvMatrix44, projectionMatrix44, viewMatrix44);
+}
+
 bool FakeRotatingCamera::drawSceneImpl(const float pvMatrix44[]) const {
     constexpr float kX = 0;
     constexpr float kY = 0;
@@ -705,7 +1123,7 @@ bool FakeRotatingCamera::drawSceneImpl(const float pvMatrix44[]) const {
 
     static const GLushort indices[] = { 0, 1, 2, 0, 2, 3 };
 
-    glClearColor(0.2, 0.3, 0.2, 1.0);
+    glClearColor(kClearColor[0], kClearColor[1], kClearColor[2], kClearColor[3]);
     glClear(GL_COLOR_BUFFER_BIT);
 
     glUseProgram(mGlProgram.get());
@@ -761,6 +1179,165 @@ bool FakeRotatingCamera::renderIntoRGBA(const StreamInfo& si,
     return drawScene(si.size, renderParams, true);
 }
 
+// The scene is static, while the sensors report the same orientation the
+// previous frame of the stream is copied instead of rendering a new one.
+bool FakeRotatingCamera::renderYcbcr(const StreamInfo& si,
+                                     const RenderParams& renderParams,
+                                     const android_ycbcr& ycbcr) const {
+    const size_t cachedFrameSize = getCachedFrameSize(si.size);
+    const bool hit = (si.cachedFrame.size() == cachedFrameSize) &&
+        isSameCameraPosition(si.cachedFrameParams.cameraParams.rotXYZ3,
+                             renderParams.cameraParams.rotXYZ3);
+    mFrameTimingStats.addFrameCacheLookup(hit);
+
+    if (hit) {
+        copyYcbcr(si.size, initCachedFrame(si.size, ycbcr, si.cachedFrame.data()), ycbcr);
+        return true;
+    }
+
+    if (!renderYcbcrImpl(si, renderParams, ycbcr)) {
+        si.cachedFrame.clear();
+        return false;
+    }
+
+    si.cachedFrame.resize(cachedFrameSize);
+    si.cachedFrameParams = renderParams;
+    copyYcbcr(si.size, ycbcr, initCachedFrame(si.size, ycbcr, si.cachedFrame.data()));
+    return true;
+}
+
+bool FakeRotatingCamera::renderYcbcrImpl(const StreamInfo& si,
+                                         const RenderParams& renderParams,
+                                         const android_ycbcr& ycbcr) const {
+    if (mUseSoftwareRenderer) {
+        float pvMatrix44[16];
+        getPvMatrix(si.size, renderParams, pvMatrix44);
+        return mSoftwareRenderer.renderYUV(pvMatrix44, si.size, ycbcr);
+    }
+
+    if (si.packedYuvBuffer) {
+        return renderIntoYcbcr(si, renderParams, ycbcr);
+    }
+
+    LOG_ALWAYS_FATAL_IF(!si.rgbaBuffer);
+    if (!renderIntoRGBA(si, renderParams, si.rgbaBuffer.get())) {
+        return false;
+    }
+
+    void* rgba = nullptr;
+    if (!grallocLock(si.rgbaBuffer.get(), BufferUsage::CPU_READ_OFTEN,
+                     si.size, &rgba)) {
+        return FAILURE(false);
+    }
+
+    const bool converted = conv::rgba2yuv(si.size.width, si.size.height,
+                                          static_cast<const uint32_t*>(rgba),
+                                          ycbcr);
+
+    grallocUnlock(si.rgbaBuffer.get());
+    return converted;
+}
+
+bool FakeRotatingCamera::renderIntoYcbcr(const StreamInfo& si,
+                                         const RenderParams& renderParams,
+                                         const android_ycbcr& ycbcr) const {
+    const PackedYuvLayout layout = getPackedYuvLayout(ycbcr);
+    if (!renderIntoPackedYuv(si, renderParams, layout)) {
+        return false;
+    }
+
+    void* packed = nullptr;
+    if (!grallocLock(si.packedYuvBuffer.get(), BufferUsage::CPU_READ_OFTEN,
+                     getPackedYuvSize(si.size), &packed)) {
+        return FAILURE(false);
+    }
+
+    copyPackedYuv(si.size, static_cast<const uint8_t*>(packed),
+                  si.packedYuvStride * sizeof(uint32_t), layout, ycbcr);
+
+    grallocUnlock(si.packedYuvBuffer.get());
+    return true;
+}
+
+// Two passes: the scene is drawn into `si.sceneTexture` and then converted
+// into Y and chroma rows of `si.packedYuvBuffer` by `mGlYuvProgram`, the
+// CPU only copies rows into the destination layout.
+bool FakeRotatingCamera::renderIntoPackedYuv(const StreamInfo& si,
+                                             const RenderParams& renderParams,
+                                             const PackedYuvLayout layout) const {
+    {
+        abc3d::AutoFrameBuffer fbo;
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, si.sceneTexture.get(), 0);
+
+        // the texture rows go the same way as in AHardwareBuffer
+        float pvMatrix44[16];
+        getPvMatrix(si.size, renderParams, pvMatrix44, true);
+
+        glViewport(0, 0, si.size.width, si.size.height);
+        if (!drawSceneImpl(pvMatrix44)) {
+            return false;
+        }
+    }
+
+    const Rect<uint16_t> packedSize = getPackedYuvSize(si.size);
+    const native_handle_t* const packedBuffer = si.packedYuvBuffer.get();
+
+    const auto gb = sp<GraphicBuffer>::make(
+        packedBuffer, GraphicBuffer::WRAP_HANDLE, packedSize.width,
+        packedSize.height, static_cast<int>(PixelFormat::RGBA_8888), 1,
+        static_cast<uint64_t>(usageOr(BufferUsage::GPU_RENDER_TARGET,
+                                      usageOr(BufferUsage::CPU_READ_OFTEN,
+                                              BufferUsage::CAMERA_OUTPUT))),
+        si.packedYuvStride);
+
+    const EGLClientBuffer clientBuf =
+        eglGetNativeClientBufferANDROID(gb->toAHardwareBuffer());
+    if (!clientBuf) {
+        return FAILURE(false);
+    }
+
+    const abc3d::AutoImageKHR eglImage(mEglContext.getDisplay(), clientBuf);
+    if (!eglImage.ok()) {
+        return false;
+    }
+
+    abc3d::AutoTexture fboTex(GL_TEXTURE_2D);
+    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, eglImage.get());
+
+    abc3d::AutoFrameBuffer fbo;
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, fboTex.get(), 0);
+
+    static const GLfloat kQuad[] = {
+        -1, -1,
+         1, -1,
+        -1,  1,
+         1,  1,
+    };
+
+    glViewport(0, 0, packedSize.width, packedSize.height);
+    // drawSceneImpl left its attributes pointing to its stack
+    glDisableVertexAttribArray(mGlProgramAttrPositionLoc);
+    glDisableVertexAttribArray(mGlProgramAttrTexCoordLoc);
+
+    glUseProgram(mGlYuvProgram.get());
+    glVertexAttribPointer(mGlYuvProgramAttrPositionLoc, 2, GL_FLOAT, GL_FALSE,
+                          2 * sizeof(GLfloat), kQuad);
+    glEnableVertexAttribArray(mGlYuvProgramAttrPositionLoc);
+    glUniform2f(mGlYuvProgramUniformSceneSizeLoc, si.size.width, si.size.height);
+    glUniform1i(mGlYuvProgramUniformLayoutLoc, static_cast<int>(layout));
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, si.sceneTexture.get());
+    glUniform1i(mGlYuvProgramUniformSceneLoc, 0);
+
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glFinish();
+
+    return true;
+}
+
 bool FakeRotatingCamera::readSensors(SensorValues* vals) {
     static const char kReadCommand[] = "get";
 
@@ -789,7 +1366,8 @@ CameraMetadata FakeRotatingCamera::applyMetadata(const CameraMetadata& metadata)
         reinterpret_cast<const camera_metadata_t*>(metadata.metadata.data());
 
     mFrameDurationNs = getFrameDuration(raw, kDefaultFrameDurationNs,
-                                        kMinFrameDurationNs, kMaxFrameDurationNs);
+                                        kMinFrameDurationNs, kMaxFrameDurationNs,
+                                        mHighSpeedMaxFps);
 
     camera_metadata_ro_entry_t entry;
     const camera_metadata_enum_android_control_af_mode_t afMode =
@@ -804,30 +1382,32 @@ CameraMetadata FakeRotatingCamera::applyMetadata(const CameraMetadata& metadata)
 
     const auto af = mAFStateMachine(afMode, afTrigger);
 
-    CameraMetadataMap m = parseCameraMetadataMap(metadata);
-
-    m[ANDROID_CONTROL_AE_STATE] = ANDROID_CONTROL_AE_STATE_CONVERGED;
-    m[ANDROID_CONTROL_AF_STATE] = af.first;
-    m[ANDROID_CONTROL_AWB_STATE] = ANDROID_CONTROL_AWB_STATE_CONVERGED;
-    m[ANDROID_FLASH_STATE] = ANDROID_FLASH_STATE_UNAVAILABLE;
-    m[ANDROID_LENS_APERTURE] = getDefaultAperture();
-    m[ANDROID_LENS_FOCUS_DISTANCE] = af.second;
-    m[ANDROID_LENS_STATE] = ANDROID_LENS_STATE_STATIONARY;
-    m[ANDROID_REQUEST_PIPELINE_DEPTH] = uint8_t(4);
-    m[ANDROID_SENSOR_FRAME_DURATION] = mFrameDurationNs;
-    m[ANDROID_SENSOR_EXPOSURE_TIME] = kDefaultSensorExposureTimeNs;
-    m[ANDROID_SENSOR_SENSITIVITY] = getDefaultSensorSensitivity();
-    m[ANDROID_SENSOR_TIMESTAMP] = int64_t(0);
-    m[ANDROID_SENSOR_ROLLING_SHUTTER_SKEW] = kMinSensorExposureTimeNs;
-    m[ANDROID_STATISTICS_SCENE_FLICKER] = ANDROID_STATISTICS_SCENE_FLICKER_NONE;
+    if (!metadataUpdateInPlace(&mCaptureResultMetadata, metadata,
+                               metadataGetCaptureResultTags())) {
+        std::optional<CameraMetadata> maybeTemplate =
+            metadataBuildCaptureResultTemplate(metadata, metadataGetCaptureResultTags());
 
-    std::optional<CameraMetadata> maybeSerialized =
-        serializeCameraMetadataMap(m);
-
-    if (maybeSerialized) {
-        mCaptureResultMetadata = std::move(maybeSerialized.value());
+        if (maybeTemplate) {
+            mCaptureResultMetadata = std::move(maybeTemplate.value());
+        }
     }
 
+    CameraMetadata* const m = &mCaptureResultMetadata;
+    metadataSetEntry(m, ANDROID_CONTROL_AE_STATE, ANDROID_CONTROL_AE_STATE_CONVERGED);
+    metadataSetEntry(m, ANDROID_CONTROL_AF_STATE, af.first);
+    metadataSetEntry(m, ANDROID_CONTROL_AWB_STATE, ANDROID_CONTROL_AWB_STATE_CONVERGED);
+    metadataSetEntry(m, ANDROID_FLASH_STATE, ANDROID_FLASH_STATE_UNAVAILABLE);
+    metadataSetEntry(m, ANDROID_LENS_APERTURE, float(getDefaultAperture()));
+    metadataSetEntry(m, ANDROID_LENS_FOCUS_DISTANCE, af.second);
+    metadataSetEntry(m, ANDROID_LENS_STATE, ANDROID_LENS_STATE_STATIONARY);
+    metadataSetEntry(m, ANDROID_REQUEST_PIPELINE_DEPTH, uint8_t(4));
+    metadataSetEntry(m, ANDROID_SENSOR_FRAME_DURATION, int64_t(mFrameDurationNs));
+    metadataSetEntry(m, ANDROID_SENSOR_EXPOSURE_TIME, int64_t(kDefaultSensorExposureTimeNs));
+    metadataSetEntry(m, ANDROID_SENSOR_SENSITIVITY, int32_t(getDefaultSensorSensitivity()));
+    metadataSetEntry(m, ANDROID_SENSOR_TIMESTAMP, int64_t(0));
+    metadataSetEntry(m, ANDROID_SENSOR_ROLLING_SHUTTER_SKEW, int64_t(kMinSensorExposureTimeNs));
+    metadataSetEntry(m, ANDROID_STATISTICS_SCENE_FLICKER, ANDROID_STATISTICS_SCENE_FLICKER_NONE);
+
     {   // reset ANDROID_CONTROL_AF_TRIGGER to IDLE
         camera_metadata_t* const raw =
             reinterpret_cast<camera_metadata_t*>(mCaptureResultMetadata.metadata.data());
@@ -853,30 +1433,13 @@ CameraMetadata FakeRotatingCamera::applyMetadata(const CameraMetadata& metadata)
 }
 
 CameraMetadata FakeRotatingCamera::updateCaptureResultMetadata() {
-    camera_metadata_t* const raw =
-        reinterpret_cast<camera_metadata_t*>(mCaptureResultMetadata.metadata.data());
-
     const auto af = mAFStateMachine();
 
-    camera_metadata_ro_entry_t entry;
-
-    if (find_camera_metadata_ro_entry(raw, ANDROID_CONTROL_AF_STATE, &entry)) {
-        ALOGW("%s:%s:%d: find_camera_metadata_ro_entry(ANDROID_CONTROL_AF_STATE) failed",
-              kClass, __func__, __LINE__);
-    } else if (update_camera_metadata_entry(raw, entry.index, &af.first, 1, nullptr)) {
-        ALOGW("%s:%s:%d: update_camera_metadata_entry(ANDROID_CONTROL_AF_STATE) failed",
-              kClass, __func__, __LINE__);
-    }
-
-    if (find_camera_metadata_ro_entry(raw, ANDROID_LENS_FOCUS_DISTANCE, &entry)) {
-        ALOGW("%s:%s:%d: find_camera_metadata_ro_entry(ANDROID_LENS_FOCUS_DISTANCE) failed",
-              kClass, __func__, __LINE__);
-    } else if (update_camera_metadata_entry(raw, entry.index, &af.second, 1, nullptr)) {
-        ALOGW("%s:%s:%d: update_camera_metadata_entry(ANDROID_LENS_FOCUS_DISTANCE) failed",
-              kClass, __func__, __LINE__);
-    }
+    metadataSetEntry(&mCaptureResultMetadata, ANDROID_CONTROL_AF_STATE, af.first);
+    metadataSetEntry(&mCaptureResultMetadata, ANDROID_LENS_FOCUS_DISTANCE, af.second);
 
-    return metadataCompact(mCaptureResultMetadata);
+    // mCaptureResultMetadata is compact and is updated only in place
+    return mCaptureResultMetadata;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -916,6 +1479,15 @@ std::tuple<int32_t, int32_t, int32_t> FakeRotatingCamera::getMaxNumOutputStreams
     };
 }
 
+Span<const HighSpeedVideoConfig> FakeRotatingCamera::getHighSpeedVideoConfigs() const {
+    static const HighSpeedVideoConfig highSpeedVideoConfigs[] = {
+        {{320, 240}, kHighSpeedMaxFPS},
+        {{640, 480}, kHighSpeedFPS},
+    };
+
+    return highSpeedVideoConfigs;
+}
+
 Span<const PixelFormat> FakeRotatingCamera::getSupportedPixelFormats() const {
     static const PixelFormat supportedPixelFormats[] = {
         PixelFormat::IMPLEMENTATION_DEFINED,
@@ -16,7 +16,10 @@
 
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 
@@ -25,6 +28,7 @@
 #include "AutoNativeHandle.h"
 #include "AFStateMachine.h"
 #include "HwCamera.h"
+#include "SoftwareRenderer.h"
 
 namespace android {
 namespace hardware {
@@ -34,6 +38,14 @@ namespace implementation {
 namespace hw {
 
 struct FakeRotatingCamera : public HwCamera {
+    // Chroma rows of `StreamInfo::packedYuvBuffer`, the values are used
+    // in the shader.
+    enum class PackedYuvLayout {
+        Planar = 0,  // Cb samples followed by Cr samples
+        NV12 = 1,    // interleaved, Cb first
+        NV21 = 2,    // interleaved, Cr first
+    };
+
     explicit FakeRotatingCamera(bool isBackFacing);
     ~FakeRotatingCamera() override;
 
@@ -53,6 +65,7 @@ struct FakeRotatingCamera : public HwCamera {
     Span<const Rect<uint16_t>> getAvailableThumbnailSizes() const override;
     bool isBackFacing() const override;
     std::tuple<int32_t, int32_t, int32_t> getMaxNumOutputStreams() const override;
+    Span<const HighSpeedVideoConfig> getHighSpeedVideoConfigs() const override;
     Span<const PixelFormat> getSupportedPixelFormats() const override;
     Span<const Rect<uint16_t>> getSupportedResolutions() const override;
     int64_t getMinFrameDurationNs() const override;
@@ -65,13 +78,45 @@ struct FakeRotatingCamera : public HwCamera {
     float getDefaultFocalLength() const override;
 
 private:
+    friend struct FakeRotatingCameraTest;
+
+    struct RenderParams {
+        struct CameraParams {
+            float pos3[3];
+            float rotXYZ3[3];
+        };
+        CameraParams cameraParams;
+    };
+
     struct StreamInfo {
         std::unique_ptr<const native_handle_t,
                         AutoAllocatorNativeHandleDeleter> rgbaBuffer;
+        // YUV frames rendered on the GPU: the scene goes into `sceneTexture`
+        // which is converted into `packedYuvBuffer` (see renderIntoPackedYuv)
+        std::unique_ptr<const native_handle_t,
+                        AutoAllocatorNativeHandleDeleter> packedYuvBuffer;
+        abc3d::AutoTexture sceneTexture;
+        uint32_t packedYuvStride = 0;
         BufferUsage usage;
         Rect<uint16_t> size;
         PixelFormat pixelFormat;
         uint32_t blobBufferSize;
+        // the last rendered YUV frame (see renderYcbcr), reused while the
+        // camera does not move
+        mutable std::vector<uint8_t> cachedFrame;
+        mutable RenderParams cachedFrameParams;
+    };
+
+    // YUV images for JPEG compression are large and would be allocated (and
+    // page faulted) for every capture. The delayed processing returns them
+    // here, it might outlive the camera and shares the ownership.
+    struct YuvImagePool {
+        std::vector<uint8_t> get(size_t size);
+        void put(std::vector<uint8_t> image);
+        void clear();
+
+        std::mutex mtx;
+        std::vector<std::vector<uint8_t>> images;
     };
 
     struct SensorValues {
@@ -80,14 +125,6 @@ private:
         float rotation[3];
     };
 
-    struct RenderParams {
-        struct CameraParams {
-            float pos3[3];
-            float rotXYZ3[3];
-        };
-        CameraParams cameraParams;
-    };
-
     abc3d::EglCurrentContext initOpenGL();
     void closeImpl(bool everything);
 
@@ -107,20 +144,40 @@ private:
                                          CachedStreamBuffer* csb) const;
     std::vector<uint8_t> captureFrameForCompressing(const StreamInfo& si,
                                                     const RenderParams& renderParams) const;
+    bool renderYcbcr(const StreamInfo& si,
+                     const RenderParams& renderParams,
+                     const android_ycbcr& ycbcr) const;
+    bool renderYcbcrImpl(const StreamInfo& si,
+                         const RenderParams& renderParams,
+                         const android_ycbcr& ycbcr) const;
     bool renderIntoRGBA(const StreamInfo& si,
                         const RenderParams& renderParams,
                         const native_handle_t* rgbaBuffer) const;
+    bool renderIntoYcbcr(const StreamInfo& si,
+                         const RenderParams& renderParams,
+                         const android_ycbcr& ycbcr) const;
+    bool renderIntoPackedYuv(const StreamInfo& si,
+                             const RenderParams& renderParams,
+                             PackedYuvLayout layout) const;
     bool drawScene(Rect<uint16_t> imageSize,
                    const RenderParams& renderParams,
                    bool isHardwareBuffer) const;
+    // `isHardwareBuffer`: the Y axis goes down (rendering into AHardwareBuffer)
+    void getPvMatrix(Rect<uint16_t> imageSize,
+                     const RenderParams& renderParams,
+                     float pvMatrix44[],
+                     bool isHardwareBuffer = true) const;
     bool drawSceneImpl(const float pvMatrix44[]) const;
     CameraMetadata applyMetadata(const CameraMetadata& metadata);
     CameraMetadata updateCaptureResultMetadata();
     bool readSensors(SensorValues* vals);
 
     const bool mIsBackFacing;
+    const bool mUseSoftwareRenderer;  // GL is emulated on the CPU anyway
+    SoftwareRenderer mSoftwareRenderer;
     AFStateMachine mAFStateMachine;
     std::unordered_map<int32_t, StreamInfo> mStreamInfoCache;
+    const std::shared_ptr<YuvImagePool> mJpegImagePool;
     base::unique_fd mQemuChannel;
 
     abc3d::EglContext mEglContext;
@@ -130,6 +187,11 @@ private:
     GLint mGlProgramUniformTextureLoc;
     GLint mGlProgramUniformPvmMatrixLoc;
     abc3d::AutoProgram mGlProgram;
+    GLint mGlYuvProgramAttrPositionLoc;
+    GLint mGlYuvProgramUniformSceneLoc;
+    GLint mGlYuvProgramUniformSceneSizeLoc;
+    GLint mGlYuvProgramUniformLayoutLoc;
+    abc3d::AutoProgram mGlYuvProgram;
 
     CameraMetadata mCaptureResultMetadata;
     int64_t mFrameDurationNs = 0;
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define FAILURE_DEBUG_PREFIX "FrameDistributor"
+
+#include <log/log.h>
+#include <ui/GraphicBufferAllocator.h>
+#include <ui/GraphicBufferMapper.h>
+
+#include <aidl/android/hardware/graphics/common/BufferUsage.h>
+#include <aidl/android/hardware/graphics/common/PixelFormat.h>
+
+#include "debug.h"
+#include "FrameDistributor.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+using aidl::android::hardware::graphics::common::BufferUsage;
+using aidl::android::hardware::graphics::common::PixelFormat;
+
+FrameDistributor::~FrameDistributor() {
+    {
+        std::lock_guard<std::mutex> lock(mMtx);
+        mStopping = true;
+    }
+    mIdleCaptureCv.notify_one();
+    if (mIdleCaptureThread.joinable()) {
+        mIdleCaptureThread.join();
+    }
+
+    for (Slot& slot : mSlots) {
+        LOG_ALWAYS_FATAL_IF(slot.readers || slot.writing);
+        freeSlotBuffer(&slot);
+    }
+}
+
+bool FrameDistributor::tryBecomePrimary(const void* const client,
+                                        std::function<bool()> captureIdleFrame) {
+    std::lock_guard<std::mutex> lock(mMtx);
+    if (mPrimary) {
+        return mPrimary == client;
+    } else {
+        mPrimary = client;
+        mCaptureIdleFrame = std::move(captureIdleFrame);
+        return true;
+    }
+}
+
+void FrameDistributor::leavePrimary(const void* const client) {
+    std::lock_guard<std::mutex> idleCaptureLock(mIdleCaptureMtx);
+    std::lock_guard<std::mutex> lock(mMtx);
+    if (mPrimary == client) {
+        mPrimary = nullptr;
+        mCaptureIdleFrame = nullptr;
+    }
+}
+
+void FrameDistributor::addSecondary() {
+    {
+        std::lock_guard<std::mutex> lock(mMtx);
+        mNumSecondaries.fetch_add(1, std::memory_order_relaxed);
+        if (!mIdleCaptureThread.joinable()) {
+            mIdleCaptureThread = std::thread(&FrameDistributor::idleCaptureLoop, this);
+        }
+    }
+    mIdleCaptureCv.notify_one();
+}
+
+void FrameDistributor::removeSecondary() {
+    LOG_ALWAYS_FATAL_IF(mNumSecondaries.fetch_sub(1, std::memory_order_relaxed) <= 0);
+}
+
+bool FrameDistributor::hasSecondaries() const {
+    return mNumSecondaries.load(std::memory_order_relaxed) > 0;
+}
+
+bool FrameDistributor::publish(const Rect<uint16_t> size,
+                               const std::function<bool(const android_ycbcr&)>& fill) {
+    Slot* slot = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mMtx);
+        for (int i = 0; i < kNumSlots; ++i) {
+            Slot& s = mSlots[i];
+            if ((i != mLatestSlot) && !s.readers && !s.writing &&
+                    (!slot || (s.number < slot->number))) {
+                slot = &s;  // the oldest one
+            }
+        }
+
+        if (!slot) {
+            return false;
+        }
+        slot->writing = true;
+    }
+
+    // only the primary writes and `writing` keeps secondaries away
+    if (slot->buffer && !(slot->size == size)) {
+        freeSlotBuffer(slot);
+    }
+
+    const bool ok = (slot->buffer || allocateSlotBuffer(size, slot)) && fill(slot->ycbcr);
+
+    std::lock_guard<std::mutex> lock(mMtx);
+    slot->writing = false;
+    if (ok) {
+        slot->number = ++mNumFrames;
+        slot->publishedAt = std::chrono::steady_clock::now();
+        mLatestSlot = slot - mSlots;
+    }
+
+    return ok;
+}
+
+std::optional<FrameDistributor::Frame> FrameDistributor::acquireLatest() {
+    std::lock_guard<std::mutex> lock(mMtx);
+    if (mLatestSlot < 0) {
+        return std::nullopt;
+    }
+
+    Slot& slot = mSlots[mLatestSlot];
+    if ((std::chrono::steady_clock::now() - slot.publishedAt) > kMaxFrameAge) {
+        return std::nullopt;
+    }
+
+    ++slot.readers;
+    return Frame{slot.ycbcr, slot.size, slot.number, mLatestSlot};
+}
+
+void FrameDistributor::release(const Frame& frame) {
+    std::lock_guard<std::mutex> lock(mMtx);
+    LOG_ALWAYS_FATAL_IF(mSlots[frame.slot].readers <= 0);
+    --mSlots[frame.slot].readers;
+}
+
+// Sleeps while there are no secondaries or the primary publishes frames.
+void FrameDistributor::idleCaptureLoop() {
+    std::unique_lock<std::mutex> lock(mMtx);
+    while (!mStopping) {
+        if (!hasSecondaries() || !mPrimary) {
+            mIdleCaptureCv.wait(lock);
+            continue;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if ((mLatestSlot < 0) ||
+                ((now - mSlots[mLatestSlot].publishedAt) >= kIdleFrameInterval)) {
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> idleCaptureLock(mIdleCaptureMtx);
+                std::function<bool()> captureIdleFrame;
+                {
+                    std::lock_guard<std::mutex> primaryLock(mMtx);
+                    captureIdleFrame = mCaptureIdleFrame;
+                }
+
+                // calls `publish`, mMtx must not be held
+                if (captureIdleFrame) {
+                    captureIdleFrame();
+                }
+            }
+            lock.lock();
+        }
+
+        mIdleCaptureCv.wait_for(lock, kIdleFrameInterval);
+    }
+}
+
+bool FrameDistributor::allocateSlotBuffer(const Rect<uint16_t> size, Slot* const slot) {
+    constexpr uint64_t kUsage = static_cast<uint64_t>(BufferUsage::CPU_READ_OFTEN) |
+                                static_cast<uint64_t>(BufferUsage::CPU_WRITE_OFTEN);
+
+    const native_handle_t* buffer = nullptr;
+    uint32_t stride;
+    if (GraphicBufferAllocator::get().allocate(
+            size.width, size.height, static_cast<int>(PixelFormat::YCBCR_420_888), 1,
+            kUsage, &buffer, &stride, "FrameDistributor") != NO_ERROR) {
+        return FAILURE(false);
+    }
+
+    if (GraphicBufferMapper::get().lockYCbCr(buffer, kUsage, {size.width, size.height},
+                                             &slot->ycbcr) != NO_ERROR) {
+        GraphicBufferAllocator::get().free(buffer);
+        return FAILURE(false);
+    }
+
+    slot->buffer = buffer;
+    slot->size = size;
+    return true;
+}
+
+void FrameDistributor::freeSlotBuffer(Slot* const slot) {
+    if (slot->buffer) {
+        LOG_ALWAYS_FATAL_IF(GraphicBufferMapper::get().unlock(slot->buffer) != NO_ERROR);
+        GraphicBufferAllocator::get().free(slot->buffer);
+        slot->buffer = nullptr;
+        slot->size = {0, 0};
+    }
+}
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <cutils/native_handle.h>
+#include <system/graphics.h>
+
+#include "Rect.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+// The host allows one client per camera. Its first QemuCamera (the primary)
+// owns the qemu channel and publishes its frames into a ring of YUV gralloc
+// buffers, other QemuCamera instances of the same camera (secondaries, e.g.
+// a concurrent open) read them instead of asking the host to render again.
+// The buffers are CPU only and stay mapped while allocated.
+//
+// While there are secondaries, a capture loop asks the primary for a frame
+// (see `tryBecomePrimary`) whenever it has published none for
+// `kIdleFrameInterval`, i.e. it processes no requests.
+struct FrameDistributor {
+    static constexpr int kNumSlots = 3;
+    // older frames are not handed out, repeating them would freeze the image
+    static constexpr std::chrono::milliseconds kMaxFrameAge{200};
+    static constexpr std::chrono::milliseconds kIdleFrameInterval{33};
+
+    struct Frame {
+        android_ycbcr ycbcr;
+        Rect<uint16_t> size;
+        uint64_t number;
+        int slot;
+    };
+
+    FrameDistributor() = default;
+    ~FrameDistributor();
+
+    // `captureIdleFrame` publishes a frame, it is called on the capture loop
+    // thread and must not block on the primary's locks (try them instead).
+    bool tryBecomePrimary(const void* client, std::function<bool()> captureIdleFrame);
+    // Waits for `captureIdleFrame` to return if it is running.
+    void leavePrimary(const void* client);
+
+    void addSecondary();
+    void removeSecondary();
+    bool hasSecondaries() const;
+
+    // The primary: `fill` writes a frame of `size` into a buffer which no
+    // secondary reads. Returns false if all buffers are busy or `fill` fails.
+    bool publish(Rect<uint16_t> size, const std::function<bool(const android_ycbcr&)>& fill);
+
+    // Secondaries: the latest frame, it is not overwritten until `release`.
+    // Returns nullopt if there is none or it is older than `kMaxFrameAge`.
+    std::optional<Frame> acquireLatest();
+    void release(const Frame& frame);
+
+private:
+    struct Slot {
+        const native_handle_t* buffer = nullptr;
+        android_ycbcr ycbcr;
+        Rect<uint16_t> size = {0, 0};
+        uint64_t number = 0;
+        std::chrono::steady_clock::time_point publishedAt;
+        int readers = 0;
+        bool writing = false;
+    };
+
+    void idleCaptureLoop();
+    static bool allocateSlotBuffer(Rect<uint16_t> size, Slot* slot);
+    static void freeSlotBuffer(Slot* slot);
+
+    Slot mSlots[kNumSlots];
+    int mLatestSlot = -1;
+    uint64_t mNumFrames = 0;
+    const void* mPrimary = nullptr;
+    std::function<bool()> mCaptureIdleFrame;  // the primary's
+    std::atomic<int> mNumSecondaries = 0;
+    bool mStopping = false;
+    mutable std::mutex mMtx;
+    std::mutex mIdleCaptureMtx;  // held while mCaptureIdleFrame runs, before mMtx
+    std::condition_variable mIdleCaptureCv;
+    std::thread mIdleCaptureThread;  // started with the first secondary
+
+    FrameDistributor(const FrameDistributor&) = delete;
+    FrameDistributor& operator=(const FrameDistributor&) = delete;
+};
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
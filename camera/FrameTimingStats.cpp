@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_CAMERA
+
+#include <algorithm>
+#include <inttypes.h>
+#include <iterator>
+#include <string>
+
+#include <android-base/stringprintf.h>
+#include <android-base/file.h>
+#include <utils/Trace.h>
+
+#include "FrameTimingStats.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+
+namespace {
+const char* const kStageNames[] = {
+    "submitRequests",
+    "sleep",
+    "shutterInterval",
+    "shutterJitter",
+    "processCaptureRequest",
+    "fenceWait",
+    "queryFrame",
+    "grallocLock",
+    "jpegEncode",
+    "resultFmqWrite",
+    "resultCallback",
+    "notifyCallback",
+    "captureToJpeg",
+    "reprocessToJpeg",
+};
+static_assert(std::size(kStageNames) == static_cast<size_t>(FrameStage::Count));
+
+int getBucket(const int64_t ns) {
+    const uint64_t us = (ns > 0) ? (ns / 1000) : 0;
+    const int bucket = (us > 0) ? (64 - __builtin_clzll(us)) : 0;
+    return std::min(bucket, FrameTimingStats::kNumBuckets - 1);
+}
+
+// the upper bound of the bucket
+int64_t getBucketLimitUs(const int bucket) {
+    return int64_t(1) << bucket;
+}
+
+int64_t getNowNs() {
+    using namespace std::chrono_literals;
+    return std::chrono::steady_clock::now().time_since_epoch() / 1ns;
+}
+}  // namespace
+
+void FrameTimingStats::add(const FrameStage stage, const int64_t ns) {
+    Histogram& h = mHistograms[static_cast<int>(stage)];
+
+    h.buckets[getBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.totalNs.fetch_add(ns, std::memory_order_relaxed);
+
+    int64_t maxNs = h.maxNs.load(std::memory_order_relaxed);
+    while ((ns > maxNs) &&
+           !h.maxNs.compare_exchange_weak(maxNs, ns, std::memory_order_relaxed)) {}
+}
+
+void FrameTimingStats::addDroppedFrames(const uint32_t n) {
+    mDroppedFrames.fetch_add(n, std::memory_order_relaxed);
+}
+
+void FrameTimingStats::setFetchLatencyNs(const int64_t ns) {
+    mFetchLatencyNs.store(ns, std::memory_order_relaxed);
+}
+
+void FrameTimingStats::addHostBytes(const uint64_t n) {
+    mHostBytes.fetch_add(n, std::memory_order_relaxed);
+}
+
+void FrameTimingStats::addFrameCacheLookup(const bool hit) {
+    (hit ? mFrameCacheHits : mFrameCacheMisses).fetch_add(1, std::memory_order_relaxed);
+}
+
+void FrameTimingStats::reset() {
+    for (Histogram& h : mHistograms) {
+        for (auto& b : h.buckets) {
+            b.store(0, std::memory_order_relaxed);
+        }
+        h.count.store(0, std::memory_order_relaxed);
+        h.totalNs.store(0, std::memory_order_relaxed);
+        h.maxNs.store(0, std::memory_order_relaxed);
+    }
+
+    mDroppedFrames.store(0, std::memory_order_relaxed);
+    mFetchLatencyNs.store(0, std::memory_order_relaxed);
+    mHostBytes.store(0, std::memory_order_relaxed);
+    mFrameCacheHits.store(0, std::memory_order_relaxed);
+    mFrameCacheMisses.store(0, std::memory_order_relaxed);
+    mResetTimeNs.store(getNowNs(), std::memory_order_relaxed);
+}
+
+void FrameTimingStats::dump(const int fd) const {
+    using base::StringAppendF;
+
+    // how often stages happen, e.g. IPC calls per second
+    const int64_t elapsedMs = std::max<int64_t>(
+        (getNowNs() - mResetTimeNs.load(std::memory_order_relaxed)) / 1000000, 1);
+
+    std::string str;
+    for (size_t i = 0; i < std::size(mHistograms); ++i) {
+        const Histogram& h = mHistograms[i];
+        const uint32_t count = h.count.load(std::memory_order_relaxed);
+        if (!count) {
+            continue;
+        }
+
+        uint32_t buckets[kNumBuckets];
+        for (int b = 0; b < kNumBuckets; ++b) {
+            buckets[b] = h.buckets[b].load(std::memory_order_relaxed);
+        }
+
+        const int64_t maxUs = h.maxNs.load(std::memory_order_relaxed) / 1000;
+
+        // the last bucket has no upper bound, `maxUs` is used instead
+        const auto percentileUs = [&buckets, count, maxUs](const unsigned p) -> int64_t {
+            const uint64_t rank = (uint64_t(count) * p + 99) / 100;
+            uint64_t n = 0;
+            for (int b = 0; b < (kNumBuckets - 1); ++b) {
+                n += buckets[b];
+                if (n >= rank) {
+                    return getBucketLimitUs(b);
+                }
+            }
+            return maxUs + 1;
+        };
+
+        StringAppendF(&str, "    %s: count=%u rate=%.1f/s avg=%" PRId64 "us max=%" PRId64 "us "
+                      "p50<%" PRId64 "us p90<%" PRId64 "us p99<%" PRId64 "us\n",
+                      kStageNames[i], count, count * 1000.0 / elapsedMs,
+                      h.totalNs.load(std::memory_order_relaxed) / count / 1000,
+                      maxUs,
+                      percentileUs(50), percentileUs(90), percentileUs(99));
+
+        str += "     ";
+        for (int b = 0; b < kNumBuckets; ++b) {
+            if (!buckets[b]) {
+                continue;
+            } else if (b == (kNumBuckets - 1)) {
+                StringAppendF(&str, " >=%" PRId64 "us:%u", getBucketLimitUs(b - 1), buckets[b]);
+            } else {
+                StringAppendF(&str, " <%" PRId64 "us:%u", getBucketLimitUs(b), buckets[b]);
+            }
+        }
+        str += '\n';
+    }
+
+    // the achieved frame rate, jitter is in the shutterJitter histogram above
+    const Histogram& shutter = mHistograms[static_cast<int>(FrameStage::ShutterInterval)];
+    const uint32_t numShutters = shutter.count.load(std::memory_order_relaxed);
+    if (numShutters) {
+        const int64_t totalNs = shutter.totalNs.load(std::memory_order_relaxed);
+        StringAppendF(&str, "    pacing: fps=%.2f droppedFrames=%u fetchLatency=%" PRId64 "us\n",
+                      (totalNs > 0) ? (numShutters * 1e9 / totalNs) : 0.0,
+                      mDroppedFrames.load(std::memory_order_relaxed),
+                      mFetchLatencyNs.load(std::memory_order_relaxed) / 1000);
+    }
+
+    const uint32_t numFrames = mHistograms[static_cast<int>(FrameStage::ProcessCaptureRequest)]
+        .count.load(std::memory_order_relaxed);
+    const uint64_t hostBytes = mHostBytes.load(std::memory_order_relaxed);
+    if (numFrames && hostBytes) {
+        StringAppendF(&str, "    host: bytes=%" PRIu64 " bytesPerFrame=%" PRIu64 "\n",
+                      hostBytes, hostBytes / numFrames);
+    }
+
+    const uint32_t cacheHits = mFrameCacheHits.load(std::memory_order_relaxed);
+    const uint32_t cacheMisses = mFrameCacheMisses.load(std::memory_order_relaxed);
+    if (cacheHits || cacheMisses) {
+        StringAppendF(&str, "    frameCache: hits=%u misses=%u hitRate=%.1f%%\n",
+                      cacheHits, cacheMisses, cacheHits * 100.0 / (cacheHits + cacheMisses));
+    }
+
+    base::WriteStringToFd(str, fd);
+}
+
+ScopedFrameStage::ScopedFrameStage(FrameTimingStats& stats, const FrameStage stage)
+        : mStats(stats)
+        , mStart(std::chrono::steady_clock::now())
+        , mStage(stage) {
+    ATRACE_BEGIN(kStageNames[static_cast<int>(stage)]);
+}
+
+ScopedFrameStage::~ScopedFrameStage() {
+    using namespace std::chrono_literals;
+    ATRACE_END();
+    mStats.add(mStage, (std::chrono::steady_clock::now() - mStart) / 1ns);
+}
+
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+
+enum class FrameStage {
+    SubmitRequests,         // processCaptureRequest IPC, per call
+    Sleep,                  // waiting for the next frame time
+    ShutterInterval,        // between shutter timestamps of consecutive frames
+    ShutterJitter,          // how far ShutterInterval is from the frame duration
+    ProcessCaptureRequest,  // HwCamera::processCaptureRequest
+    FenceWait,
+    QueryFrame,             // host round trip
+    GrallocLock,            // lock and unlock
+    JpegEncode,
+    ResultFmqWrite,
+    ResultCallback,         // processCaptureResult IPC
+    NotifyCallback,         // notify IPC
+    CaptureToJpeg,          // from the request to its JPEG, captured frames
+    ReprocessToJpeg,        // from the request to its JPEG, YUV reprocessing
+
+    Count
+};
+
+// Histograms of time spent in frame stages, buckets are powers of two in
+// microseconds. Lock free, stages are recorded from several threads.
+struct FrameTimingStats {
+    static constexpr int kNumBuckets = 20;  // the last one is [~0.26s, inf)
+
+    FrameTimingStats() { reset(); }
+
+    void add(FrameStage stage, int64_t ns);
+    void addDroppedFrames(uint32_t n);
+    void setFetchLatencyNs(int64_t ns);
+    void addHostBytes(uint64_t n);
+    void addFrameCacheLookup(bool hit);
+    void reset();
+    void dump(int fd) const;
+
+private:
+    struct Histogram {
+        std::atomic<uint32_t> buckets[kNumBuckets];
+        std::atomic<uint32_t> count;
+        std::atomic<int64_t> totalNs;
+        std::atomic<int64_t> maxNs;
+    };
+
+    Histogram mHistograms[static_cast<int>(FrameStage::Count)];
+    std::atomic<int64_t> mResetTimeNs;  // for rates in `dump`
+    std::atomic<uint32_t> mDroppedFrames;  // frame slots skipped by the capture thread
+    std::atomic<int64_t> mFetchLatencyNs;  // the capture thread's estimate
+    std::atomic<uint64_t> mHostBytes;  // written by the host into frame buffers
+    std::atomic<uint32_t> mFrameCacheHits;  // frames copied instead of rendered
+    std::atomic<uint32_t> mFrameCacheMisses;
+
+    FrameTimingStats(const FrameTimingStats&) = delete;
+    FrameTimingStats& operator=(const FrameTimingStats&) = delete;
+};
+
+// Records the time spent in its scope and marks it in systrace.
+struct ScopedFrameStage {
+    ScopedFrameStage(FrameTimingStats& stats, FrameStage stage);
+    ~ScopedFrameStage();
+
+private:
+    FrameTimingStats& mStats;
+    const std::chrono::steady_clock::time_point mStart;
+    const FrameStage mStage;
+
+    ScopedFrameStage(const ScopedFrameStage&) = delete;
+    ScopedFrameStage& operator=(const ScopedFrameStage&) = delete;
+};
+
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -40,8 +40,13 @@ constexpr int32_t kDefaultSensorSensitivity = 100;
 
 int64_t HwCamera::getFrameDuration(const camera_metadata_t* const metadata,
                                    const int64_t def,
-                                   const int64_t min,
-                                   const int64_t max) {
+                                   int64_t min,
+                                   const int64_t max,
+                                   const int32_t highSpeedMaxFps) {
+    if (highSpeedMaxFps > 0) {
+        min = kOneSecondNs / highSpeedMaxFps;
+    }
+
     camera_metadata_ro_entry_t entry;
     camera_metadata_enum_android_control_ae_mode ae_mode;
 
@@ -61,7 +66,8 @@ int64_t HwCamera::getFrameDuration(const camera_metadata_t* const metadata,
         if (find_camera_metadata_ro_entry(metadata, ANDROID_CONTROL_AE_TARGET_FPS_RANGE, &entry)) {
             return def;
         } else {
-            const int fps = (entry.data.i32[0] + entry.data.i32[1]) / 2;
+            const int fps = (highSpeedMaxFps > 0) ? entry.data.i32[1] :
+                (entry.data.i32[0] + entry.data.i32[1]) / 2;
             if (fps > 0) {
                 return std::max(std::min(kOneSecondNs / fps, max), min);
             }  else {
@@ -75,7 +81,8 @@ bool HwCamera::compressJpeg(const Rect<uint16_t> imageSize,
                             const android_ycbcr& imageYcbcr,
                             const CameraMetadata& metadata,
                             const native_handle_t* jpegBuffer,
-                            const size_t jpegBufferSize) {
+                            const size_t jpegBufferSize,
+                            const std::atomic<bool>* const abort) {
     GraphicBufferMapper& gbm = GraphicBufferMapper::get();
 
     void* jpegData = nullptr;
@@ -86,7 +93,8 @@ bool HwCamera::compressJpeg(const Rect<uint16_t> imageSize,
 
     const size_t jpegImageDataCapacity = jpegBufferSize - sizeof(struct camera3_jpeg_blob);
     const size_t compressedSize = jpeg::compressYUV(imageYcbcr, imageSize, metadata,
-                                                    jpegData, jpegImageDataCapacity);
+                                                    jpegData, jpegImageDataCapacity,
+                                                    abort);
 
     LOG_ALWAYS_FATAL_IF(gbm.unlock(jpegBuffer) != NO_ERROR);
 
@@ -102,6 +110,37 @@ bool HwCamera::compressJpeg(const Rect<uint16_t> imageSize,
     return success;
 }
 
+bool HwCamera::grallocLock(const native_handle_t* const buffer,
+                           const BufferUsage usage,
+                           const Rect<uint16_t> size,
+                           void** const data) const {
+    ScopedFrameStage stage(mFrameTimingStats, FrameStage::GrallocLock);
+    return GraphicBufferMapper::get().lock(
+        buffer, static_cast<uint32_t>(usage),
+        {size.width, size.height}, data) == NO_ERROR;
+}
+
+bool HwCamera::grallocLockYCbCr(const native_handle_t* const buffer,
+                                const BufferUsage usage,
+                                const Rect<uint16_t> size,
+                                android_ycbcr* const ycbcr) const {
+    ScopedFrameStage stage(mFrameTimingStats, FrameStage::GrallocLock);
+    return GraphicBufferMapper::get().lockYCbCr(
+        buffer, static_cast<uint32_t>(usage),
+        {size.width, size.height}, ycbcr) == NO_ERROR;
+}
+
+void HwCamera::grallocUnlock(const native_handle_t* const buffer) const {
+    ScopedFrameStage stage(mFrameTimingStats, FrameStage::GrallocLock);
+    LOG_ALWAYS_FATAL_IF(GraphicBufferMapper::get().unlock(buffer) != NO_ERROR);
+}
+
+void HwCamera::waitAcquireFences(const Span<CachedStreamBuffer* const> csbs,
+                                 const unsigned timeoutMs) {
+    mFrameTimingStats.add(FrameStage::FenceWait,
+                          mAcquireFenceWaiter.wait(csbs, timeoutMs));
+}
+
 std::tuple<int32_t, int32_t, int32_t, int32_t> HwCamera::getAeCompensationRange() const {
     return {-6, 6, 1, 2}; // range=[-6, +6], step=1/2
 }
@@ -147,6 +186,10 @@ int32_t HwCamera::getPipelineMaxDepth() const {
     return 4;
 }
 
+Span<const HighSpeedVideoConfig> HwCamera::getHighSpeedVideoConfigs() const {
+    return {};
+}
+
 float HwCamera::getMaxDigitalZoom() const {
     return 1.0;
 }
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <tuple>
@@ -36,6 +38,8 @@
 #include <system/camera_metadata.h>
 #include <system/graphics.h>
 
+#include "AcquireFenceWaiter.h"
+#include "FrameTimingStats.h"
 #include "Rect.h"
 #include "Span.h"
 #include "CachedStreamBuffer.h"
@@ -56,20 +60,34 @@ using aidl::android::hardware::graphics::common::BufferUsage;
 using aidl::android::hardware::graphics::common::Dataspace;
 using aidl::android::hardware::graphics::common::PixelFormat;
 
+// CONSTRAINED_HIGH_SPEED_VIDEO: `size` can run at up to `maxFps`
+struct HighSpeedVideoConfig {
+    Rect<uint16_t> size;
+    int32_t maxFps;
+};
+
 struct HwCaptureRequest {
     CameraMetadata metadataUpdate;
     std::vector<CachedStreamBuffer*> buffers;
+    CachedStreamBuffer* inputBuffer = nullptr;  // YUV reprocessing
+    std::chrono::steady_clock::time_point requestTime;
     int32_t frameNumber;
 };
 
-// pass `true` to process the buffer, pass `false` to return an error asap to
-// release the underlying buffer to the framework.
-using DelayedStreamBuffer = std::function<StreamBuffer(bool)>;
+// pass `ok=true` to process the buffer, pass `ok=false` to return an error asap
+// to release the underlying buffer to the framework. Processing gives up early
+// once `*abort` becomes true. `process` may run in an offline session after
+// the camera is closed or reopened, it must not depend on the camera state.
+struct DelayedStreamBuffer {
+    std::function<StreamBuffer(bool ok, const std::atomic<bool>* abort)> process;
+    int32_t streamId;
+};
 
 struct HwCamera {
     static constexpr int32_t kErrorBadFormat = -1;
     static constexpr int32_t kErrorBadUsage = -2;
     static constexpr int32_t kErrorBadDataspace = -3;
+    static constexpr int32_t kRawWhiteLevel = 1023;  // RAW16 samples are 10 bit
 
     virtual ~HwCamera() {}
 
@@ -84,14 +102,27 @@ struct HwCamera {
                        std::vector<DelayedStreamBuffer>>
         processCaptureRequest(CameraMetadata, Span<CachedStreamBuffer*>) = 0;
 
+    FrameTimingStats& getFrameTimingStats() const { return mFrameTimingStats; }
+
+    // `highSpeedMaxFps` is nonzero in constrained high-speed sessions: frames
+    // run at the upper bound of the target fps range, up to `highSpeedMaxFps`.
     static int64_t getFrameDuration(const camera_metadata_t*, int64_t def,
-                                    int64_t min, int64_t max);
+                                    int64_t min, int64_t max,
+                                    int32_t highSpeedMaxFps = 0);
+
+    // 0 unless the session is a constrained high-speed one, set before `configure`
+    void setHighSpeedMaxFps(int32_t maxFps) { mHighSpeedMaxFps = maxFps; }
 
     static bool compressJpeg(Rect<uint16_t> imageSize,
                              const android_ycbcr& imageYcbcr,
                              const CameraMetadata& metadata,
                              const native_handle_t* jpegBuffer,
-                             size_t jpegBufferSize);
+                             size_t jpegBufferSize,
+                             const std::atomic<bool>* abort = nullptr);
+
+    // Flushing has started (`true`) or finished (`false`). Long operations
+    // (e.g. host queries) give up early while it is set.
+    virtual void setAborting(bool /*aborting*/) {}
 
     ////////////////////////////////////////////////////////////////////////////
     virtual Span<const std::pair<int32_t, int32_t>> getTargetFpsRanges() const = 0;
@@ -107,6 +138,7 @@ struct HwCamera {
     virtual float getMinimumFocusDistance() const;
     virtual std::tuple<int32_t, int32_t, int32_t> getMaxNumOutputStreams() const = 0;
     virtual int32_t getPipelineMaxDepth() const;
+    virtual Span<const HighSpeedVideoConfig> getHighSpeedVideoConfigs() const;
     virtual Span<const PixelFormat> getSupportedPixelFormats() const = 0;
     virtual Span<const Rect<uint16_t>> getSupportedResolutions() const = 0;
     virtual float getMaxDigitalZoom() const;
@@ -126,6 +158,26 @@ struct HwCamera {
     virtual int32_t getDefaultSensorSensitivity() const;
     virtual int64_t getDefaultSensorExpTime() const = 0;
     virtual int64_t getDefaultSensorFrameDuration() const = 0;
+
+protected:
+    friend struct Reprocessor;
+
+    // GraphicBufferMapper calls which record their time as FrameStage::GrallocLock
+    bool grallocLock(const native_handle_t* buffer, BufferUsage usage,
+                     Rect<uint16_t> size, void** data) const;
+    bool grallocLockYCbCr(const native_handle_t* buffer, BufferUsage usage,
+                          Rect<uint16_t> size, android_ycbcr* ycbcr) const;
+    void grallocUnlock(const native_handle_t* buffer) const;
+
+    // Waits for acquire fences of all `csbs` concurrently, buffers which
+    // still have their fences after this call must not be written into.
+    void waitAcquireFences(Span<CachedStreamBuffer* const> csbs, unsigned timeoutMs);
+
+    mutable FrameTimingStats mFrameTimingStats;
+    int32_t mHighSpeedMaxFps = 0;
+
+private:
+    AcquireFenceWaiter mAcquireFenceWaiter;
 };
 
 using HwCameraFactoryProduct = std::unique_ptr<HwCamera>;
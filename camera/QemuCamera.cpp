@@ -16,19 +16,26 @@
 
 #define FAILURE_DEBUG_PREFIX "QemuCamera"
 
+#include <algorithm>
 #include <inttypes.h>
 #include <cstdlib>
 
 #include <log/log.h>
 #include <system/camera_metadata.h>
 #include <linux/videodev2.h>
+#include <libyuv/convert_from.h>
+#include <libyuv/planar_functions.h>
+#include <libyuv/scale.h>
 #include <ui/GraphicBufferAllocator.h>
 #include <ui/GraphicBufferMapper.h>
 
+#include <aidl/android/hardware/camera/device/BufferStatus.h>
 #include <gralloc_cb_bp.h>
 
+#include "converters.h"
 #include "debug.h"
 #include "jpeg.h"
+#include "list_qemu_cameras.h"
 #include "metadata_utils.h"
 #include "QemuCamera.h"
 #include "qemu_channel.h"
@@ -40,6 +47,7 @@ namespace provider {
 namespace implementation {
 namespace hw {
 
+using aidl::android::hardware::camera::device::BufferStatus;
 using base::unique_fd;
 
 namespace {
@@ -48,6 +56,8 @@ constexpr char kClass[] = "QemuCamera";
 constexpr int kMinFPS = 2;
 constexpr int kMedFPS = 15;
 constexpr int kMaxFPS = 30;
+constexpr int kHighSpeedFPS = 120;     // up to 640x480
+constexpr int kHighSpeedMaxFPS = 240;  // up to 320x240
 constexpr int64_t kOneSecondNs = 1000000000;
 
 constexpr int64_t kMinFrameDurationNs = kOneSecondNs / kMaxFPS;
@@ -68,10 +78,57 @@ constexpr float   kDefaultAperture = 4.0;
 
 constexpr int32_t kDefaultJpegQuality = 85;
 
+// RAW16 noise model (DNG NoiseProfile): the variance of a [0, 1] signal `x`
+// is `S * x + O`, S grows with the analog gain (sensitivity / 100) and O with
+// its square.
+constexpr double kRawNoiseShotScale = 4.0e-5;
+constexpr double kRawNoiseReadScale = 1.0e-7;
+
+// RGGB Bayer samples from the packed RGBA row `y`, 8 bit values are stretched
+// to HwCamera::kRawWhiteLevel (10 bit).
+void mosaicRaw16RowFromRGBA(const uint8_t* rgba, const unsigned width,
+                            const unsigned y, uint16_t* raw) {
+    const unsigned evenChannel = (y & 1) ? 1 : 0;  // R G / G B
+    for (unsigned x = 0; x < width; ++x, rgba += 4, ++raw) {
+        const unsigned v = rgba[(x & 1) ? (evenChannel + 1) : evenChannel];
+        *raw = (v << 2) | (v >> 6);
+    }
+}
+
+void mosaicRaw16FromRGBA(const uint8_t* rgba, const Rect<uint16_t> size,
+                         uint16_t* raw, const unsigned rawStride) {
+    for (unsigned y = 0; y < size.height; ++y, rgba += size.width * 4, raw += rawStride) {
+        mosaicRaw16RowFromRGBA(rgba, size.width, y, raw);
+    }
+}
+
+// in pixels
+unsigned getStride(const native_handle_t* const buffer, const unsigned width) {
+    const cb_handle_t* const cb = cb_handle_t::from(buffer);
+    return (cb && cb->stride) ? cb->stride : width;
+}
+
 constexpr BufferUsage usageOr(const BufferUsage a, const BufferUsage b) {
     return static_cast<BufferUsage>(static_cast<uint64_t>(a) | static_cast<uint64_t>(b));
 }
 
+const native_handle_t* allocateFrameImage(const Rect<uint16_t> dim,
+                                          const PixelFormat bufferFormat) {
+    constexpr BufferUsage kUsage = usageOr(BufferUsage::CAMERA_OUTPUT,
+                                           BufferUsage::CPU_READ_OFTEN);
+
+    const native_handle_t* image = nullptr;
+    uint32_t stride;
+
+    if (GraphicBufferAllocator::get().allocate(
+            dim.width, dim.height, static_cast<int>(bufferFormat), 1,
+            static_cast<uint64_t>(kUsage), &image, &stride, "QemuCamera") != NO_ERROR) {
+        return FAILURE(nullptr);
+    }
+
+    return image;
+}
+
 constexpr bool usageTest(const BufferUsage a, const BufferUsage b) {
     return (static_cast<uint64_t>(a) & static_cast<uint64_t>(b)) != 0;
 }
@@ -80,7 +137,21 @@ constexpr bool usageTest(const BufferUsage a, const BufferUsage b) {
 
 QemuCamera::QemuCamera(const Parameters& params)
         : mParams(params)
-        , mAFStateMachine(200, 1, 2) {}
+        , mAFStateMachine(200, 1, 2) {
+    for (const Rect<uint16_t> res : mParams.supportedResolutions) {
+        const int area = int(res.width) * res.height;
+        if (area <= (320 * 240)) {
+            mHighSpeedVideoConfigs.push_back({res, kHighSpeedMaxFPS});
+        } else if (area <= (640 * 480)) {
+            mHighSpeedVideoConfigs.push_back({res, kHighSpeedFPS});
+        }
+    }
+}
+
+QemuCamera::~QemuCamera() {
+    // the capture loop must not call captureIdleFrame any more
+    mParams.frameDistributor->leavePrimary(this);
+}
 
 std::tuple<PixelFormat, BufferUsage, Dataspace, int32_t>
 QemuCamera::overrideStreamParams(const PixelFormat format,
@@ -107,6 +178,14 @@ QemuCamera::overrideStreamParams(const PixelFormat format,
         return {PixelFormat::RGBA_8888, usageOr(usage, kExtraUsage),
                 Dataspace::UNKNOWN, usageTest(usage, BufferUsage::VIDEO_ENCODER) ? 8 : 4};
 
+    case PixelFormat::Y8:
+        return {PixelFormat::Y8, usageOr(usage, kExtraUsage),
+                Dataspace::UNKNOWN, 4};
+
+    case PixelFormat::RAW16:
+        return {PixelFormat::RAW16, usageOr(usage, kExtraUsage),
+                Dataspace::ARBITRARY, 4};
+
     case PixelFormat::BLOB:
         switch (dataspace) {
         case Dataspace::JFIF:
@@ -125,52 +204,110 @@ bool QemuCamera::configure(const CameraMetadata& sessionParams,
                            size_t nStreams,
                            const Stream* streams,
                            const HalStream* halStreams) {
+    std::lock_guard<std::mutex> lock(mChannelMtx);
     applyMetadata(sessionParams);
 
-    if (!mQemuChannel.ok()) {
-        auto qemuChannel = qemuOpenChannel(std::string("name=") + mParams.name);
-        if (!qemuChannel.ok()) {
+    if (!mQemuChannel.ok() && !mSecondary) {
+        FrameDistributor& distributor = *mParams.frameDistributor;
+        if (!distributor.tryBecomePrimary(this, [this](){ return captureIdleFrame(); })) {
+            distributor.addSecondary();
+            mSecondary = true;
+        } else if (!openQemuChannel()) {
+            distributor.leavePrimary(this);
             return false;
         }
-
-        static const char kConnectQuery[] = "connect";
-        if (qemuRunQuery(qemuChannel.get(), kConnectQuery, sizeof(kConnectQuery)) < 0) {
-            return false;
-        }
-
-        static const char kStartQuery[] = "start";
-        if (qemuRunQuery(qemuChannel.get(), kStartQuery, sizeof(kStartQuery)) < 0) {
-            return false;
-        }
-
-        mQemuChannel = std::move(qemuChannel);
     }
 
     mStreamInfoCache.clear();
     for (; nStreams > 0; --nStreams, ++streams, ++halStreams) {
         const int32_t id = streams->id;
         LOG_ALWAYS_FATAL_IF(halStreams->id != id);
+
+        // RAW16 is the whole pixel array only
+        if ((halStreams->overrideFormat == PixelFormat::RAW16) &&
+                ((streams->width != mParams.sensorSize.width) ||
+                 (streams->height != mParams.sensorSize.height))) {
+            mStreamInfoCache.clear();
+            return FAILURE(false);
+        }
+
         StreamInfo& si = mStreamInfoCache[id];
         si.size.width = streams->width;
         si.size.height = streams->height;
         si.pixelFormat = halStreams->overrideFormat;
         si.blobBufferSize = streams->bufferSize;
+
+        // the host writes neither Y8 nor RAW16, see captureFrameY8/captureFrameRaw16
+        if (si.pixelFormat == PixelFormat::Y8) {
+            si.image.reset(allocateFrameImage(si.size, PixelFormat::YCBCR_420_888));
+        } else if (si.pixelFormat == PixelFormat::RAW16) {
+            si.image.reset(allocateFrameImage(si.size, PixelFormat::RGBA_8888));
+        }
+
+        if (((si.pixelFormat == PixelFormat::Y8) || (si.pixelFormat == PixelFormat::RAW16)) &&
+                !si.image) {
+            mStreamInfoCache.clear();
+            return FAILURE(false);
+        }
     }
 
     return true;
 }
 
+bool QemuCamera::openQemuChannel() {
+    QemuChannel qemuChannel(mParams.openChannel ? mParams.openChannel() :
+        qemuOpenChannel(std::string("name=") + mParams.name));
+    if (!qemuChannel.ok()) {
+        return false;
+    }
+
+    static const char kConnectQuery[] = "connect";
+    if (qemuChannel.runQuery(kConnectQuery, sizeof(kConnectQuery)) < 0) {
+        return false;
+    }
+
+    qemuChannel.negotiate();
+
+    static const char kStartQuery[] = "start";
+    if (qemuChannel.runQuery(kStartQuery, sizeof(kStartQuery)) < 0) {
+        return false;
+    }
+
+    mQemuChannel = std::move(qemuChannel);
+    return true;
+}
+
 void QemuCamera::close() {
+    std::lock_guard<std::mutex> lock(mChannelMtx);
     mStreamInfoCache.clear();
+    mIdleFrameImage.reset();
 
     if (mQemuChannel.ok()) {
+        drainCancelledFrames();
+
         static const char kStopQuery[] = "stop";
-        if (qemuRunQuery(mQemuChannel.get(), kStopQuery, sizeof(kStopQuery)) >= 0) {
+        if (mQemuChannel.runQuery(kStopQuery, sizeof(kStopQuery)) >= 0) {
             static const char kDisconnectQuery[] = "disconnect";
-            qemuRunQuery(mQemuChannel.get(), kDisconnectQuery, sizeof(kDisconnectQuery));
+            mQemuChannel.runQuery(kDisconnectQuery, sizeof(kDisconnectQuery));
         }
 
         mQemuChannel.reset();
+        mParams.frameDistributor->leavePrimary(this);
+    }
+
+    if (mSecondary) {
+        mParams.frameDistributor->removeSecondary();
+        mSecondary = false;
+    }
+
+    freeCancelledFrameImages();
+}
+
+void QemuCamera::setAborting(const bool aborting) {
+    if (aborting) {
+        mQemuChannel.cancel();
+    } else {
+        mQemuChannel.clearCancel();
     }
 }
 
@@ -178,15 +315,48 @@ std::tuple<int64_t, CameraMetadata,
            std::vector<StreamBuffer>, std::vector<DelayedStreamBuffer>>
 QemuCamera::processCaptureRequest(CameraMetadata metadataUpdate,
                                   Span<CachedStreamBuffer*> csbs) {
+    std::lock_guard<std::mutex> lock(mChannelMtx);
     CameraMetadata resultMetadata = metadataUpdate.metadata.empty() ?
         updateCaptureResultMetadata() :
         applyMetadata(std::move(metadataUpdate));
 
+    drainCancelledFrames();
+    mFramePublished = false;
+
+    FrameDistributor& distributor = *mParams.frameDistributor;
+    if (mSecondary &&
+            distributor.tryBecomePrimary(this, [this](){ return captureIdleFrame(); })) {
+        // the primary is gone, this camera takes over the host connection
+        distributor.removeSecondary();
+        mSecondary = false;
+        if (!openQemuChannel()) {
+            distributor.leavePrimary(this);
+        }
+    }
+
+    if (mSecondary) {
+        mSharedFrame = distributor.acquireLatest();
+        if (mSharedFrame) {
+            mNoSharedFrames = false;
+        } else if (!mNoSharedFrames) {
+            ALOGW("%s:%s:%d no frames from the primary yet, "
+                  "buffers of this camera fail until they come",
+                  kClass, __func__, __LINE__);
+            mNoSharedFrames = true;
+        }
+    }
+
     const size_t csbsSize = csbs.size();
     std::vector<StreamBuffer> outputBuffers;
     std::vector<DelayedStreamBuffer> delayedOutputBuffers;
     outputBuffers.reserve(csbsSize);
 
+    // JPEG frames are queried into intermediate buffers which do not depend
+    // on acquire fences, other buffers are captured into once their fences
+    // signal (awaited all together).
+    std::vector<CachedStreamBuffer*> fencedCsbs;
+    fencedCsbs.reserve(csbsSize);
+
     for (size_t i = 0; i < csbsSize; ++i) {
         CachedStreamBuffer* csb = csbs[i];
         LOG_ALWAYS_FATAL_IF(!csb);  // otherwise mNumBuffersInFlight will be hard
@@ -203,14 +373,79 @@ QemuCamera::processCaptureRequest(CameraMetadata metadataUpdate,
             }
         }
 
-        if (si) {
-            captureFrame(*si, csb, &outputBuffers, &delayedOutputBuffers);
-        } else {
+        if (!si) {
             outputBuffers.push_back(csb->finish(false));
+        } else if (si->pixelFormat == PixelFormat::BLOB) {
+            delayedOutputBuffers.push_back(captureFrameJpeg(*si, csb));
+        } else {
+            fencedCsbs.push_back(csb);
         }
     }
 
-    return make_tuple((mQemuChannel.ok() ? mFrameDurationNs : FAILURE(-1)),
+    if (!fencedCsbs.empty()) {
+        waitAcquireFences({fencedCsbs.begin(), fencedCsbs.end()},
+                          mFrameDurationNs / 2000000);
+
+        // One host frame serves all buffers of its size (e.g. preview and
+        // recording in high-speed sessions, or Y8 next to YUV): YUV buffers
+        // are queried first, the rest are converted from them.
+        std::stable_partition(fencedCsbs.begin(), fencedCsbs.end(),
+            [](const CachedStreamBuffer* csb){
+                return csb->getStreamInfo<StreamInfo>()->pixelFormat ==
+                       PixelFormat::YCBCR_420_888;
+            });
+
+        const CachedStreamBuffer* yuvCsb = nullptr;  // locked into `yuvYcbcr`
+        const CachedStreamBuffer* rgbaCsb = nullptr;
+        Rect<uint16_t> yuvSize = {0, 0};
+        android_ycbcr yuvYcbcr;
+        for (CachedStreamBuffer* csb : fencedCsbs) {
+            const StreamInfo& si = *csb->getStreamInfo<StreamInfo>();
+            if (csb->getAcquireFence() >= 0) {
+                outputBuffers.push_back(csb->finish(FAILURE(false)));
+            } else if (mSecondary) {
+                outputBuffers.push_back(csb->finish(mSharedFrame && convertFrameFromYUV(
+                    mSharedFrame->ycbcr, mSharedFrame->size,
+                    si.pixelFormat, si.size, csb->getBuffer())));
+            } else if (yuvCsb && (yuvSize == si.size) &&
+                       convertFrameFromYUV(yuvYcbcr, yuvSize,
+                                           si.pixelFormat, si.size, csb->getBuffer())) {
+                outputBuffers.push_back(csb->finish(true));
+            } else {
+                captureFrame(si, csb, &outputBuffers, &delayedOutputBuffers);
+                if (outputBuffers.back().status != BufferStatus::OK) {
+                    continue;
+                } else if (!yuvCsb && (si.pixelFormat == PixelFormat::YCBCR_420_888) &&
+                           grallocLockYCbCr(csb->getBuffer(), BufferUsage::CPU_READ_OFTEN,
+                                            si.size, &yuvYcbcr)) {
+                    yuvCsb = csb;
+                    yuvSize = si.size;
+                } else if (!rgbaCsb && (si.pixelFormat == PixelFormat::RGBA_8888)) {
+                    rgbaCsb = csb;
+                }
+            }
+        }
+
+        if (!mSecondary && distributor.hasSecondaries()) {
+            if (yuvCsb) {
+                publishFrame(yuvSize, &yuvYcbcr, nullptr);
+            } else if (rgbaCsb) {
+                publishFrame(rgbaCsb->getStreamInfo<StreamInfo>()->size, nullptr,
+                             rgbaCsb->getBuffer());
+            }
+        }
+
+        if (yuvCsb) {
+            grallocUnlock(yuvCsb->getBuffer());
+        }
+    }
+
+    if (mSharedFrame) {
+        distributor.release(mSharedFrame.value());
+        mSharedFrame.reset();
+    }
+
+    return make_tuple(((mQemuChannel.ok() || mSecondary) ? mFrameDurationNs : FAILURE(-1)),
                       std::move(resultMetadata), std::move(outputBuffers),
                       std::move(delayedOutputBuffers));
 }
@@ -218,7 +453,7 @@ QemuCamera::processCaptureRequest(CameraMetadata metadataUpdate,
 void QemuCamera::captureFrame(const StreamInfo& si,
                               CachedStreamBuffer* csb,
                               std::vector<StreamBuffer>* outputBuffers,
-                              std::vector<DelayedStreamBuffer>* delayedOutputBuffers) const {
+                              std::vector<DelayedStreamBuffer>* delayedOutputBuffers) {
     switch (si.pixelFormat) {
     case PixelFormat::YCBCR_420_888:
         outputBuffers->push_back(csb->finish(captureFrameYUV(si, csb)));
@@ -228,6 +463,14 @@ void QemuCamera::captureFrame(const StreamInfo& si,
         outputBuffers->push_back(csb->finish(captureFrameRGBA(si, csb)));
         break;
 
+    case PixelFormat::Y8:
+        outputBuffers->push_back(csb->finish(captureFrameY8(si, csb)));
+        break;
+
+    case PixelFormat::RAW16:
+        outputBuffers->push_back(csb->finish(captureFrameRaw16(si, csb)));
+        break;
+
     case PixelFormat::BLOB:
         delayedOutputBuffers->push_back(captureFrameJpeg(si, csb));
         break;
@@ -242,58 +485,233 @@ void QemuCamera::captureFrame(const StreamInfo& si,
 }
 
 bool QemuCamera::captureFrameYUV(const StreamInfo& si,
-                                 CachedStreamBuffer* csb) const {
+                                 CachedStreamBuffer* csb) {
     const cb_handle_t* const cb = cb_handle_t::from(csb->getBuffer());
     if (!cb) {
         return FAILURE(false);
     }
 
-    if (!csb->waitAcquireFence(mFrameDurationNs / 2000000)) {
-        return FAILURE(false);
-    }
-
     const auto size = si.size;
     android_ycbcr ycbcr;
-    if (GraphicBufferMapper::get().lockYCbCr(
-            cb, static_cast<uint32_t>(BufferUsage::CPU_WRITE_OFTEN),
-            {size.width, size.height}, &ycbcr) != NO_ERROR) {
+    if (!grallocLockYCbCr(cb, BufferUsage::CPU_WRITE_OFTEN, size, &ycbcr)) {
         return FAILURE(false);
     }
 
     bool const res = queryFrame(si.size, V4L2_PIX_FMT_YUV420,
-                                mExposureComp, cb->getMmapedOffset());
+                                mExposureComp, cb->getMmapedOffset()) == 0;
 
-    LOG_ALWAYS_FATAL_IF(GraphicBufferMapper::get().unlock(cb) != NO_ERROR);
+    grallocUnlock(cb);
     return res;
 }
 
 bool QemuCamera::captureFrameRGBA(const StreamInfo& si,
-                                  CachedStreamBuffer* csb) const {
+                                  CachedStreamBuffer* csb) {
     const cb_handle_t* const cb = cb_handle_t::from(csb->getBuffer());
     if (!cb) {
         return FAILURE(false);
     }
 
-    if (!csb->waitAcquireFence(mFrameDurationNs / 2000000)) {
-        return FAILURE(false);
-    }
-
     const auto size = si.size;
     void* mem = nullptr;
-    if (GraphicBufferMapper::get().lock(
-            cb, static_cast<uint32_t>(BufferUsage::CPU_WRITE_OFTEN),
-            {size.width, size.height}, &mem) != NO_ERROR) {
+    if (!grallocLock(cb, BufferUsage::CPU_WRITE_OFTEN, size, &mem)) {
         return FAILURE(false);
     }
 
     bool const res = queryFrame(si.size, V4L2_PIX_FMT_RGB32,
-                                mExposureComp, cb->getMmapedOffset());
-    LOG_ALWAYS_FATAL_IF(GraphicBufferMapper::get().unlock(cb) != NO_ERROR);
+                                mExposureComp, cb->getMmapedOffset()) == 0;
+    grallocUnlock(cb);
+    return res;
+}
+
+// The host has no luma only format: the frame is queried as YUV into the
+// stream's intermediate buffer and its Y plane is copied.
+bool QemuCamera::captureFrameY8(const StreamInfo& si,
+                                CachedStreamBuffer* csb) {
+    const native_handle_t* const image = captureFrameIntoStreamImage(
+        si, PixelFormat::YCBCR_420_888, V4L2_PIX_FMT_YUV420);
+    if (!image) {
+        return false;
+    }
+
+    const Rect<uint16_t> size = si.size;
+    bool res = false;
+    android_ycbcr imageYcbcr;
+    if (grallocLockYCbCr(image, BufferUsage::CPU_READ_OFTEN, size, &imageYcbcr)) {
+        void* mem = nullptr;
+        if (grallocLock(csb->getBuffer(), BufferUsage::CPU_WRITE_OFTEN, size, &mem)) {
+            libyuv::CopyPlane(static_cast<const uint8_t*>(imageYcbcr.y), imageYcbcr.ystride,
+                              static_cast<uint8_t*>(mem),
+                              getStride(csb->getBuffer(), size.width),
+                              size.width, size.height);
+            grallocUnlock(csb->getBuffer());
+            res = true;
+        }
+        grallocUnlock(image);
+    }
+
     return res;
 }
 
+// A synthetic Bayer frame mosaicked from an RGBA frame.
+bool QemuCamera::captureFrameRaw16(const StreamInfo& si,
+                                   CachedStreamBuffer* csb) {
+    const native_handle_t* const image = captureFrameIntoStreamImage(
+        si, PixelFormat::RGBA_8888, V4L2_PIX_FMT_RGB32);
+    if (!image) {
+        return false;
+    }
+
+    const Rect<uint16_t> size = si.size;
+    bool res = false;
+    void* imageMem = nullptr;
+    if (grallocLock(image, BufferUsage::CPU_READ_OFTEN, size, &imageMem)) {
+        void* mem = nullptr;
+        if (grallocLock(csb->getBuffer(), BufferUsage::CPU_WRITE_OFTEN, size, &mem)) {
+            mosaicRaw16FromRGBA(static_cast<const uint8_t*>(imageMem), size,
+                                static_cast<uint16_t*>(mem),
+                                getStride(csb->getBuffer(), size.width));
+            grallocUnlock(csb->getBuffer());
+            res = true;
+        }
+        grallocUnlock(image);
+    }
+
+    return res;
+}
+
+// `src` is a planar YUV frame: captured for this request (the host writes
+// planar images) or shared by the primary (see FrameDistributor). It is
+// scaled first if its size is different.
+bool QemuCamera::convertFrameFromYUV(android_ycbcr src,
+                                     const Rect<uint16_t> srcSize,
+                                     const PixelFormat format,
+                                     const Rect<uint16_t> size,
+                                     const native_handle_t* const dst) {
+    if (src.chroma_step != 1) {
+        return FAILURE(false);
+    }
+
+    if (!(srcSize == size)) {
+        const size_t ySize = size_t(size.width) * size.height;
+        const size_t cWidth = (size.width + 1) / 2;
+        const size_t cSize = cWidth * ((size.height + 1) / 2);
+        mScaledFrame.resize(ySize + 2 * cSize);
+
+        uint8_t* const y = mScaledFrame.data();
+        if (libyuv::I420Scale(
+                static_cast<const uint8_t*>(src.y), src.ystride,
+                static_cast<const uint8_t*>(src.cb), src.cstride,
+                static_cast<const uint8_t*>(src.cr), src.cstride,
+                srcSize.width, srcSize.height,
+                y, size.width, y + ySize, cWidth, y + ySize + cSize, cWidth,
+                size.width, size.height, libyuv::kFilterBox)) {
+            return FAILURE(false);
+        }
+
+        src.y = y;
+        src.cb = y + ySize;
+        src.cr = y + ySize + cSize;
+        src.ystride = size.width;
+        src.cstride = cWidth;
+    }
+
+    bool res = false;
+    if (format == PixelFormat::YCBCR_420_888) {
+        android_ycbcr dstYcbcr;
+        if (grallocLockYCbCr(dst, BufferUsage::CPU_WRITE_OFTEN, size, &dstYcbcr)) {
+            res = (dstYcbcr.chroma_step == 1) && !libyuv::I420Copy(
+                static_cast<const uint8_t*>(src.y), src.ystride,
+                static_cast<const uint8_t*>(src.cb), src.cstride,
+                static_cast<const uint8_t*>(src.cr), src.cstride,
+                static_cast<uint8_t*>(dstYcbcr.y), dstYcbcr.ystride,
+                static_cast<uint8_t*>(dstYcbcr.cb), dstYcbcr.cstride,
+                static_cast<uint8_t*>(dstYcbcr.cr), dstYcbcr.cstride,
+                size.width, size.height);
+            grallocUnlock(dst);
+        }
+    } else if (format == PixelFormat::RGBA_8888) {
+        void* mem = nullptr;
+        if (grallocLock(dst, BufferUsage::CPU_WRITE_OFTEN, size, &mem)) {
+            // libyuv's ABGR is RGBA in memory, rows are packed like the host writes them
+            res = !libyuv::I420ToABGR(
+                static_cast<const uint8_t*>(src.y), src.ystride,
+                static_cast<const uint8_t*>(src.cb), src.cstride,
+                static_cast<const uint8_t*>(src.cr), src.cstride,
+                static_cast<uint8_t*>(mem), size.width * 4,
+                size.width, size.height);
+            grallocUnlock(dst);
+        }
+    } else if (format == PixelFormat::Y8) {
+        void* mem = nullptr;
+        if (grallocLock(dst, BufferUsage::CPU_WRITE_OFTEN, size, &mem)) {
+            libyuv::CopyPlane(static_cast<const uint8_t*>(src.y), src.ystride,
+                              static_cast<uint8_t*>(mem), getStride(dst, size.width),
+                              size.width, size.height);
+            grallocUnlock(dst);
+            res = true;
+        }
+    } else if (format == PixelFormat::RAW16) {
+        // converted to RGBA one row at a time
+        mRaw16Row.resize(size_t(size.width) * 4);
+        void* mem = nullptr;
+        if (grallocLock(dst, BufferUsage::CPU_WRITE_OFTEN, size, &mem)) {
+            const unsigned rawStride = getStride(dst, size.width);
+            uint16_t* raw = static_cast<uint16_t*>(mem);
+            res = true;
+            for (unsigned y = 0; res && (y < size.height); ++y, raw += rawStride) {
+                const unsigned cy = y / 2;
+                res = !libyuv::I420ToABGR(
+                    static_cast<const uint8_t*>(src.y) + y * src.ystride, src.ystride,
+                    static_cast<const uint8_t*>(src.cb) + cy * src.cstride, src.cstride,
+                    static_cast<const uint8_t*>(src.cr) + cy * src.cstride, src.cstride,
+                    mRaw16Row.data(), size.width * 4, size.width, 1);
+                if (res) {
+                    mosaicRaw16RowFromRGBA(mRaw16Row.data(), size.width, y, raw);
+                }
+            }
+            grallocUnlock(dst);
+        }
+    }
+
+    return res;
+}
+
+// Secondaries have no host connection, their frames come from the primary:
+// one per request, whichever host frame (incl. intermediate ones) is first.
+void QemuCamera::publishFrame(const Rect<uint16_t> size,
+                              const android_ycbcr* const yuv,
+                              const native_handle_t* const rgba) {
+    if (mFramePublished) {
+        return;
+    }
+    mFramePublished = true;
+
+    FrameDistributor& distributor = *mParams.frameDistributor;
+    if (yuv) {
+        distributor.publish(size, [size, yuv](const android_ycbcr& dst){
+            return (yuv->chroma_step == 1) && (dst.chroma_step == 1) && !libyuv::I420Copy(
+                static_cast<const uint8_t*>(yuv->y), yuv->ystride,
+                static_cast<const uint8_t*>(yuv->cb), yuv->cstride,
+                static_cast<const uint8_t*>(yuv->cr), yuv->cstride,
+                static_cast<uint8_t*>(dst.y), dst.ystride,
+                static_cast<uint8_t*>(dst.cb), dst.cstride,
+                static_cast<uint8_t*>(dst.cr), dst.cstride,
+                size.width, size.height);
+        });
+    } else if (rgba) {
+        void* mem = nullptr;
+        if (grallocLock(rgba, BufferUsage::CPU_READ_OFTEN, size, &mem)) {
+            distributor.publish(size, [size, mem](const android_ycbcr& dst){
+                return conv::rgba2yuv(size.width, size.height,
+                                      static_cast<const uint32_t*>(mem), dst);
+            });
+            grallocUnlock(rgba);
+        }
+    }
+}
+
 DelayedStreamBuffer QemuCamera::captureFrameJpeg(const StreamInfo& si,
-                                                 CachedStreamBuffer* csb) const {
+                                                 CachedStreamBuffer* csb) {
     const native_handle_t* const image = captureFrameForCompressing(
         si.size, PixelFormat::YCBCR_420_888, V4L2_PIX_FMT_YUV420);
 
@@ -301,17 +719,22 @@ DelayedStreamBuffer QemuCamera::captureFrameJpeg(const StreamInfo& si,
     const uint32_t jpegBufferSize = si.blobBufferSize;
     const int64_t frameDurationNs = mFrameDurationNs;
     CameraMetadata metadata = mCaptureResultMetadata;
+    FrameTimingStats* const stats = &mFrameTimingStats;
 
-    return [csb, image, imageSize, metadata = std::move(metadata), jpegBufferSize,
-            frameDurationNs](const bool ok) -> StreamBuffer {
+    auto process = [csb, image, imageSize, metadata = std::move(metadata), jpegBufferSize,
+                    frameDurationNs, stats](const bool ok,
+                                            const std::atomic<bool>* const abort)
+                                                -> StreamBuffer {
         StreamBuffer sb;
         if (ok && image && csb->waitAcquireFence(frameDurationNs / 1000000)) {
             android_ycbcr imageYcbcr;
             if (GraphicBufferMapper::get().lockYCbCr(
                     image, static_cast<uint32_t>(BufferUsage::CPU_READ_OFTEN),
                     {imageSize.width, imageSize.height}, &imageYcbcr) == NO_ERROR) {
+                ScopedFrameStage stage(*stats, FrameStage::JpegEncode);
                 sb = csb->finish(compressJpeg(imageSize, imageYcbcr, metadata,
-                                              csb->getBuffer(), jpegBufferSize));
+                                              csb->getBuffer(), jpegBufferSize,
+                                              abort));
                 LOG_ALWAYS_FATAL_IF(GraphicBufferMapper::get().unlock(image) != NO_ERROR);
             } else {
                 sb = csb->finish(FAILURE(false));
@@ -326,55 +749,163 @@ DelayedStreamBuffer QemuCamera::captureFrameJpeg(const StreamInfo& si,
 
         return sb;
     };
+
+    return {std::move(process), csb->getStreamId()};
 }
 
 const native_handle_t* QemuCamera::captureFrameForCompressing(
         const Rect<uint16_t> dim,
         const PixelFormat bufferFormat,
-        const uint32_t qemuFormat) const {
-    constexpr BufferUsage kUsage = usageOr(BufferUsage::CAMERA_OUTPUT,
-                                           BufferUsage::CPU_READ_OFTEN);
+        const uint32_t qemuFormat) {
+    const native_handle_t* const image = allocateFrameImage(dim, bufferFormat);
+    if (!image) {
+        return nullptr;
+    }
 
-    GraphicBufferAllocator& gba = GraphicBufferAllocator::get();
-    const native_handle_t* image = nullptr;
-    uint32_t stride;
+    switch (captureFrameIntoImage(image, dim, bufferFormat, qemuFormat)) {
+    case 0:
+        return image;
 
-    if (gba.allocate(dim.width, dim.height, static_cast<int>(bufferFormat), 1,
-                     static_cast<uint64_t>(kUsage), &image, &stride,
-                     "QemuCamera") != NO_ERROR) {
-        return FAILURE(nullptr);
+    case -ECANCELED:
+        mCancelledFrameImages.push_back(image);
+        return nullptr;
+
+    default:
+        GraphicBufferAllocator::get().free(image);
+        return nullptr;
+    }
+}
+
+// Unlike JPEG images (they outlive the request), Y8 and RAW16 frames are
+// queried into the same buffer every time. A cancelled one is replaced.
+const native_handle_t* QemuCamera::captureFrameIntoStreamImage(
+        const StreamInfo& si,
+        const PixelFormat bufferFormat,
+        const uint32_t qemuFormat) {
+    if (!si.image) {
+        si.image.reset(allocateFrameImage(si.size, bufferFormat));
+        if (!si.image) {
+            return nullptr;
+        }
+    }
+
+    switch (captureFrameIntoImage(si.image.get(), si.size, bufferFormat, qemuFormat)) {
+    case 0:
+        return si.image.get();
+
+    case -ECANCELED:
+        mCancelledFrameImages.push_back(si.image.release());
+        return nullptr;
+
+    default:
+        return nullptr;
+    }
+}
+
+// Returns -ECANCELED if the host might still write into `image`: it must be
+// kept until the reply arrives (see drainCancelledFrames).
+int QemuCamera::captureFrameIntoImage(const native_handle_t* const image,
+                                      const Rect<uint16_t> dim,
+                                      const PixelFormat bufferFormat,
+                                      const uint32_t qemuFormat) {
+    if (mSecondary) {
+        return (mSharedFrame && convertFrameFromYUV(mSharedFrame->ycbcr, mSharedFrame->size,
+                                                    bufferFormat, dim, image)) ? 0 : -ENODATA;
     }
 
     const cb_handle_t* const cb = cb_handle_t::from(image);
     if (!cb) {
-        gba.free(image);
-        return FAILURE(nullptr);
+        return FAILURE(-EINVAL);
     }
 
-    if (!queryFrame(dim, qemuFormat, mExposureComp, cb->getMmapedOffset())) {
-        gba.free(image);
-        return FAILURE(nullptr);
+    const int e = queryFrame(dim, qemuFormat, mExposureComp, cb->getMmapedOffset(), true);
+    if ((e == 0) && mParams.frameDistributor->hasSecondaries()) {
+        if (bufferFormat == PixelFormat::RGBA_8888) {
+            publishFrame(dim, nullptr, image);
+        } else {
+            android_ycbcr ycbcr;
+            if (grallocLockYCbCr(image, BufferUsage::CPU_READ_OFTEN, dim, &ycbcr)) {
+                publishFrame(dim, &ycbcr, nullptr);
+                grallocUnlock(image);
+            }
+        }
+    } else if ((e < 0) && (e != -ECANCELED)) {
+        return FAILURE(e);
     }
 
-    return image;
+    return e;
 }
 
-bool QemuCamera::queryFrame(const Rect<uint16_t> dim,
-                            const uint32_t pixelFormat,
-                            const float exposureComp,
-                            const uint64_t dataOffset) const {
-    constexpr float scaleR = 1;
-    constexpr float scaleG = 1;
-    constexpr float scaleB = 1;
+// Called by FrameDistributor's capture loop while this camera is the primary
+// and processes no requests. Busy cameras publish frames themselves.
+bool QemuCamera::captureIdleFrame() {
+    std::unique_lock<std::mutex> lock(mChannelMtx, std::try_to_lock);
+    if (!lock.owns_lock() || !mQemuChannel.ok()) {
+        return false;
+    }
 
-    char queryStr[128];
-    const int querySize = snprintf(queryStr, sizeof(queryStr),
-        "frame dim=%" PRIu32 "x%" PRIu32 " pix=%" PRIu32 " offset=%" PRIu64
-        " whiteb=%g,%g,%g expcomp=%g time=%d",
-        dim.width, dim.height, static_cast<uint32_t>(pixelFormat), dataOffset,
-        scaleR, scaleG, scaleB, exposureComp, 0);
+    const Rect<uint16_t> size = mParams.sensorSize;
+    if (!mIdleFrameImage) {
+        mIdleFrameImage.reset(allocateFrameImage(size, PixelFormat::YCBCR_420_888));
+        if (!mIdleFrameImage) {
+            return false;
+        }
+    }
+
+    const cb_handle_t* const cb = cb_handle_t::from(mIdleFrameImage.get());
+    if (!cb) {
+        return FAILURE(false);
+    }
+
+    // not through queryFrame: idle frames are not in the session's stats
+    static const float kWhiteBalance[3] = {1, 1, 1};
+    drainCancelledFrames();
+    if (mQemuChannel.queryFrame(size.width, size.height, V4L2_PIX_FMT_YUV420,
+                                kWhiteBalance, mExposureComp,
+                                cb->getMmapedOffset(), false) != 0) {
+        return FAILURE(false);
+    }
 
-    return qemuRunQuery(mQemuChannel.get(), queryStr, querySize + 1) >= 0;
+    android_ycbcr ycbcr;
+    if (!grallocLockYCbCr(mIdleFrameImage.get(), BufferUsage::CPU_READ_OFTEN, size, &ycbcr)) {
+        return FAILURE(false);
+    }
+
+    mFramePublished = false;
+    publishFrame(size, &ycbcr, nullptr);
+    grallocUnlock(mIdleFrameImage.get());
+    return true;
+}
+
+void QemuCamera::drainCancelledFrames() {
+    if (mQemuChannel.hasCancelled() && (mQemuChannel.drainCancelled() == 0)) {
+        freeCancelledFrameImages();
+    }
+}
+
+void QemuCamera::freeCancelledFrameImages() {
+    GraphicBufferAllocator& gba = GraphicBufferAllocator::get();
+    for (const native_handle_t* image : mCancelledFrameImages) {
+        gba.free(image);
+    }
+    mCancelledFrameImages.clear();
+}
+
+int QemuCamera::queryFrame(const Rect<uint16_t> dim,
+                           const uint32_t pixelFormat,
+                           const float exposureComp,
+                           const uint64_t dataOffset,
+                           const bool cancellable) {
+    static const float kWhiteBalance[3] = {1, 1, 1};
+    ScopedFrameStage stage(mFrameTimingStats, FrameStage::QueryFrame);
+
+    const uint64_t numPixels = uint64_t(dim.width) * dim.height;
+    mFrameTimingStats.addHostBytes((pixelFormat == V4L2_PIX_FMT_YUV420) ?
+        (numPixels * 3 / 2) : (numPixels * 4));
+
+    return mQemuChannel.queryFrame(dim.width, dim.height, pixelFormat,
+                                   kWhiteBalance, exposureComp, dataOffset,
+                                   cancellable);
 }
 
 float QemuCamera::calculateExposureComp(const int64_t exposureNs,
@@ -392,7 +923,8 @@ CameraMetadata QemuCamera::applyMetadata(const CameraMetadata& metadata) {
     camera_metadata_ro_entry_t entry;
 
     mFrameDurationNs = getFrameDuration(raw, kDefaultFrameDurationNs,
-                                        kMinFrameDurationNs, kMaxFrameDurationNs);
+                                        kMinFrameDurationNs, kMaxFrameDurationNs,
+                                        mHighSpeedMaxFps);
 
     if (find_camera_metadata_ro_entry(raw, ANDROID_SENSOR_EXPOSURE_TIME, &entry)) {
         mSensorExposureDurationNs = std::min(mFrameDurationNs, kDefaultSensorExposureTimeNs);
@@ -427,28 +959,45 @@ CameraMetadata QemuCamera::applyMetadata(const CameraMetadata& metadata) {
     mExposureComp = calculateExposureComp(mSensorExposureDurationNs,
                                           mSensorSensitivity, mAperture);
 
-    CameraMetadataMap m = parseCameraMetadataMap(metadata);
-
-    m[ANDROID_CONTROL_AE_STATE] = ANDROID_CONTROL_AE_STATE_CONVERGED;
-    m[ANDROID_CONTROL_AF_STATE] = af.first;
-    m[ANDROID_CONTROL_AWB_STATE] = ANDROID_CONTROL_AWB_STATE_CONVERGED;
-    m[ANDROID_FLASH_STATE] = ANDROID_FLASH_STATE_UNAVAILABLE;
-    m[ANDROID_LENS_APERTURE] = mAperture;
-    m[ANDROID_LENS_FOCUS_DISTANCE] = af.second;
-    m[ANDROID_LENS_STATE] = ANDROID_LENS_STATE_STATIONARY;
-    m[ANDROID_REQUEST_PIPELINE_DEPTH] = uint8_t(4);
-    m[ANDROID_SENSOR_FRAME_DURATION] = mFrameDurationNs;
-    m[ANDROID_SENSOR_EXPOSURE_TIME] = mSensorExposureDurationNs;
-    m[ANDROID_SENSOR_SENSITIVITY] = mSensorSensitivity;
-    m[ANDROID_SENSOR_TIMESTAMP] = int64_t(0);
-    m[ANDROID_SENSOR_ROLLING_SHUTTER_SKEW] = kMinSensorExposureTimeNs;
-    m[ANDROID_STATISTICS_SCENE_FLICKER] = ANDROID_STATISTICS_SCENE_FLICKER_NONE;
+    // RAW16 is always supported, see getSupportedPixelFormats
+    if (!metadataUpdateInPlace(&mCaptureResultMetadata, metadata,
+                               metadataGetRawCaptureResultTags())) {
+        std::optional<CameraMetadata> maybeTemplate =
+            metadataBuildCaptureResultTemplate(metadata, metadataGetRawCaptureResultTags());
 
-    std::optional<CameraMetadata> maybeSerialized =
-        serializeCameraMetadataMap(m);
+        if (maybeTemplate) {
+            mCaptureResultMetadata = std::move(maybeTemplate.value());
+        }
+    }
 
-    if (maybeSerialized) {
-        mCaptureResultMetadata = std::move(maybeSerialized.value());
+    CameraMetadata* const m = &mCaptureResultMetadata;
+    metadataSetEntry(m, ANDROID_CONTROL_AE_STATE, ANDROID_CONTROL_AE_STATE_CONVERGED);
+    metadataSetEntry(m, ANDROID_CONTROL_AF_STATE, af.first);
+    metadataSetEntry(m, ANDROID_CONTROL_AWB_STATE, ANDROID_CONTROL_AWB_STATE_CONVERGED);
+    metadataSetEntry(m, ANDROID_FLASH_STATE, ANDROID_FLASH_STATE_UNAVAILABLE);
+    metadataSetEntry(m, ANDROID_LENS_APERTURE, float(mAperture));
+    metadataSetEntry(m, ANDROID_LENS_FOCUS_DISTANCE, af.second);
+    metadataSetEntry(m, ANDROID_LENS_STATE, ANDROID_LENS_STATE_STATIONARY);
+    metadataSetEntry(m, ANDROID_REQUEST_PIPELINE_DEPTH, uint8_t(4));
+    metadataSetEntry(m, ANDROID_SENSOR_FRAME_DURATION, int64_t(mFrameDurationNs));
+    metadataSetEntry(m, ANDROID_SENSOR_EXPOSURE_TIME, int64_t(mSensorExposureDurationNs));
+    metadataSetEntry(m, ANDROID_SENSOR_SENSITIVITY, int32_t(mSensorSensitivity));
+    metadataSetEntry(m, ANDROID_SENSOR_TIMESTAMP, int64_t(0));
+    metadataSetEntry(m, ANDROID_SENSOR_ROLLING_SHUTTER_SKEW, int64_t(kMinSensorExposureTimeNs));
+    metadataSetEntry(m, ANDROID_STATISTICS_SCENE_FLICKER, ANDROID_STATISTICS_SCENE_FLICKER_NONE);
+
+    {   // RAW16 frames are mosaicked from sRGB ones, see CameraDevice
+        static const camera_metadata_rational_t kNeutralColorPoint[3] = {
+            {1, 1}, {1, 1}, {1, 1},
+        };
+        const double gain = mSensorSensitivity / 100.0;
+        const double s = kRawNoiseShotScale * gain;
+        const double o = kRawNoiseReadScale * gain * gain;
+        const double noiseProfile[8] = {s, o, s, o, s, o, s, o};
+
+        metadataSetEntry(m, ANDROID_SENSOR_GREEN_SPLIT, 0.0f);
+        metadataSetEntry(m, ANDROID_SENSOR_NEUTRAL_COLOR_POINT, kNeutralColorPoint, 3);
+        metadataSetEntry(m, ANDROID_SENSOR_NOISE_PROFILE, noiseProfile, 8);
     }
 
     {   // reset ANDROID_CONTROL_AF_TRIGGER to IDLE
@@ -476,30 +1025,13 @@ CameraMetadata QemuCamera::applyMetadata(const CameraMetadata& metadata) {
 }
 
 CameraMetadata QemuCamera::updateCaptureResultMetadata() {
-    camera_metadata_t* const raw =
-        reinterpret_cast<camera_metadata_t*>(mCaptureResultMetadata.metadata.data());
-
     const auto af = mAFStateMachine();
 
-    camera_metadata_ro_entry_t entry;
-
-    if (find_camera_metadata_ro_entry(raw, ANDROID_CONTROL_AF_STATE, &entry)) {
-        ALOGW("%s:%s:%d: find_camera_metadata_ro_entry(ANDROID_CONTROL_AF_STATE) failed",
-              kClass, __func__, __LINE__);
-    } else if (update_camera_metadata_entry(raw, entry.index, &af.first, 1, nullptr)) {
-        ALOGW("%s:%s:%d: update_camera_metadata_entry(ANDROID_CONTROL_AF_STATE) failed",
-              kClass, __func__, __LINE__);
-    }
-
-    if (find_camera_metadata_ro_entry(raw, ANDROID_LENS_FOCUS_DISTANCE, &entry)) {
-        ALOGW("%s:%s:%d: find_camera_metadata_ro_entry(ANDROID_LENS_FOCUS_DISTANCE) failed",
-              kClass, __func__, __LINE__);
-    } else if (update_camera_metadata_entry(raw, entry.index, &af.second, 1, nullptr)) {
-        ALOGW("%s:%s:%d: update_camera_metadata_entry(ANDROID_LENS_FOCUS_DISTANCE) failed",
-              kClass, __func__, __LINE__);
-    }
+    metadataSetEntry(&mCaptureResultMetadata, ANDROID_CONTROL_AF_STATE, af.first);
+    metadataSetEntry(&mCaptureResultMetadata, ANDROID_LENS_FOCUS_DISTANCE, af.second);
 
-    return metadataCompact(mCaptureResultMetadata);
+    // mCaptureResultMetadata is compact and is updated only in place
+    return mCaptureResultMetadata;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -535,17 +1067,23 @@ Span<const float> QemuCamera::getAvailableApertures() const {
 
 std::tuple<int32_t, int32_t, int32_t> QemuCamera::getMaxNumOutputStreams() const {
     return {
-        0,  // raw
+        1,  // raw
         2,  // processed
         1,  // jpeg
     };
 }
 
+Span<const HighSpeedVideoConfig> QemuCamera::getHighSpeedVideoConfigs() const {
+    return {mHighSpeedVideoConfigs.begin(), mHighSpeedVideoConfigs.end()};
+}
+
 Span<const PixelFormat> QemuCamera::getSupportedPixelFormats() const {
     static const PixelFormat supportedPixelFormats[] = {
         PixelFormat::IMPLEMENTATION_DEFINED,
         PixelFormat::YCBCR_420_888,
         PixelFormat::RGBA_8888,
+        PixelFormat::Y8,
+        PixelFormat::RAW16,
         PixelFormat::BLOB,
     };
 
@@ -16,13 +16,18 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <unordered_map>
 
-#include <android-base/unique_fd.h>
-
 #include "HwCamera.h"
 #include "AFStateMachine.h"
+#include "AutoNativeHandle.h"
+#include "FrameDistributor.h"
+#include "qemu_channel.h"
 
 namespace android {
 namespace hardware {
@@ -38,9 +43,12 @@ struct QemuCamera : public HwCamera {
         std::vector<Rect<uint16_t>> availableThumbnailResolutions;
         Rect<uint16_t> sensorSize;
         bool isBackFacing;
+        std::shared_ptr<FrameDistributor> frameDistributor;  // shared by all instances
+        std::function<base::unique_fd()> openChannel;  // for tests, the emulator's if empty
     };
 
     explicit QemuCamera(const Parameters& params);
+    ~QemuCamera() override;
 
     std::tuple<PixelFormat, BufferUsage, Dataspace, int32_t>
         overrideStreamParams(PixelFormat, BufferUsage, Dataspace) const override;
@@ -48,6 +56,7 @@ struct QemuCamera : public HwCamera {
     bool configure(const CameraMetadata& sessionParams, size_t nStreams,
                    const Stream* streams, const HalStream* halStreams) override;
     void close() override;
+    void setAborting(bool aborting) override;
 
     std::tuple<int64_t, CameraMetadata, std::vector<StreamBuffer>,
                std::vector<DelayedStreamBuffer>>
@@ -59,6 +68,7 @@ struct QemuCamera : public HwCamera {
     bool isBackFacing() const override;
     Span<const float> getAvailableApertures() const override;
     std::tuple<int32_t, int32_t, int32_t> getMaxNumOutputStreams() const override;
+    Span<const HighSpeedVideoConfig> getHighSpeedVideoConfigs() const override;
     Span<const PixelFormat> getSupportedPixelFormats() const override;
     Span<const Rect<uint16_t>> getSupportedResolutions() const override;
     int64_t getMinFrameDurationNs() const override;
@@ -78,30 +88,65 @@ private:
         Rect<uint16_t> size;
         PixelFormat pixelFormat;
         uint32_t blobBufferSize;
+        // Y8 and RAW16 frames are queried into it (see `captureFrameIntoStreamImage`),
+        // it goes to mCancelledFrameImages if its query is cancelled.
+        mutable std::unique_ptr<const native_handle_t,
+                                AutoAllocatorNativeHandleDeleter> image;
     };
 
     void captureFrame(const StreamInfo& si,
                       CachedStreamBuffer* csb,
                       std::vector<StreamBuffer>* outputBuffers,
-                      std::vector<DelayedStreamBuffer>* delayedOutputBuffers) const;
-    bool captureFrameYUV(const StreamInfo& si, CachedStreamBuffer* dst) const;
-    bool captureFrameRGBA(const StreamInfo& si, CachedStreamBuffer* dst) const;
+                      std::vector<DelayedStreamBuffer>* delayedOutputBuffers);
+    bool captureFrameYUV(const StreamInfo& si, CachedStreamBuffer* dst);
+    bool captureFrameRGBA(const StreamInfo& si, CachedStreamBuffer* dst);
+    bool captureFrameY8(const StreamInfo& si, CachedStreamBuffer* dst);
+    bool captureFrameRaw16(const StreamInfo& si, CachedStreamBuffer* dst);
+    bool convertFrameFromYUV(android_ycbcr src, Rect<uint16_t> srcSize,
+                             PixelFormat format, Rect<uint16_t> size,
+                             const native_handle_t* dst);
+    void publishFrame(Rect<uint16_t> size, const android_ycbcr* yuv,
+                      const native_handle_t* rgba);
     DelayedStreamBuffer captureFrameJpeg(const StreamInfo& si,
-                                         CachedStreamBuffer* csb) const;
+                                         CachedStreamBuffer* csb);
     const native_handle_t* captureFrameForCompressing(Rect<uint16_t> dim,
                                                       PixelFormat bufferFormat,
-                                                      uint32_t qemuFormat) const;
-    bool queryFrame(Rect<uint16_t> dim, uint32_t pixelFormat,
-                    float exposureComp, uint64_t dataOffset) const;
+                                                      uint32_t qemuFormat);
+    const native_handle_t* captureFrameIntoStreamImage(const StreamInfo& si,
+                                                       PixelFormat bufferFormat,
+                                                       uint32_t qemuFormat);
+    int captureFrameIntoImage(const native_handle_t* image, Rect<uint16_t> dim,
+                              PixelFormat bufferFormat, uint32_t qemuFormat);
+    bool openQemuChannel();
+    int queryFrame(Rect<uint16_t> dim, uint32_t pixelFormat,
+                   float exposureComp, uint64_t dataOffset,
+                   bool cancellable = false);
+    bool captureIdleFrame();
+    void drainCancelledFrames();
+    void freeCancelledFrameImages();
     static float calculateExposureComp(int64_t exposureNs, int sensorSensitivity,
                                        float aperture);
     CameraMetadata applyMetadata(const CameraMetadata& metadata);
     CameraMetadata updateCaptureResultMetadata();
 
     const Parameters& mParams;
+    std::vector<HighSpeedVideoConfig> mHighSpeedVideoConfigs;
     AFStateMachine mAFStateMachine;
     std::unordered_map<int32_t, StreamInfo> mStreamInfoCache;
-    base::unique_fd mQemuChannel;
+    QemuChannel mQemuChannel;
+    // taken by processCaptureRequest, configure, close and captureIdleFrame
+    // (FrameDistributor's thread), setAborting cancels without it
+    std::mutex mChannelMtx;
+    std::unique_ptr<const native_handle_t,
+                    AutoAllocatorNativeHandleDeleter> mIdleFrameImage;
+    bool mSecondary = false;  // no mQemuChannel, frames come from the primary
+    bool mNoSharedFrames = false;  // logged once, see `processCaptureRequest`
+    bool mFramePublished = false;  // for the current request, see `publishFrame`
+    std::optional<FrameDistributor::Frame> mSharedFrame;  // for the current request
+    std::vector<uint8_t> mScaledFrame;  // see `convertFrameFromYUV`
+    std::vector<uint8_t> mRaw16Row;     // see `convertFrameFromYUV`
+    // the host might still write into them, see `captureFrameForCompressing`
+    std::vector<const native_handle_t*> mCancelledFrameImages;
     CameraMetadata mCaptureResultMetadata;
 
     int64_t mFrameDurationNs = 0;
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define FAILURE_DEBUG_PREFIX "Reprocessor"
+
+#include <stdlib.h>
+#include <algorithm>
+
+#include <log/log.h>
+#include <libyuv/scale.h>
+#include <libyuv/scale_uv.h>
+
+#include <aidl/android/hardware/camera/device/StreamType.h>
+
+#include "debug.h"
+#include "Reprocessor.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+using aidl::android::hardware::camera::device::StreamType;
+
+namespace {
+constexpr unsigned kAcquireFenceTimeoutMs = 500;
+
+// Cb and Cr interleaved, either order
+bool isSemiPlanar(const android_ycbcr& ycbcr) {
+    return (ycbcr.chroma_step == 2) &&
+        (std::abs(static_cast<const uint8_t*>(ycbcr.cr) -
+                  static_cast<const uint8_t*>(ycbcr.cb)) == 1);
+}
+
+void scaleChromaPlaneNearest(const uint8_t* src, const int srcWidth, const int srcHeight,
+                             const size_t srcStride, const size_t srcStep,
+                             uint8_t* dst, const int dstWidth, const int dstHeight,
+                             const size_t dstStride, const size_t dstStep) {
+    for (int y = 0; y < dstHeight; ++y) {
+        const uint8_t* const srcRow = src + (y * srcHeight / dstHeight) * srcStride;
+        uint8_t* dstRow = dst + y * dstStride;
+        for (int x = 0; x < dstWidth; ++x, dstRow += dstStep) {
+            *dstRow = srcRow[(x * srcWidth / dstWidth) * srcStep];
+        }
+    }
+}
+
+// Scales (copies if the sizes match) `src` into `dst`, both are YUV 4:2:0
+// with any strides and chroma steps. libyuv handles matching chroma layouts,
+// mixed ones take the nearest chroma sample.
+void scaleYCbCr(const android_ycbcr& src, const Rect<uint16_t> srcSize,
+                const android_ycbcr& dst, const Rect<uint16_t> dstSize) {
+    const int srcWidth2 = srcSize.width / 2;
+    const int srcHeight2 = srcSize.height / 2;
+    const int dstWidth2 = dstSize.width / 2;
+    const int dstHeight2 = dstSize.height / 2;
+    const uint8_t* const srcCb = static_cast<const uint8_t*>(src.cb);
+    const uint8_t* const srcCr = static_cast<const uint8_t*>(src.cr);
+    uint8_t* const dstCb = static_cast<uint8_t*>(dst.cb);
+    uint8_t* const dstCr = static_cast<uint8_t*>(dst.cr);
+
+    libyuv::ScalePlane(static_cast<const uint8_t*>(src.y), src.ystride,
+                       srcSize.width, srcSize.height,
+                       static_cast<uint8_t*>(dst.y), dst.ystride,
+                       dstSize.width, dstSize.height,
+                       libyuv::kFilterBox);
+
+    if ((src.chroma_step == 1) && (dst.chroma_step == 1)) {
+        libyuv::ScalePlane(srcCb, src.cstride, srcWidth2, srcHeight2,
+                           dstCb, dst.cstride, dstWidth2, dstHeight2,
+                           libyuv::kFilterBox);
+        libyuv::ScalePlane(srcCr, src.cstride, srcWidth2, srcHeight2,
+                           dstCr, dst.cstride, dstWidth2, dstHeight2,
+                           libyuv::kFilterBox);
+    } else if (isSemiPlanar(src) && isSemiPlanar(dst) &&
+               ((srcCb < srcCr) == (dstCb < dstCr))) {
+        libyuv::UVScale(std::min(srcCb, srcCr), src.cstride, srcWidth2, srcHeight2,
+                        std::min(dstCb, dstCr), dst.cstride, dstWidth2, dstHeight2,
+                        libyuv::kFilterBox);
+    } else {
+        scaleChromaPlaneNearest(srcCb, srcWidth2, srcHeight2, src.cstride, src.chroma_step,
+                                dstCb, dstWidth2, dstHeight2, dst.cstride, dst.chroma_step);
+        scaleChromaPlaneNearest(srcCr, srcWidth2, srcHeight2, src.cstride, src.chroma_step,
+                                dstCr, dstWidth2, dstHeight2, dst.cstride, dst.chroma_step);
+    }
+}
+
+}  // namespace
+
+bool Reprocessor::configure(size_t nStreams, const Stream* streams,
+                            const HalStream* halStreams) {
+    mOutputStreams.clear();
+    mInputStreamId = -1;
+
+    for (; nStreams > 0; --nStreams, ++streams, ++halStreams) {
+        LOG_ALWAYS_FATAL_IF(halStreams->id != streams->id);
+        const Rect<uint16_t> size = {static_cast<uint16_t>(streams->width),
+                                     static_cast<uint16_t>(streams->height)};
+
+        if (streams->streamType == StreamType::INPUT) {
+            if ((mInputStreamId >= 0) ||
+                    (streams->format != PixelFormat::YCBCR_420_888) ||
+                    (size.width & 1) || (size.height & 1)) {
+                return FAILURE(false);
+            }
+
+            mInputStreamId = streams->id;
+            mInputSize = size;
+        } else {
+            StreamInfo& si = mOutputStreams[streams->id];
+            si.size = size;
+            si.pixelFormat = halStreams->overrideFormat;
+            si.blobBufferSize = streams->bufferSize;
+        }
+    }
+
+    return true;
+}
+
+std::pair<std::vector<StreamBuffer>, std::vector<DelayedStreamBuffer>>
+Reprocessor::process(const CameraMetadata& settings,
+                     CachedStreamBuffer* const input,
+                     const Span<CachedStreamBuffer* const> outputs,
+                     const HwCamera& hwCamera) const {
+    std::vector<StreamBuffer> outputBuffers;
+    std::vector<DelayedStreamBuffer> delayedOutputBuffers;
+    const Rect<uint16_t> inputSize = mInputSize;
+
+    android_ycbcr inputYcbcr;
+    bool inputLocked = false;
+
+    for (CachedStreamBuffer* const csb : outputs) {
+        const auto i = mOutputStreams.find(csb->getStreamId());
+        if (i == mOutputStreams.end()) {
+            outputBuffers.push_back(csb->finish(FAILURE(false)));
+            continue;
+        }
+
+        const StreamInfo& si = i->second;
+        switch (si.pixelFormat) {
+        case PixelFormat::BLOB: {
+                const uint32_t jpegBufferSize = si.blobBufferSize;
+                const HwCamera* const hw = &hwCamera;
+                auto process = [csb, input, inputSize, settings, jpegBufferSize, hw]
+                               (const bool ok, const std::atomic<bool>* const abort)
+                                   -> StreamBuffer {
+                    if (!ok || !csb->waitAcquireFence(kAcquireFenceTimeoutMs)) {
+                        return csb->finish(false);
+                    }
+
+                    android_ycbcr ycbcr;
+                    if (!hw->grallocLockYCbCr(input->getBuffer(), BufferUsage::CPU_READ_OFTEN,
+                                              inputSize, &ycbcr)) {
+                        return csb->finish(FAILURE(false));
+                    }
+
+                    bool success;
+                    {
+                        ScopedFrameStage stage(hw->getFrameTimingStats(),
+                                               FrameStage::JpegEncode);
+                        success = HwCamera::compressJpeg(inputSize, ycbcr, settings,
+                                                         csb->getBuffer(), jpegBufferSize,
+                                                         abort);
+                    }
+
+                    hw->grallocUnlock(input->getBuffer());
+                    return csb->finish(success);
+                };
+
+                delayedOutputBuffers.push_back({std::move(process), csb->getStreamId()});
+            }
+            break;
+
+        case PixelFormat::YCBCR_420_888:
+            if (!inputLocked) {
+                inputLocked = hwCamera.grallocLockYCbCr(input->getBuffer(),
+                                                        BufferUsage::CPU_READ_OFTEN,
+                                                        inputSize, &inputYcbcr);
+                if (!inputLocked) {
+                    outputBuffers.push_back(csb->finish(FAILURE(false)));
+                    break;
+                }
+            }
+            outputBuffers.push_back(csb->finish(processYUV(inputYcbcr, csb, si, hwCamera)));
+            break;
+
+        default:
+            outputBuffers.push_back(csb->finish(FAILURE(false)));
+            break;
+        }
+    }
+
+    if (inputLocked) {
+        hwCamera.grallocUnlock(input->getBuffer());
+    }
+
+    return {std::move(outputBuffers), std::move(delayedOutputBuffers)};
+}
+
+bool Reprocessor::processYUV(const android_ycbcr& inputYcbcr,
+                             CachedStreamBuffer* const csb,
+                             const StreamInfo& si,
+                             const HwCamera& hwCamera) const {
+    if (!csb->waitAcquireFence(kAcquireFenceTimeoutMs)) {
+        return FAILURE(false);
+    }
+
+    android_ycbcr outputYcbcr;
+    if (!hwCamera.grallocLockYCbCr(csb->getBuffer(), BufferUsage::CPU_WRITE_OFTEN,
+                                   si.size, &outputYcbcr)) {
+        return FAILURE(false);
+    }
+
+    scaleYCbCr(inputYcbcr, mInputSize, outputYcbcr, si.size);
+
+    hwCamera.grallocUnlock(csb->getBuffer());
+    return true;
+}
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
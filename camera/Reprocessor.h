@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "HwCamera.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+// YUV reprocessing: app supplied YCBCR_420_888 images (e.g. ZSL frames kept
+// by the app) are compressed into JPEG or scaled into YUV outputs. The host
+// is not involved.
+struct Reprocessor {
+    // Returns false if the configuration has more than one input stream or
+    // its format is not supported.
+    bool configure(size_t nStreams, const Stream* streams, const HalStream* halStreams);
+
+    bool hasInputStream() const { return mInputStreamId >= 0; }
+    int32_t getInputStreamId() const { return mInputStreamId; }
+    Rect<uint16_t> getInputSize() const { return mInputSize; }
+
+    // YUV outputs are produced right away, JPEG outputs are delayed and read
+    // `input` when processed, it must stay valid (not returned) until then.
+    // `input`'s acquire fence must be waited for already. Buffers are locked
+    // through `hwCamera` which must outlive the delayed outputs.
+    std::pair<std::vector<StreamBuffer>, std::vector<DelayedStreamBuffer>>
+        process(const CameraMetadata& settings, CachedStreamBuffer* input,
+                Span<CachedStreamBuffer* const> outputs,
+                const HwCamera& hwCamera) const;
+
+private:
+    struct StreamInfo {
+        Rect<uint16_t> size;
+        PixelFormat pixelFormat;
+        uint32_t blobBufferSize;
+    };
+
+    bool processYUV(const android_ycbcr& inputYcbcr, CachedStreamBuffer* csb,
+                    const StreamInfo& si, const HwCamera& hwCamera) const;
+
+    std::unordered_map<int32_t, StreamInfo> mOutputStreams;
+    Rect<uint16_t> mInputSize = {0, 0};
+    int32_t mInputStreamId = -1;
+};
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define FAILURE_DEBUG_PREFIX "SoftwareRenderer"
+
+#include <algorithm>
+#include <cmath>
+
+#include "converters.h"
+#include "debug.h"
+#include "SoftwareRenderer.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+namespace {
+// The y=0 plane goes into clip space as {x, z, 1} -> H * {x, z, 1} = {X, Y, W}.
+// H^-1 * {X/W, Y/W, 1} gives {x/W, z/W, 1/W}, i.e. texture coordinates are
+// a linear function of the pixel position divided by another linear function.
+bool invertPlaneProjection(const float m[], float hinv[]) {
+    const double h[9] = {
+        m[0], m[2], m[3],
+        m[4], m[6], m[7],
+        m[12], m[14], m[15],
+    };
+
+    const double det = h[0] * (h[4] * h[8] - h[5] * h[7]) -
+                       h[1] * (h[3] * h[8] - h[5] * h[6]) +
+                       h[2] * (h[3] * h[7] - h[4] * h[6]);
+    if (std::abs(det) < 1e-12) {
+        return false;  // the plane is seen edge-on
+    }
+
+    hinv[0] = (h[4] * h[8] - h[5] * h[7]) / det;
+    hinv[1] = (h[2] * h[7] - h[1] * h[8]) / det;
+    hinv[2] = (h[1] * h[5] - h[2] * h[4]) / det;
+    hinv[3] = (h[5] * h[6] - h[3] * h[8]) / det;
+    hinv[4] = (h[0] * h[8] - h[2] * h[6]) / det;
+    hinv[5] = (h[2] * h[3] - h[0] * h[5]) / det;
+    hinv[6] = (h[3] * h[7] - h[4] * h[6]) / det;
+    hinv[7] = (h[1] * h[6] - h[0] * h[7]) / det;
+    hinv[8] = (h[0] * h[4] - h[1] * h[3]) / det;
+    return true;
+}
+
+int wrap(const int i, const int n) {
+    return (i < 0) ? (i + n) : ((i >= n) ? (i - n) : i);
+}
+
+// bilinear filtering of four packed 8bit x4 texels, weights are in 1/256
+uint32_t lerpTexels(const uint32_t p00, const uint32_t p01,
+                    const uint32_t p10, const uint32_t p11,
+                    const uint32_t wx, const uint32_t wy) {
+    uint32_t r = 0;
+    for (unsigned shift = 0; shift < 32; shift += 8) {
+        const uint32_t top = ((p00 >> shift) & 0xFF) * (256 - wx) +
+                             ((p01 >> shift) & 0xFF) * wx;
+        const uint32_t bottom = ((p10 >> shift) & 0xFF) * (256 - wx) +
+                                ((p11 >> shift) & 0xFF) * wx;
+        r |= ((top * (256 - wy) + bottom * wy + 32768) >> 16) << shift;
+    }
+    return r;
+}
+}  // namespace
+
+void SoftwareRenderer::init(Texture texture, const uint32_t clearColorRgba) {
+    mYuvTexels.resize(texture.texels.size());
+    std::transform(texture.texels.begin(), texture.texels.end(),
+                   mYuvTexels.begin(), &conv::rgba2yuvPixel);
+
+    mRgbaTexels = std::move(texture.texels);
+    mClearRgba = clearColorRgba;
+    mClearYuv = conv::rgba2yuvPixel(clearColorRgba);
+    mWidth = texture.width;
+    mHeight = texture.height;
+    mLinear = texture.linear;
+}
+
+void SoftwareRenderer::renderRGBA(const float pvMatrix44[], const Rect<uint16_t> size,
+                                  uint32_t* rgba, const size_t stride) const {
+    const size_t width = size.width;
+    float hinv[9];
+    if (!invertPlaneProjection(pvMatrix44, hinv)) {
+        for (size_t row = 0; row < size.height; ++row, rgba += stride) {
+            std::fill(rgba, rgba + width, mClearRgba);
+        }
+        return;
+    }
+
+    std::vector<float> us(width);
+    std::vector<float> vs(width);
+    const float dnx = 2.0f / width;
+    const float nx0 = 0.5f * dnx - 1.0f;
+
+    for (size_t row = 0; row < size.height; ++row, rgba += stride) {
+        const float ny = (2.0f * row + 1.0f) / size.height - 1.0f;
+        mapRow(hinv, ny, nx0, dnx, width, us.data(), vs.data());
+
+        for (size_t col = 0; col < width; ++col) {
+            rgba[col] = (us[col] < 0) ? mClearRgba :
+                sample(mRgbaTexels.data(), us[col], vs[col]);
+        }
+    }
+}
+
+bool SoftwareRenderer::renderYUV(const float pvMatrix44[], const Rect<uint16_t> size,
+                                 const android_ycbcr& ycbcr) const {
+    const size_t width = size.width;
+    const size_t height = size.height;
+    if ((width & 1) || (height & 1)) {
+        return FAILURE(false);
+    }
+
+    float hinv[9];
+    const bool visible = invertPlaneProjection(pvMatrix44, hinv);
+
+    std::vector<float> uvs(4 * width);
+    float* const us0 = &uvs[0];
+    float* const vs0 = &uvs[width];
+    float* const us1 = &uvs[2 * width];
+    float* const vs1 = &uvs[3 * width];
+    if (!visible) {
+        std::fill(uvs.begin(), uvs.end(), -1.0f);
+    }
+
+    const float dnx = 2.0f / width;
+    const float nx0 = 0.5f * dnx - 1.0f;
+    const size_t chromaStep = ycbcr.chroma_step;
+    const uint32_t* const texels = mYuvTexels.data();
+    const uint32_t clear = mClearYuv;
+
+    // Two rows at once, four pixels give four Y values and one {Cb, Cr} pair
+    for (size_t row = 0; row < height; row += 2) {
+        if (visible) {
+            mapRow(hinv, (2.0f * row + 1.0f) / height - 1.0f, nx0, dnx, width, us0, vs0);
+            mapRow(hinv, (2.0f * row + 3.0f) / height - 1.0f, nx0, dnx, width, us1, vs1);
+        }
+
+        uint8_t* y0 = static_cast<uint8_t*>(ycbcr.y) + row * ycbcr.ystride;
+        uint8_t* y1 = y0 + ycbcr.ystride;
+        uint8_t* cb = static_cast<uint8_t*>(ycbcr.cb) + (row / 2) * ycbcr.cstride;
+        uint8_t* cr = static_cast<uint8_t*>(ycbcr.cr) + (row / 2) * ycbcr.cstride;
+
+        for (size_t col = 0; col < width; col += 2, cb += chromaStep, cr += chromaStep) {
+            const uint32_t p00 = (us0[col] < 0) ? clear : sample(texels, us0[col], vs0[col]);
+            const uint32_t p01 = (us0[col + 1] < 0) ? clear : sample(texels, us0[col + 1], vs0[col + 1]);
+            const uint32_t p10 = (us1[col] < 0) ? clear : sample(texels, us1[col], vs1[col]);
+            const uint32_t p11 = (us1[col + 1] < 0) ? clear : sample(texels, us1[col + 1], vs1[col + 1]);
+
+            y0[col] = p00;
+            y0[col + 1] = p01;
+            y1[col] = p10;
+            y1[col + 1] = p11;
+            *cb = (((p00 >> 8) & 0xFF) + ((p01 >> 8) & 0xFF) +
+                   ((p10 >> 8) & 0xFF) + ((p11 >> 8) & 0xFF) + 2) >> 2;
+            *cr = (((p00 >> 16) & 0xFF) + ((p01 >> 16) & 0xFF) +
+                   ((p10 >> 16) & 0xFF) + ((p11 >> 16) & 0xFF) + 2) >> 2;
+        }
+    }
+
+    return true;
+}
+
+// Texture coordinates (in texels) of `n` pixel centers of a row, `us[i] < 0`
+// marks the background. Written as a flat loop over arrays without branches
+// to let the compiler vectorize it.
+void SoftwareRenderer::mapRow(const float hinv[], const float ny,
+                              const float nx0, const float dnx,
+                              const size_t n, float* const us, float* const vs) const {
+    const float a0 = hinv[0] * nx0 + hinv[1] * ny + hinv[2];
+    const float b0 = hinv[3] * nx0 + hinv[4] * ny + hinv[5];
+    const float s0 = hinv[6] * nx0 + hinv[7] * ny + hinv[8];
+    const float da = hinv[0] * dnx;
+    const float db = hinv[3] * dnx;
+    const float ds = hinv[6] * dnx;
+    const float halfWidth = 0.5f * mWidth;
+    const float halfHeight = 0.5f * mHeight;
+
+    for (size_t i = 0; i < n; ++i) {
+        const float a = a0 + da * i;  // x/W
+        const float b = b0 + db * i;  // z/W
+        const float s = s0 + ds * i;  // 1/W, W>0 in front of the camera
+        const bool inside = (s > 0) && (std::abs(a) <= s) && (std::abs(b) <= s);
+        const float rs = 1.0f / s;
+        us[i] = inside ? ((a * rs + 1.0f) * halfWidth) : -1.0f;
+        vs[i] = inside ? ((b * rs + 1.0f) * halfHeight) : -1.0f;
+    }
+}
+
+// GL_REPEAT wrapping, `u` and `v` are in [0, width] and [0, height]
+uint32_t SoftwareRenderer::sample(const uint32_t* const texels,
+                                  const float u, const float v) const {
+    const int width = mWidth;
+    const int height = mHeight;
+
+    if (!mLinear) {
+        const int x = std::min(int(u), width - 1);
+        const int y = std::min(int(v), height - 1);
+        return texels[y * width + x];
+    }
+
+    const float fu = u - 0.5f;
+    const float fv = v - 0.5f;
+    const float fx = std::floor(fu);
+    const float fy = std::floor(fv);
+    const uint32_t wx = (fu - fx) * 256;
+    const uint32_t wy = (fv - fy) * 256;
+    const int x0 = wrap(int(fx), width);
+    const int x1 = wrap(int(fx) + 1, width);
+    const uint32_t* const r0 = &texels[wrap(int(fy), height) * width];
+    const uint32_t* const r1 = &texels[wrap(int(fy) + 1, height) * width];
+
+    return lerpTexels(r0[x0], r0[x1], r1[x0], r1[x1], wx, wy);
+}
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
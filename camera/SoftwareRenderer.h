@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <system/graphics.h>
+
+#include "Rect.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+// Draws the FakeRotatingCamera scene on the CPU: a quad on the y=0 plane
+// (x and z in [-1, 1], texture coordinates are {(x+1)/2, (z+1)/2}) over a
+// solid background. Used when GL is emulated in software anyway.
+struct SoftwareRenderer {
+    struct Texture {
+        std::vector<uint32_t> texels;  // R8G8B8A8, the first row is at v=0
+        uint16_t width = 0;
+        uint16_t height = 0;
+        bool linear = false;  // GL_LINEAR or GL_NEAREST
+    };
+
+    void init(Texture texture, uint32_t clearColorRgba);
+    bool ok() const { return !mRgbaTexels.empty(); }
+
+    // `pvMatrix44` is row major (as passed to glUniformMatrix4fv with
+    // transpose=true). Row 0 of the image is at y=-1 in NDC, like GL
+    // rendering into an AHardwareBuffer.
+    void renderRGBA(const float pvMatrix44[], Rect<uint16_t> size,
+                    uint32_t* rgba, size_t stride) const;
+    // writes the Y and Cb/Cr planes directly, `size` must be even
+    bool renderYUV(const float pvMatrix44[], Rect<uint16_t> size,
+                   const android_ycbcr& ycbcr) const;
+
+private:
+    void mapRow(const float hinv[], float ny, float nx0, float dnx,
+                size_t n, float* us, float* vs) const;
+    uint32_t sample(const uint32_t* texels, float u, float v) const;
+
+    std::vector<uint32_t> mRgbaTexels;
+    std::vector<uint32_t> mYuvTexels;  // packed {Y, Cb, Cr, A}
+    uint32_t mClearRgba = 0;
+    uint32_t mClearYuv = 0;
+    uint16_t mWidth = 0;
+    uint16_t mHeight = 0;
+    bool mLinear = false;
+};
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -14,8 +14,14 @@
  * limitations under the License.
  */
 
+
 #define FAILURE_DEBUG_PREFIX "StreamBufferCache"
 
+#include <algorithm>
+#include <iterator>
+
+#include <log/log.h>
+
 #include "StreamBufferCache.h"
 #include "debug.h"
 
@@ -25,27 +31,226 @@ namespace camera {
 namespace provider {
 namespace implementation {
 
+namespace {
+constexpr size_t kMinIndexCapacity = 16;
+
+size_t hashBufferId(const int64_t bufferId) {
+    // the framework hands out sequential ids, spread them over the table
+    uint64_t h = static_cast<uint64_t>(bufferId) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+}
+
+// keeps the load factor at or below 1/2
+size_t indexCapacityFor(const size_t n) {
+    size_t capacity = kMinIndexCapacity;
+    while (capacity < (n * 2)) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+}  // namespace
+
 CachedStreamBuffer*
 StreamBufferCache::update(const StreamBuffer& sb) {
-    const auto bi = mCache.find(sb.bufferId);
-    if (bi == mCache.end()) {
-        const auto r = mCache.insert({sb.bufferId, CachedStreamBuffer(sb)});
-        LOG_ALWAYS_FATAL_IF(!r.second);
-        return &(r.first->second);
-    } else {
-        CachedStreamBuffer* csb = &bi->second;
+    LOG_ALWAYS_FATAL_IF(!sb.bufferId);
+
+    const size_t i = findEntry(sb.bufferId);
+    if (i < mIndex.size()) {
+        CachedStreamBuffer* csb = mIndex[i].csb;
         csb->importAcquireFence(sb.acquireFence);
         return csb;
     }
+
+    StreamSlab* slab = getSlab(sb.streamId);
+    uint32_t slot;
+    if (slab->freeSlots.empty()) {
+        slot = slab->slots.size();
+        slab->slots.emplace_back();
+    } else {
+        slot = slab->freeSlots.back();
+        slab->freeSlots.pop_back();
+    }
+
+    CachedStreamBuffer* csb = &slab->slots[slot].emplace(sb);
+    insertEntry({sb.bufferId, csb, slab, slot});
+    return csb;
 }
 
 void StreamBufferCache::remove(const int64_t bufferId) {
-    mCache.erase(bufferId);
+    if (!bufferId) {
+        return;
+    }
+
+    const size_t i = findEntry(bufferId);
+    if (i < mIndex.size()) {
+        const IndexEntry e = mIndex[i];
+        eraseEntry(i);
+        e.slab->slots[e.slot].reset();
+        e.slab->freeSlots.push_back(e.slot);
+    }
+}
+
+void StreamBufferCache::remove(const std::vector<BufferCache>& caches) {
+    for (const BufferCache& bc : caches) {
+        remove(bc.bufferId);
+    }
+
+    // the framework drops whole streams at once, shrink the index once
+    if ((mIndex.size() > kMinIndexCapacity) && ((mIndexSize * 8) < mIndex.size())) {
+        rehash(indexCapacityFor(mIndexSize));
+    }
 }
 
 void StreamBufferCache::clearStreamInfo() {
-    for (auto& kv : mCache) {
-        kv.second.setStreamInfo(nullptr);
+    for (const auto& slab : mSlabs) {
+        for (auto& slot : slab->slots) {
+            if (slot) {
+                slot->setStreamInfo(nullptr);
+            }
+        }
+    }
+}
+
+std::vector<int64_t> StreamBufferCache::getBufferIds(const int32_t streamId) const {
+    std::vector<int64_t> bufferIds;
+    for (const auto& slab : mSlabs) {
+        if (slab->streamId == streamId) {
+            for (const auto& slot : slab->slots) {
+                if (slot) {
+                    bufferIds.push_back(slot->getBufferId());
+                }
+            }
+        }
+    }
+    return bufferIds;
+}
+
+void StreamBufferCache::reserve(const int32_t streamId, const size_t maxBuffers) {
+    StreamSlab* slab = getSlab(streamId);
+    while (slab->slots.size() < maxBuffers) {
+        slab->freeSlots.push_back(slab->slots.size());
+        slab->slots.emplace_back();
+    }
+
+    size_t nSlots = 0;
+    for (const auto& s : mSlabs) {
+        nSlots += s->slots.size();
+    }
+
+    const size_t capacity = indexCapacityFor(nSlots);
+    if (capacity > mIndex.size()) {
+        rehash(capacity);
+    }
+}
+
+std::unique_ptr<StreamBufferCache>
+StreamBufferCache::extractStreams(const std::vector<int32_t>& streamIds) {
+    auto extracted = std::make_unique<StreamBufferCache>();
+
+    const auto keep = std::stable_partition(mSlabs.begin(), mSlabs.end(),
+        [&streamIds](const std::unique_ptr<StreamSlab>& slab){
+            return std::find(streamIds.begin(), streamIds.end(),
+                             slab->streamId) == streamIds.end();
+        });
+
+    // slabs are moved as a whole, CachedStreamBuffer objects stay in place
+    std::move(keep, mSlabs.end(), std::back_inserter(extracted->mSlabs));
+    mSlabs.erase(keep, mSlabs.end());
+
+    reindex();
+    extracted->reindex();
+    return extracted;
+}
+
+StreamBufferCache::StreamSlab* StreamBufferCache::getSlab(const int32_t streamId) {
+    for (const auto& slab : mSlabs) {
+        if (slab->streamId == streamId) {
+            return slab.get();
+        }
+    }
+
+    auto slab = std::make_unique<StreamSlab>();
+    slab->streamId = streamId;
+    mSlabs.push_back(std::move(slab));
+    return mSlabs.back().get();
+}
+
+size_t StreamBufferCache::findEntry(const int64_t bufferId) const {
+    const size_t capacity = mIndex.size();
+    if (!capacity) {
+        return capacity;
+    }
+
+    const size_t mask = capacity - 1;
+    for (size_t i = hashBufferId(bufferId) & mask; ; i = (i + 1) & mask) {
+        const int64_t id = mIndex[i].bufferId;
+        if (id == bufferId) {
+            return i;
+        } else if (!id) {
+            return capacity;
+        }
+    }
+}
+
+void StreamBufferCache::insertEntry(const IndexEntry& e) {
+    if (((mIndexSize + 1) * 2) > mIndex.size()) {
+        rehash(indexCapacityFor(mIndexSize + 1));
+    }
+
+    const size_t mask = mIndex.size() - 1;
+    size_t i = hashBufferId(e.bufferId) & mask;
+    while (mIndex[i].bufferId) {
+        i = (i + 1) & mask;
+    }
+
+    mIndex[i] = e;
+    ++mIndexSize;
+}
+
+// backward shift deletion, no tombstones to slow down lookups
+void StreamBufferCache::eraseEntry(size_t hole) {
+    const size_t mask = mIndex.size() - 1;
+    for (size_t j = (hole + 1) & mask; mIndex[j].bufferId; j = (j + 1) & mask) {
+        const size_t home = hashBufferId(mIndex[j].bufferId) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            mIndex[hole] = mIndex[j];
+            hole = j;
+        }
+    }
+
+    mIndex[hole] = IndexEntry();
+    --mIndexSize;
+}
+
+void StreamBufferCache::rehash(const size_t capacity) {
+    std::vector<IndexEntry> entries;
+    entries.swap(mIndex);
+
+    mIndex.resize(capacity);
+    mIndexSize = 0;
+    for (const IndexEntry& e : entries) {
+        if (e.bufferId) {
+            insertEntry(e);
+        }
+    }
+}
+
+void StreamBufferCache::reindex() {
+    size_t n = 0;
+    for (const auto& slab : mSlabs) {
+        n += slab->slots.size() - slab->freeSlots.size();
+    }
+
+    mIndex.assign(indexCapacityFor(n), IndexEntry());
+    mIndexSize = 0;
+    for (const auto& slab : mSlabs) {
+        const uint32_t nSlots = slab->slots.size();
+        for (uint32_t k = 0; k < nSlots; ++k) {
+            auto& slot = slab->slots[k];
+            if (slot) {
+                insertEntry({slot->getBufferId(), &slot.value(), slab.get(), k});
+            }
+        }
     }
 }
 
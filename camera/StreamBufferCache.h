@@ -14,11 +14,16 @@
  * limitations under the License.
  */
 
+
 #pragma once
 
 #include <stdint.h>
-#include <map>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <vector>
 
+#include <aidl/android/hardware/camera/device/BufferCache.h>
 #include <aidl/android/hardware/camera/device/StreamBuffer.h>
 
 #include "CachedStreamBuffer.h"
@@ -29,17 +34,50 @@ namespace camera {
 namespace provider {
 namespace implementation {
 
+using aidl::android::hardware::camera::device::BufferCache;
 using aidl::android::hardware::camera::device::StreamBuffer;
 
 struct StreamBufferCache {
     StreamBufferCache() = default;
     CachedStreamBuffer* update(const StreamBuffer& sb);
     void remove(int64_t bufferId);
+    void remove(const std::vector<BufferCache>& caches);
     void clearStreamInfo();
+    std::vector<int64_t> getBufferIds(int32_t streamId) const;
+
+    // Preallocates slots for `maxBuffers` buffers of `streamId`.
+    void reserve(int32_t streamId, size_t maxBuffers);
+
+    // Moves buffers of `streamIds` into a new cache, pointers to them
+    // (e.g. in pending delayed results) stay valid.
+    std::unique_ptr<StreamBufferCache> extractStreams(const std::vector<int32_t>& streamIds);
 
 private:
-    // std::map is to keep iterators valid after `insert`
-    std::map<int64_t, CachedStreamBuffer> mCache;
+    // CachedStreamBuffer objects never move, `update` returns pointers to them.
+    struct StreamSlab {
+        int32_t streamId;
+        std::deque<std::optional<CachedStreamBuffer>> slots;
+        std::vector<uint32_t> freeSlots;
+    };
+
+    // open addressing with linear probing, bufferId=0 marks an empty entry
+    struct IndexEntry {
+        int64_t bufferId = 0;
+        CachedStreamBuffer* csb = nullptr;
+        StreamSlab* slab = nullptr;
+        uint32_t slot = 0;
+    };
+
+    StreamSlab* getSlab(int32_t streamId);
+    size_t findEntry(int64_t bufferId) const;
+    void insertEntry(const IndexEntry& e);
+    void eraseEntry(size_t i);
+    void rehash(size_t capacity);
+    void reindex();
+
+    std::vector<std::unique_ptr<StreamSlab>> mSlabs;
+    std::vector<IndexEntry> mIndex;  // the size is zero or a power of two
+    size_t mIndexSize = 0;
 
     StreamBufferCache(const StreamBufferCache&) = delete;
     StreamBufferCache& operator=(const StreamBufferCache&) = delete;
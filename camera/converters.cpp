@@ -14,8 +14,16 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
 #include <libyuv/convert.h>
+#include <libyuv/convert_from_argb.h>
 #include "converters.h"
+#include "cpu_budget.h"
 #include "debug.h"
 
 namespace android {
@@ -24,6 +32,7 @@ namespace camera {
 namespace provider {
 namespace implementation {
 namespace conv {
+namespace {
 
 // https://en.wikipedia.org/wiki/YCbCr#JPEG_conversion
 constexpr size_t kFixedPointShift = 16;
@@ -51,21 +60,14 @@ constexpr int32_t kCx_Clamp = 255 << kCx_Shift;
 #define RGB2CB(R, G, B) (kCB_R * (R) + kCB_G * (G) + kCB_B * (B) + kCx_Add)
 #define RGB2CR(R, G, B) (kCR_R * (R) + kCR_G * (G) + kCR_B * (B) + kCx_Add)
 
-bool rgba2yuv(const size_t width, size_t height,
-              const uint32_t* rgba, const android_ycbcr& ycbcr) {
-    if ((width & 1) || (height & 1)) {
-        return FAILURE(false);
-    }
-
-    if (ycbcr.chroma_step == 1) {
-        return (libyuv::ABGRToI420(
-            reinterpret_cast<const uint8_t*>(rgba), (width * sizeof(*rgba)),
-            static_cast<uint8_t*>(ycbcr.y), ycbcr.ystride,
-            static_cast<uint8_t*>(ycbcr.cb), ycbcr.cstride,
-            static_cast<uint8_t*>(ycbcr.cr), ycbcr.cstride,
-            width, height) == 0) ? true : FAILURE(false);
-    }
+// Frames smaller than this are converted on the calling thread, waking up
+// workers costs more than it saves.
+constexpr size_t kMinBandArea = 640 * 480;
+constexpr size_t kMaxBands = 4;
 
+// The generic (slow) path for layouts libyuv does not have a converter for.
+bool rgba2yuvGeneric(const size_t width, size_t height,
+                     const uint32_t* rgba, const android_ycbcr& ycbcr) {
     const size_t width2 = width + width;
     const size_t ystride = ycbcr.ystride;
     const size_t ystride2 = ystride + ystride;
@@ -115,7 +117,7 @@ bool rgba2yuv(const size_t width, size_t height,
                 tmp0 = CLAMP_SHIFT(tmp0, 0, kY_Clamp, kY_Shift);
                 tmp1 = CLAMP_SHIFT(tmp1, 0, kY_Clamp, kY_Shift);
                 y0[0] = tmp0;
-                y1[0] = tmp1;
+                y0[1] = tmp1;
             }
             {
                 const uint32_t p10 = r1[0];
@@ -149,6 +151,199 @@ bool rgba2yuv(const size_t width, size_t height,
     return true;
 }
 
+bool rgba2yuvImpl(const size_t width, const size_t height,
+                  const uint32_t* rgba, const android_ycbcr& ycbcr) {
+    const uint8_t* const src = reinterpret_cast<const uint8_t*>(rgba);
+    const int srcStride = width * sizeof(*rgba);
+    uint8_t* const y = static_cast<uint8_t*>(ycbcr.y);
+    uint8_t* const cb = static_cast<uint8_t*>(ycbcr.cb);
+    uint8_t* const cr = static_cast<uint8_t*>(ycbcr.cr);
+    int r;
+
+    switch (ycbcr.chroma_step) {
+    case 1:
+        r = libyuv::ABGRToI420(src, srcStride, y, ycbcr.ystride,
+                               cb, ycbcr.cstride, cr, ycbcr.cstride,
+                               width, height);
+        break;
+
+    case 2:
+        if (cr == (cb + 1)) {
+            r = libyuv::ABGRToNV12(src, srcStride, y, ycbcr.ystride,
+                                   cb, ycbcr.cstride, width, height);
+        } else if (cb == (cr + 1)) {
+            r = libyuv::ABGRToNV21(src, srcStride, y, ycbcr.ystride,
+                                   cr, ycbcr.cstride, width, height);
+        } else {
+            return rgba2yuvGeneric(width, height, rgba, ycbcr);
+        }
+        break;
+
+    default:
+        return rgba2yuvGeneric(width, height, rgba, ycbcr);
+    }
+
+    return (r == 0) ? true : FAILURE_V(false, "libyuv failed with %d", r);
+}
+
+// `rows` must be even
+android_ycbcr ycbcrSkipRows(const android_ycbcr& ycbcr, const size_t rows) {
+    android_ycbcr r = ycbcr;
+    r.y = static_cast<uint8_t*>(ycbcr.y) + rows * ycbcr.ystride;
+    r.cb = static_cast<uint8_t*>(ycbcr.cb) + (rows / 2) * ycbcr.cstride;
+    r.cr = static_cast<uint8_t*>(ycbcr.cr) + (rows / 2) * ycbcr.cstride;
+    return r;
+}
+
+// Threads converting bands of frames, started on the first use and kept for
+// the process lifetime. One frame at a time, concurrent callers convert on
+// their own threads.
+class BandWorkers {
+public:
+    static BandWorkers& get() {
+        static BandWorkers workers;
+        return workers;
+    }
+
+    // Runs `band(i)` for `i` in [0, nBands), the last band on the calling
+    // thread. Returns false if the workers are busy with another frame.
+    bool tryRun(const size_t nBands, const std::function<bool(size_t)>& band,
+                bool* result) {
+        std::unique_lock<std::mutex> runLock(mRunMtx, std::try_to_lock);
+        if (!runLock.owns_lock()) {
+            return false;
+        }
+
+        const size_t nWorkerBands = std::min(nBands - 1, std::size(mThreads));
+        {
+            std::lock_guard<std::mutex> lock(mMtx);
+            mBand = &band;
+            mNumWorkerBands = nWorkerBands;
+            mNumPending = nWorkerBands;
+            mResult = true;
+            ++mGeneration;
+        }
+        mWorkCv.notify_all();
+
+        bool r = band(nBands - 1);
+
+        std::unique_lock<std::mutex> lock(mMtx);
+        mDoneCv.wait(lock, [this](){ return mNumPending == 0; });
+        mBand = nullptr;
+        *result = r && mResult;
+        return true;
+    }
+
+private:
+    BandWorkers() {
+        for (size_t i = 0; i < std::size(mThreads); ++i) {
+            mThreads[i] = std::thread(&BandWorkers::threadLoop, this, i);
+        }
+    }
+
+    ~BandWorkers() {
+        {
+            std::lock_guard<std::mutex> lock(mMtx);
+            mExiting = true;
+        }
+        mWorkCv.notify_all();
+
+        for (std::thread& t : mThreads) {
+            t.join();
+        }
+    }
+
+    void threadLoop(const size_t i) {
+        uint64_t generation = 0;
+        std::unique_lock<std::mutex> lock(mMtx);
+
+        while (true) {
+            mWorkCv.wait(lock, [this, generation](){
+                return mExiting || (mGeneration != generation);
+            });
+            if (mExiting) {
+                break;
+            }
+
+            generation = mGeneration;
+            if (i >= mNumWorkerBands) {
+                continue;
+            }
+
+            const std::function<bool(size_t)>& band = *mBand;
+            lock.unlock();
+            const bool r = band(i);
+            lock.lock();
+
+            mResult = mResult && r;
+            if (--mNumPending == 0) {
+                mDoneCv.notify_one();
+            }
+        }
+    }
+
+    std::thread mThreads[kMaxBands - 1];
+    std::mutex mRunMtx;  // held by the caller for the whole frame
+    std::mutex mMtx;
+    std::condition_variable mWorkCv;
+    std::condition_variable mDoneCv;
+    const std::function<bool(size_t)>* mBand = nullptr;
+    uint64_t mGeneration = 0;
+    size_t mNumWorkerBands = 0;
+    size_t mNumPending = 0;
+    bool mResult = true;
+    bool mExiting = false;
+};
+
+}  // namespace
+
+bool rgba2yuv(const size_t width, const size_t height,
+              const uint32_t* rgba, const android_ycbcr& ycbcr) {
+    if ((width & 1) || (height & 1)) {
+        return FAILURE(false);
+    }
+
+    const size_t nBands = std::min({kMaxBands,
+                                    cpu_budget::getThreadsPerCamera(),
+                                    std::max(size_t(1), (width * height) / kMinBandArea)});
+    if (nBands <= 1) {
+        return rgba2yuvImpl(width, height, rgba, ycbcr);
+    }
+
+    // The image is split into horizontal bands (with even heights), each band
+    // is converted on its own thread, the last one on the calling thread.
+    const size_t bandHeight = (((height + nBands - 1) / nBands) + 1) & ~size_t(1);
+    const size_t nNonEmptyBands = (height + bandHeight - 1) / bandHeight;
+    const auto band = [width, height, bandHeight, rgba, &ycbcr](const size_t i) {
+        const size_t row = i * bandHeight;
+        return rgba2yuvImpl(width, std::min(bandHeight, height - row),
+                            rgba + row * width, ycbcrSkipRows(ycbcr, row));
+    };
+
+    bool result;
+    if (BandWorkers::get().tryRun(nNonEmptyBands, band, &result)) {
+        return result;
+    } else {
+        return rgba2yuvImpl(width, height, rgba, ycbcr);
+    }
+}
+
+uint32_t rgba2yuvPixel(const uint32_t rgba) {
+    const int32_t r = rgba & 0xFF;
+    const int32_t g = (rgba >> 8) & 0xFF;
+    const int32_t b = (rgba >> 16) & 0xFF;
+
+    int32_t y = RGB2Y(r, g, b);
+    // the Cx math expects a sum of four pixels
+    int32_t cb = RGB2CB(4 * r, 4 * g, 4 * b);
+    int32_t cr = RGB2CR(4 * r, 4 * g, 4 * b);
+    y = CLAMP_SHIFT(y, 0, kY_Clamp, kY_Shift);
+    cb = CLAMP_SHIFT(cb, 0, kCx_Clamp, kCx_Shift);
+    cr = CLAMP_SHIFT(cr, 0, kCx_Clamp, kCx_Shift);
+
+    return uint32_t(y) | (uint32_t(cb) << 8) | (uint32_t(cr) << 16) | (rgba & 0xFF000000U);
+}
+
 }  // namespace conv
 }  // namespace implementation
 }  // namespace provider
@@ -29,6 +29,9 @@ namespace conv {
 bool rgba2yuv(size_t width, size_t height,
               const uint32_t* rgba, const android_ycbcr& ycbcr);
 
+// packed {R, G, B, A} into packed {Y, Cb, Cr, A}, same math as `rgba2yuv`
+uint32_t rgba2yuvPixel(uint32_t rgba);
+
 }  // namespace conv
 }  // namespace implementation
 }  // namespace provider
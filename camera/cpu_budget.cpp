@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <log/log.h>
+
+#include "cpu_budget.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace cpu_budget {
+namespace {
+std::atomic<size_t> gNumCameras = 0;
+}  // namespace
+
+void addCamera() {
+    gNumCameras.fetch_add(1, std::memory_order_relaxed);
+}
+
+void removeCamera() {
+    LOG_ALWAYS_FATAL_IF(gNumCameras.fetch_sub(1, std::memory_order_relaxed) == 0);
+}
+
+size_t getThreadsPerCamera() {
+    static const size_t numCpus = std::max(1U, std::thread::hardware_concurrency());
+    const size_t numCameras = std::max(size_t(1), gNumCameras.load(std::memory_order_relaxed));
+    return std::max(size_t(1), numCpus / numCameras);
+}
+
+}  // namespace cpu_budget
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -14,9 +14,13 @@
  * limitations under the License.
  */
 
+
 #define FAILURE_DEBUG_PREFIX "exif"
 
-#include <vector>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <tuple>
 
 #if defined(__LP64__)
 #include <time.h>
@@ -29,6 +33,7 @@ using Timestamp = time64_t;
 #endif
 
 #include <math.h>
+#include <string.h>
 
 #include <android-base/properties.h>
 #include <system/camera_metadata.h>
@@ -44,89 +49,121 @@ namespace implementation {
 namespace exif {
 namespace {
 
-struct ExifMemDeleter {
-    void operator()(ExifMem* allocator) const {
-        exif_mem_unref(allocator);
+// The payload starts with "Exif\0\0", TIFF offsets are counted from the
+// TIFF header which follows it. The byte order is Intel (little endian).
+constexpr uint32_t kTiffHeaderOffset = 6;
+constexpr size_t kMaxPayloadSize = 65533;  // a JPEG segment is up to 64K
+
+// IFD0 has the GPS pointer as its last (the largest tag) entry, it is
+// excluded from the entry count if there is no GPS data.
+constexpr uint16_t kIfd0NumEntries = 10;
+
+// Entries of the EXIF IFD which are removed if their metadata is absent
+constexpr uint16_t kExifIfdExposureTimeIndex = 0;
+constexpr uint16_t kExifIfdFNumberIndex = 1;
+constexpr uint16_t kExifIfdIsoIndex = 2;
+constexpr uint16_t kExifIfdFlashIndex = 7;
+constexpr uint16_t kExifIfdFocalLengthIndex = 8;
+constexpr uint16_t kExifIfdWhiteBalanceIndex = 16;
+
+constexpr uint16_t kTypeByte = 1;
+constexpr uint16_t kTypeAscii = 2;
+constexpr uint16_t kTypeShort = 3;
+constexpr uint16_t kTypeLong = 4;
+constexpr uint16_t kTypeRational = 5;
+constexpr uint16_t kTypeUndefined = 7;
+
+constexpr size_t kDateTimeSize = 20;  // "YYYY:MM:DD HH:MM:SS\0"
+
+size_t getTypeSize(const uint16_t type) {
+    switch (type) {
+    case kTypeShort:    return 2;
+    case kTypeLong:     return 4;
+    case kTypeRational: return 8;
+    default:            return 1;
     }
-};
-
-typedef std::unique_ptr<ExifMem, ExifMemDeleter> ExifMemPtr;
-
-ExifEntry* allocateEntry(ExifMem* mem, const ExifTag tag, const ExifFormat format,
-                         const size_t numComponents) {
-    ExifEntry* e = exif_entry_new_mem(mem);
-    const size_t size = numComponents * exif_format_get_size(format);
-    e->data = static_cast<unsigned char*>(exif_mem_alloc(mem, size));
-    e->size = size;
-    e->tag = tag;
-    e->components = numComponents;
-    e->format = format;
-    return e;
 }
 
-void appendEntry(ExifData* edata, ExifMem* mem,
-                 const ExifIfd ifd, const ExifTag tag) {
-    ExifEntry* e = exif_entry_new_mem(mem);
-    exif_entry_initialize(e, tag);
-    exif_content_add_entry(edata->ifd[ifd], e);
-    exif_entry_unref(e);
+void put16(uint8_t* p, const uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
 }
 
-void appendEntryU8(ExifData* edata, ExifMem* mem,
-                    const ExifIfd ifd, const ExifTag tag,
-                    const uint8_t value) {
-    ExifEntry* e = allocateEntry(mem, tag, EXIF_FORMAT_BYTE, 1);
-    *e->data = value;
-    exif_content_add_entry(edata->ifd[ifd], e);
-    exif_entry_unref(e);
+void put32(uint8_t* p, const uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
 }
 
-void appendEntryU16(ExifData* edata, ExifMem* mem,
-                    const ExifIfd ifd, const ExifTag tag,
-                    const uint16_t value) {
-    ExifEntry* e = allocateEntry(mem, tag, EXIF_FORMAT_SHORT, 1);
-    exif_set_short(e->data, exif_data_get_byte_order(edata), value);
-    exif_content_add_entry(edata->ifd[ifd], e);
-    exif_entry_unref(e);
+void putRational(uint8_t* p, const uint32_t num, const uint32_t den) {
+    put32(p, num);
+    put32(p + 4, den);
 }
 
-void appendEntryU32(ExifData* edata, ExifMem* mem,
-                    const ExifIfd ifd, const ExifTag tag,
-                    const uint32_t value) {
-    ExifEntry* e = allocateEntry(mem, tag, EXIF_FORMAT_LONG, 1);
-    exif_set_long(e->data, exif_data_get_byte_order(edata), value);
-    exif_content_add_entry(edata->ifd[ifd], e);
-    exif_entry_unref(e);
-}
+struct Entry {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    const void* value;      // in the EXIF byte order, nullptr leaves zeros
+    uint32_t* valueOffset;  // receives where the value is in the payload
+};
 
-void appendEntryR32(ExifData* edata, ExifMem* mem,
-                    const ExifIfd ifd, const ExifTag tag,
-                    const ExifRational* src, size_t n) {
-    ExifEntry* e = allocateEntry(mem, tag, EXIF_FORMAT_RATIONAL, n);
+// Appends an IFD followed by its values to `out`, returns the offset of the
+// "next IFD" field (left zero).
+uint32_t appendIfd(std::vector<uint8_t>* out, const Entry* entries, const size_t n) {
+    const size_t ifdOffset = out->size();
+    const size_t ifdSize = 2 + 12 * n + 4;
+    size_t valuesSize = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const size_t size = entries[i].count * getTypeSize(entries[i].type);
+        if (size > 4) {
+            valuesSize += (size + 1) & ~size_t(1);  // values start at even offsets
+        }
+    }
+
+    out->resize(ifdOffset + ifdSize + valuesSize);
+    uint8_t* const base = out->data();
+    uint8_t* e = base + ifdOffset + 2;
+    size_t nextValueOffset = ifdOffset + ifdSize;
+
+    put16(base + ifdOffset, n);
+    for (size_t i = 0; i < n; ++i, e += 12) {
+        const Entry& entry = entries[i];
+        const size_t size = entry.count * getTypeSize(entry.type);
+        size_t valueOffset;
+
+        put16(e, entry.tag);
+        put16(e + 2, entry.type);
+        put32(e + 4, entry.count);
+        if (size > 4) {
+            valueOffset = nextValueOffset;
+            nextValueOffset += (size + 1) & ~size_t(1);
+            put32(e + 8, valueOffset - kTiffHeaderOffset);
+        } else {
+            valueOffset = e + 8 - base;
+        }
 
-    for (uint8_t* dst = e->data; n > 0; --n, ++src, dst += sizeof(ExifRational)) {
-        exif_set_rational(dst, exif_data_get_byte_order(edata), *src);
+        if (entry.value) {
+            memcpy(base + valueOffset, entry.value, size);
+        }
+        if (entry.valueOffset) {
+            *entry.valueOffset = valueOffset;
+        }
     }
 
-    exif_content_add_entry(edata->ifd[ifd], e);
-    exif_entry_unref(e);
+    return ifdOffset + 2 + 12 * n;
 }
 
-void appendEntryR32(ExifData* edata, ExifMem* mem,
-                    const ExifIfd ifd, const ExifTag tag,
-                    const uint32_t num, const uint32_t dem) {
-    const ExifRational value = { num, dem };
-    appendEntryR32(edata, mem, ifd, tag, &value, 1);
-}
+// The entries after `i` and the "next IFD" field move up, the IFD ends 12
+// bytes earlier. Values outside of the IFD stay where they are.
+void removeIfdEntry(uint8_t* const ifd, const size_t i) {
+    const size_t n = ifd[0] | (ifd[1] << 8);
+    uint8_t* const e = ifd + 2 + 12 * i;
 
-void appendEntryS(ExifData* edata, ExifMem* mem,
-                  const ExifIfd ifd, const ExifTag tag,
-                  const char* value, const size_t size,
-                  const ExifFormat format) {
-    ExifEntry* e = allocateEntry(mem, tag, format, size);
-    memcpy(e->data, value, size);
-    exif_content_add_entry(edata->ifd[ifd], e);
-    exif_entry_unref(e);
+    memmove(e, e + 12, 12 * (n - 1 - i) + 4);
+    memset(ifd + 2 + 12 * (n - 1) + 4, 0, 12);
+    put16(ifd, n - 1);
 }
 
 std::tuple<uint32_t, uint32_t, uint32_t> convertDegToDegMmSs(double v) {
@@ -145,32 +182,174 @@ struct tm convertT64ToTm(const int64_t t) {
     return result;
 }
 
+void putDegMmSs(uint8_t* p, const double v) {
+    const auto [ideg, minutes, secondsM] = convertDegToDegMmSs(fabs(v));
+    putRational(p, ideg, 1);
+    putRational(p + 8, minutes, 1);
+    putRational(p + 16, secondsM, 1000000);
+}
+
+// `coordinates` are {latitude, longitude, altitude}
+void appendGpsIfd(std::vector<uint8_t>* out, const double* coordinates,
+                  const camera_metadata_t* rawMetadata) {
+    static const uint8_t kGpsVersion[] = {2, 2, 0, 0};
+
+    uint8_t latitude[24];
+    uint8_t longitude[24];
+    uint8_t altitude[8];
+    uint8_t hhmmss[24];
+    char yyyymmdd[12];
+
+    putDegMmSs(latitude, coordinates[0]);
+    putDegMmSs(longitude, coordinates[1]);
+    putRational(altitude, static_cast<uint32_t>(fabs(coordinates[2]) * 1000.0), 1000);
+    const uint8_t altitudeRef = (coordinates[2] < 0.0) ? 1 : 0;
+
+    Entry entries[10];
+    size_t n = 0;
+
+    entries[n++] = {0x0000, kTypeByte, 4, kGpsVersion, nullptr};  // GPSVersionID
+    entries[n++] = {0x0001, kTypeAscii, 2,
+                    (coordinates[0] < 0.0) ? "S" : "N", nullptr};  // GPSLatitudeRef
+    entries[n++] = {0x0002, kTypeRational, 3, latitude, nullptr};  // GPSLatitude
+    entries[n++] = {0x0003, kTypeAscii, 2,
+                    (coordinates[1] < 0.0) ? "W" : "E", nullptr};  // GPSLongitudeRef
+    entries[n++] = {0x0004, kTypeRational, 3, longitude, nullptr};  // GPSLongitude
+    entries[n++] = {0x0005, kTypeByte, 1, &altitudeRef, nullptr};  // GPSAltitudeRef
+    entries[n++] = {0x0006, kTypeRational, 1, altitude, nullptr};  // GPSAltitude
+
+    camera_metadata_ro_entry_t timestampEntry;
+    const bool hasTimestamp = !find_camera_metadata_ro_entry(
+        rawMetadata, ANDROID_JPEG_GPS_TIMESTAMP, &timestampEntry);
+    if (hasTimestamp) {
+        const struct tm gpsTime = convertT64ToTm(timestampEntry.data.i64[0]);
+        putRational(hhmmss, gpsTime.tm_hour, 1);
+        putRational(hhmmss + 8, gpsTime.tm_min, 1);
+        putRational(hhmmss + 16, gpsTime.tm_sec, 1);
+        snprintf(yyyymmdd, sizeof(yyyymmdd), "%04d:%02d:%02d",
+                 gpsTime.tm_year + 1900, gpsTime.tm_mon + 1, gpsTime.tm_mday);
+
+        entries[n++] = {0x0007, kTypeRational, 3, hhmmss, nullptr};  // GPSTimeStamp
+    }
+
+    // EXIF_FORMAT_UNDEFINED requires this prefix
+    static const uint8_t kAsciiPrefix[] = {0x41, 0x53, 0x43, 0x49, 0x49, 0x00, 0x00, 0x00};
+    camera_metadata_ro_entry_t methodEntry;
+    uint32_t methodOffset = 0;
+    const bool hasMethod = !find_camera_metadata_ro_entry(
+        rawMetadata, ANDROID_JPEG_GPS_PROCESSING_METHOD, &methodEntry);
+    if (hasMethod) {
+        entries[n++] = {0x001B, kTypeUndefined,
+                        uint32_t(sizeof(kAsciiPrefix) + methodEntry.count),
+                        nullptr, &methodOffset};  // GPSProcessingMethod
+    }
+
+    if (hasTimestamp) {
+        entries[n++] = {0x001D, kTypeAscii, 11, yyyymmdd, nullptr};  // GPSDateStamp
+    }
+
+    appendIfd(out, entries, n);
+
+    if (hasMethod) {
+        uint8_t* const method = out->data() + methodOffset;
+        memcpy(method, kAsciiPrefix, sizeof(kAsciiPrefix));
+        memcpy(method + sizeof(kAsciiPrefix), methodEntry.data.u8, methodEntry.count);
+    }
+}
+
 }  // namespace
 
-ExifDataPtr createExifData(const CameraMetadata& metadata,
-                           const Rect<uint16_t> size) {
+ExifTemplate::ExifTemplate(const Rect<uint16_t> imageSize)
+        : mImageSize(imageSize) {
+    static const uint8_t kHeader[] = {
+        'E', 'x', 'i', 'f', 0, 0,
+        'I', 'I', 42, 0, 8, 0, 0, 0,  // TIFF, IFD0 follows
+    };
+    static const uint8_t kExifVersion[] = {'0', '2', '2', '0'};
+    static const uint8_t kComponentsConfiguration[] = {1, 2, 3, 0};  // YCbCr
+    static const uint8_t kFlashpixVersion[] = {'0', '1', '0', '0'};
+    static const char kSubSecTime[] = "000";
+
+    const std::string make = base::GetProperty("ro.product.manufacturer", "");
+    const std::string model = base::GetProperty("ro.product.model", "");
+
+    uint8_t resolution[8];
+    putRational(resolution, 72, 1);
+    uint8_t inch[2];
+    put16(inch, 2);
+    uint8_t centered[2];
+    put16(centered, 1);
+    uint8_t sRGB[2];
+    put16(sRGB, 1);
+    uint8_t width[4];
+    put32(width, imageSize.width);
+    uint8_t height[4];
+    put32(height, imageSize.height);
+
+    mTemplate.assign(std::begin(kHeader), std::end(kHeader));
+
+    uint32_t exifPointerOffset;
+    const Entry ifd0[] = {
+        {0x010F, kTypeAscii, uint32_t(make.size() + 1), make.c_str(), nullptr},  // Make
+        {0x0110, kTypeAscii, uint32_t(model.size() + 1), model.c_str(), nullptr},  // Model
+        {0x0112, kTypeShort, 1, nullptr, &mOrientationOffset},  // Orientation
+        {0x011A, kTypeRational, 1, resolution, nullptr},  // XResolution
+        {0x011B, kTypeRational, 1, resolution, nullptr},  // YResolution
+        {0x0128, kTypeShort, 1, inch, nullptr},  // ResolutionUnit
+        {0x0132, kTypeAscii, kDateTimeSize, nullptr, &mDateTimeOffset},  // DateTime
+        {0x0213, kTypeShort, 1, centered, nullptr},  // YCbCrPositioning
+        {0x8769, kTypeLong, 1, nullptr, &exifPointerOffset},  // ExifIfdPointer
+        {0x8825, kTypeLong, 1, nullptr, &mIfd0GpsPointerOffset},  // GPSInfoIfdPointer
+    };
+    static_assert((sizeof(ifd0) / sizeof(ifd0[0])) == kIfd0NumEntries);
+
+    mIfd0Offset = mTemplate.size();
+    appendIfd(&mTemplate, ifd0, kIfd0NumEntries);
+
+    mExifIfdOffset = mTemplate.size();
+    put32(&mTemplate[exifPointerOffset], mExifIfdOffset - kTiffHeaderOffset);
+    const Entry exifIfd[] = {
+        {0x829A, kTypeRational, 1, nullptr, &mExposureTimeOffset},  // ExposureTime
+        {0x829D, kTypeRational, 1, nullptr, &mFNumberOffset},  // FNumber
+        {0x8827, kTypeShort, 1, nullptr, &mIsoOffset},  // ISOSpeedRatings
+        {0x9000, kTypeUndefined, 4, kExifVersion, nullptr},  // ExifVersion
+        {0x9003, kTypeAscii, kDateTimeSize, nullptr, &mDateTimeOriginalOffset},  // DateTimeOriginal
+        {0x9004, kTypeAscii, kDateTimeSize, nullptr, &mDateTimeDigitizedOffset},  // DateTimeDigitized
+        {0x9101, kTypeUndefined, 4, kComponentsConfiguration, nullptr},  // ComponentsConfiguration
+        {0x9209, kTypeShort, 1, nullptr, &mFlashOffset},  // Flash
+        {0x920A, kTypeRational, 1, nullptr, &mFocalLengthOffset},  // FocalLength
+        {0x9290, kTypeAscii, sizeof(kSubSecTime), kSubSecTime, nullptr},  // SubSecTime
+        {0x9291, kTypeAscii, sizeof(kSubSecTime), kSubSecTime, nullptr},  // SubSecTimeOriginal
+        {0x9292, kTypeAscii, sizeof(kSubSecTime), kSubSecTime, nullptr},  // SubSecTimeDigitized
+        {0xA000, kTypeUndefined, 4, kFlashpixVersion, nullptr},  // FlashpixVersion
+        {0xA001, kTypeShort, 1, sRGB, nullptr},  // ColorSpace
+        {0xA002, kTypeLong, 1, width, nullptr},  // PixelXDimension
+        {0xA003, kTypeLong, 1, height, nullptr},  // PixelYDimension
+        {0xA403, kTypeShort, 1, nullptr, &mWhiteBalanceOffset},  // WhiteBalance
+    };
+    static_assert(kExifIfdExposureTimeIndex < kExifIfdFNumberIndex);
+    static_assert(kExifIfdFNumberIndex < kExifIfdIsoIndex);
+    static_assert(kExifIfdIsoIndex < kExifIfdFlashIndex);
+    static_assert(kExifIfdFlashIndex < kExifIfdFocalLengthIndex);
+    static_assert(kExifIfdFocalLengthIndex < kExifIfdWhiteBalanceIndex);
+    LOG_ALWAYS_FATAL_IF(exifIfd[kExifIfdExposureTimeIndex].tag != 0x829A);
+    LOG_ALWAYS_FATAL_IF(exifIfd[kExifIfdFNumberIndex].tag != 0x829D);
+    LOG_ALWAYS_FATAL_IF(exifIfd[kExifIfdIsoIndex].tag != 0x8827);
+    LOG_ALWAYS_FATAL_IF(exifIfd[kExifIfdFlashIndex].tag != 0x9209);
+    LOG_ALWAYS_FATAL_IF(exifIfd[kExifIfdFocalLengthIndex].tag != 0x920A);
+    LOG_ALWAYS_FATAL_IF(exifIfd[kExifIfdWhiteBalanceIndex].tag != 0xA403);
+    appendIfd(&mTemplate, exifIfd, sizeof(exifIfd) / sizeof(exifIfd[0]));
+}
+
+bool ExifTemplate::serialize(const CameraMetadata& metadata,
+                             const void* const thumbnail, const size_t thumbnailSize,
+                             std::vector<uint8_t>* const app1) const {
     const camera_metadata_t* const rawMetadata =
         reinterpret_cast<const camera_metadata_t*>(metadata.metadata.data());
     camera_metadata_ro_entry_t metadataEntry;
 
-    ExifMemPtr allocator(exif_mem_new_default());
-    ExifDataPtr exifData(exif_data_new_mem(allocator.get()));
-
-    exif_data_set_option(exifData.get(), EXIF_DATA_OPTION_FOLLOW_SPECIFICATION);
-    exif_data_set_data_type(exifData.get(), EXIF_DATA_TYPE_COMPRESSED);
-    exif_data_set_byte_order(exifData.get(), EXIF_BYTE_ORDER_INTEL);
-    exif_data_fix(exifData.get());
-
-    {
-        const std::string v = base::GetProperty("ro.product.manufacturer", "");
-        appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_0, EXIF_TAG_MAKE,
-                     v.c_str(), v.size() + 1, EXIF_FORMAT_ASCII);
-    }
-    {
-        const std::string v = base::GetProperty("ro.product.model", "");
-        appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_0, EXIF_TAG_MODEL,
-                     v.c_str(), v.size() + 1, EXIF_FORMAT_ASCII);
-    }
+    app1->assign(mTemplate.begin(), mTemplate.end());
+    uint8_t* const p = app1->data();
 
     {
         struct tm now;
@@ -179,75 +358,52 @@ ExifDataPtr createExifData(const CameraMetadata& metadata,
             localtime_r(&t, &now);
         }
 
-        char timeStr[20];
-        const int len = snprintf(timeStr, sizeof(timeStr),
-                                 "%04d:%02d:%02d %02d:%02d:%02d",
-                                 now.tm_year + 1900, now.tm_mon + 1, now.tm_mday,
-                                 now.tm_hour, now.tm_min, now.tm_sec) + 1;
-        appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_0,
-                     EXIF_TAG_DATE_TIME, timeStr, len, EXIF_FORMAT_ASCII);
-        appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                     EXIF_TAG_DATE_TIME_ORIGINAL, timeStr, len, EXIF_FORMAT_ASCII);
-        appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                     EXIF_TAG_DATE_TIME_DIGITIZED, timeStr, len, EXIF_FORMAT_ASCII);
-    }
-    {
-        char ddd[4];
-        const int len = snprintf(ddd, sizeof(ddd), "%03d", 0);
-        appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                     EXIF_TAG_SUB_SEC_TIME, ddd, len, EXIF_FORMAT_ASCII);
-        appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                     EXIF_TAG_SUB_SEC_TIME_ORIGINAL, ddd, len, EXIF_FORMAT_ASCII);
-        appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                     EXIF_TAG_SUB_SEC_TIME_DIGITIZED, ddd, len, EXIF_FORMAT_ASCII);
-    }
-
-    if ((size.width > 0) && (size.height > 0)) {
-        appendEntryU32(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                       EXIF_TAG_PIXEL_X_DIMENSION, size.width);
-        appendEntryU32(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                       EXIF_TAG_PIXEL_Y_DIMENSION, size.width);
+        char timeStr[kDateTimeSize];
+        snprintf(timeStr, sizeof(timeStr), "%04d:%02d:%02d %02d:%02d:%02d",
+                 now.tm_year + 1900, now.tm_mon + 1, now.tm_mday,
+                 now.tm_hour, now.tm_min, now.tm_sec);
+        memcpy(p + mDateTimeOffset, timeStr, kDateTimeSize);
+        memcpy(p + mDateTimeOriginalOffset, timeStr, kDateTimeSize);
+        memcpy(p + mDateTimeDigitizedOffset, timeStr, kDateTimeSize);
     }
 
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_ORIENTATION,
-                                       &metadataEntry)) {
-        unsigned v;
-        switch (metadataEntry.data.i32[0]) {
-        default:
-        case 0:     v = 1; break;
-        case 90:    v = 6; break;
-        case 180:   v = 3; break;
-        case 270:   v = 8; break;
+    {
+        unsigned v = 1;
+        if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_ORIENTATION,
+                                           &metadataEntry)) {
+            switch (metadataEntry.data.i32[0]) {
+            default:
+            case 0:     v = 1; break;
+            case 90:    v = 6; break;
+            case 180:   v = 3; break;
+            case 270:   v = 8; break;
+            }
         }
-
-        appendEntryU16(exifData.get(), allocator.get(), EXIF_IFD_0,
-                       EXIF_TAG_ORIENTATION, v);
+        put16(p + mOrientationOffset, v);
     }
 
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_LENS_APERTURE,
-                                       &metadataEntry)) {
-        const float v = metadataEntry.data.f[0];
-        appendEntryR32(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                       EXIF_TAG_FNUMBER, uint32_t(v * 1000U), 1000U);
+    const bool hasFNumber = !find_camera_metadata_ro_entry(
+        rawMetadata, ANDROID_LENS_APERTURE, &metadataEntry);
+    if (hasFNumber) {
+        putRational(p + mFNumberOffset, uint32_t(metadataEntry.data.f[0] * 1000U), 1000U);
     }
 
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_LENS_FOCAL_LENGTH,
-                                       &metadataEntry)) {
-        const float v = metadataEntry.data.f[0];
-        appendEntryR32(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                       EXIF_TAG_FOCAL_LENGTH, uint32_t(v * 1000U), 1000U);
+    const bool hasFocalLength = !find_camera_metadata_ro_entry(
+        rawMetadata, ANDROID_LENS_FOCAL_LENGTH, &metadataEntry);
+    if (hasFocalLength) {
+        putRational(p + mFocalLengthOffset, uint32_t(metadataEntry.data.f[0] * 1000U), 1000U);
     }
 
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_FLASH_MODE,
-                                       &metadataEntry)) {
-        const unsigned v =
-            (metadataEntry.data.i32[0] == ANDROID_FLASH_MODE_OFF) ? 0 : 1;
-        appendEntryU16(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                       EXIF_TAG_FLASH, v);
+    const bool hasFlash = !find_camera_metadata_ro_entry(
+        rawMetadata, ANDROID_FLASH_MODE, &metadataEntry);
+    if (hasFlash) {
+        put16(p + mFlashOffset,
+              (metadataEntry.data.i32[0] == ANDROID_FLASH_MODE_OFF) ? 0 : 1);
     }
 
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_SENSOR_EXPOSURE_TIME,
-                                       &metadataEntry)) {
+    const bool hasExposureTime = !find_camera_metadata_ro_entry(
+        rawMetadata, ANDROID_SENSOR_EXPOSURE_TIME, &metadataEntry);
+    if (hasExposureTime) {
         int64_t num = metadataEntry.data.i64[0];
         uint32_t dem = 1000000000U;
         while (num > std::numeric_limits<uint32_t>::max()) {
@@ -255,122 +411,87 @@ ExifDataPtr createExifData(const CameraMetadata& metadata,
             dem /= 10;
         }
 
-        appendEntryR32(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                       EXIF_TAG_EXPOSURE_TIME, uint32_t(num), dem);
+        putRational(p + mExposureTimeOffset, uint32_t(num), dem);
     }
 
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_SENSOR_SENSITIVITY,
-                                       &metadataEntry)) {
-        appendEntryU16(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                       EXIF_TAG_ISO_SPEED_RATINGS, metadataEntry.data.i32[0]);
+    const bool hasIso = !find_camera_metadata_ro_entry(
+        rawMetadata, ANDROID_SENSOR_SENSITIVITY, &metadataEntry);
+    if (hasIso) {
+        put16(p + mIsoOffset, metadataEntry.data.i32[0]);
     }
 
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_CONTROL_AWB_MODE,
-                                       &metadataEntry)) {
-        const unsigned v =
-            (metadataEntry.data.i32[0] == ANDROID_CONTROL_AWB_MODE_AUTO) ? 0 : 1;
-
-        appendEntryU16(exifData.get(), allocator.get(), EXIF_IFD_EXIF,
-                       EXIF_TAG_WHITE_BALANCE, v);
+    const bool hasWhiteBalance = !find_camera_metadata_ro_entry(
+        rawMetadata, ANDROID_CONTROL_AWB_MODE, &metadataEntry);
+    if (hasWhiteBalance) {
+        put16(p + mWhiteBalanceOffset,
+              (metadataEntry.data.i32[0] == ANDROID_CONTROL_AWB_MODE_AUTO) ? 0 : 1);
     }
 
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_GPS_COORDINATES,
-                                       &metadataEntry)) {
-        {
-            const auto [ideg, minutes, secondsM] = convertDegToDegMmSs(
-                fabs(metadataEntry.data.d[0]));
-            ExifRational degmmss[3] = {{ideg, 1}, {minutes, 1},
-                                       {secondsM, 1000000}};
-            appendEntryR32(exifData.get(), allocator.get(), EXIF_IFD_GPS,
-                           static_cast<ExifTag>(EXIF_TAG_GPS_LATITUDE),
-                           degmmss, 3);
-
-            const char* latRef = (metadataEntry.data.d[0] < 0.0) ? "S" : "N";
-            appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_GPS,
-                         static_cast<ExifTag>(EXIF_TAG_GPS_LATITUDE_REF),
-                         latRef, 2, EXIF_FORMAT_ASCII);
-        }
-        {
-            const auto [ideg, minutes, secondsM] = convertDegToDegMmSs(
-                fabs(metadataEntry.data.d[1]));
-            ExifRational degmmss[3] = {{ideg, 1}, {minutes, 1},
-                                       {secondsM, 1000000}};
-            appendEntryR32(exifData.get(), allocator.get(), EXIF_IFD_GPS,
-                           static_cast<ExifTag>(EXIF_TAG_GPS_LONGITUDE),
-                           degmmss, 3);
-
-            const char* latRef = (metadataEntry.data.d[1] < 0.0) ? "W" : "E";
-            appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_GPS,
-                         static_cast<ExifTag>(EXIF_TAG_GPS_LONGITUDE_REF),
-                         latRef, 2, EXIF_FORMAT_ASCII);
-        }
-        {
-            appendEntryR32(exifData.get(), allocator.get(), EXIF_IFD_GPS,
-                           static_cast<ExifTag>(EXIF_TAG_GPS_ALTITUDE),
-                           static_cast<uint32_t>(fabs(metadataEntry.data.d[2]) * 1000.0),
-                           1000);
-            appendEntryU8(exifData.get(), allocator.get(), EXIF_IFD_GPS,
-                          static_cast<ExifTag>(EXIF_TAG_GPS_ALTITUDE_REF),
-                          (metadataEntry.data.d[2] < 0.0) ? 1 : 0);
-        }
+    // Inline values move with their entries, remove after all values are
+    // written, the largest index first to keep the others valid.
+    if (!hasWhiteBalance) {
+        removeIfdEntry(p + mExifIfdOffset, kExifIfdWhiteBalanceIndex);
     }
-
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_GPS_TIMESTAMP,
-                                       &metadataEntry)) {
-        struct tm gpsTime = convertT64ToTm(metadataEntry.data.i64[0]);
-
-        {
-            char yyyymmdd[12];
-            const int len = snprintf(yyyymmdd, sizeof(yyyymmdd), "%04d:%02d:%02d",
-                                     gpsTime.tm_year + 1900, gpsTime.tm_mon + 1,
-                                     gpsTime.tm_mday) + 1;
-            appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_GPS,
-                         static_cast<ExifTag>(EXIF_TAG_GPS_DATE_STAMP),
-                         yyyymmdd, len, EXIF_FORMAT_ASCII);
-        }
-        {
-            ExifRational hhmmss[3] = {{static_cast<ExifLong>(gpsTime.tm_hour), 1},
-                                      {static_cast<ExifLong>(gpsTime.tm_min), 1},
-                                      {static_cast<ExifLong>(gpsTime.tm_sec), 1}};
-            appendEntryR32(exifData.get(), allocator.get(), EXIF_IFD_GPS,
-                           static_cast<ExifTag>(EXIF_TAG_GPS_TIME_STAMP),
-                           hhmmss, 3);
-        }
+    if (!hasFocalLength) {
+        removeIfdEntry(p + mExifIfdOffset, kExifIfdFocalLengthIndex);
+    }
+    if (!hasFlash) {
+        removeIfdEntry(p + mExifIfdOffset, kExifIfdFlashIndex);
+    }
+    if (!hasIso) {
+        removeIfdEntry(p + mExifIfdOffset, kExifIfdIsoIndex);
+    }
+    if (!hasFNumber) {
+        removeIfdEntry(p + mExifIfdOffset, kExifIfdFNumberIndex);
+    }
+    if (!hasExposureTime) {
+        removeIfdEntry(p + mExifIfdOffset, kExifIfdExposureTimeIndex);
     }
 
-    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_GPS_PROCESSING_METHOD,
+    // `p` is not valid after appending below
+    uint32_t nextIfdOffset;
+    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_GPS_COORDINATES,
                                        &metadataEntry)) {
-        // EXIF_FORMAT_UNDEFINED requires this prefix
-        std::vector<char> value = {0x41, 0x53, 0x43, 0x49, 0x49, 0x00, 0x00, 0x00};
-        value.insert(value.end(),
-                     reinterpret_cast<const char*>(metadataEntry.data.u8),
-                     reinterpret_cast<const char*>(metadataEntry.data.u8) + metadataEntry.count);
-
-        appendEntryS(exifData.get(), allocator.get(), EXIF_IFD_GPS,
-                     static_cast<ExifTag>(EXIF_TAG_GPS_PROCESSING_METHOD),
-                     value.data(), value.size(), EXIF_FORMAT_UNDEFINED);
+        nextIfdOffset = mIfd0Offset + 2 + 12 * kIfd0NumEntries;
+        put32(p + mIfd0GpsPointerOffset, app1->size() - kTiffHeaderOffset);
+        appendGpsIfd(app1, metadataEntry.data.d, rawMetadata);
+    } else {
+        nextIfdOffset = mIfd0Offset + 2 + 12 * (kIfd0NumEntries - 1);
+        put16(p + mIfd0Offset, kIfd0NumEntries - 1);
+        put32(p + nextIfdOffset, 0);
     }
 
-    return exifData;
-}
-
-void* exifDataAllocThumbnail(ExifData* const edata, const size_t size) {
-    // WARNING: maloc and free must match the functions that are used in
-    // exif_mem_new_default (see above) to manage memory. They will be used in
-    // exif_data_free to deallocate memory allocated here.
-    void* mem = malloc(size);
-    if (mem) {
-        if (edata->data) {
-            free(edata->data);
-        }
-        edata->size = size;
-        edata->data = static_cast<uint8_t*>(mem);
+    if (thumbnail) {
+        uint8_t resolution[8];
+        putRational(resolution, 72, 1);
+        uint8_t inch[2];
+        put16(inch, 2);
+        uint8_t jpegCompression[2];
+        put16(jpegCompression, 6);
+        uint8_t length[4];
+        put32(length, thumbnailSize);
+
+        uint32_t thumbnailPointerOffset;
+        const Entry ifd1[] = {
+            {0x0103, kTypeShort, 1, jpegCompression, nullptr},  // Compression
+            {0x011A, kTypeRational, 1, resolution, nullptr},  // XResolution
+            {0x011B, kTypeRational, 1, resolution, nullptr},  // YResolution
+            {0x0128, kTypeShort, 1, inch, nullptr},  // ResolutionUnit
+            {0x0201, kTypeLong, 1, nullptr, &thumbnailPointerOffset},  // JPEGInterchangeFormat
+            {0x0202, kTypeLong, 1, length, nullptr},  // JPEGInterchangeFormatLength
+        };
+
+        put32(app1->data() + nextIfdOffset, app1->size() - kTiffHeaderOffset);
+        appendIfd(app1, ifd1, sizeof(ifd1) / sizeof(ifd1[0]));
+
+        const size_t thumbnailOffset = app1->size();
+        app1->resize(thumbnailOffset + thumbnailSize);
+        memcpy(app1->data() + thumbnailOffset, thumbnail, thumbnailSize);
+        put32(app1->data() + thumbnailPointerOffset, thumbnailOffset - kTiffHeaderOffset);
     }
-    return mem;
-}
 
-void ExifDataDeleter::operator()(ExifData* p) const {
-    exif_data_free(p);
+    return (app1->size() <= kMaxPayloadSize) ? true :
+        FAILURE_V(false, "the payload is too large, size=%zu", app1->size());
 }
 
 }  // namespace exif
@@ -16,9 +16,9 @@
 
 #pragma once
 
-#include <memory>
+#include <vector>
+#include <stdint.h>
 #include <aidl/android/hardware/camera/device/CameraMetadata.h>
-#include <libexif/exif-data.h>
 
 #include "Rect.h"
 
@@ -31,11 +31,37 @@ namespace exif {
 
 using aidl::android::hardware::camera::device::CameraMetadata;
 
-struct ExifDataDeleter { void operator()(ExifData*) const; };
-typedef std::unique_ptr<ExifData, ExifDataDeleter> ExifDataPtr;
+// The EXIF (APP1) payload for images of one size serialized once, per capture
+// only the values which depend on metadata are written into fixed slots. GPS
+// and the thumbnail (IFD1) are appended at the end when present.
+struct ExifTemplate {
+    explicit ExifTemplate(Rect<uint16_t> imageSize);
 
-ExifDataPtr createExifData(const CameraMetadata&, Rect<uint16_t> size);
-void* exifDataAllocThumbnail(ExifData* edata, size_t size);
+    Rect<uint16_t> getImageSize() const { return mImageSize; }
+
+    // Writes the payload for `jpeg_write_marker(JPEG_APP0 + 1, ...)` into
+    // `app1` (reuses its memory), `thumbnail` is a JPEG image or nullptr.
+    bool serialize(const CameraMetadata& metadata,
+                   const void* thumbnail, size_t thumbnailSize,
+                   std::vector<uint8_t>* app1) const;
+
+private:
+    std::vector<uint8_t> mTemplate;
+    Rect<uint16_t> mImageSize;
+    uint32_t mIfd0Offset;  // the offsets below are in `mTemplate`
+    uint32_t mIfd0GpsPointerOffset;
+    uint32_t mExifIfdOffset;
+    uint32_t mOrientationOffset;
+    uint32_t mDateTimeOffset;
+    uint32_t mExposureTimeOffset;
+    uint32_t mFNumberOffset;
+    uint32_t mIsoOffset;
+    uint32_t mDateTimeOriginalOffset;
+    uint32_t mDateTimeDigitizedOffset;
+    uint32_t mFlashOffset;
+    uint32_t mFocalLengthOffset;
+    uint32_t mWhiteBalanceOffset;
+};
 
 }  // namespace exif
 }  // namespace implementation
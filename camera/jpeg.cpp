@@ -18,15 +18,25 @@
 
 #include <inttypes.h>
 #include <setjmp.h>
+#include <stdlib.h>
 #include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <vector>
 
 extern "C" {
 #include <jpeglib.h>
 }
+#include <android-base/properties.h>
 #include <libyuv/scale.h>
+#include <libyuv/scale_uv.h>
 #include <system/camera_metadata.h>
 
+#include "cpu_budget.h"
 #include "debug.h"
 #include "exif.h"
 #include "jpeg.h"
@@ -41,11 +51,26 @@ namespace jpeg {
 namespace {
 constexpr int kJpegMCUSize = 16;  // we have to feed `jpeg_write_raw_data` in multiples of this
 
-// compressYUVImplPixelsFast handles the case where the image width is a multiple
-// of kJpegMCUSize. In this case no additional memcpy is required. See
-// compressYUVImplPixelsSlow below for the cases where the image width is not
-// a multiple of kJpegMCUSize.
-bool compressYUVImplPixelsFast(const android_ycbcr& image, jpeg_compress_struct* cinfo) {
+bool isAborted(const std::atomic<bool>* abort) {
+    return abort && abort->load(std::memory_order_relaxed);
+}
+
+void copyChromaRow(uint8_t* dst, const uint8_t* src, int width, const size_t step) {
+    if (step == 1) {
+        memcpy(dst, src, width);
+    } else {
+        for (; width > 0; --width, ++dst, src += step) {
+            *dst = *src;
+        }
+    }
+}
+
+// compressYUVImplPixelsFast handles the case where the image is planar
+// (chroma_step is 1) and its width is a multiple of kJpegMCUSize. In this case
+// libjpeg reads the image in place. See compressYUVImplPixelsStaged below for
+// the other cases.
+bool compressYUVImplPixelsFast(const android_ycbcr& image, jpeg_compress_struct* cinfo,
+                               const std::atomic<bool>* abort) {
     const uint8_t* y[kJpegMCUSize];
     const uint8_t* cb[kJpegMCUSize / 2];
     const uint8_t* cr[kJpegMCUSize / 2];
@@ -59,6 +84,8 @@ bool compressYUVImplPixelsFast(const android_ycbcr& image, jpeg_compress_struct*
         const int nscl = cinfo->next_scanline;
         if (nscl >= height) {
             break;
+        } else if (isAborted(abort)) {
+            return false;
         }
 
         for (int i = 0; i < kJpegMCUSize; ++i) {
@@ -81,22 +108,25 @@ bool compressYUVImplPixelsFast(const android_ycbcr& image, jpeg_compress_struct*
 
 // Since JPEG processes everything in blocks of kJpegMCUSize, we have to make
 // both width and height a multiple of kJpegMCUSize. The height is handled by
-// repeating the last line. compressYUVImplPixelsSlow handles the case when the
-// image width is not a multiple of kJpegMCUSize by allocating a memory block
-// large enough to hold kJpegMCUSize rows of the image with width aligned up to
-// the next multiple of kJpegMCUSize. The original image has to be copied
-// chunk-by-chunk into this memory block.
-bool compressYUVImplPixelsSlow(const android_ycbcr& image, jpeg_compress_struct* cinfo,
-                               const size_t alignedWidth, uint8_t* const alignedMemory) {
+// repeating the last line. compressYUVImplPixelsStaged handles images with
+// the width which is not a multiple of kJpegMCUSize or with interleaved
+// chroma (chroma_step > 1, e.g. NV21 from gralloc) by staging one MCU row at
+// a time in `scratch`: kJpegMCUSize rows of Y with the width aligned up to
+// kJpegMCUSize (only if the width is not aligned, otherwise Y is read in
+// place) and kJpegMCUSize/2 rows of Cb and Cr each, deinterleaved.
+bool compressYUVImplPixelsStaged(const android_ycbcr& image, jpeg_compress_struct* cinfo,
+                                 const size_t alignedWidth, uint8_t* const scratch,
+                                 const std::atomic<bool>* abort) {
+    uint8_t* yScratch[kJpegMCUSize];
     uint8_t* y[kJpegMCUSize];
     uint8_t* cb[kJpegMCUSize / 2];
     uint8_t* cr[kJpegMCUSize / 2];
     uint8_t** planes[] = { y, cb, cr };
 
     {
-        uint8_t* y0 = alignedMemory;
+        uint8_t* y0 = scratch;
         for (int i = 0; i < kJpegMCUSize; ++i, y0 += alignedWidth) {
-            y[i] = y0;
+            yScratch[i] = y0;
         }
 
         const size_t alignedWidth2 = alignedWidth / 2;
@@ -115,20 +145,33 @@ bool compressYUVImplPixelsSlow(const android_ycbcr& image, jpeg_compress_struct*
     const int height1 = height - 1;
     const int ystride = image.ystride;
     const int cstride = image.cstride;
+    const size_t chromaStep = image.chroma_step;
+    const bool stageY = (width % kJpegMCUSize) != 0;
 
     while (true) {
         const int nscl = cinfo->next_scanline;
         if (nscl >= height) {
             break;
+        } else if (isAborted(abort)) {
+            return false;
         }
 
         for (int i = 0; i < kJpegMCUSize; ++i) {
             const int nscli = std::min(nscl + i, height1);
-            memcpy(y[i], static_cast<const uint8_t*>(image.y) + nscli * ystride, width);
+            const uint8_t* const srcY = static_cast<const uint8_t*>(image.y) + nscli * ystride;
+            if (stageY) {
+                memcpy(yScratch[i], srcY, width);
+                y[i] = yScratch[i];
+            } else {
+                y[i] = const_cast<uint8_t*>(srcY);
+            }
+
             if ((i & 1) == 0) {
                 const int offset = (nscli / 2) * cstride;
-                memcpy(cb[i / 2], static_cast<const uint8_t*>(image.cb) + offset, width2);
-                memcpy(cr[i / 2], static_cast<const uint8_t*>(image.cr) + offset, width2);
+                copyChromaRow(cb[i / 2], static_cast<const uint8_t*>(image.cb) + offset,
+                              width2, chromaStep);
+                copyChromaRow(cr[i / 2], static_cast<const uint8_t*>(image.cr) + offset,
+                              width2, chromaStep);
             }
         }
 
@@ -141,10 +184,6 @@ bool compressYUVImplPixelsSlow(const android_ycbcr& image, jpeg_compress_struct*
 }
 
 struct JpegErrorMgr : public jpeg_error_mgr {
-    JpegErrorMgr() {
-        error_exit = &onJpegErrorS;
-    }
-
     void onJpegError(j_common_ptr cinfo) {
         {
             char errorMessage[JMSG_LENGTH_MAX];
@@ -164,80 +203,272 @@ struct JpegErrorMgr : public jpeg_error_mgr {
     jmp_buf jumpBuffer;
 };
 
-bool compressYUVImpl(const android_ycbcr& image, const Rect<uint16_t> imageSize,
-                     unsigned char* const rawExif, const unsigned rawExifSize,
-                     const int quality,
-                     jpeg_destination_mgr* sink) {
-    if (image.chroma_step != 1) {
-        return FAILURE(false);
+// A long lived `jpeg_compress_struct` with its scratch memory. Compression
+// parameters (including quantization and Huffman tables) are rebuilt only
+// if the quality changes.
+struct Compressor {
+    Compressor() = default;
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    ~Compressor() {
+        if (created) {
+            jpeg_destroy_compress(&cinfo);
+        }
     }
 
-    std::vector<uint8_t> alignedMemory;
     jpeg_compress_struct cinfo;
     JpegErrorMgr err;
+    bool created = false;
+    int quality = -1;
+    std::vector<uint8_t> scratch;        // compressYUVImplPixelsStaged
+    std::vector<uint8_t> resized;        // the resized image for thumbnails
+    std::vector<uint8_t> output;         // for VectorSink, never shrinks
+    size_t outputSize = 0;
+};
+
+// Runs thumbnail compressions for its Encoder, the thread is started once
+// and lives as long as the encoder.
+struct ThumbnailWorker {
+    ThumbnailWorker() = default;
+    ThumbnailWorker(const ThumbnailWorker&) = delete;
+    ThumbnailWorker& operator=(const ThumbnailWorker&) = delete;
+
+    ~ThumbnailWorker() {
+        if (thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            jobCv.notify_one();
+            thread.join();
+        }
+    }
+
+    void start(std::function<bool()> j) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!thread.joinable()) {
+                thread = std::thread(&ThumbnailWorker::threadLoop, this);
+            }
+            job = std::move(j);
+            done = false;
+        }
+        jobCv.notify_one();
+    }
+
+    bool wait() {
+        std::unique_lock<std::mutex> lock(mtx);
+        doneCv.wait(lock, [this](){ return done; });
+        return result;
+    }
+
+private:
+    void threadLoop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            jobCv.wait(lock, [this](){ return job || stopping; });
+            if (!job) {
+                break;
+            }
+
+            std::function<bool()> j = std::move(job);
+            job = nullptr;
+            lock.unlock();
+            const bool r = j();
+            lock.lock();
+
+            result = r;
+            done = true;
+            doneCv.notify_one();
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable jobCv;
+    std::condition_variable doneCv;
+    std::function<bool()> job;
+    bool result = false;
+    bool done = false;
+    bool stopping = false;
+    std::thread thread;
+};
+
+// The main image and the thumbnail are compressed concurrently if the CPU
+// budget of the camera allows two threads
+struct Encoder {
+    Compressor main;
+    Compressor thumbnail;
+    ThumbnailWorker thumbnailWorker;
+    std::optional<exif::ExifTemplate> exifTemplate;  // for the last image size
+    std::vector<uint8_t> exif;                       // the APP1 payload
+    Rect<uint16_t> lastThumbnailSize = {0, 0};
+    int lastThumbnailQuality = 0;
+    size_t lastApp1Size = 0;                         // for the above
+};
+
+// One per thread: the session's JPEG thread or an offline session thread.
+Encoder& getThreadEncoder() {
+    thread_local Encoder encoder;
+    return encoder;
+}
+
+// read once, the property is not expected to change while the HAL runs
+std::atomic<bool>& getReuseEncoder() {
+    static std::atomic<bool> reuse(
+        base::GetBoolProperty("vendor.qemu.camera.jpeg.reuse_encoder", true));
+    return reuse;
+}
+
+bool reuseEncoder() {
+    return getReuseEncoder().load(std::memory_order_relaxed);
+}
+
+bool compressYUVImpl(Compressor* const c,
+                     const android_ycbcr& image, const Rect<uint16_t> imageSize,
+                     const uint8_t* const exif, const size_t exifSize,
+                     const int quality,
+                     jpeg_destination_mgr* sink,
+                     const std::atomic<bool>* abort) {
+    if (!image.chroma_step) {
+        return FAILURE(false);
+    }
+
+    jpeg_compress_struct& cinfo = c->cinfo;
     bool result;
 
-    cinfo.err = jpeg_std_error(&err);
-    jpeg_create_compress(&cinfo);
-    cinfo.image_width = imageSize.width;
-    cinfo.image_height = imageSize.height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_YCbCr;
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-    jpeg_default_colorspace(&cinfo);
-    cinfo.raw_data_in = TRUE;
-    cinfo.dct_method = JDCT_IFAST;
-    cinfo.comp_info[0].h_samp_factor = 2;
-    cinfo.comp_info[0].v_samp_factor = 2;
-    cinfo.comp_info[1].h_samp_factor = 1;
-    cinfo.comp_info[1].v_samp_factor = 1;
-    cinfo.comp_info[2].h_samp_factor = 1;
-    cinfo.comp_info[2].v_samp_factor = 1;
-    cinfo.dest = sink;
+    if (!c->created) {
+        cinfo.err = jpeg_std_error(&c->err);
+        c->err.error_exit = &JpegErrorMgr::onJpegErrorS;  // jpeg_std_error resets it
+        jpeg_create_compress(&cinfo);
+        c->created = true;
+        c->quality = -1;
+    }
 
-    if (setjmp(err.jumpBuffer)) {
-        jpeg_destroy_compress(&cinfo);
+    if (setjmp(c->err.jumpBuffer)) {
+        // keeps the tables, returns `cinfo` to the idle state
+        jpeg_abort_compress(&cinfo);
         return FAILURE(false);
     }
 
+    if (c->quality != quality) {
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_YCbCr;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, quality, TRUE);
+        jpeg_default_colorspace(&cinfo);
+        cinfo.raw_data_in = TRUE;
+        cinfo.dct_method = JDCT_IFAST;
+        cinfo.comp_info[0].h_samp_factor = 2;
+        cinfo.comp_info[0].v_samp_factor = 2;
+        cinfo.comp_info[1].h_samp_factor = 1;
+        cinfo.comp_info[1].v_samp_factor = 1;
+        cinfo.comp_info[2].h_samp_factor = 1;
+        cinfo.comp_info[2].v_samp_factor = 1;
+        c->quality = quality;
+    }
+
+    cinfo.image_width = imageSize.width;
+    cinfo.image_height = imageSize.height;
+    cinfo.dest = sink;
+
     jpeg_start_compress(&cinfo, TRUE);
 
-    if (rawExif) {
-        jpeg_write_marker(&cinfo, JPEG_APP0 + 1, rawExif, rawExifSize);
+    if (exif) {
+        jpeg_write_marker(&cinfo, JPEG_APP0 + 1, exif, exifSize);
     }
 
-    if (imageSize.width % kJpegMCUSize) {
+    if ((imageSize.width % kJpegMCUSize) || (image.chroma_step != 1)) {
         const size_t alignedWidth =
-            ((imageSize.width + kJpegMCUSize) / kJpegMCUSize) * kJpegMCUSize;
-        alignedMemory.resize(alignedWidth * kJpegMCUSize * 3 / 2);
-        result = compressYUVImplPixelsSlow(image, &cinfo, alignedWidth, alignedMemory.data());
+            ((imageSize.width + kJpegMCUSize - 1) / kJpegMCUSize) * kJpegMCUSize;
+        c->scratch.resize(alignedWidth * kJpegMCUSize * 3 / 2);
+        result = compressYUVImplPixelsStaged(image, &cinfo, alignedWidth,
+                                             c->scratch.data(), abort);
     } else {
-        result = compressYUVImplPixelsFast(image, &cinfo);
+        result = compressYUVImplPixelsFast(image, &cinfo, abort);
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    if (result) {
+        jpeg_finish_compress(&cinfo);
+    } else {
+        jpeg_abort_compress(&cinfo);
+    }
 
     return result;
 }
 
+// Semi-planar images (Cb and Cr interleaved in either order) are resized
+// into semi-planar thumbnails with the same chroma order.
+android_ycbcr resizeYUVSemiPlanar(const android_ycbcr& srcYCbCr,
+                                  const Rect<uint16_t> srcSize,
+                                  const Rect<uint16_t> dstSize,
+                                  std::vector<uint8_t>* pDstData) {
+    const uint8_t* const srcCb = static_cast<const uint8_t*>(srcYCbCr.cb);
+    const uint8_t* const srcCr = static_cast<const uint8_t*>(srcYCbCr.cr);
+    const bool cbFirst = srcCb < srcCr;
+
+    const size_t dstWidth = dstSize.width;
+    const size_t dstHeight = dstSize.height;
+    pDstData->resize(yuv::NV21size(dstWidth, dstHeight));
+    uint8_t* const dstY = pDstData->data();
+    uint8_t* const dstCbCr = dstY + dstWidth * dstHeight;
+
+    libyuv::ScalePlane(
+        static_cast<const uint8_t*>(srcYCbCr.y), srcYCbCr.ystride,
+        srcSize.width, srcSize.height,
+        dstY, dstWidth, dstWidth, dstHeight,
+        libyuv::kFilterBox);
+
+    const int result = libyuv::UVScale(
+        cbFirst ? srcCb : srcCr, srcYCbCr.cstride,
+        srcSize.width / 2, srcSize.height / 2,
+        dstCbCr, dstWidth, dstWidth / 2, dstHeight / 2,
+        libyuv::kFilterBox);
+    if (result) {
+        return FAILURE_V(android_ycbcr(), "libyuv::UVScale failed with %d", result);
+    }
+
+    android_ycbcr dstYCbCr;
+    dstYCbCr.y = dstY;
+    dstYCbCr.cb = cbFirst ? dstCbCr : (dstCbCr + 1);
+    dstYCbCr.cr = cbFirst ? (dstCbCr + 1) : dstCbCr;
+    dstYCbCr.ystride = dstWidth;
+    dstYCbCr.cstride = dstWidth;
+    dstYCbCr.chroma_step = 2;
+
+    return dstYCbCr;
+}
+
+// libyuv's box filter (SIMD) averages all source pixels, thumbnails are
+// several times smaller than the image and bilinear filtering would alias.
 android_ycbcr resizeYUV(const android_ycbcr& srcYCbCr,
                         const Rect<uint16_t> srcSize,
                         const Rect<uint16_t> dstSize,
                         std::vector<uint8_t>* pDstData) {
-    if (srcYCbCr.chroma_step != 1) {
-        return FAILURE(android_ycbcr());
-    }
-
     const size_t dstWidth = dstSize.width;
     const size_t dstHeight = dstSize.height;
     if ((dstWidth & 1) || (dstHeight & 1)) {
         return FAILURE(android_ycbcr());
     }
 
-    std::vector<uint8_t> dstData(yuv::NV21size(dstWidth, dstHeight));
-    const android_ycbcr dstYCbCr = yuv::NV21init(dstWidth, dstHeight, dstData.data());
+    switch (srcYCbCr.chroma_step) {
+    case 1:
+        break;
+
+    case 2:
+        if (std::abs(static_cast<const uint8_t*>(srcYCbCr.cr) -
+                     static_cast<const uint8_t*>(srcYCbCr.cb)) == 1) {
+            return resizeYUVSemiPlanar(srcYCbCr, srcSize, dstSize, pDstData);
+        }
+        [[fallthrough]];
+
+    default:
+        return FAILURE_V(android_ycbcr(), "unsupported chroma_step=%zu",
+                         srcYCbCr.chroma_step);
+    }
+
+    pDstData->resize(yuv::NV21size(dstWidth, dstHeight));
+    const android_ycbcr dstYCbCr = yuv::NV21init(dstWidth, dstHeight, pDstData->data());
 
     const int result = libyuv::I420Scale(
         static_cast<const uint8_t*>(srcYCbCr.y), srcYCbCr.ystride,
@@ -248,12 +479,11 @@ android_ycbcr resizeYUV(const android_ycbcr& srcYCbCr,
         static_cast<uint8_t*>(dstYCbCr.cb), dstYCbCr.cstride,
         static_cast<uint8_t*>(dstYCbCr.cr), dstYCbCr.cstride,
         dstWidth, dstHeight,
-        libyuv::kFilterBilinear);
+        libyuv::kFilterBox);
 
     if (result) {
         return FAILURE_V(android_ycbcr(), "libyuv::I420Scale failed with %d", result);
     } else {
-        *pDstData = std::move(dstData);
         return dstYCbCr;
     }
 }
@@ -272,6 +502,126 @@ struct StaticBufferSink : public jpeg_destination_mgr {
     static void termDestinationS(j_compress_ptr) {}
 };
 
+// Writes into `Compressor::output` growing it as needed, the memory is
+// reused by the next image.
+struct VectorSink : public jpeg_destination_mgr {
+    explicit VectorSink(Compressor* c) : compressor(c) {
+        init_destination = &initDestinationS;
+        empty_output_buffer = &emptyOutputBufferS;
+        term_destination = &termDestinationS;
+    }
+
+    static void initDestinationS(j_compress_ptr cinfo) {
+        VectorSink* const self = static_cast<VectorSink*>(cinfo->dest);
+        std::vector<uint8_t>& output = self->compressor->output;
+        if (output.empty()) {
+            output.resize(kMinVectorSinkSize);
+        }
+
+        self->next_output_byte = output.data();
+        self->free_in_buffer = output.size();
+    }
+
+    // the whole buffer is full, `free_in_buffer` is not updated by libjpeg
+    static boolean emptyOutputBufferS(j_compress_ptr cinfo) {
+        VectorSink* const self = static_cast<VectorSink*>(cinfo->dest);
+        std::vector<uint8_t>& output = self->compressor->output;
+        const size_t used = output.size();
+
+        output.resize(used * 2);
+        self->next_output_byte = output.data() + used;
+        self->free_in_buffer = output.size() - used;
+        return TRUE;
+    }
+
+    static void termDestinationS(j_compress_ptr cinfo) {
+        VectorSink* const self = static_cast<VectorSink*>(cinfo->dest);
+        self->compressor->outputSize =
+            self->compressor->output.size() - self->free_in_buffer;
+    }
+
+    static constexpr size_t kMinVectorSinkSize = 64 * 1024;
+
+    Compressor* const compressor;
+};
+
+bool compressThumbnail(Compressor* const c, const android_ycbcr& image,
+                       const Rect<uint16_t> imageSize,
+                       const Rect<uint16_t> thumbnailSize,
+                       const int quality, const std::atomic<bool>* abort) {
+    const android_ycbcr thumbnail = resizeYUV(image, imageSize, thumbnailSize, &c->resized);
+    if (!thumbnail.y) {
+        return FAILURE(false);
+    }
+
+    VectorSink sink(c);
+    return compressYUVImpl(c, thumbnail, thumbnailSize, nullptr, 0, quality, &sink, abort);
+}
+
+constexpr size_t kMaxApp1Size = 2 + 65535;  // the marker and the longest segment
+constexpr size_t kApp1SizeSlack = 1024;
+
+// The main image is compressed `gap` bytes into the output while the
+// thumbnail (which goes into EXIF) is not ready yet. The gap repeats the
+// last APP1 size for the same thumbnail parameters, or allows 4 bits per
+// pixel.
+size_t estimateApp1Size(const Encoder& encoder, const Rect<uint16_t> thumbnailSize,
+                        const int thumbnailQuality) {
+    size_t size;
+    if ((encoder.lastThumbnailSize == thumbnailSize) &&
+            (encoder.lastThumbnailQuality == thumbnailQuality) && encoder.lastApp1Size) {
+        size = encoder.lastApp1Size + encoder.lastApp1Size / 8 + kApp1SizeSlack;
+    } else {
+        size = size_t(thumbnailSize.width) * thumbnailSize.height / 2 + 4 * kApp1SizeSlack;
+    }
+
+    return std::min(size, kMaxApp1Size);
+}
+
+// `jpeg + gap` holds `mainSize` bytes of the image without EXIF: SOI, APP0
+// (JFIF) and the rest. SOI and APP0 move to the beginning followed by an
+// APP1 segment with `exif`. If `exif` fits, APP1 is zero padded to fill the
+// gap and nothing else moves, otherwise the rest of the image moves too.
+size_t placeExif(uint8_t* const jpeg, const size_t gap, const size_t mainSize,
+                 const uint8_t* const exif, const size_t exifSize,
+                 const size_t jpegCapacity) {
+    const uint8_t* const main = jpeg + gap;
+    if ((mainSize < 4) || (main[0] != 0xFF) || (main[1] != 0xD8)) {
+        return FAILURE(0);
+    }
+
+    size_t headerSize = 2;  // SOI
+    if ((mainSize >= 6) && (main[2] == 0xFF) && (main[3] == JPEG_APP0)) {
+        headerSize += 2 + ((size_t(main[4]) << 8) | main[5]);
+    }
+    if (headerSize > mainSize) {
+        return FAILURE(0);
+    }
+
+    size_t app1Size = 4 + exifSize;
+    if (app1Size > kMaxApp1Size) {
+        return FAILURE_V(0, "exifSize=%zu is too large", exifSize);
+    } else if (app1Size <= gap) {
+        app1Size = gap;
+    } else if ((mainSize + app1Size) > jpegCapacity) {
+        return FAILURE(0);
+    } else {
+        memmove(jpeg + headerSize + app1Size, main + headerSize, mainSize - headerSize);
+    }
+
+    memmove(jpeg, main, headerSize);
+
+    uint8_t* d = jpeg + headerSize;
+    *d++ = 0xFF;
+    *d++ = JPEG_APP0 + 1;
+    *d++ = (app1Size - 2) >> 8;
+    *d++ = (app1Size - 2) & 0xFF;
+    memcpy(d, exif, exifSize);
+    memset(d + exifSize, 0, app1Size - 4 - exifSize);
+
+    return mainSize + app1Size;
+}
+
 constexpr int kDefaultQuality = 85;
 
 int sanitizeJpegQuality(const int quality) {
@@ -290,35 +640,23 @@ size_t compressYUV(const android_ycbcr& image,
                    const Rect<uint16_t> imageSize,
                    const CameraMetadata& metadata,
                    void* const jpegData,
-                   const size_t jpegDataCapacity) {
-    std::vector<uint8_t> nv21data;
-    const android_ycbcr imageNV21 =
-        yuv::toNV21Shallow(imageSize.width, imageSize.height,
-                           image, &nv21data);
-
-    auto exifData = exif::createExifData(metadata, imageSize);
-    if (!exifData) {
-        return FAILURE(0);
+                   const size_t jpegDataCapacity,
+                   const std::atomic<bool>* const abort) {
+    if (isAborted(abort)) {
+        return 0;
     }
 
     const camera_metadata_t* const rawMetadata =
         reinterpret_cast<const camera_metadata_t*>(metadata.metadata.data());
     camera_metadata_ro_entry_t metadataEntry;
 
-    do {
-        Rect<uint16_t> thumbnailSize = {0, 0};
-        int thumbnailQuality = 0;
-
-        if (find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_THUMBNAIL_SIZE,
-                                          &metadataEntry)) {
-            break;
-        } else {
-            thumbnailSize.width = metadataEntry.data.i32[0];
-            thumbnailSize.height = metadataEntry.data.i32[1];
-            if ((thumbnailSize.width <= 0) || (thumbnailSize.height <= 0)) {
-                break;
-            }
-        }
+    Rect<uint16_t> thumbnailSize = {0, 0};
+    int thumbnailQuality = 0;
+    if (!find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_THUMBNAIL_SIZE,
+                                       &metadataEntry) &&
+            (metadataEntry.data.i32[0] > 0) && (metadataEntry.data.i32[1] > 0)) {
+        thumbnailSize.width = metadataEntry.data.i32[0];
+        thumbnailSize.height = metadataEntry.data.i32[1];
 
         if (find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_THUMBNAIL_QUALITY,
                                           &metadataEntry)) {
@@ -326,52 +664,86 @@ size_t compressYUV(const android_ycbcr& image,
         } else {
             thumbnailQuality = sanitizeJpegQuality(metadataEntry.data.i32[0]);
         }
+    }
 
-        std::vector<uint8_t> thumbnailData;
-        const android_ycbcr thumbmnail = resizeYUV(imageNV21, imageSize,
-                                                   thumbnailSize, &thumbnailData);
-        if (!thumbmnail.y) {
+    int quality;
+    if (find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_QUALITY,
+                                      &metadataEntry)) {
+        quality = kDefaultQuality;
+    } else {
+        quality = sanitizeJpegQuality(metadataEntry.data.i32[0]);
+    }
+
+    std::unique_ptr<Encoder> freshEncoder;
+    Encoder* encoder;
+    if (reuseEncoder()) {
+        encoder = &getThreadEncoder();
+    } else {
+        freshEncoder = std::make_unique<Encoder>();
+        encoder = freshEncoder.get();
+    }
+
+    if (!encoder->exifTemplate || !(encoder->exifTemplate->getImageSize() == imageSize)) {
+        encoder->exifTemplate.emplace(imageSize);
+    }
+
+    if (!thumbnailSize.width) {
+        if (!encoder->exifTemplate->serialize(metadata, nullptr, 0, &encoder->exif)) {
             return FAILURE(0);
         }
 
         StaticBufferSink sink(jpegData, jpegDataCapacity);
-        if (!compressYUVImpl(thumbmnail, thumbnailSize, nullptr, 0,
-                             thumbnailQuality, &sink)) {
-            return FAILURE(0);
-        }
+        const bool success = compressYUVImpl(&encoder->main, image, imageSize,
+                                             encoder->exif.data(), encoder->exif.size(),
+                                             quality, &sink, abort);
 
-        const size_t thumbnailJpegSize = jpegDataCapacity - sink.free_in_buffer;
-        void* exifThumbnailJpegDataPtr = exif::exifDataAllocThumbnail(
-            exifData.get(), thumbnailJpegSize);
-        if (!exifThumbnailJpegDataPtr) {
-            return FAILURE(0);
-        }
+        return success ? (jpegDataCapacity - sink.free_in_buffer) : 0;
+    }
 
-        memcpy(exifThumbnailJpegDataPtr, jpegData, thumbnailJpegSize);
-    } while (false);
+    // EXIF (APP1) carries the thumbnail and goes before the main image. The
+    // main image is compressed (concurrently with the thumbnail, see Encoder)
+    // past a gap for APP1 which is written when both are ready.
+    const size_t gap = estimateApp1Size(*encoder, thumbnailSize, thumbnailQuality);
+    if (jpegDataCapacity <= gap) {
+        return FAILURE(0);
+    }
 
-    int quality;
-    if (find_camera_metadata_ro_entry(rawMetadata, ANDROID_JPEG_QUALITY,
-                                      &metadataEntry)) {
-        quality = kDefaultQuality;
-    } else {
-        quality = sanitizeJpegQuality(metadataEntry.data.i32[0]);
+    const auto thumbnailJob = [&]() {
+        return compressThumbnail(&encoder->thumbnail, image, imageSize,
+                                 thumbnailSize, thumbnailQuality, abort);
+    };
+    const bool concurrentThumbnail = cpu_budget::getThreadsPerCamera() > 1;
+    if (concurrentThumbnail) {
+        encoder->thumbnailWorker.start(thumbnailJob);
+    }
+
+    uint8_t* const jpeg = static_cast<uint8_t*>(jpegData);
+    StaticBufferSink mainSink(jpeg + gap, jpegDataCapacity - gap);
+    const bool mainSuccess = compressYUVImpl(&encoder->main, image, imageSize,
+                                             nullptr, 0, quality, &mainSink, abort);
+    const bool thumbnailSuccess = concurrentThumbnail ?
+        encoder->thumbnailWorker.wait() : thumbnailJob();
+
+    if (!mainSuccess || !thumbnailSuccess) {
+        return FAILURE(0);
     }
 
-    unsigned char* rawExif = nullptr;
-    unsigned rawExifSize = 0;
-    exif_data_save_data(const_cast<ExifData*>(exifData.get()),
-                        &rawExif, &rawExifSize);
-    if (!rawExif) {
+    const Compressor& thumbnail = encoder->thumbnail;
+    if (!encoder->exifTemplate->serialize(metadata, thumbnail.output.data(),
+                                          thumbnail.outputSize, &encoder->exif)) {
         return FAILURE(0);
     }
 
-    StaticBufferSink sink(jpegData, jpegDataCapacity);
-    const bool success = compressYUVImpl(imageNV21, imageSize, rawExif, rawExifSize,
-                                         quality, &sink);
-    free(rawExif);
+    encoder->lastThumbnailSize = thumbnailSize;
+    encoder->lastThumbnailQuality = thumbnailQuality;
+    encoder->lastApp1Size = 4 + encoder->exif.size();
+
+    return placeExif(jpeg, gap, jpegDataCapacity - gap - mainSink.free_in_buffer,
+                     encoder->exif.data(), encoder->exif.size(), jpegDataCapacity);
+}
 
-    return success ? (jpegDataCapacity - sink.free_in_buffer) : 0;
+void setReuseEncoderForTesting(const bool reuse) {
+    getReuseEncoder().store(reuse, std::memory_order_relaxed);
 }
 
 }  // namespace jpeg
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <atomic>
+
 #include <aidl/android/hardware/camera/device/CameraMetadata.h>
 #include <system/graphics.h>
 #include "Rect.h"
@@ -29,9 +31,15 @@ namespace jpeg {
 
 using aidl::android::hardware::camera::device::CameraMetadata;
 
+// Gives up (returns zero) soon after `*abort` becomes true.
 size_t compressYUV(const android_ycbcr& image, Rect<uint16_t> imageSize,
                    const CameraMetadata& metadata,
-                   void* jpegData, size_t jpegDataCapacity);
+                   void* jpegData, size_t jpegDataCapacity,
+                   const std::atomic<bool>* abort = nullptr);
+
+// Overrides vendor.qemu.camera.jpeg.reuse_encoder (the per thread encoder
+// cache), for benchmarks.
+void setReuseEncoderForTesting(bool reuse);
 
 }  // namespace jpeg
 }  // namespace implementation
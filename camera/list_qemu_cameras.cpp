@@ -17,10 +17,12 @@
 #include <algorithm>
 #include <charconv>
 #include <numeric>
+#include <string>
 #include <string_view>
 #include <math.h>
 
 #include <log/log.h>
+#include <qemud.h>
 
 #include "debug.h"
 #include "list_qemu_cameras.h"
@@ -34,6 +36,8 @@ namespace provider {
 namespace implementation {
 namespace hw {
 namespace {
+const char kServiceName[] = "camera";
+
 bool findToken(const std::string_view str, const std::string_view key, std::string_view* value) {
     size_t pos = 0;
     while (true) {
@@ -130,6 +134,20 @@ struct RectAreaComparator {
 
 } // namespace
 
+base::unique_fd qemuOpenChannel() {
+    return base::unique_fd(qemud_channel_open(kServiceName));
+}
+
+base::unique_fd qemuOpenChannel(const std::string_view param) {
+    if (param.empty()) {
+        return qemuOpenChannel();
+    } else {
+        return base::unique_fd(qemud_channel_open(
+            (std::string(kServiceName) + ":" +
+             std::string(param.begin(), param.end())).c_str()));
+    }
+}
+
 bool listQemuCameras(const std::function<void(HwCameraFactory)>& cameraSink) {
     using namespace std::literals;
     static const char kListQuery[] = "list";
@@ -248,6 +266,7 @@ bool listQemuCameras(const std::function<void(HwCameraFactory)>& cameraSink) {
         });
 
         params.isBackFacing = (dir == "back"sv);
+        params.frameDistributor = std::make_shared<FrameDistributor>();
 
         cameraSink([params = std::move(params)]() {
             return std::make_unique<QemuCamera>(params);
@@ -17,6 +17,8 @@
 #pragma once
 
 #include <functional>
+#include <string_view>
+#include <android-base/unique_fd.h>
 #include "HwCamera.h"
 
 namespace android {
@@ -26,6 +28,10 @@ namespace provider {
 namespace implementation {
 namespace hw {
 
+// Opens the host camera service, `param` selects a camera.
+base::unique_fd qemuOpenChannel();
+base::unique_fd qemuOpenChannel(std::string_view param);
+
 bool listQemuCameras(const std::function<void(HwCameraFactory)>& cameraSink);
 
 }  // namespace hw
@@ -47,6 +47,17 @@ CameraMetadata metadataCompactRaw(const camera_metadata_t* raw) {
     return r;
 }
 
+size_t getResultTagCount(const uint32_t tag) {
+    switch (tag) {
+    case ANDROID_SENSOR_NEUTRAL_COLOR_POINT:
+        return 3;  // R, G, B
+    case ANDROID_SENSOR_NOISE_PROFILE:
+        return 8;  // (S, O) for each of the 4 CFA channels
+    default:
+        return 1;
+    }
+}
+
 } // namespace
 
 CameraMetadata metadataCompact(const CameraMetadata& m) {
@@ -119,6 +130,136 @@ void metadataSetShutterTimestamp(CameraMetadata* m, const int64_t shutterTimesta
     }
 }
 
+Span<const uint32_t> metadataGetCaptureResultTags() {
+    static const uint32_t kCaptureResultTags[] = {
+        ANDROID_CONTROL_AE_STATE,
+        ANDROID_CONTROL_AF_STATE,
+        ANDROID_CONTROL_AWB_STATE,
+        ANDROID_FLASH_STATE,
+        ANDROID_LENS_APERTURE,
+        ANDROID_LENS_FOCUS_DISTANCE,
+        ANDROID_LENS_STATE,
+        ANDROID_REQUEST_PIPELINE_DEPTH,
+        ANDROID_SENSOR_FRAME_DURATION,
+        ANDROID_SENSOR_EXPOSURE_TIME,
+        ANDROID_SENSOR_SENSITIVITY,
+        ANDROID_SENSOR_TIMESTAMP,
+        ANDROID_SENSOR_ROLLING_SHUTTER_SKEW,
+        ANDROID_STATISTICS_SCENE_FLICKER,
+    };
+
+    return kCaptureResultTags;
+}
+
+Span<const uint32_t> metadataGetRawCaptureResultTags() {
+    static const std::vector<uint32_t> kRawCaptureResultTags = [](){
+        const Span<const uint32_t> tags = metadataGetCaptureResultTags();
+        std::vector<uint32_t> rawTags(tags.begin(), tags.end());
+        rawTags.push_back(ANDROID_SENSOR_GREEN_SPLIT);
+        rawTags.push_back(ANDROID_SENSOR_NEUTRAL_COLOR_POINT);
+        rawTags.push_back(ANDROID_SENSOR_NOISE_PROFILE);
+        return rawTags;
+    }();
+
+    return {kRawCaptureResultTags.begin(), kRawCaptureResultTags.end()};
+}
+
+std::optional<CameraMetadata> metadataBuildCaptureResultTemplate(
+        const CameraMetadata& settings,
+        const Span<const uint32_t> resultTags) {
+    CameraMetadataMap m;
+    if (!settings.metadata.empty()) {
+        m = parseCameraMetadataMap(settings);
+    }
+
+    for (const uint32_t tag : resultTags) {
+        CameraMetadataValue& v = m[tag];
+        if (!v.count) {
+            const int type = get_camera_metadata_tag_type(tag);
+            if (type < 0) {
+                return FAILURE_V(std::nullopt, "unexpected tag=%u", tag);
+            }
+
+            v.count = getResultTagCount(tag);
+            v.data.assign(v.count * camera_metadata_type_size[type], 0);
+        }
+    }
+
+    return serializeCameraMetadataMap(m);
+}
+
+bool metadataUpdateInPlace(CameraMetadata* dst, const CameraMetadata& settings,
+                           const Span<const uint32_t> resultTags) {
+    if (dst->metadata.empty()) {
+        return false;
+    }
+
+    camera_metadata_t* const dstRaw =
+        reinterpret_cast<camera_metadata_t*>(dst->metadata.data());
+    const camera_metadata_t* const srcRaw = settings.metadata.empty() ? nullptr :
+        reinterpret_cast<const camera_metadata_t*>(settings.metadata.data());
+    const size_t srcN = srcRaw ? get_camera_metadata_entry_count(srcRaw) : 0;
+
+    camera_metadata_ro_entry_t srcEntry;
+    camera_metadata_ro_entry_t dstEntry;
+
+    size_t expectedDstN = srcN;
+    for (const uint32_t tag : resultTags) {
+        if (!srcRaw || find_camera_metadata_ro_entry(srcRaw, tag, &srcEntry)) {
+            ++expectedDstN;
+        }
+    }
+
+    if (get_camera_metadata_entry_count(dstRaw) != expectedDstN) {
+        return false;
+    }
+
+    for (size_t i = 0; i < srcN; ++i) {
+        if (get_camera_metadata_ro_entry(srcRaw, i, &srcEntry)) {
+            return FAILURE(false);
+        }
+
+        if (find_camera_metadata_ro_entry(dstRaw, srcEntry.tag, &dstEntry)) {
+            return false;
+        }
+
+        if (dstEntry.count != srcEntry.count) {
+            return false;
+        }
+
+        // the same tag and count mean the same size, no reallocation
+        if (update_camera_metadata_entry(dstRaw, dstEntry.index, srcEntry.data.u8,
+                                         srcEntry.count, nullptr)) {
+            return FAILURE(false);
+        }
+    }
+
+    return true;
+}
+
+bool metadataSetEntry(CameraMetadata* m, const uint32_t tag,
+                      const void* data, const size_t count) {
+    if (m->metadata.empty()) {
+        return false;
+    }
+
+    camera_metadata_t* const raw =
+        reinterpret_cast<camera_metadata_t*>(m->metadata.data());
+
+    camera_metadata_ro_entry_t entry;
+    if (find_camera_metadata_ro_entry(raw, tag, &entry)) {
+        ALOGW("%s:%d: find_camera_metadata_ro_entry(%s.%s) failed", __func__, __LINE__,
+              get_camera_metadata_section_name(tag), get_camera_metadata_tag_name(tag));
+        return false;
+    } else if (update_camera_metadata_entry(raw, entry.index, data, count, nullptr)) {
+        ALOGW("%s:%d: update_camera_metadata_entry(%s.%s) failed", __func__, __LINE__,
+              get_camera_metadata_section_name(tag), get_camera_metadata_tag_name(tag));
+        return false;
+    } else {
+        return true;
+    }
+}
+
 void prettyPrintCameraMetadata(const CameraMetadata& m) {
     const camera_metadata_t* const raw =
         reinterpret_cast<const camera_metadata_t*>(m.metadata.data());
@@ -23,6 +23,8 @@
 
 #include <aidl/android/hardware/camera/device/CameraMetadata.h>
 
+#include "Span.h"
+
 namespace android {
 namespace hardware {
 namespace camera {
@@ -70,6 +72,33 @@ CameraMetadataMap parseCameraMetadataMap(const CameraMetadata& m);
 
 void metadataSetShutterTimestamp(CameraMetadata* metadata, int64_t shutterTimestampNs);
 
+// Entries set by the HAL on top of the request settings in capture results
+Span<const uint32_t> metadataGetCaptureResultTags();
+// metadataGetCaptureResultTags plus the DNG ones for cameras with RAW outputs
+Span<const uint32_t> metadataGetRawCaptureResultTags();
+
+// Capture results are built once out of the request settings plus
+// `resultTags` (zero initialized if they are not in the settings) and then
+// patched in place while the layout of the settings stays the same. Result
+// tags hold one value except the DNG ones which have their fixed counts.
+std::optional<CameraMetadata> metadataBuildCaptureResultTemplate(
+    const CameraMetadata& settings, Span<const uint32_t> resultTags);
+
+// Overwrites the entries of `dst` with the ones from `settings` in place.
+// Returns false if `dst` was not built from settings of the same layout, in
+// this case `dst` might be partially updated and has to be rebuilt.
+bool metadataUpdateInPlace(CameraMetadata* dst, const CameraMetadata& settings,
+                           Span<const uint32_t> resultTags);
+
+bool metadataSetEntry(CameraMetadata* metadata, uint32_t tag,
+                      const void* data, size_t count);
+
+template <class T> bool metadataSetEntry(CameraMetadata* metadata, const uint32_t tag,
+                                         const T& value) {
+    static_assert(std::is_trivial<T>::value);
+    return metadataSetEntry(metadata, tag, &value, 1);
+}
+
 void prettyPrintCameraMetadata(const CameraMetadata&);
 
 }  // namespace implementation
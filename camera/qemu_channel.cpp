@@ -14,9 +14,13 @@
  * limitations under the License.
  */
 
-#include <string>
-#include <qemud.h>
-#include <qemu_pipe_bp.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string_view>
+#include <android-base/file.h>
 #include <debug.h>
 #include "qemu_channel.h"
 
@@ -27,11 +31,20 @@ namespace provider {
 namespace implementation {
 namespace hw {
 namespace {
-const char kServiceName[] = "camera";
+// The channel is a plain fd, it is also a socket in tests.
+int readFully(const int fd, void* data, const size_t size) {
+    errno = 0;
+    return base::ReadFully(fd, data, size) ? 0 : (errno ? -errno : -EPIPE);
+}
+
+int writeFully(const int fd, const void* data, const size_t size) {
+    errno = 0;
+    return base::WriteFully(fd, data, size) ? 0 : (errno ? -errno : -EPIPE);
+}
 
 int qemuReceiveMessage(const int fd, std::vector<uint8_t>* data) {
     char len16[9];
-    int e = qemu_pipe_read_fully(fd, len16, 8);
+    int e = readFully(fd, len16, 8);
     if (e < 0) {
         return FAILURE(e);
     }
@@ -43,7 +56,7 @@ int qemuReceiveMessage(const int fd, std::vector<uint8_t>* data) {
     }
 
     data->resize(len);
-    e = qemu_pipe_read_fully(fd, data->data(), len);
+    e = readFully(fd, data->data(), len);
     if (e < 0) {
         return FAILURE(e);
     }
@@ -51,41 +64,10 @@ int qemuReceiveMessage(const int fd, std::vector<uint8_t>* data) {
     return 0;
 }
 
-} // namespace
-
-base::unique_fd qemuOpenChannel() {
-    return base::unique_fd(qemud_channel_open(kServiceName));
-}
-
-base::unique_fd qemuOpenChannel(const std::string_view param) {
-    if (param.empty()) {
-        return qemuOpenChannel();
-    } else {
-        return base::unique_fd(qemud_channel_open(
-            (std::string(kServiceName) + ":" +
-             std::string(param.begin(), param.end())).c_str()));
-    }
-}
-
-int qemuRunQuery(const int fd,
-                 const char* const query,
-                 const size_t querySize,
-                 std::vector<uint8_t>* result) {
+int qemuParseReply(const char* const query, const std::vector<uint8_t>& reply) {
     static const uint8_t kZero = 0;
-    static const uint8_t kSeparator = ' ';
     static const uint8_t kColon = ':';
 
-    int e = qemu_pipe_write_fully(fd, query, querySize);
-    if (e < 0) {
-        return FAILURE(e);
-    }
-
-    std::vector<uint8_t> reply;
-    e = qemuReceiveMessage(fd, &reply);
-    if (e < 0) {
-        return e;
-    }
-
     if (reply.size() >= 3) {
         bool ok;
 
@@ -110,10 +92,6 @@ int qemuRunQuery(const int fd,
                 } else {
                     return FAILURE_V(-EBADE, "failed to exec '%s' query", query);
                 }
-            } else if (result) {
-                reply.erase(reply.begin(), reply.begin() + 3);
-                *result = std::move(reply);
-                return result->size();
             } else {
                 return reply.size() - 3;
             }
@@ -126,6 +104,298 @@ int qemuRunQuery(const int fd,
     }
 }
 
+bool hasCapability(const uint8_t* caps, const size_t size, const std::string_view cap) {
+    const char* const begin = reinterpret_cast<const char*>(caps);
+    const char* const end = begin + size;
+    const auto isSeparator = [](const char c){ return (c == ' ') || (c == ',') || (c == 0); };
+
+    for (const char* i = begin; i < end;) {
+        const char* const tokenEnd = std::find_if(i, end, isSeparator);
+        if (std::string_view(i, tokenEnd - i) == cap) {
+            return true;
+        }
+        i = tokenEnd + 1;
+    }
+
+    return false;
+}
+
+} // namespace
+
+int qemuRunQuery(const int fd,
+                 const char* const query,
+                 const size_t querySize,
+                 std::vector<uint8_t>* result) {
+    int e = writeFully(fd, query, querySize);
+    if (e < 0) {
+        return FAILURE(e);
+    }
+
+    std::vector<uint8_t> reply;
+    e = qemuReceiveMessage(fd, &reply);
+    if (e < 0) {
+        return e;
+    }
+
+    e = qemuParseReply(query, reply);
+    if ((e >= 0) && result) {
+        reply.erase(reply.begin(), reply.begin() + 3);
+        *result = std::move(reply);
+    }
+
+    return e;
+}
+
+QemuChannel::QemuChannel()
+        : mCancelFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {}
+
+QemuChannel::QemuChannel(base::unique_fd fd)
+        : mFd(std::move(fd))
+        , mCancelFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {}
+
+void QemuChannel::reset() {
+    mFd.reset();
+    mInFlight.clear();
+    mCompleted.clear();
+    mCancelled.clear();
+    mBinary = false;
+}
+
+void QemuChannel::cancel() {
+    const uint64_t one = 1;
+    if (write(mCancelFd.get(), &one, sizeof(one)) != sizeof(one)) {
+        ALOGE("%s:%d: write failed with %s (%d)", __func__, __LINE__,
+              strerror(errno), errno);
+    }
+}
+
+void QemuChannel::clearCancel() {
+    uint64_t value;
+    (void)read(mCancelFd.get(), &value, sizeof(value));
+}
+
+int QemuChannel::drainCancelled() {
+    while (!mCancelled.empty()) {
+        int id;
+        int status;
+        const int e = receiveFrameReply(&id, &status, true, kDrainTimeoutMs);
+        if (e == -ETIMEDOUT) {
+            return FAILURE_V(e, "%zu cancelled frame replies did not come in %dms",
+                             mCancelled.size(), kDrainTimeoutMs);
+        } else if (e < 0) {
+            return e;
+        }
+
+        const auto i = std::find(mCancelled.begin(), mCancelled.end(), id);
+        if (i == mCancelled.end()) {
+            mCompleted.push_back({id, status});
+        } else {
+            mCancelled.erase(i);
+        }
+    }
+
+    return 0;
+}
+
+void QemuChannel::negotiate() {
+    static const char kCapsQuery[] = "caps";
+
+    // Older hosts do not know the `caps` query and reply with an error, this
+    // is expected and not logged (runQuery would).
+    mBinary = false;
+    if (!mInFlight.empty() || !mCancelled.empty() ||
+            (writeFully(mFd.get(), kCapsQuery, sizeof(kCapsQuery)) < 0) ||
+            (qemuReceiveMessage(mFd.get(), &mReply) < 0)) {
+        return;
+    }
+
+    if ((mReply.size() > 3) && !memcmp(mReply.data(), "ok:", 3)) {
+        mBinary = hasCapability(&mReply[3], mReply.size() - 3, "binframe");
+    }
+}
+
+int QemuChannel::runQuery(const char* const query, const size_t querySize) {
+    int e = drainCancelled();
+    if (e < 0) {
+        return e;
+    }
+
+    if (!mInFlight.empty()) {
+        return FAILURE(-EBUSY);
+    }
+
+    e = writeFully(mFd.get(), query, querySize);
+    if (e < 0) {
+        return FAILURE(e);
+    }
+
+    e = qemuReceiveMessage(mFd.get(), &mReply);
+    if (e < 0) {
+        return e;
+    }
+
+    return qemuParseReply(query, mReply);
+}
+
+int QemuChannel::sendFrameRequest(const uint32_t width, const uint32_t height,
+                                  const uint32_t pixelFormat,
+                                  const float whiteBalance[3],
+                                  const float exposureComp,
+                                  const uint64_t dataOffset) {
+    const int requestId = (mLastRequestId == INT32_MAX) ? 1 : (mLastRequestId + 1);
+    int e;
+
+    if (mBinary) {
+        QemuFrameRequest req;
+        req.magic = QemuFrameRequest::kMagic;
+        req.requestId = requestId;
+        req.width = width;
+        req.height = height;
+        req.pixelFormat = pixelFormat;
+        req.whiteBalance[0] = whiteBalance[0];
+        req.whiteBalance[1] = whiteBalance[1];
+        req.whiteBalance[2] = whiteBalance[2];
+        req.exposureComp = exposureComp;
+        req.reserved = 0;
+        req.dataOffset = dataOffset;
+
+        e = writeFully(mFd.get(), &req, sizeof(req));
+    } else {
+        char queryStr[128];
+        const int querySize = snprintf(queryStr, sizeof(queryStr),
+            "frame dim=%" PRIu32 "x%" PRIu32 " pix=%" PRIu32 " offset=%" PRIu64
+            " whiteb=%g,%g,%g expcomp=%g time=%d",
+            width, height, pixelFormat, dataOffset,
+            whiteBalance[0], whiteBalance[1], whiteBalance[2], exposureComp, 0);
+
+        e = writeFully(mFd.get(), queryStr, querySize + 1);
+    }
+
+    if (e < 0) {
+        return FAILURE(e);
+    }
+
+    mLastRequestId = requestId;
+    mInFlight.push_back(requestId);
+    return requestId;
+}
+
+int QemuChannel::waitFrameReply(const int requestId, const bool cancellable) {
+    {
+        const auto i = std::find_if(mCompleted.begin(), mCompleted.end(),
+            [requestId](const std::pair<int, int>& kv){ return kv.first == requestId; });
+        if (i != mCompleted.end()) {
+            const int status = i->second;
+            mCompleted.erase(i);
+            return status;
+        }
+    }
+
+    while (true) {
+        int id;
+        int status;
+        const int e = receiveFrameReply(&id, &status, cancellable);
+        if (e == -ECANCELED) {
+            mCancelled.push_back(requestId);
+            return e;
+        } else if (e < 0) {
+            return e;
+        } else if (id == requestId) {
+            return status;
+        }
+
+        const auto i = std::find(mCancelled.begin(), mCancelled.end(), id);
+        if (i == mCancelled.end()) {
+            mCompleted.push_back({id, status});
+        } else {
+            mCancelled.erase(i);
+        }
+    }
+}
+
+int QemuChannel::queryFrame(const uint32_t width, const uint32_t height,
+                            const uint32_t pixelFormat,
+                            const float whiteBalance[3],
+                            const float exposureComp,
+                            const uint64_t dataOffset,
+                            const bool cancellable) {
+    const int requestId = sendFrameRequest(width, height, pixelFormat,
+                                           whiteBalance, exposureComp, dataOffset);
+    return (requestId < 0) ? requestId : waitFrameReply(requestId, cancellable);
+}
+
+int QemuChannel::receiveMessage(const bool cancellable, const int timeoutMs) {
+    if (cancellable || (timeoutMs >= 0)) {
+        struct pollfd fds[2] = {
+            { mFd.get(), POLLIN, 0 },
+            { mCancelFd.get(), POLLIN, 0 },
+        };
+
+        while (true) {
+            const int r = poll(fds, cancellable ? 2 : 1, timeoutMs);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                } else {
+                    return FAILURE_V(-errno, "poll failed with %s (%d)",
+                                     strerror(errno), errno);
+                }
+            } else if (r == 0) {
+                return -ETIMEDOUT;
+            }
+
+            // the reply wins if both are ready
+            if (fds[0].revents) {
+                break;
+            } else if (fds[1].revents & POLLIN) {
+                return -ECANCELED;
+            }
+        }
+    }
+
+    return qemuReceiveMessage(mFd.get(), &mReply);
+}
+
+int QemuChannel::receiveFrameReply(int* const requestId, int* const status,
+                                   const bool cancellable, const int timeoutMs) {
+    if (mInFlight.empty()) {
+        return FAILURE(-EINVAL);
+    }
+
+    const int e = receiveMessage(cancellable, timeoutMs);
+    if (e < 0) {
+        return e;
+    }
+
+    if (mBinary) {
+        QemuFrameReply reply;
+        if (mReply.size() != sizeof(reply)) {
+            return FAILURE(-EBADE);
+        }
+        memcpy(&reply, mReply.data(), sizeof(reply));
+        if (reply.magic != QemuFrameReply::kMagic) {
+            return FAILURE(-EBADE);
+        }
+
+        const auto i = std::find(mInFlight.begin(), mInFlight.end(),
+                                 int(reply.requestId));
+        if (i == mInFlight.end()) {
+            return FAILURE_V(-EBADE, "unexpected requestId=%u", reply.requestId);
+        }
+        mInFlight.erase(i);
+
+        *requestId = reply.requestId;
+        *status = (reply.status < 0) ? FAILURE(reply.status) : 0;
+    } else {
+        // text replies come in the order queries were sent
+        *requestId = mInFlight.front();
+        mInFlight.pop_front();
+        *status = std::min(qemuParseReply("frame", mReply), 0);
+    }
+
+    return 0;
+}
+
 }  // namespace hw
 }  // namespace implementation
 }  // namespace provider
@@ -16,8 +16,9 @@
 
 #pragma once
 
+#include <deque>
+#include <utility>
 #include <vector>
-#include <string_view>
 #include <android-base/unique_fd.h>
 
 namespace android {
@@ -27,13 +28,100 @@ namespace provider {
 namespace implementation {
 namespace hw {
 
-base::unique_fd qemuOpenChannel();
-base::unique_fd qemuOpenChannel(std::string_view arg);
-
 // `query` is ASCIZ, `querySise` includes the terminarting zero.
 int qemuRunQuery(int fd, const char* query, size_t querySise,
                  std::vector<uint8_t>* data = nullptr);
 
+// The binary form of the `frame` query, it is used instead of the text one
+// if the host lists `binframe` in its reply to the `caps` query. Replies
+// use the same length prefixed framing as the text protocol and carry
+// QemuFrameReply.
+struct QemuFrameRequest {
+    static constexpr uint32_t kMagic = 0x4d524651;  // "QFRM"
+
+    uint32_t magic;
+    uint32_t requestId;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelFormat;
+    float whiteBalance[3];
+    float exposureComp;
+    uint32_t reserved;
+    uint64_t dataOffset;
+};
+static_assert(sizeof(QemuFrameRequest) == 48);
+
+struct QemuFrameReply {
+    static constexpr uint32_t kMagic = 0x52524651;  // "QFRR"
+
+    uint32_t magic;
+    uint32_t requestId;
+    int32_t status;  // zero or a negative errno
+    uint32_t reserved;
+};
+static_assert(sizeof(QemuFrameReply) == 16);
+
+// Owns the channel fd and the reply buffer (reused across queries). Frame
+// requests are identified by ids, several of them can be in flight and
+// their replies can be collected in any order. QemuCamera sends one at a
+// time (`queryFrame`), its frames depend on one another.
+struct QemuChannel {
+    QemuChannel();
+    explicit QemuChannel(base::unique_fd fd);
+
+    bool ok() const { return mFd.ok(); }
+    int get() const { return mFd.get(); }
+    bool isBinary() const { return mBinary; }
+    void reset();
+
+    // Switches to the binary protocol if the host supports it.
+    void negotiate();
+
+    // See `qemuRunQuery` above, must not be called with frames in flight.
+    int runQuery(const char* query, size_t querySize);
+
+    // Returns a request id (positive) or a negative error.
+    int sendFrameRequest(uint32_t width, uint32_t height, uint32_t pixelFormat,
+                         const float whiteBalance[3], float exposureComp,
+                         uint64_t dataOffset);
+    // Returns zero or a negative error. If `cancellable` and `cancel` is
+    // called before the reply arrives, returns -ECANCELED; the host might
+    // still write into the frame destination until `drainCancelled`.
+    int waitFrameReply(int requestId, bool cancellable = false);
+
+    int queryFrame(uint32_t width, uint32_t height, uint32_t pixelFormat,
+                   const float whiteBalance[3], float exposureComp,
+                   uint64_t dataOffset, bool cancellable = false);
+
+    // `cancel` can be called from any thread, it stays in effect until
+    // `clearCancel`.
+    void cancel();
+    void clearCancel();
+
+    bool hasCancelled() const { return !mCancelled.empty(); }
+    // Waits for replies of requests which waits were cancelled, up to
+    // `kDrainTimeoutMs` for each. Returns -ETIMEDOUT (a stuck host) or
+    // -ECANCELED (see `cancel`) if some are still pending, it can be retried.
+    int drainCancelled();
+
+    static constexpr int kDrainTimeoutMs = 500;
+
+private:
+    // `timeoutMs` < 0 waits forever
+    int receiveMessage(bool cancellable, int timeoutMs = -1);
+    int receiveFrameReply(int* requestId, int* status, bool cancellable,
+                          int timeoutMs = -1);
+
+    base::unique_fd mFd;
+    base::unique_fd mCancelFd;  // eventfd
+    std::vector<uint8_t> mReply;
+    std::deque<int> mInFlight;  // in the order they were sent
+    std::vector<std::pair<int, int>> mCompleted;  // {requestId, status}
+    std::vector<int> mCancelled;  // replies to be dropped
+    int mLastRequestId = 0;
+    bool mBinary = false;
+};
+
 }  // namespace hw
 }  // namespace implementation
 }  // namespace provider
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+
+#include <benchmark/benchmark.h>
+
+#include "CameraDevice.h"
+#include "fake_hw_camera.h"
+#include "metadata_utils.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+constexpr int32_t kFps = 30;
+
+std::shared_ptr<CameraDevice> makeCameraDevice() {
+    return ndk::SharedRefBase::make<CameraDevice>(
+        std::make_unique<hw::FakeHwCamera>(hw::FakeHwCamera::Params{
+            1000000000 / kFps,  // frameDurationNs
+            0,                  // queryFrameNs
+            0,                  // encodeNs
+        }));
+}
+
+// Arg: 0 - a new CameraDevice for each call (builds and serializes the
+// characteristics, as every call did before they were cached),
+// 1 - the same CameraDevice (returns the cached copy).
+void BM_GetCameraCharacteristics(benchmark::State& state) {
+    const bool cached = state.range(0);
+    std::shared_ptr<CameraDevice> device = makeCameraDevice();
+    CameraMetadata metadata;
+    if (!device->getCameraCharacteristics(&metadata).isOk()) {
+        state.SkipWithError("getCameraCharacteristics failed");
+        return;
+    }
+
+    for (auto _ : state) {
+        if (!cached) {
+            state.PauseTiming();
+            device = makeCameraDevice();
+            state.ResumeTiming();
+        }
+
+        benchmark::DoNotOptimize(device->getCameraCharacteristics(&metadata).isOk());
+        benchmark::DoNotOptimize(metadata.metadata.data());
+    }
+
+    state.counters["bytes"] = metadata.metadata.size();
+}
+BENCHMARK(BM_GetCameraCharacteristics)->ArgName("cached")->Arg(0)->Arg(1);
+
+// Args: the template, 0 - build and serialize it on each call (as before
+// caching), 1 - CameraDevice::getDefaultRequestSettings (cached).
+void BM_ConstructDefaultRequestSettings(benchmark::State& state) {
+    const auto tpl = static_cast<RequestTemplate>(state.range(0));
+    const bool cached = state.range(1);
+    const std::shared_ptr<CameraDevice> device = makeCameraDevice();
+
+    size_t bytes = 0;
+    for (auto _ : state) {
+        const std::optional<CameraMetadata> metadata = cached ?
+            device->getDefaultRequestSettings(tpl) :
+            serializeCameraMetadataMap(device->constructDefaultRequestSettings(tpl));
+        if (!metadata) {
+            state.SkipWithError("no default request settings");
+            break;
+        }
+
+        bytes = metadata->metadata.size();
+        benchmark::DoNotOptimize(metadata->metadata.data());
+    }
+
+    state.counters["bytes"] = bytes;
+}
+BENCHMARK(BM_ConstructDefaultRequestSettings)
+    ->ArgNames({"template", "cached"})
+    ->Args({static_cast<int>(RequestTemplate::PREVIEW), 0})
+    ->Args({static_cast<int>(RequestTemplate::PREVIEW), 1})
+    ->Args({static_cast<int>(RequestTemplate::STILL_CAPTURE), 0})
+    ->Args({static_cast<int>(RequestTemplate::STILL_CAPTURE), 1})
+    ->Args({static_cast<int>(RequestTemplate::MANUAL), 0})
+    ->Args({static_cast<int>(RequestTemplate::MANUAL), 1});
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <aidl/android/hardware/camera/device/StreamConfigurationMode.h>
+#include <aidl/android/hardware/graphics/common/Dataspace.h>
+
+#include "CameraDeviceSession.h"
+#include "fake_camera_framework.h"
+#include "fake_hw_camera.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+using aidl::android::hardware::camera::device::StreamConfigurationMode;
+using aidl::android::hardware::camera::device::StreamRotation;
+using aidl::android::hardware::camera::device::StreamType;
+using aidl::android::hardware::graphics::common::Dataspace;
+
+using namespace std::chrono_literals;
+
+constexpr int kNumCameras = 2;  // front and back
+constexpr int32_t kFps = 30;
+constexpr int32_t kYuvStreamId = 0;
+constexpr int32_t kJpegStreamId = 1;
+constexpr int32_t kJpegBufferSize = 1 << 20;
+constexpr auto kWindow = 250ms;  // fps is sampled per window
+
+Stream makeStream(const int32_t id, const PixelFormat format,
+                  const Dataspace dataspace) {
+    Stream s;
+    s.id = id;
+    s.streamType = StreamType::OUTPUT;
+    s.width = 640;
+    s.height = 480;
+    s.format = format;
+    s.usage = BufferUsage::CPU_READ_OFTEN;
+    s.dataSpace = dataspace;
+    s.rotation = StreamRotation::ROTATION_0;
+    s.bufferSize = (format == PixelFormat::BLOB) ? kJpegBufferSize : 0;
+    return s;
+}
+
+struct StreamingCamera {
+    StreamingCamera()
+            : hwCamera({
+                1000000000 / kFps,  // frameDurationNs
+                5000000,            // queryFrameNs
+                20000000,           // encodeNs
+              })
+            , framework(ndk::SharedRefBase::make<FakeCameraFramework>())
+            , session(ndk::SharedRefBase::make<CameraDeviceSession>(nullptr, framework,
+                                                                    hwCamera)) {}
+
+    bool configure() {
+        StreamConfiguration cfg;
+        cfg.streams.push_back(makeStream(kYuvStreamId, PixelFormat::YCBCR_420_888,
+                                         Dataspace::UNKNOWN));
+        cfg.streams.push_back(makeStream(kJpegStreamId, PixelFormat::BLOB,
+                                         Dataspace::JFIF));
+        cfg.operationMode = StreamConfigurationMode::NORMAL_MODE;
+        cfg.streamConfigCounter = 1;
+
+        std::vector<HalStream> halStreams;
+        return session->configureStreams(cfg, &halStreams).isOk() &&
+               framework->allocateBuffers(cfg.streams, halStreams);
+    }
+
+    hw::FakeHwCamera hwCamera;
+    std::shared_ptr<FakeCameraFramework> framework;
+    std::shared_ptr<CameraDeviceSession> session;
+    uint64_t windowShutters0 = 0;
+    double minWindowFps = 1e9;
+};
+
+// Front and back cameras stream preview and JPEG together, the framework
+// sends a request to a camera as soon as it has a preview buffer for it.
+// An iteration is a sampling window; the counters show each camera's
+// average and lowest window fps (its stability) and the combined rate.
+void BM_ConcurrentCameras(benchmark::State& state) {
+    StreamingCamera cameras[kNumCameras];
+    for (StreamingCamera& c : cameras) {
+        if (!c.configure()) {
+            state.SkipWithError("could not configure a session");
+            return;
+        }
+    }
+
+    const std::vector<int32_t> streamIds = {kYuvStreamId, kJpegStreamId};
+    const auto start = std::chrono::steady_clock::now();
+
+    for (auto _ : state) {
+        for (StreamingCamera& c : cameras) {
+            c.windowShutters0 = c.framework->getNumShutters();
+        }
+
+        const auto windowStart = std::chrono::steady_clock::now();
+        while ((std::chrono::steady_clock::now() - windowStart) < kWindow) {
+            for (StreamingCamera& c : cameras) {
+                if (c.framework->getNumFreeBuffers(kYuvStreamId) > 0) {
+                    c.framework->submit(*c.session, 1, streamIds);
+                }
+            }
+            std::this_thread::sleep_for(1ms);
+        }
+
+        const double windowSeconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - windowStart).count();
+        for (StreamingCamera& c : cameras) {
+            const uint64_t shutters = c.framework->getNumShutters() - c.windowShutters0;
+            c.minWindowFps = std::min(c.minWindowFps, shutters / windowSeconds);
+        }
+    }
+
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    uint64_t totalShutters = 0;
+    uint64_t totalErrors = 0;
+    for (int i = 0; i < kNumCameras; ++i) {
+        StreamingCamera& c = cameras[i];
+        c.session->flush();
+        c.session->close();
+
+        const uint64_t shutters = c.framework->getNumShutters();
+        const std::string prefix = "camera" + std::to_string(i) + "_";
+        state.counters[prefix + "fps"] = shutters / seconds;
+        state.counters[prefix + "min_fps"] = c.minWindowFps;
+        totalShutters += shutters;
+        totalErrors += c.framework->getNumErrors();
+    }
+
+    state.counters["fps"] = totalShutters / seconds;
+    state.counters["errors"] = totalErrors;
+}
+
+BENCHMARK(BM_ConcurrentCameras)->Iterations(20)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
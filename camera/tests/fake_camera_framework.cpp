@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <aidlcommonsupport/NativeHandle.h>
+#include <log/log.h>
+
+#include "fake_camera_framework.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+
+using aidl::android::hardware::camera::device::BufferStatus;
+using aidl::android::hardware::camera::device::StreamType;
+using aidl::android::hardware::graphics::common::PixelFormat;
+
+namespace {
+constexpr char kRequestorName[] = "FakeCameraFramework";
+}  // namespace
+
+bool FakeCameraFramework::allocateBuffers(const std::vector<Stream>& streams,
+                                          const std::vector<HalStream>& halStreams) {
+    std::lock_guard<std::mutex> lock(mMtx);
+
+    for (size_t i = 0; i < streams.size(); ++i) {
+        const Stream& s = streams[i];
+        const HalStream& hs = halStreams[i];
+
+        // BLOB buffers are `bufferSize` bytes long, the app writes input buffers
+        const bool blob = (hs.overrideFormat == PixelFormat::BLOB);
+        const uint32_t width = blob ? s.bufferSize : s.width;
+        const uint32_t height = blob ? 1 : s.height;
+        const uint64_t usage = static_cast<uint64_t>(s.usage) |
+            ((s.streamType == StreamType::INPUT) ?
+                static_cast<uint64_t>(hs.consumerUsage) :
+                static_cast<uint64_t>(hs.producerUsage));
+
+        StreamBuffers& sbs = mStreams[s.id];
+        for (int32_t j = 0; j < hs.maxBuffers; ++j) {
+            sp<GraphicBuffer> gb = sp<GraphicBuffer>::make(
+                width, height, static_cast<int32_t>(hs.overrideFormat), 1,
+                usage, kRequestorName);
+            if (gb->initCheck() != NO_ERROR) {
+                return false;
+            }
+
+            const int64_t bufferId = mNextBufferId++;
+            sbs.buffers[bufferId].gb = std::move(gb);
+            sbs.freeBufferIds.push_back(bufferId);
+        }
+    }
+
+    return true;
+}
+
+size_t FakeCameraFramework::submit(ICameraDeviceSession& session, const size_t n,
+                                   const std::vector<int32_t>& streamIds,
+                                   const CameraMetadata& settings) {
+    std::vector<CaptureRequest> requests;
+
+    {
+        std::lock_guard<std::mutex> lock(mMtx);
+
+        while (requests.size() < n) {
+            CaptureRequest req;
+
+            for (const int32_t streamId : streamIds) {
+                StreamBuffer sb;
+                if (takeBufferLocked(streamId, &sb)) {
+                    req.outputBuffers.push_back(std::move(sb));
+                }
+            }
+
+            if (req.outputBuffers.empty() ||
+                    (req.outputBuffers.front().streamId != streamIds.front())) {
+                for (const StreamBuffer& sb : req.outputBuffers) {
+                    untakeBufferLocked(sb);
+                }
+                break;
+            }
+
+            if (requests.empty()) {
+                req.settings = settings;
+            }
+            req.frameNumber = mNextFrameNumber++;
+            requests.push_back(std::move(req));
+        }
+    }
+
+    if (requests.empty()) {
+        return 0;
+    }
+
+    return sendRequests(session, std::move(requests));
+}
+
+bool FakeCameraFramework::submitReprocess(ICameraDeviceSession& session,
+                                          const int32_t inputStreamId,
+                                          const std::vector<int32_t>& streamIds,
+                                          const CameraMetadata& settings) {
+    std::vector<CaptureRequest> requests(1);
+    CaptureRequest& req = requests.front();
+
+    {
+        std::lock_guard<std::mutex> lock(mMtx);
+
+        bool ok = takeBufferLocked(inputStreamId, &req.inputBuffer);
+        for (const int32_t streamId : streamIds) {
+            StreamBuffer sb;
+            if (takeBufferLocked(streamId, &sb)) {
+                req.outputBuffers.push_back(std::move(sb));
+            } else {
+                ok = false;
+            }
+        }
+
+        if (!ok) {
+            if (req.inputBuffer.bufferId) {
+                untakeBufferLocked(req.inputBuffer);
+            }
+            for (const StreamBuffer& sb : req.outputBuffers) {
+                untakeBufferLocked(sb);
+            }
+            return false;
+        }
+
+        req.settings = settings;
+        req.frameNumber = mNextFrameNumber++;
+    }
+
+    return sendRequests(session, std::move(requests)) == 1;
+}
+
+// Takes a free buffer of the stream, it counts as in flight
+bool FakeCameraFramework::takeBufferLocked(const int32_t streamId, StreamBuffer* sb) {
+    StreamBuffers& sbs = mStreams[streamId];
+    if (sbs.freeBufferIds.empty()) {
+        return false;
+    }
+
+    const int64_t bufferId = sbs.freeBufferIds.back();
+    sbs.freeBufferIds.pop_back();
+    Buffer& b = sbs.buffers[bufferId];
+
+    sb->streamId = streamId;
+    sb->bufferId = bufferId;
+    if (!b.sent) {
+        sb->buffer = dupToAidl(b.gb->handle);
+        b.sent = true;
+    }
+
+    // results could come back before `processCaptureRequest` returns
+    b.inFlight = true;
+    ++mNumBuffersInFlight;
+    return true;
+}
+
+// The buffer was not sent, the handle goes with it next time
+void FakeCameraFramework::untakeBufferLocked(const StreamBuffer& sb) {
+    mStreams[sb.streamId].buffers[sb.bufferId].sent = false;
+    returnBufferLocked(sb);
+}
+
+size_t FakeCameraFramework::sendRequests(ICameraDeviceSession& session,
+                                         std::vector<CaptureRequest> requests) {
+    int32_t count = 0;
+    session.processCaptureRequest(requests, {}, &count);
+
+    // not accepted requests might not leave their handles cached, they are
+    // sent again next time
+    std::lock_guard<std::mutex> lock(mMtx);
+    for (size_t i = count; i < requests.size(); ++i) {
+        const CaptureRequest& req = requests[i];
+        for (const StreamBuffer& sb : req.outputBuffers) {
+            untakeBufferLocked(sb);
+        }
+        if (req.inputBuffer.bufferId) {
+            untakeBufferLocked(req.inputBuffer);
+        }
+    }
+
+    return count;
+}
+
+size_t FakeCameraFramework::getNumBuffersInFlight() const {
+    std::lock_guard<std::mutex> lock(mMtx);
+    return mNumBuffersInFlight;
+}
+
+size_t FakeCameraFramework::getNumFreeBuffers(const int32_t streamId) const {
+    std::lock_guard<std::mutex> lock(mMtx);
+    const auto i = mStreams.find(streamId);
+    return (i == mStreams.end()) ? 0 : i->second.freeBufferIds.size();
+}
+
+uint64_t FakeCameraFramework::getNumShutters() const {
+    std::lock_guard<std::mutex> lock(mMtx);
+    return mNumShutters;
+}
+
+uint64_t FakeCameraFramework::getNumErrors() const {
+    std::lock_guard<std::mutex> lock(mMtx);
+    return mNumErrors;
+}
+
+uint64_t FakeCameraFramework::getNumFailedBuffers() const {
+    std::lock_guard<std::mutex> lock(mMtx);
+    return mNumFailedBuffers;
+}
+
+uint64_t FakeCameraFramework::getNumUnexpectedBuffers() const {
+    std::lock_guard<std::mutex> lock(mMtx);
+    return mNumUnexpectedBuffers;
+}
+
+ndk::ScopedAStatus FakeCameraFramework::notify(const std::vector<NotifyMsg>& msgs) {
+    std::lock_guard<std::mutex> lock(mMtx);
+
+    for (const NotifyMsg& msg : msgs) {
+        if (msg.getTag() == NotifyMsg::Tag::shutter) {
+            ++mNumShutters;
+        } else {
+            ++mNumErrors;
+        }
+    }
+
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus FakeCameraFramework::processCaptureResult(
+        const std::vector<CaptureResult>& results) {
+    std::lock_guard<std::mutex> lock(mMtx);
+
+    for (const CaptureResult& cr : results) {
+        for (const StreamBuffer& sb : cr.outputBuffers) {
+            returnBufferLocked(sb);
+        }
+        if (cr.inputBuffer.bufferId) {
+            returnBufferLocked(cr.inputBuffer);
+        }
+    }
+
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus FakeCameraFramework::requestStreamBuffers(
+        const std::vector<BufferRequest>& /*bufReqs*/,
+        std::vector<StreamBufferRet>* /*buffers*/,
+        BufferRequestStatus* status) {
+    *status = BufferRequestStatus::FAILED_UNKNOWN;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus FakeCameraFramework::returnStreamBuffers(
+        const std::vector<StreamBuffer>& buffers) {
+    std::lock_guard<std::mutex> lock(mMtx);
+
+    for (const StreamBuffer& sb : buffers) {
+        returnBufferLocked(sb);
+    }
+
+    return ndk::ScopedAStatus::ok();
+}
+
+void FakeCameraFramework::returnBufferLocked(const StreamBuffer& sb) {
+    StreamBuffers& sbs = mStreams[sb.streamId];
+    const auto i = sbs.buffers.find(sb.bufferId);
+    if ((i == sbs.buffers.end()) || !i->second.inFlight) {
+        ++mNumUnexpectedBuffers;
+        return;
+    }
+    i->second.inFlight = false;
+
+    LOG_ALWAYS_FATAL_IF(!mNumBuffersInFlight);
+    --mNumBuffersInFlight;
+    if (sb.status != BufferStatus::OK) {
+        ++mNumFailedBuffers;
+    }
+    sbs.freeBufferIds.push_back(sb.bufferId);
+}
+
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <aidl/android/hardware/camera/device/BnCameraDeviceCallback.h>
+#include <aidl/android/hardware/camera/device/BnCameraOfflineSessionCallback.h>
+#include <aidl/android/hardware/camera/device/CaptureRequest.h>
+#include <aidl/android/hardware/camera/device/HalStream.h>
+#include <aidl/android/hardware/camera/device/ICameraDeviceSession.h>
+#include <aidl/android/hardware/camera/device/Stream.h>
+#include <ui/GraphicBuffer.h>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+
+using aidl::android::hardware::camera::device::BnCameraDeviceCallback;
+using aidl::android::hardware::camera::device::BnCameraOfflineSessionCallback;
+using aidl::android::hardware::camera::device::BufferRequest;
+using aidl::android::hardware::camera::device::BufferRequestStatus;
+using aidl::android::hardware::camera::device::CameraMetadata;
+using aidl::android::hardware::camera::device::CaptureRequest;
+using aidl::android::hardware::camera::device::CaptureResult;
+using aidl::android::hardware::camera::device::HalStream;
+using aidl::android::hardware::camera::device::ICameraDeviceSession;
+using aidl::android::hardware::camera::device::NotifyMsg;
+using aidl::android::hardware::camera::device::Stream;
+using aidl::android::hardware::camera::device::StreamBuffer;
+using aidl::android::hardware::camera::device::StreamBufferRet;
+
+// Plays the camera framework for a session: owns gralloc buffers of the
+// configured streams, submits requests with the free ones and takes them
+// back from results.
+struct FakeCameraFramework : public BnCameraDeviceCallback {
+    // `maxBuffers` buffers for every output and input stream
+    bool allocateBuffers(const std::vector<Stream>& streams,
+                         const std::vector<HalStream>& halStreams);
+
+    // Sends up to `n` requests in one `processCaptureRequest` call. A request
+    // gets a buffer of each stream in `streamIds` which has a free one, the
+    // first stream must have one. `settings` go with the first request.
+    // Returns the number of accepted requests.
+    size_t submit(ICameraDeviceSession& session, size_t n,
+                  const std::vector<int32_t>& streamIds,
+                  const CameraMetadata& settings = {});
+
+    // Sends one reprocess request with a buffer of the input stream and a
+    // buffer of each stream in `streamIds`, all of them must have one.
+    // Returns true if the request was accepted.
+    bool submitReprocess(ICameraDeviceSession& session, int32_t inputStreamId,
+                         const std::vector<int32_t>& streamIds,
+                         const CameraMetadata& settings);
+
+    size_t getNumBuffersInFlight() const;
+    size_t getNumFreeBuffers(int32_t streamId) const;
+    uint64_t getNumShutters() const;
+    uint64_t getNumErrors() const;
+    // buffers which came back with BufferStatus::ERROR
+    uint64_t getNumFailedBuffers() const;
+    // buffers which came back while the session did not have them (e.g.
+    // returned twice), they are not counted anywhere else
+    uint64_t getNumUnexpectedBuffers() const;
+
+    ndk::ScopedAStatus notify(const std::vector<NotifyMsg>& msgs) override;
+    ndk::ScopedAStatus processCaptureResult(const std::vector<CaptureResult>& results) override;
+    ndk::ScopedAStatus requestStreamBuffers(const std::vector<BufferRequest>& bufReqs,
+                                            std::vector<StreamBufferRet>* buffers,
+                                            BufferRequestStatus* status) override;
+    ndk::ScopedAStatus returnStreamBuffers(const std::vector<StreamBuffer>& buffers) override;
+
+private:
+    struct Buffer {
+        sp<GraphicBuffer> gb;
+        bool sent = false;  // the session has the handle cached
+        bool inFlight = false;
+    };
+
+    struct StreamBuffers {
+        std::unordered_map<int64_t, Buffer> buffers;
+        std::vector<int64_t> freeBufferIds;
+    };
+
+    bool takeBufferLocked(int32_t streamId, StreamBuffer* sb);
+    void untakeBufferLocked(const StreamBuffer& sb);
+    void returnBufferLocked(const StreamBuffer& sb);
+    size_t sendRequests(ICameraDeviceSession& session, std::vector<CaptureRequest> requests);
+
+    mutable std::mutex mMtx;
+    std::unordered_map<int32_t, StreamBuffers> mStreams;
+    int64_t mNextBufferId = 1;
+    int32_t mNextFrameNumber = 0;
+    size_t mNumBuffersInFlight = 0;
+    uint64_t mNumShutters = 0;
+    uint64_t mNumErrors = 0;
+    uint64_t mNumFailedBuffers = 0;
+    uint64_t mNumUnexpectedBuffers = 0;
+};
+
+// Delivers results of an offline session (see `switchToOffline`) to the
+// framework which owns their buffers.
+struct FakeOfflineSessionCallback : public BnCameraOfflineSessionCallback {
+    explicit FakeOfflineSessionCallback(std::shared_ptr<FakeCameraFramework> framework)
+            : mFramework(std::move(framework)) {}
+
+    ndk::ScopedAStatus notify(const std::vector<NotifyMsg>& msgs) override {
+        return mFramework->notify(msgs);
+    }
+
+    ndk::ScopedAStatus processCaptureResult(const std::vector<CaptureResult>& results) override {
+        return mFramework->processCaptureResult(results);
+    }
+
+private:
+    const std::shared_ptr<FakeCameraFramework> mFramework;
+};
+
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "fake_hw_camera.h"
+#include "yuv.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+namespace {
+
+constexpr unsigned kAcquireFenceTimeoutMs = 100;
+constexpr int64_t kAbortPollNs = 1000000;
+const Rect<uint16_t> kResolution = {640, 480};
+
+// false if `*abort` became true before `ns` passed
+bool sleepUnlessAborted(int64_t ns, const std::atomic<bool>* abort) {
+    using namespace std::chrono_literals;
+
+    while (ns > 0) {
+        if (abort && *abort) {
+            return false;
+        }
+
+        const int64_t stepNs = std::min(ns, kAbortPollNs);
+        std::this_thread::sleep_for(1ns * stepNs);
+        ns -= stepNs;
+    }
+
+    return !(abort && *abort);
+}
+
+}  // namespace
+
+FakeHwCamera::FakeHwCamera(const Params params)
+        : mParams(params)
+        , mHighSpeedVideoConfig({kResolution, params.highSpeedMaxFps}) {}
+
+std::tuple<PixelFormat, BufferUsage, Dataspace, int32_t>
+FakeHwCamera::overrideStreamParams(const PixelFormat format,
+                                   const BufferUsage usage,
+                                   const Dataspace dataspace) const {
+    const BufferUsage producerUsage = static_cast<BufferUsage>(
+        static_cast<uint64_t>(usage) | static_cast<uint64_t>(BufferUsage::CPU_WRITE_OFTEN));
+
+    switch (format) {
+    case PixelFormat::IMPLEMENTATION_DEFINED:
+        return {PixelFormat::YCBCR_420_888, producerUsage, dataspace, kMaxBuffers};
+
+    case PixelFormat::YCBCR_420_888:
+    case PixelFormat::BLOB:
+        return {format, producerUsage, dataspace, kMaxBuffers};
+
+    default:
+        return {format, usage, dataspace, kErrorBadFormat};
+    }
+}
+
+bool FakeHwCamera::configure(const CameraMetadata& /*sessionParams*/,
+                             size_t nStreams, const Stream* streams,
+                             const HalStream* halStreams) {
+    mBlobStreams.clear();
+    for (; nStreams > 0; --nStreams, ++streams, ++halStreams) {
+        if (halStreams->overrideFormat == PixelFormat::BLOB) {
+            BlobStream bs;
+            bs.id = streams->id;
+            bs.size = {static_cast<uint16_t>(streams->width),
+                       static_cast<uint16_t>(streams->height)};
+            bs.bufferSize = streams->bufferSize;
+            if (mParams.compressJpeg) {
+                std::vector<uint8_t> image(yuv::NV21size(bs.size.width, bs.size.height));
+                std::fill(image.begin() + bs.size.width * bs.size.height, image.end(), 128);
+                bs.nv21Image = std::make_shared<const std::vector<uint8_t>>(std::move(image));
+            }
+            mBlobStreams.push_back(std::move(bs));
+        }
+    }
+
+    return true;
+}
+
+void FakeHwCamera::close() {
+    mBlobStreams.clear();
+    mSettings = {};
+}
+
+std::tuple<int64_t, CameraMetadata, std::vector<StreamBuffer>,
+           std::vector<DelayedStreamBuffer>>
+FakeHwCamera::processCaptureRequest(CameraMetadata metadataUpdate,
+                                    Span<CachedStreamBuffer*> csbs) {
+    if (!metadataUpdate.metadata.empty()) {
+        mSettings = std::move(metadataUpdate);
+    }
+
+    waitAcquireFences({csbs.begin(), csbs.end()}, kAcquireFenceTimeoutMs);
+
+    // the host round trip
+    const bool ok = sleepUnlessAborted(mParams.queryFrameNs, &mAborting);
+
+    std::vector<StreamBuffer> outputBuffers;
+    std::vector<DelayedStreamBuffer> delayedOutputBuffers;
+
+    for (CachedStreamBuffer* csb : csbs) {
+        if (!ok) {
+            outputBuffers.push_back(csb->finish(false));
+        } else if (const BlobStream* bs = findBlobStream(csb->getStreamId())) {
+            DelayedStreamBuffer dsb;
+            if (bs->nv21Image) {
+                dsb.process = [csb, size = bs->size, bufferSize = bs->bufferSize,
+                               image = bs->nv21Image, settings = mSettings]
+                              (const bool ok, const std::atomic<bool>* abort) -> StreamBuffer {
+                    if (!ok) {
+                        return csb->finish(false);
+                    }
+
+                    const android_ycbcr ycbcr = yuv::NV21init(
+                        size.width, size.height, const_cast<uint8_t*>(image->data()));
+                    return csb->finish(compressJpeg(size, ycbcr, settings,
+                                                    csb->getBuffer(), bufferSize, abort));
+                };
+            } else {
+                const int64_t encodeNs = mParams.encodeNs;
+                dsb.process = [csb, encodeNs](const bool ok,
+                                              const std::atomic<bool>* abort) -> StreamBuffer {
+                    return csb->finish(ok && sleepUnlessAborted(encodeNs, abort));
+                };
+            }
+            dsb.streamId = csb->getStreamId();
+            delayedOutputBuffers.push_back(std::move(dsb));
+        } else {
+            outputBuffers.push_back(csb->finish(true));
+        }
+    }
+
+    return {mParams.frameDurationNs, CameraMetadata(),
+            std::move(outputBuffers), std::move(delayedOutputBuffers)};
+}
+
+void FakeHwCamera::setAborting(const bool aborting) {
+    mAborting = aborting;
+}
+
+const FakeHwCamera::BlobStream* FakeHwCamera::findBlobStream(const int32_t streamId) const {
+    const auto i = std::find_if(mBlobStreams.begin(), mBlobStreams.end(),
+                                [streamId](const BlobStream& bs) { return bs.id == streamId; });
+    return (i == mBlobStreams.end()) ? nullptr : &*i;
+}
+
+Span<const std::pair<int32_t, int32_t>> FakeHwCamera::getTargetFpsRanges() const {
+    static const std::pair<int32_t, int32_t> targetFpsRanges[] = {{30, 30}};
+    return targetFpsRanges;
+}
+
+Span<const HighSpeedVideoConfig> FakeHwCamera::getHighSpeedVideoConfigs() const {
+    if (mParams.highSpeedMaxFps > 0) {
+        return {&mHighSpeedVideoConfig, 1};
+    } else {
+        return {};
+    }
+}
+
+Span<const Rect<uint16_t>> FakeHwCamera::getAvailableThumbnailSizes() const {
+    static const Rect<uint16_t> availableThumbnailSizes[] = {{0, 0}};
+    return availableThumbnailSizes;
+}
+
+bool FakeHwCamera::isBackFacing() const {
+    return true;
+}
+
+std::tuple<int32_t, int32_t, int32_t> FakeHwCamera::getMaxNumOutputStreams() const {
+    return {0, 2, 1};
+}
+
+Span<const PixelFormat> FakeHwCamera::getSupportedPixelFormats() const {
+    static const PixelFormat supportedPixelFormats[] = {
+        PixelFormat::YCBCR_420_888,
+        PixelFormat::BLOB,
+    };
+
+    return supportedPixelFormats;
+}
+
+Span<const Rect<uint16_t>> FakeHwCamera::getSupportedResolutions() const {
+    return {&kResolution, 1};
+}
+
+int64_t FakeHwCamera::getMinFrameDurationNs() const {
+    return mParams.frameDurationNs;
+}
+
+Rect<uint16_t> FakeHwCamera::getSensorSize() const {
+    return kResolution;
+}
+
+std::pair<int64_t, int64_t> FakeHwCamera::getSensorExposureTimeRange() const {
+    return {mParams.frameDurationNs / 2, mParams.frameDurationNs};
+}
+
+int64_t FakeHwCamera::getSensorMaxFrameDuration() const {
+    return mParams.frameDurationNs;
+}
+
+std::pair<int32_t, int32_t> FakeHwCamera::getDefaultTargetFpsRange(RequestTemplate) const {
+    return getTargetFpsRanges()[0];
+}
+
+int64_t FakeHwCamera::getDefaultSensorExpTime() const {
+    return mParams.frameDurationNs / 2;
+}
+
+int64_t FakeHwCamera::getDefaultSensorFrameDuration() const {
+    return mParams.frameDurationNs;
+}
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
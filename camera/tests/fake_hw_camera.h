@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "HwCamera.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+// An HwCamera which does not produce images, it only spends the time a real
+// one would: `queryFrameNs` per frame on the capture thread and `encodeNs`
+// per BLOB buffer on the delayed thread. Both give up once aborted.
+// Constrained high-speed sessions are supported if `highSpeedMaxFps` is set.
+// With `compressJpeg` BLOB buffers get real JPEG images (of a black frame)
+// instead of sleeping `encodeNs`.
+struct FakeHwCamera : public HwCamera {
+    struct Params {
+        int64_t frameDurationNs;
+        int64_t queryFrameNs;
+        int64_t encodeNs;
+        int32_t highSpeedMaxFps = 0;
+        bool compressJpeg = false;
+    };
+
+    explicit FakeHwCamera(Params params);
+
+    std::tuple<PixelFormat, BufferUsage, Dataspace, int32_t>
+        overrideStreamParams(PixelFormat, BufferUsage, Dataspace) const override;
+
+    bool configure(const CameraMetadata& sessionParams, size_t nStreams,
+                   const Stream* streams, const HalStream* halStreams) override;
+    void close() override;
+
+    std::tuple<int64_t, CameraMetadata, std::vector<StreamBuffer>,
+               std::vector<DelayedStreamBuffer>>
+        processCaptureRequest(CameraMetadata, Span<CachedStreamBuffer*>) override;
+
+    void setAborting(bool aborting) override;
+
+    Span<const std::pair<int32_t, int32_t>> getTargetFpsRanges() const override;
+    Span<const HighSpeedVideoConfig> getHighSpeedVideoConfigs() const override;
+    Span<const Rect<uint16_t>> getAvailableThumbnailSizes() const override;
+    bool isBackFacing() const override;
+    std::tuple<int32_t, int32_t, int32_t> getMaxNumOutputStreams() const override;
+    Span<const PixelFormat> getSupportedPixelFormats() const override;
+    Span<const Rect<uint16_t>> getSupportedResolutions() const override;
+    int64_t getMinFrameDurationNs() const override;
+    Rect<uint16_t> getSensorSize() const override;
+    std::pair<int64_t, int64_t> getSensorExposureTimeRange() const override;
+    int64_t getSensorMaxFrameDuration() const override;
+    std::pair<int32_t, int32_t> getDefaultTargetFpsRange(RequestTemplate) const override;
+    int64_t getDefaultSensorExpTime() const override;
+    int64_t getDefaultSensorFrameDuration() const override;
+
+    static constexpr int32_t kMaxBuffers = 8;
+
+private:
+    struct BlobStream {
+        int32_t id;
+        Rect<uint16_t> size;
+        uint32_t bufferSize;
+        std::shared_ptr<const std::vector<uint8_t>> nv21Image;  // if compressJpeg
+    };
+
+    const BlobStream* findBlobStream(int32_t streamId) const;
+
+    const Params mParams;
+    const HighSpeedVideoConfig mHighSpeedVideoConfig;
+    std::vector<BlobStream> mBlobStreams;
+    CameraMetadata mSettings;  // the last ones applied
+    std::atomic<bool> mAborting = false;
+};
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
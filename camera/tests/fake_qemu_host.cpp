@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <log/log.h>
+
+#include "fake_qemu_host.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+FakeQemuHost::FakeQemuHost(const bool binary) : mBinary(binary) {
+    int fds[2];
+    LOG_ALWAYS_FATAL_IF(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+    mHostFd.reset(fds[0]);
+    mGuestFd.reset(fds[1]);
+
+    mThread = std::thread(&FakeQemuHost::threadLoop, this);
+}
+
+FakeQemuHost::~FakeQemuHost() {
+    shutdown(mHostFd.get(), SHUT_RDWR);
+    mThread.join();
+}
+
+base::unique_fd FakeQemuHost::takeChannelFd() {
+    return std::move(mGuestFd);
+}
+
+void FakeQemuHost::setReplyBatch(const size_t n) {
+    std::lock_guard<std::mutex> lock(mMtx);
+    mReplyBatch = n;
+}
+
+void FakeQemuHost::failFrame(const uint32_t n, const int status) {
+    std::lock_guard<std::mutex> lock(mMtx);
+    mFailures[n] = status;
+}
+
+uint32_t FakeQemuHost::getNumFrameRequests() const {
+    std::lock_guard<std::mutex> lock(mMtx);
+    return mNumFrameRequests;
+}
+
+std::vector<std::string> FakeQemuHost::getQueries() const {
+    std::lock_guard<std::mutex> lock(mMtx);
+    return mQueries;
+}
+
+void FakeQemuHost::threadLoop() {
+    std::string query;
+    QemuFrameRequest req;
+
+    while (readQuery(&query, &req)) {
+        if (query.empty()) {
+            handleFrame(req.requestId);
+        } else if (!query.compare(0, 6, "frame ")) {
+            handleFrame(0);
+        } else if (query == "caps") {
+            {
+                std::lock_guard<std::mutex> lock(mMtx);
+                mQueries.push_back(query);
+            }
+
+            if (mBinary) {
+                static const char kReply[] = "ok:binframe";
+                sendReply(kReply, sizeof(kReply));
+            } else {
+                static const char kReply[] = "ko:unknown command";
+                sendReply(kReply, sizeof(kReply));
+            }
+        } else {
+            {
+                std::lock_guard<std::mutex> lock(mMtx);
+                mQueries.push_back(query);
+            }
+
+            static const char kReply[] = "ok";
+            sendReply(kReply, sizeof(kReply));
+        }
+    }
+}
+
+// Returns a text query in `query` or an empty string and a binary request in
+// `req`. Text queries are zero terminated.
+bool FakeQemuHost::readQuery(std::string* query, QemuFrameRequest* req) {
+    query->clear();
+
+    uint32_t magic;
+    if (!base::ReadFully(mHostFd.get(), &magic, sizeof(magic))) {
+        return false;
+    }
+
+    if (magic == QemuFrameRequest::kMagic) {
+        req->magic = magic;
+        return base::ReadFully(mHostFd.get(), reinterpret_cast<uint8_t*>(req) + sizeof(magic),
+                               sizeof(*req) - sizeof(magic));
+    }
+
+    const char* const head = reinterpret_cast<const char*>(&magic);
+    const size_t headLen = strnlen(head, sizeof(magic));
+    query->assign(head, headLen);
+    if (headLen < sizeof(magic)) {
+        return true;
+    }
+
+    while (true) {
+        char c;
+        if (!base::ReadFully(mHostFd.get(), &c, 1)) {
+            return false;
+        } else if (!c) {
+            return true;
+        } else {
+            query->push_back(c);
+        }
+    }
+}
+
+// `requestId` is zero for text requests, their replies carry no id.
+void FakeQemuHost::handleFrame(const uint32_t requestId) {
+    std::vector<PendingReply> replies;
+    {
+        std::lock_guard<std::mutex> lock(mMtx);
+        const uint32_t n = ++mNumFrameRequests;
+        const auto i = mFailures.find(n);
+        mPendingReplies.push_back({requestId, (i == mFailures.end()) ? 0 : i->second});
+
+        if (mPendingReplies.size() < std::max(mReplyBatch, size_t(1))) {
+            return;
+        }
+
+        replies.swap(mPendingReplies);
+    }
+
+    if (mBinary && requestId) {
+        std::reverse(replies.begin(), replies.end());
+    }
+
+    for (const PendingReply& r : replies) {
+        if (r.requestId) {
+            QemuFrameReply reply;
+            reply.magic = QemuFrameReply::kMagic;
+            reply.requestId = r.requestId;
+            reply.status = r.status;
+            reply.reserved = 0;
+            sendReply(&reply, sizeof(reply));
+        } else if (r.status) {
+            static const char kReply[] = "ko:frame failed";
+            sendReply(kReply, sizeof(kReply));
+        } else {
+            static const char kReply[] = "ok";
+            sendReply(kReply, sizeof(kReply));
+        }
+    }
+}
+
+void FakeQemuHost::sendReply(const void* const data, const size_t size) {
+    char len16[9];
+    snprintf(len16, sizeof(len16), "%08zx", size);
+    if (!base::WriteFully(mHostFd.get(), len16, 8) ||
+            !base::WriteFully(mHostFd.get(), data, size)) {
+        ALOGE("%s:%d: write failed with %s (%d)", __func__, __LINE__,
+              strerror(errno), errno);
+    }
+}
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "qemu_channel.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+// The host side of the camera qemu channel over a socketpair, it speaks the
+// text protocol and, if `binary`, the binary frame protocol. Frames are not
+// written anywhere, only replied to.
+struct FakeQemuHost {
+    explicit FakeQemuHost(bool binary);
+    ~FakeQemuHost();
+
+    // The guest end, for QemuChannel.
+    base::unique_fd takeChannelFd();
+
+    // Frame replies are held until `n` of them are pending, binary ones are
+    // then sent in the reverse order. Zero replies right away.
+    void setReplyBatch(size_t n);
+    // The reply to the `n`th (starting from 1) frame request carries `status`.
+    void failFrame(uint32_t n, int status);
+
+    uint32_t getNumFrameRequests() const;
+    std::vector<std::string> getQueries() const;
+
+private:
+    struct PendingReply {
+        uint32_t requestId;
+        int status;
+    };
+
+    void threadLoop();
+    bool readQuery(std::string* query, QemuFrameRequest* req);
+    void handleFrame(uint32_t requestId);
+    void sendReply(const void* data, size_t size);
+
+    const bool mBinary;
+    base::unique_fd mHostFd;
+    base::unique_fd mGuestFd;
+
+    mutable std::mutex mMtx;
+    std::vector<std::string> mQueries;  // text ones, except frames
+    std::vector<PendingReply> mPendingReplies;
+    std::unordered_map<uint32_t, int> mFailures;
+    uint32_t mNumFrameRequests = 0;
+    size_t mReplyBatch = 0;
+
+    std::thread mThread;
+};
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <string>
+
+#include <aidlcommonsupport/NativeHandle.h>
+#include <android-base/properties.h>
+#include <benchmark/benchmark.h>
+#include <ui/GraphicBuffer.h>
+
+#include "FakeRotatingCamera.h"
+#include "StreamBufferCache.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+using aidl::android::hardware::camera::device::BufferStatus;
+using aidl::android::hardware::camera::device::HalStream;
+using aidl::android::hardware::camera::device::Stream;
+using aidl::android::hardware::camera::device::StreamRotation;
+using aidl::android::hardware::camera::device::StreamType;
+using aidl::android::hardware::graphics::common::BufferUsage;
+using aidl::android::hardware::graphics::common::Dataspace;
+using aidl::android::hardware::graphics::common::PixelFormat;
+
+constexpr char kRendererProp[] = "vendor.qemu.FakeRotatingCamera.renderer";
+constexpr const char* kRenderers[] = {"cpu", "gl"};
+constexpr int32_t kStreamId = 0;
+
+// FakeRotatingCamera reads the property once when it is created.
+struct ScopedRenderer {
+    explicit ScopedRenderer(const char* renderer)
+            : mPrevious(base::GetProperty(kRendererProp, "")) {
+        mOk = base::SetProperty(kRendererProp, renderer) &&
+              base::WaitForProperty(kRendererProp, renderer, std::chrono::seconds(1));
+    }
+
+    ~ScopedRenderer() {
+        base::SetProperty(kRendererProp, mPrevious);
+    }
+
+    bool ok() const { return mOk; }
+
+private:
+    const std::string mPrevious;
+    bool mOk;
+};
+
+// Renders frames of one stream straight into a gralloc buffer, without a
+// session pacing them. Needs the emulator (the sensors pipe) and permission
+// to set vendor properties.
+// Args: renderer (0 - cpu, 1 - gl), format (0 - YUV, 1 - RGBA), width, height.
+void BM_FakeRotatingCameraRender(benchmark::State& state) {
+    const char* renderer = kRenderers[state.range(0)];
+    const PixelFormat format = state.range(1) ?
+        PixelFormat::RGBA_8888 : PixelFormat::YCBCR_420_888;
+
+    const ScopedRenderer scopedRenderer(renderer);
+    if (!scopedRenderer.ok()) {
+        state.SkipWithError("could not set the renderer property");
+        return;
+    }
+
+    hw::FakeRotatingCamera camera(true);
+
+    Stream stream;
+    stream.id = kStreamId;
+    stream.streamType = StreamType::OUTPUT;
+    stream.width = state.range(2);
+    stream.height = state.range(3);
+    stream.format = format;
+    stream.usage = BufferUsage::CPU_READ_OFTEN;
+    stream.dataSpace = Dataspace::UNKNOWN;
+    stream.rotation = StreamRotation::ROTATION_0;
+
+    HalStream halStream;
+    int32_t maxBuffers;
+    std::tie(halStream.overrideFormat, halStream.producerUsage,
+             halStream.overrideDataSpace, maxBuffers) =
+        camera.overrideStreamParams(stream.format, stream.usage, stream.dataSpace);
+    if (maxBuffers <= 0) {
+        state.SkipWithError("unsupported stream");
+        return;
+    }
+    halStream.id = kStreamId;
+    halStream.maxBuffers = maxBuffers;
+
+    if (!camera.configure({}, 1, &stream, &halStream)) {
+        state.SkipWithError("configure failed");
+        return;
+    }
+
+    const sp<GraphicBuffer> gb = sp<GraphicBuffer>::make(
+        stream.width, stream.height, static_cast<int>(halStream.overrideFormat), 1,
+        static_cast<uint64_t>(halStream.producerUsage), "FakeRotatingCameraBenchmark");
+    if (gb->initCheck() != NO_ERROR) {
+        state.SkipWithError("could not allocate a buffer");
+        camera.close();
+        return;
+    }
+
+    StreamBuffer sb;
+    sb.streamId = kStreamId;
+    sb.bufferId = 1;
+    sb.buffer = dupToAidl(gb->handle);
+
+    StreamBufferCache cache;
+    cache.reserve(kStreamId, 1);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (auto _ : state) {
+        CachedStreamBuffer* csb = cache.update(sb);
+        auto [frameDurationNs, metadata, outputBuffers, delayedOutputBuffers] =
+            camera.processCaptureRequest({}, Span<CachedStreamBuffer*>(&csb, 1));
+        if ((outputBuffers.size() != 1) ||
+                (outputBuffers.front().status != BufferStatus::OK)) {
+            state.SkipWithError("processCaptureRequest failed");
+            break;
+        }
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    camera.close();
+
+    // GL renders off the calling thread, the CPU time would overstate it
+    state.SetLabel(renderer);
+    state.counters["fps"] = state.iterations() / elapsed.count();
+}
+BENCHMARK(BM_FakeRotatingCameraRender)
+    ->ArgNames({"gl", "rgba", "width", "height"})
+    ->ArgsProduct({{0, 1}, {0, 1}, {640}, {480}})
+    ->ArgsProduct({{0, 1}, {0, 1}, {1920}, {1080}})
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <android-base/properties.h>
+#include <gtest/gtest.h>
+#include <ui/GraphicBufferAllocator.h>
+
+#include "FakeRotatingCamera.h"
+#include "converters.h"
+#include "yuv.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+
+using aidl::android::hardware::camera::device::StreamRotation;
+using aidl::android::hardware::camera::device::StreamType;
+
+namespace {
+constexpr char kRendererProp[] = "vendor.qemu.FakeRotatingCamera.renderer";
+constexpr int32_t kStreamId = 0;
+constexpr uint16_t kWidth = 640;
+constexpr uint16_t kHeight = 480;
+
+// The shader and conv::rgba2yuv use the same coefficients, the difference
+// comes from mediump math in the shader and from GL_LINEAR averaging chroma
+// in 8 bits.
+constexpr int kMaxLumaDiff = 4;
+constexpr int kMaxChromaDiff = 6;
+constexpr double kMaxMeanDiff = 1.0;
+
+struct DiffStats {
+    void add(const int a, const int b) {
+        const int d = std::abs(a - b);
+        maxDiff = std::max(maxDiff, d);
+        sum += d;
+        ++n;
+    }
+
+    double mean() const { return n ? (double(sum) / n) : 0; }
+
+    int maxDiff = 0;
+    int64_t sum = 0;
+    int64_t n = 0;
+};
+}  // namespace
+
+// Renders the same camera pose through the packed YUV shader
+// (`renderIntoPackedYuv`) and through RGBA followed by `conv::rgba2yuv`.
+// Needs the emulator: GL and the sensors pipe.
+struct FakeRotatingCameraTest : public ::testing::Test {
+protected:
+    using RenderParams = FakeRotatingCamera::RenderParams;
+
+    void SetUp() override {
+        mPreviousRenderer = base::GetProperty(kRendererProp, "");
+        if (!base::SetProperty(kRendererProp, "gl") ||
+                !base::WaitForProperty(kRendererProp, "gl", std::chrono::seconds(1))) {
+            GTEST_SKIP() << "could not set " << kRendererProp;
+        }
+        mRendererSet = true;
+
+        mCamera = std::make_unique<FakeRotatingCamera>(true);
+
+        Stream stream;
+        stream.id = kStreamId;
+        stream.streamType = StreamType::OUTPUT;
+        stream.width = kWidth;
+        stream.height = kHeight;
+        stream.format = PixelFormat::YCBCR_420_888;
+        stream.usage = BufferUsage::CPU_READ_OFTEN;
+        stream.dataSpace = Dataspace::JFIF;
+        stream.rotation = StreamRotation::ROTATION_0;
+
+        HalStream halStream;
+        int32_t maxBuffers;
+        std::tie(halStream.overrideFormat, halStream.producerUsage,
+                 halStream.overrideDataSpace, maxBuffers) =
+            mCamera->overrideStreamParams(stream.format, stream.usage, stream.dataSpace);
+        ASSERT_GT(maxBuffers, 0);
+        halStream.id = kStreamId;
+        halStream.maxBuffers = maxBuffers;
+
+        if (!mCamera->configure({}, 1, &stream, &halStream)) {
+            GTEST_SKIP() << "FakeRotatingCamera::configure failed, not an emulator?";
+        }
+    }
+
+    void TearDown() override {
+        if (mCamera) {
+            mCamera->close();
+        }
+        if (mRendererSet) {
+            base::SetProperty(kRendererProp, mPreviousRenderer);
+        }
+    }
+
+    static RenderParams makeRenderParams(const float rotation[3]) {
+        constexpr double kR = 5.0;  // as in processCaptureRequest
+
+        RenderParams renderParams;
+        float* pos3 = renderParams.cameraParams.pos3;
+        pos3[0] = -kR * sin(rotation[0]) * sin(rotation[1]);
+        pos3[1] = -kR * sin(rotation[0]) * cos(rotation[1]);
+        pos3[2] = kR * cos(rotation[0]);
+        std::copy(rotation, rotation + 3, renderParams.cameraParams.rotXYZ3);
+        return renderParams;
+    }
+
+    bool renderPackedYuv(const RenderParams& renderParams,
+                         const android_ycbcr& ycbcr) const {
+        const FakeRotatingCamera::StreamInfo& si = mCamera->mStreamInfoCache.at(kStreamId);
+        if (!si.packedYuvBuffer) {
+            return false;
+        }
+
+        const abc3d::EglCurrentContext currentContext =
+            mCamera->mEglContext.getCurrentContext();
+        return currentContext.ok() && mCamera->renderIntoYcbcr(si, renderParams, ycbcr);
+    }
+
+    bool renderRgbaAndConvert(const RenderParams& renderParams,
+                              const android_ycbcr& ycbcr) const {
+        FakeRotatingCamera::StreamInfo si;
+        si.size = {kWidth, kHeight};
+        si.pixelFormat = PixelFormat::RGBA_8888;
+        si.usage = static_cast<BufferUsage>(static_cast<uint64_t>(BufferUsage::GPU_RENDER_TARGET) |
+                                            static_cast<uint64_t>(BufferUsage::CPU_READ_OFTEN));
+
+        const native_handle_t* buffer;
+        uint32_t stride;
+        if (GraphicBufferAllocator::get().allocate(
+                kWidth, kHeight, static_cast<int>(si.pixelFormat), 1,
+                static_cast<uint64_t>(si.usage), &buffer, &stride,
+                "FakeRotatingCameraTest") != NO_ERROR) {
+            return false;
+        }
+        si.rgbaBuffer.reset(buffer);
+
+        const abc3d::EglCurrentContext currentContext =
+            mCamera->mEglContext.getCurrentContext();
+        if (!currentContext.ok() ||
+                !mCamera->renderIntoRGBA(si, renderParams, si.rgbaBuffer.get())) {
+            return false;
+        }
+
+        void* rgba = nullptr;
+        if (!mCamera->grallocLock(si.rgbaBuffer.get(), BufferUsage::CPU_READ_OFTEN,
+                                  si.size, &rgba)) {
+            return false;
+        }
+
+        // conv::rgba2yuv expects tightly packed rows
+        std::vector<uint32_t> packed(size_t(kWidth) * kHeight);
+        for (size_t row = 0; row < kHeight; ++row) {
+            std::copy_n(static_cast<const uint32_t*>(rgba) + row * stride, kWidth,
+                        &packed[row * kWidth]);
+        }
+        mCamera->grallocUnlock(si.rgbaBuffer.get());
+
+        return conv::rgba2yuv(kWidth, kHeight, packed.data(), ycbcr);
+    }
+
+    std::unique_ptr<FakeRotatingCamera> mCamera;
+
+private:
+    std::string mPreviousRenderer;
+    bool mRendererSet = false;
+};
+
+TEST_F(FakeRotatingCameraTest, PackedYuvMatchesRgbaConversion) {
+    const float kRotations[][3] = {
+        {0, 0, 0},
+        {0.3f, 0.2f, 0.1f},
+        {1.1f, -0.7f, 0.4f},
+    };
+
+    for (const float* rotation : kRotations) {
+        SCOPED_TRACE(::testing::Message() << "rotation={" << rotation[0] << ", "
+                     << rotation[1] << ", " << rotation[2] << "}");
+        const RenderParams renderParams = makeRenderParams(rotation);
+
+        std::vector<uint8_t> packedData(yuv::NV21size(kWidth, kHeight));
+        const android_ycbcr packed = yuv::NV21init(kWidth, kHeight, packedData.data());
+        ASSERT_TRUE(renderPackedYuv(renderParams, packed));
+
+        std::vector<uint8_t> convertedData(yuv::NV21size(kWidth, kHeight));
+        const android_ycbcr converted = yuv::NV21init(kWidth, kHeight, convertedData.data());
+        ASSERT_TRUE(renderRgbaAndConvert(renderParams, converted));
+
+        DiffStats luma;
+        for (size_t row = 0; row < kHeight; ++row) {
+            const uint8_t* a = static_cast<const uint8_t*>(packed.y) + row * packed.ystride;
+            const uint8_t* b = static_cast<const uint8_t*>(converted.y) + row * converted.ystride;
+            for (size_t i = 0; i < kWidth; ++i) {
+                luma.add(a[i], b[i]);
+            }
+        }
+
+        DiffStats chroma;
+        for (size_t row = 0; row < kHeight / 2; ++row) {
+            const size_t offset = row * packed.cstride;
+            const uint8_t* aCb = static_cast<const uint8_t*>(packed.cb) + offset;
+            const uint8_t* aCr = static_cast<const uint8_t*>(packed.cr) + offset;
+            const uint8_t* bCb = static_cast<const uint8_t*>(converted.cb) + offset;
+            const uint8_t* bCr = static_cast<const uint8_t*>(converted.cr) + offset;
+            for (size_t i = 0; i < kWidth / 2; ++i) {
+                const size_t j = i * packed.chroma_step;
+                chroma.add(aCb[j], bCb[j]);
+                chroma.add(aCr[j], bCr[j]);
+            }
+        }
+
+        RecordProperty("max_luma_diff", luma.maxDiff);
+        RecordProperty("max_chroma_diff", chroma.maxDiff);
+        EXPECT_LE(luma.maxDiff, kMaxLumaDiff);
+        EXPECT_LE(chroma.maxDiff, kMaxChromaDiff);
+        EXPECT_LE(luma.mean(), kMaxMeanDiff);
+        EXPECT_LE(chroma.mean(), kMaxMeanDiff);
+    }
+}
+
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
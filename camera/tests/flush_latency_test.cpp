@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <aidl/android/hardware/camera/device/StreamConfigurationMode.h>
+#include <aidl/android/hardware/graphics/common/Dataspace.h>
+
+#include "CameraDeviceSession.h"
+#include "fake_camera_framework.h"
+#include "fake_hw_camera.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+using aidl::android::hardware::camera::device::CameraOfflineSessionInfo;
+using aidl::android::hardware::camera::device::ICameraOfflineSession;
+using aidl::android::hardware::camera::device::OfflineStream;
+using aidl::android::hardware::camera::device::StreamConfigurationMode;
+using aidl::android::hardware::camera::device::StreamRotation;
+using aidl::android::hardware::camera::device::StreamType;
+using aidl::android::hardware::graphics::common::Dataspace;
+
+using namespace std::chrono_literals;
+
+constexpr int32_t kYuvStreamId = 0;
+constexpr int32_t kJpegStreamId = 1;
+constexpr int32_t kJpegBufferSize = 1 << 20;
+constexpr size_t kBurstSize = 4;
+constexpr int kNumFlushes = 20;
+constexpr auto kFlushBudget = 100ms;
+constexpr int64_t kSlowEncodeNs = 100000000;
+constexpr auto kReopenBudget = 200ms;  // one encode which could be running and some
+
+Stream makeStream(const int32_t id, const PixelFormat format,
+                  const Dataspace dataspace, const BufferUsage usage) {
+    Stream s;
+    s.id = id;
+    s.streamType = StreamType::OUTPUT;
+    s.width = 640;
+    s.height = 480;
+    s.format = format;
+    s.usage = usage;
+    s.dataSpace = dataspace;
+    s.rotation = StreamRotation::ROTATION_0;
+    s.bufferSize = (format == PixelFormat::BLOB) ? kJpegBufferSize : 0;
+    return s;
+}
+
+StreamConfiguration makeYuvJpegConfig() {
+    StreamConfiguration cfg;
+    cfg.streams.push_back(makeStream(kYuvStreamId, PixelFormat::YCBCR_420_888,
+                                     Dataspace::UNKNOWN, BufferUsage::CPU_READ_OFTEN));
+    cfg.streams.push_back(makeStream(kJpegStreamId, PixelFormat::BLOB,
+                                     Dataspace::JFIF, BufferUsage::CPU_READ_OFTEN));
+    cfg.operationMode = StreamConfigurationMode::NORMAL_MODE;
+    cfg.streamConfigCounter = 1;
+    return cfg;
+}
+
+// The framework keeps every buffer it has in flight (YUV and JPEG bursts)
+// and flushes periodically. A flush interrupts host queries and JPEG
+// encodes, it must return all buffers well within the 100ms Android asks for.
+TEST(FlushLatencyTest, BurstCapture) {
+    hw::FakeHwCamera hwCamera({
+        1000000000 / 30,  // frameDurationNs
+        20000000,         // queryFrameNs, a slow host
+        60000000,         // encodeNs, a large JPEG
+    });
+
+    auto framework = ndk::SharedRefBase::make<FakeCameraFramework>();
+    auto session = ndk::SharedRefBase::make<CameraDeviceSession>(nullptr, framework,
+                                                                 hwCamera);
+
+    const StreamConfiguration cfg = makeYuvJpegConfig();
+    std::vector<HalStream> halStreams;
+    ASSERT_TRUE(session->configureStreams(cfg, &halStreams).isOk());
+    ASSERT_TRUE(framework->allocateBuffers(cfg.streams, halStreams));
+
+    // the framework does not submit while it flushes
+    std::mutex submitMtx;
+    std::atomic<bool> stopBursts = false;
+    std::thread burstThread([&](){
+        const std::vector<int32_t> streamIds = {kYuvStreamId, kJpegStreamId};
+        while (!stopBursts) {
+            size_t n;
+            {
+                std::lock_guard<std::mutex> lock(submitMtx);
+                n = framework->submit(*session, kBurstSize, streamIds);
+            }
+            if (!n) {
+                std::this_thread::sleep_for(1ms);
+            }
+        }
+    });
+
+    std::vector<std::chrono::steady_clock::duration> latencies;
+    for (int i = 0; i < kNumFlushes; ++i) {
+        std::this_thread::sleep_for(150ms);
+
+        std::lock_guard<std::mutex> lock(submitMtx);
+        const auto start = std::chrono::steady_clock::now();
+        EXPECT_TRUE(session->flush().isOk());
+        latencies.push_back(std::chrono::steady_clock::now() - start);
+        EXPECT_EQ(framework->getNumBuffersInFlight(), 0U);
+    }
+
+    stopBursts = true;
+    burstThread.join();
+
+    ASSERT_TRUE(session->flush().isOk());
+    EXPECT_EQ(framework->getNumBuffersInFlight(), 0U);
+    EXPECT_GT(framework->getNumShutters(), 0U);
+
+    std::sort(latencies.begin(), latencies.end());
+    const int medianUs = latencies[latencies.size() / 2] / 1us;
+    const int maxUs = latencies.back() / 1us;
+    RecordProperty("median_flush_latency_us", medianUs);
+    RecordProperty("max_flush_latency_us", maxUs);
+    EXPECT_LT(latencies.back(), kFlushBudget) << "median=" << medianUs << "us";
+
+    EXPECT_TRUE(session->close().isOk());
+}
+
+// Requests wait in the queue for their (slow) frames, the JPEG buffers
+// they hold come back as soon as the JPEG stream is flushed.
+TEST(SignalStreamFlushTest, ReturnsQueuedBuffers) {
+    hw::FakeHwCamera hwCamera({
+        500000000,  // frameDurationNs
+        0,          // queryFrameNs
+        0,          // encodeNs
+    });
+
+    auto framework = ndk::SharedRefBase::make<FakeCameraFramework>();
+    auto session = ndk::SharedRefBase::make<CameraDeviceSession>(nullptr, framework,
+                                                                 hwCamera);
+
+    const StreamConfiguration cfg = makeYuvJpegConfig();
+    std::vector<HalStream> halStreams;
+    ASSERT_TRUE(session->configureStreams(cfg, &halStreams).isOk());
+    ASSERT_TRUE(framework->allocateBuffers(cfg.streams, halStreams));
+
+    const size_t numJpegBuffers = framework->getNumFreeBuffers(kJpegStreamId);
+    const size_t numYuvBuffers = framework->getNumFreeBuffers(kYuvStreamId);
+    ASSERT_EQ(framework->submit(*session, numYuvBuffers, {kYuvStreamId, kJpegStreamId}),
+              numYuvBuffers);
+
+    std::this_thread::sleep_for(50ms);
+    ASSERT_TRUE(session->signalStreamFlush({kJpegStreamId}, cfg.streamConfigCounter).isOk());
+
+    const auto deadline = std::chrono::steady_clock::now() + kFlushBudget;
+    while ((framework->getNumFreeBuffers(kJpegStreamId) < numJpegBuffers) &&
+           (std::chrono::steady_clock::now() < deadline)) {
+        std::this_thread::sleep_for(1ms);
+    }
+
+    EXPECT_EQ(framework->getNumFreeBuffers(kJpegStreamId), numJpegBuffers);
+    // YUV buffers still wait for their frames
+    EXPECT_LT(framework->getNumFreeBuffers(kYuvStreamId), numYuvBuffers);
+
+    EXPECT_TRUE(session->close().isOk());
+    EXPECT_EQ(framework->getNumBuffersInFlight(), 0U);
+}
+
+// A JPEG burst goes offline and the camera is closed and reopened while the
+// offline session encodes. Reopening waits for one encode at most (the one
+// running when switching), not for the whole burst; every buffer left in the
+// offline session comes back encoded.
+TEST(SwitchToOfflineTest, ReopenWhileEncoding) {
+    hw::FakeHwCamera hwCamera({
+        1000000000 / 30,  // frameDurationNs
+        0,                // queryFrameNs
+        kSlowEncodeNs,    // encodeNs
+    });
+
+    auto framework = ndk::SharedRefBase::make<FakeCameraFramework>();
+    auto session = ndk::SharedRefBase::make<CameraDeviceSession>(nullptr, framework,
+                                                                 hwCamera);
+
+    const StreamConfiguration cfg = makeYuvJpegConfig();
+    std::vector<HalStream> halStreams;
+    ASSERT_TRUE(session->configureStreams(cfg, &halStreams).isOk());
+    ASSERT_TRUE(framework->allocateBuffers(cfg.streams, halStreams));
+
+    const size_t numJpegBuffers = framework->getNumFreeBuffers(kJpegStreamId);
+    ASSERT_EQ(framework->submit(*session, numJpegBuffers, {kJpegStreamId}), numJpegBuffers);
+
+    // all frames are captured, encodes are queued
+    std::this_thread::sleep_for(1ns * (1000000000 / 30) * (numJpegBuffers + 1));
+
+    const auto start = std::chrono::steady_clock::now();
+    CameraOfflineSessionInfo info;
+    std::shared_ptr<ICameraOfflineSession> offlineSession;
+    ASSERT_TRUE(session->switchToOffline({kJpegStreamId}, &info, &offlineSession).isOk());
+    ASSERT_TRUE(offlineSession);
+    ASSERT_TRUE(offlineSession->setCallback(
+        ndk::SharedRefBase::make<FakeOfflineSessionCallback>(framework)).isOk());
+
+    EXPECT_TRUE(session->close().isOk());
+    session.reset();
+
+    auto reopened = ndk::SharedRefBase::make<CameraDeviceSession>(nullptr, framework,
+                                                                  hwCamera);
+    ASSERT_TRUE(reopened->configureStreams(cfg, &halStreams).isOk());
+    const auto reopenLatency = std::chrono::steady_clock::now() - start;
+    RecordProperty("reopen_latency_us", int(reopenLatency / 1us));
+    EXPECT_LT(reopenLatency, kReopenBudget);
+
+    size_t numOffline = 0;
+    for (const OfflineStream& os : info.offlineStreams) {
+        numOffline += os.numOutstandingBuffers;
+    }
+    EXPECT_GT(numOffline, 1U);
+
+    const auto deadline = std::chrono::steady_clock::now() +
+        1ns * kSlowEncodeNs * (numJpegBuffers + 2);
+    while ((framework->getNumBuffersInFlight() > 0) &&
+           (std::chrono::steady_clock::now() < deadline)) {
+        std::this_thread::sleep_for(10ms);
+    }
+
+    EXPECT_EQ(framework->getNumBuffersInFlight(), 0U);
+    EXPECT_EQ(framework->getNumFreeBuffers(kJpegStreamId), numJpegBuffers);
+    EXPECT_EQ(framework->getNumFailedBuffers(), 0U);
+
+    EXPECT_TRUE(offlineSession->close().isOk());
+    EXPECT_TRUE(reopened->close().isOk());
+}
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <aidl/android/hardware/camera/device/StreamConfigurationMode.h>
+#include <aidl/android/hardware/graphics/common/Dataspace.h>
+
+#include "CameraDeviceSession.h"
+#include "fake_camera_framework.h"
+#include "fake_hw_camera.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+using aidl::android::hardware::camera::device::StreamConfigurationMode;
+using aidl::android::hardware::camera::device::StreamRotation;
+using aidl::android::hardware::camera::device::StreamType;
+using aidl::android::hardware::graphics::common::Dataspace;
+
+using namespace std::chrono_literals;
+
+constexpr int32_t kHighSpeedFps = 240;
+constexpr size_t kBatchSize = kHighSpeedFps / 30;  // as the framework sends them
+constexpr int32_t kPreviewStreamId = 0;
+constexpr int32_t kRecordStreamId = 1;
+
+Stream makeHighSpeedStream(const int32_t id, const BufferUsage usage) {
+    Stream s;
+    s.id = id;
+    s.streamType = StreamType::OUTPUT;
+    s.width = 640;
+    s.height = 480;
+    s.format = PixelFormat::IMPLEMENTATION_DEFINED;
+    s.usage = usage;
+    s.dataSpace = Dataspace::UNKNOWN;
+    s.rotation = StreamRotation::ROTATION_0;
+    s.bufferSize = 0;
+    return s;
+}
+
+// A constrained high-speed session (preview and recording) at 240 fps: the
+// framework submits batches of 8 requests as soon as it has buffers for
+// them. The iteration time is one processCaptureRequest call, the counters
+// show the frame rate the capture thread keeps up.
+void BM_HighSpeedSession240Fps(benchmark::State& state) {
+    hw::FakeHwCamera hwCamera({
+        1000000000 / kHighSpeedFps,  // frameDurationNs
+        500000,                      // queryFrameNs
+        0,                           // encodeNs
+        kHighSpeedFps,               // highSpeedMaxFps
+    });
+
+    auto framework = ndk::SharedRefBase::make<FakeCameraFramework>();
+    auto session = ndk::SharedRefBase::make<CameraDeviceSession>(nullptr, framework,
+                                                                 hwCamera);
+
+    StreamConfiguration cfg;
+    cfg.streams.push_back(makeHighSpeedStream(kPreviewStreamId, BufferUsage::CPU_READ_OFTEN));
+    cfg.streams.push_back(makeHighSpeedStream(kRecordStreamId, BufferUsage::VIDEO_ENCODER));
+    cfg.operationMode = StreamConfigurationMode::CONSTRAINED_HIGH_SPEED_MODE;
+    cfg.streamConfigCounter = 1;
+
+    std::vector<HalStream> halStreams;
+    if (!session->configureStreams(cfg, &halStreams).isOk() ||
+            !framework->allocateBuffers(cfg.streams, halStreams)) {
+        state.SkipWithError("could not configure a high-speed session");
+        return;
+    }
+
+    const std::vector<int32_t> streamIds = {kPreviewStreamId, kRecordStreamId};
+    const uint64_t shutters0 = framework->getNumShutters();
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t numRequests = 0;
+
+    for (auto _ : state) {
+        while (framework->getNumFreeBuffers(kPreviewStreamId) < kBatchSize) {
+            std::this_thread::sleep_for(100us);
+        }
+
+        const auto submitStart = std::chrono::steady_clock::now();
+        numRequests += framework->submit(*session, kBatchSize, streamIds);
+        state.SetIterationTime(std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - submitStart).count());
+    }
+
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    const uint64_t shutters = framework->getNumShutters() - shutters0;
+
+    session->flush();
+    session->close();
+
+    state.counters["fps"] = shutters / seconds;
+    state.counters["requests"] = numRequests;
+    state.counters["errors"] = framework->getNumErrors();
+}
+
+BENCHMARK(BM_HighSpeedSession240Fps)->UseManualTime()->MinTime(2.0);
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
+
+BENCHMARK_MAIN();
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <system/camera_metadata.h>
+
+#include "converters.h"
+#include "exif.h"
+#include "fake_qemu_host.h"
+#include "jpeg.h"
+#include "metadata_utils.h"
+#include "qemu_channel.h"
+#include "yuv.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+constexpr uint32_t kPixelFormatYUV420 = 0x32315559;  // V4L2_PIX_FMT_YUV420
+const float kWhiteBalance[3] = {1, 1, 1};
+
+// a gradient, flat images compress too well to be representative
+std::vector<uint32_t> makeRgbaImage(const size_t width, const size_t height) {
+    std::vector<uint32_t> rgba(width * height);
+    uint32_t* p = rgba.data();
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x, ++p) {
+            *p = 0xFF000000U | (((x + y) & 0xFF) << 16) | ((y & 0xFF) << 8) | (x & 0xFF);
+        }
+    }
+    return rgba;
+}
+
+enum class YuvLayout { I420, NV21, Generic };
+
+struct Yuv420Image {
+    Yuv420Image(const size_t width, const size_t height, const YuvLayout layout)
+            : data(width * height * 2) {
+        const size_t area = width * height;
+        uint8_t* const y = data.data();
+        ycbcr = yuv::NV21init(width, height, y);
+
+        switch (layout) {
+        case YuvLayout::I420:
+            break;
+
+        case YuvLayout::NV21:
+            ycbcr.cr = y + area;
+            ycbcr.cb = y + area + 1;
+            ycbcr.cstride = width;
+            ycbcr.chroma_step = 2;
+            break;
+
+        case YuvLayout::Generic:  // no libyuv converter for this one
+            ycbcr.cb = y + area;
+            ycbcr.cr = y + area + area / 2;
+            ycbcr.cstride = width;
+            ycbcr.chroma_step = 2;
+            break;
+        }
+    }
+
+    std::vector<uint8_t> data;
+    android_ycbcr ycbcr;
+};
+
+// the settings of a still capture request, as the framework sends them
+CameraMetadata makeStillCaptureSettings(const int32_t thumbnailWidth,
+                                        const int32_t thumbnailHeight) {
+    CameraMetadataMap m;
+
+    m[ANDROID_CONTROL_AWB_MODE] = uint8_t(ANDROID_CONTROL_AWB_MODE_AUTO);
+    m[ANDROID_FLASH_MODE] = uint8_t(ANDROID_FLASH_MODE_OFF);
+    m[ANDROID_JPEG_ORIENTATION] = int32_t(90);
+    m[ANDROID_JPEG_QUALITY] = uint8_t(85);
+    m[ANDROID_JPEG_THUMBNAIL_QUALITY] = uint8_t(85);
+    m[ANDROID_JPEG_THUMBNAIL_SIZE].add<int32_t>(thumbnailWidth).add<int32_t>(thumbnailHeight);
+    m[ANDROID_LENS_APERTURE] = float(2.8);
+    m[ANDROID_LENS_FOCAL_LENGTH] = float(4.38);
+    m[ANDROID_SENSOR_EXPOSURE_TIME] = int64_t(33333333);
+    m[ANDROID_SENSOR_SENSITIVITY] = int32_t(100);
+
+    return serializeCameraMetadataMap(m).value();
+}
+
+// args: width, height, YuvLayout
+void BM_Rgba2Yuv(benchmark::State& state) {
+    const size_t width = state.range(0);
+    const size_t height = state.range(1);
+    const std::vector<uint32_t> rgba = makeRgbaImage(width, height);
+    const Yuv420Image yuv(width, height, static_cast<YuvLayout>(state.range(2)));
+
+    for (auto _ : state) {
+        if (!conv::rgba2yuv(width, height, rgba.data(), yuv.ycbcr)) {
+            state.SkipWithError("rgba2yuv failed");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * width * height * 4);
+}
+
+BENCHMARK(BM_Rgba2Yuv)
+    ->ArgNames({"width", "height", "layout"})
+    ->Args({320, 240, 0})->Args({640, 480, 0})->Args({1920, 1080, 0})
+    ->Args({3840, 2160, 0})
+    ->Args({640, 480, 1})->Args({1920, 1080, 1})->Args({3840, 2160, 1})
+    ->Args({640, 480, 2})->Args({1920, 1080, 2});
+
+// args: width, height, thumbnail or not, encoder cache on or off
+void BM_CompressYUV(benchmark::State& state) {
+    jpeg::setReuseEncoderForTesting(state.range(3));
+
+    const Rect<uint16_t> size = {uint16_t(state.range(0)), uint16_t(state.range(1))};
+    const Yuv420Image yuv(size.width, size.height, YuvLayout::I420);
+    const std::vector<uint32_t> rgba = makeRgbaImage(size.width, size.height);
+    conv::rgba2yuv(size.width, size.height, rgba.data(), yuv.ycbcr);
+
+    const CameraMetadata settings = state.range(2) ?
+        makeStillCaptureSettings(160, 120) : makeStillCaptureSettings(0, 0);
+    std::vector<uint8_t> jpeg(size_t(size.width) * size.height * 3 / 2 + 65536);
+    size_t jpegSize = 0;
+
+    for (auto _ : state) {
+        jpegSize = jpeg::compressYUV(yuv.ycbcr, size, settings, jpeg.data(), jpeg.size());
+        if (!jpegSize) {
+            state.SkipWithError("compressYUV failed");
+            break;
+        }
+    }
+
+    state.counters["jpegBytes"] = jpegSize;
+    jpeg::setReuseEncoderForTesting(true);
+}
+
+BENCHMARK(BM_CompressYUV)
+    ->ArgNames({"width", "height", "thumbnail", "reuse"})
+    ->ArgsProduct({{320}, {240}, {0}, {0, 1}})
+    ->ArgsProduct({{640}, {480}, {0, 1}, {0, 1}})
+    ->ArgsProduct({{1920}, {1080}, {0, 1}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ExifSerialize(benchmark::State& state) {
+    const exif::ExifTemplate exifTemplate({1920, 1080});
+    const CameraMetadata settings = makeStillCaptureSettings(0, 0);
+    std::vector<uint8_t> app1;
+
+    for (auto _ : state) {
+        if (!exifTemplate.serialize(settings, nullptr, 0, &app1)) {
+            state.SkipWithError("serialize failed");
+            break;
+        }
+    }
+}
+
+BENCHMARK(BM_ExifSerialize);
+
+// The per frame part of QemuCamera::applyMetadata: the result is patched
+// in place from the request settings.
+void BM_CaptureResultUpdateInPlace(benchmark::State& state) {
+    const CameraMetadata settings = makeStillCaptureSettings(160, 120);
+    const Span<const uint32_t> resultTags = metadataGetRawCaptureResultTags();
+    CameraMetadata result = metadataBuildCaptureResultTemplate(settings, resultTags).value();
+
+    for (auto _ : state) {
+        if (!metadataUpdateInPlace(&result, settings, resultTags)) {
+            state.SkipWithError("metadataUpdateInPlace failed");
+            break;
+        }
+        metadataSetEntry(&result, ANDROID_SENSOR_EXPOSURE_TIME, int64_t(16666666));
+        metadataSetEntry(&result, ANDROID_SENSOR_TIMESTAMP, int64_t(state.iterations()));
+    }
+}
+
+BENCHMARK(BM_CaptureResultUpdateInPlace);
+
+// args: binary protocol or text, frame requests in flight. The host does
+// not write frames, this is the channel overhead per frame.
+void BM_QemuChannelFrames(benchmark::State& state) {
+    const size_t depth = state.range(1);
+    hw::FakeQemuHost host(state.range(0));
+    host.setReplyBatch(depth);
+    hw::QemuChannel channel(host.takeChannelFd());
+    channel.negotiate();
+
+    std::vector<int> ids(depth);
+    for (auto _ : state) {
+        for (int& id : ids) {
+            id = channel.sendFrameRequest(640, 480, kPixelFormatYUV420,
+                                          kWhiteBalance, 0, 0);
+        }
+        for (const int id : ids) {
+            if ((id <= 0) || channel.waitFrameReply(id)) {
+                state.SkipWithError("frame request failed");
+                return;
+            }
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * depth);
+}
+
+BENCHMARK(BM_QemuChannelFrames)
+    ->ArgNames({"binary", "depth"})
+    ->Args({0, 1})->Args({0, 4})->Args({1, 1})->Args({1, 4});
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
+
+BENCHMARK_MAIN();
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <aidl/android/hardware/camera/device/StreamConfigurationMode.h>
+#include <aidl/android/hardware/graphics/common/Dataspace.h>
+
+#include "CameraDevice.h"
+#include "CameraDeviceSession.h"
+#include "QemuCamera.h"
+#include "fake_camera_framework.h"
+#include "fake_qemu_host.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+using aidl::android::hardware::camera::device::ICameraDeviceSession;
+using aidl::android::hardware::camera::device::StreamConfigurationMode;
+using aidl::android::hardware::camera::device::StreamRotation;
+using aidl::android::hardware::camera::device::StreamType;
+using aidl::android::hardware::graphics::common::Dataspace;
+
+using namespace std::chrono_literals;
+
+constexpr int32_t kPreviewStreamId = 0;
+constexpr int32_t kJpegStreamId = 1;
+constexpr int32_t kJpegBufferSize = 1 << 20;
+constexpr uint16_t kSensorWidth = 1280;
+constexpr uint16_t kSensorHeight = 720;
+
+enum class StreamSet { YUV, YUV_JPEG, RGBA };
+
+Stream makeStream(const int32_t id, const PixelFormat format,
+                  const Dataspace dataspace, const Rect<uint16_t> size) {
+    Stream s;
+    s.id = id;
+    s.streamType = StreamType::OUTPUT;
+    s.width = size.width;
+    s.height = size.height;
+    s.format = format;
+    s.usage = BufferUsage::CPU_READ_OFTEN;
+    s.dataSpace = dataspace;
+    s.rotation = StreamRotation::ROTATION_0;
+    s.bufferSize = (format == PixelFormat::BLOB) ? kJpegBufferSize : 0;
+    return s;
+}
+
+// QemuCamera talks to FakeQemuHost which replies to frame requests right
+// away (without writing pixels): what is measured is the guest side of the
+// pipeline, i.e. the session, gralloc, conversions and JPEG encoding.
+// Args: the stream set (0 - YUV, 1 - YUV+JPEG, 2 - RGBA) and the width and
+// height of the streams. The framework sends a request as soon as it has a
+// preview buffer, the counters show the frame rate delivered end to end.
+void BM_QemuCameraStreaming(benchmark::State& state) {
+    const auto streamSet = static_cast<StreamSet>(state.range(0));
+    const Rect<uint16_t> size = {static_cast<uint16_t>(state.range(1)),
+                                 static_cast<uint16_t>(state.range(2))};
+
+    hw::FakeQemuHost host(true);
+
+    hw::QemuCamera::Parameters params;
+    params.name = "benchmark";
+    params.supportedResolutions = {{640, 480}, {kSensorWidth, kSensorHeight}};
+    params.availableThumbnailResolutions = {{0, 0}, {160, 120}};
+    params.sensorSize = {kSensorWidth, kSensorHeight};
+    params.isBackFacing = true;
+    params.frameDistributor = std::make_shared<hw::FrameDistributor>();
+    params.openChannel = [&host](){ return host.takeChannelFd(); };
+
+    const auto device = ndk::SharedRefBase::make<CameraDevice>(
+        std::make_unique<hw::QemuCamera>(params));
+    const auto framework = ndk::SharedRefBase::make<FakeCameraFramework>();
+    std::shared_ptr<ICameraDeviceSession> session;
+    const std::optional<CameraMetadata> settings =
+        device->getDefaultRequestSettings(RequestTemplate::PREVIEW);
+    if (!settings || !device->open(framework, &session).isOk()) {
+        state.SkipWithError("could not open the camera");
+        return;
+    }
+
+    StreamConfiguration cfg;
+    cfg.streams.push_back(makeStream(
+        kPreviewStreamId,
+        (streamSet == StreamSet::RGBA) ? PixelFormat::RGBA_8888 : PixelFormat::YCBCR_420_888,
+        Dataspace::UNKNOWN, size));
+    if (streamSet == StreamSet::YUV_JPEG) {
+        cfg.streams.push_back(makeStream(kJpegStreamId, PixelFormat::BLOB,
+                                         Dataspace::JFIF, size));
+    }
+    cfg.operationMode = StreamConfigurationMode::NORMAL_MODE;
+    cfg.streamConfigCounter = 1;
+
+    std::vector<HalStream> halStreams;
+    if (!session->configureStreams(cfg, &halStreams).isOk() ||
+            !framework->allocateBuffers(cfg.streams, halStreams)) {
+        state.SkipWithError("could not configure streams");
+        session->close();
+        return;
+    }
+
+    std::vector<int32_t> streamIds;
+    for (const Stream& s : cfg.streams) {
+        streamIds.push_back(s.id);
+    }
+
+    bool first = true;
+    const uint64_t shutters0 = framework->getNumShutters();
+    const auto start = std::chrono::steady_clock::now();
+
+    for (auto _ : state) {
+        while (framework->getNumFreeBuffers(kPreviewStreamId) == 0) {
+            std::this_thread::sleep_for(100us);
+        }
+
+        // the settings go with the first request only, as the framework does
+        framework->submit(*session, 1, streamIds,
+                          first ? settings.value() : CameraMetadata());
+        first = false;
+    }
+
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    const uint64_t shutters = framework->getNumShutters() - shutters0;
+
+    session->flush();
+    session->close();
+
+    state.counters["fps"] = shutters / seconds;
+    state.counters["errors"] = framework->getNumErrors();
+    state.counters["failed"] = framework->getNumFailedBuffers();
+    state.counters["hostFrames"] = host.getNumFrameRequests();
+}
+
+BENCHMARK(BM_QemuCameraStreaming)
+    ->ArgNames({"streams", "width", "height"})
+    ->ArgsProduct({{0, 1, 2}, {640}, {480}})
+    ->ArgsProduct({{0, 1, 2}, {kSensorWidth}, {kSensorHeight}})
+    ->MinTime(2.0);
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
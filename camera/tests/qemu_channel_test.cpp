@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+
+#include <gtest/gtest.h>
+
+#include "fake_qemu_host.h"
+#include "qemu_channel.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace hw {
+namespace {
+
+constexpr uint32_t kWidth = 640;
+constexpr uint32_t kHeight = 480;
+constexpr uint32_t kPixelFormat = 0x32315559;  // V4L2_PIX_FMT_YUV420
+const float kWhiteBalance[3] = {1, 1, 1};
+
+int sendFrame(QemuChannel& channel) {
+    return channel.sendFrameRequest(kWidth, kHeight, kPixelFormat, kWhiteBalance, 0, 0);
+}
+
+TEST(QemuChannelTest, OldHostKeepsTextProtocol) {
+    FakeQemuHost host(false);
+    QemuChannel channel(host.takeChannelFd());
+
+    channel.negotiate();
+    EXPECT_FALSE(channel.isBinary());
+    EXPECT_EQ(channel.queryFrame(kWidth, kHeight, kPixelFormat, kWhiteBalance, 0, 0), 0);
+
+    static const char kStartQuery[] = "start";
+    EXPECT_EQ(channel.runQuery(kStartQuery, sizeof(kStartQuery)), 0);
+    EXPECT_EQ(host.getQueries(), std::vector<std::string>({"caps", "start"}));
+    EXPECT_EQ(host.getNumFrameRequests(), 1U);
+}
+
+TEST(QemuChannelTest, NegotiatesBinaryProtocol) {
+    FakeQemuHost host(true);
+    QemuChannel channel(host.takeChannelFd());
+
+    channel.negotiate();
+    EXPECT_TRUE(channel.isBinary());
+    EXPECT_EQ(channel.queryFrame(kWidth, kHeight, kPixelFormat, kWhiteBalance, 0, 0), 0);
+    EXPECT_EQ(host.getNumFrameRequests(), 1U);
+}
+
+TEST(QemuChannelTest, PipelinedTextRequests) {
+    FakeQemuHost host(false);
+    host.setReplyBatch(3);
+    QemuChannel channel(host.takeChannelFd());
+    channel.negotiate();
+
+    const int id1 = sendFrame(channel);
+    const int id2 = sendFrame(channel);
+    const int id3 = sendFrame(channel);
+    ASSERT_GT(id1, 0);
+    ASSERT_GT(id2, 0);
+    ASSERT_GT(id3, 0);
+
+    // replies to the earlier requests are kept for their waits
+    EXPECT_EQ(channel.waitFrameReply(id3), 0);
+    EXPECT_EQ(channel.waitFrameReply(id1), 0);
+    EXPECT_EQ(channel.waitFrameReply(id2), 0);
+}
+
+TEST(QemuChannelTest, BinaryRepliesOutOfOrder) {
+    FakeQemuHost host(true);
+    host.setReplyBatch(4);
+    host.failFrame(2, -EIO);
+    QemuChannel channel(host.takeChannelFd());
+    channel.negotiate();
+    ASSERT_TRUE(channel.isBinary());
+
+    int ids[4];
+    for (int& id : ids) {
+        id = sendFrame(channel);
+        ASSERT_GT(id, 0);
+    }
+
+    // the host replies in the reverse order
+    EXPECT_EQ(channel.waitFrameReply(ids[0]), 0);
+    EXPECT_EQ(channel.waitFrameReply(ids[1]), -EIO);
+    EXPECT_EQ(channel.waitFrameReply(ids[2]), 0);
+    EXPECT_EQ(channel.waitFrameReply(ids[3]), 0);
+    EXPECT_EQ(host.getNumFrameRequests(), 4U);
+}
+
+TEST(QemuChannelTest, RunQueryWithFramesInFlight) {
+    FakeQemuHost host(true);
+    QemuChannel channel(host.takeChannelFd());
+    channel.negotiate();
+
+    const int id = sendFrame(channel);
+    ASSERT_GT(id, 0);
+
+    static const char kStopQuery[] = "stop";
+    EXPECT_EQ(channel.runQuery(kStopQuery, sizeof(kStopQuery)), -EBUSY);
+    EXPECT_EQ(channel.waitFrameReply(id), 0);
+    EXPECT_EQ(channel.runQuery(kStopQuery, sizeof(kStopQuery)), 0);
+}
+
+TEST(QemuChannelTest, CancelledWaitIsDrained) {
+    FakeQemuHost host(true);
+    host.setReplyBatch(2);
+    QemuChannel channel(host.takeChannelFd());
+    channel.negotiate();
+
+    const int id1 = sendFrame(channel);
+    ASSERT_GT(id1, 0);
+
+    channel.cancel();
+    EXPECT_EQ(channel.waitFrameReply(id1, true), -ECANCELED);
+    EXPECT_TRUE(channel.hasCancelled());
+    channel.clearCancel();
+
+    // releases both replies, the one for `id1` is dropped
+    const int id2 = sendFrame(channel);
+    ASSERT_GT(id2, 0);
+    EXPECT_EQ(channel.waitFrameReply(id2), 0);
+    EXPECT_EQ(channel.drainCancelled(), 0);
+    EXPECT_FALSE(channel.hasCancelled());
+}
+
+// The host never replies to the cancelled request, draining gives up
+// instead of hanging the capture thread.
+TEST(QemuChannelTest, DrainCancelledTimesOut) {
+    FakeQemuHost host(true);
+    host.setReplyBatch(2);
+    QemuChannel channel(host.takeChannelFd());
+    channel.negotiate();
+
+    const int id = sendFrame(channel);
+    ASSERT_GT(id, 0);
+
+    channel.cancel();
+    EXPECT_EQ(channel.waitFrameReply(id, true), -ECANCELED);
+    EXPECT_EQ(channel.drainCancelled(), -ECANCELED);  // still cancelled
+    channel.clearCancel();
+
+    EXPECT_EQ(channel.drainCancelled(), -ETIMEDOUT);
+    EXPECT_TRUE(channel.hasCancelled());
+}
+
+}  // namespace
+}  // namespace hw
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <system/camera_metadata.h>
+
+#include <aidl/android/hardware/camera/device/StreamConfigurationMode.h>
+#include <aidl/android/hardware/graphics/common/Dataspace.h>
+
+#include "CameraDeviceSession.h"
+#include "fake_camera_framework.h"
+#include "fake_hw_camera.h"
+#include "metadata_utils.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+using aidl::android::hardware::camera::device::StreamConfigurationMode;
+using aidl::android::hardware::camera::device::StreamRotation;
+using aidl::android::hardware::camera::device::StreamType;
+using aidl::android::hardware::graphics::common::Dataspace;
+
+using namespace std::chrono_literals;
+
+constexpr int32_t kJpegStreamId = 1;
+constexpr int32_t kInputStreamId = 2;
+constexpr int32_t kJpegBufferSize = 1 << 20;
+constexpr auto kTimeout = 2s;
+
+Stream makeStream(const int32_t id, const StreamType type, const PixelFormat format,
+                  const Dataspace dataspace, const int32_t bufferSize) {
+    Stream s;
+    s.id = id;
+    s.streamType = type;
+    s.width = 640;
+    s.height = 480;
+    s.format = format;
+    s.usage = (type == StreamType::INPUT) ?
+        BufferUsage::CPU_WRITE_OFTEN : BufferUsage::CPU_READ_OFTEN;
+    s.dataSpace = dataspace;
+    s.rotation = StreamRotation::ROTATION_0;
+    s.bufferSize = bufferSize;
+    return s;
+}
+
+CameraMetadata makeStillCaptureSettings() {
+    CameraMetadataMap m;
+    m[ANDROID_CONTROL_CAPTURE_INTENT] = uint8_t(ANDROID_CONTROL_CAPTURE_INTENT_STILL_CAPTURE);
+    m[ANDROID_JPEG_QUALITY] = uint8_t(85);
+    m[ANDROID_JPEG_ORIENTATION] = int32_t(0);
+    m[ANDROID_SENSOR_TIMESTAMP] = int64_t(1000000000);
+    return serializeCameraMetadataMap(m).value();
+}
+
+// The time from sending a still capture request until its JPEG is back.
+// Arg: 0 - a regular capture (waits for a frame from the sensor, then
+// encodes it), 1 - ZSL, an app kept YUV frame is reprocessed into JPEG.
+// Both encode the same (black) 640x480 image with the same settings.
+void BM_StillCaptureToJpeg(benchmark::State& state) {
+    const bool reprocess = state.range(0);
+
+    hw::FakeHwCamera hwCamera({
+        1000000000 / 30,  // frameDurationNs
+        5000000,          // queryFrameNs
+        0,                // encodeNs, not used
+        0,                // highSpeedMaxFps
+        true,             // compressJpeg
+    });
+
+    auto framework = ndk::SharedRefBase::make<FakeCameraFramework>();
+    auto session = ndk::SharedRefBase::make<CameraDeviceSession>(nullptr, framework,
+                                                                 hwCamera);
+
+    StreamConfiguration cfg;
+    cfg.streams.push_back(makeStream(kInputStreamId, StreamType::INPUT,
+                                     PixelFormat::YCBCR_420_888, Dataspace::UNKNOWN, 0));
+    cfg.streams.push_back(makeStream(kJpegStreamId, StreamType::OUTPUT,
+                                     PixelFormat::BLOB, Dataspace::JFIF, kJpegBufferSize));
+    cfg.operationMode = StreamConfigurationMode::NORMAL_MODE;
+    cfg.streamConfigCounter = 1;
+
+    std::vector<HalStream> halStreams;
+    if (!session->configureStreams(cfg, &halStreams).isOk() ||
+            !framework->allocateBuffers(cfg.streams, halStreams)) {
+        state.SkipWithError("could not configure streams");
+        return;
+    }
+
+    const CameraMetadata settings = makeStillCaptureSettings();
+
+    for (auto _ : state) {
+        const auto start = std::chrono::steady_clock::now();
+        const bool submitted = reprocess ?
+            framework->submitReprocess(*session, kInputStreamId, {kJpegStreamId}, settings) :
+            (framework->submit(*session, 1, {kJpegStreamId}, settings) == 1);
+        if (!submitted) {
+            state.SkipWithError("the request was not accepted");
+            break;
+        }
+
+        const auto deadline = start + kTimeout;
+        while ((framework->getNumBuffersInFlight() > 0) &&
+               (std::chrono::steady_clock::now() < deadline)) {
+            std::this_thread::sleep_for(100us);
+        }
+
+        const auto end = std::chrono::steady_clock::now();
+        if (framework->getNumBuffersInFlight() > 0) {
+            state.SkipWithError("the JPEG did not come back");
+            break;
+        }
+
+        state.SetIterationTime(std::chrono::duration<double>(end - start).count());
+    }
+
+    session->close();
+
+    state.counters["failed"] = framework->getNumFailedBuffers();
+}
+BENCHMARK(BM_StillCaptureToJpeg)
+    ->ArgName("zsl")->Arg(0)->Arg(1)
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <system/camera_metadata.h>
+
+#include <aidl/android/hardware/camera/device/StreamConfigurationMode.h>
+#include <aidl/android/hardware/graphics/common/Dataspace.h>
+
+#include "CameraDeviceSession.h"
+#include "fake_camera_framework.h"
+#include "fake_hw_camera.h"
+#include "metadata_utils.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+using aidl::android::hardware::camera::device::StreamConfigurationMode;
+using aidl::android::hardware::camera::device::StreamRotation;
+using aidl::android::hardware::camera::device::StreamType;
+using aidl::android::hardware::graphics::common::Dataspace;
+
+using namespace std::chrono_literals;
+
+constexpr int32_t kYuvStreamId = 0;
+constexpr int32_t kJpegStreamId = 1;
+constexpr int32_t kInputStreamId = 2;
+constexpr int32_t kJpegBufferSize = 1 << 20;
+constexpr int32_t kTooSmallJpegBufferSize = 512;  // JPEG headers do not fit
+constexpr int kNumRequests = 9;
+constexpr auto kTimeout = 2s;
+
+Stream makeStream(const int32_t id, const StreamType type, const PixelFormat format,
+                  const Dataspace dataspace, const int32_t bufferSize) {
+    Stream s;
+    s.id = id;
+    s.streamType = type;
+    s.width = 640;
+    s.height = 480;
+    s.format = format;
+    s.usage = (type == StreamType::INPUT) ?
+        BufferUsage::CPU_WRITE_OFTEN : BufferUsage::CPU_READ_OFTEN;
+    s.dataSpace = dataspace;
+    s.rotation = StreamRotation::ROTATION_0;
+    s.bufferSize = bufferSize;
+    return s;
+}
+
+// ZSL: the app keeps YUV frames and sends them back to get JPEG or YUV
+StreamConfiguration makeReprocessConfig(const int32_t jpegBufferSize) {
+    StreamConfiguration cfg;
+    cfg.streams.push_back(makeStream(kInputStreamId, StreamType::INPUT,
+                                     PixelFormat::YCBCR_420_888, Dataspace::UNKNOWN, 0));
+    cfg.streams.push_back(makeStream(kYuvStreamId, StreamType::OUTPUT,
+                                     PixelFormat::YCBCR_420_888, Dataspace::UNKNOWN, 0));
+    cfg.streams.push_back(makeStream(kJpegStreamId, StreamType::OUTPUT,
+                                     PixelFormat::BLOB, Dataspace::JFIF, jpegBufferSize));
+    cfg.operationMode = StreamConfigurationMode::NORMAL_MODE;
+    cfg.streamConfigCounter = 1;
+    return cfg;
+}
+
+// the capture result of the input image as the app sends it back
+CameraMetadata makeReprocessSettings() {
+    CameraMetadataMap m;
+    m[ANDROID_CONTROL_CAPTURE_INTENT] = uint8_t(ANDROID_CONTROL_CAPTURE_INTENT_STILL_CAPTURE);
+    m[ANDROID_JPEG_QUALITY] = uint8_t(85);
+    m[ANDROID_JPEG_ORIENTATION] = int32_t(0);
+    m[ANDROID_SENSOR_TIMESTAMP] = int64_t(1000000000);
+    return serializeCameraMetadataMap(m).value();
+}
+
+// The input buffer is read by the delayed JPEG encode and goes back with the
+// last result of the request (or with the request if there are no JPEG
+// outputs). It must come back once whether the JPEG succeeds or fails.
+// Param: the JPEG buffer is too small and every JPEG output fails.
+class ReprocessTest : public ::testing::TestWithParam<bool> {};
+
+TEST_P(ReprocessTest, InputBufferReturnedOnce) {
+    const bool jpegFails = GetParam();
+
+    hw::FakeHwCamera hwCamera({
+        1000000000 / 30,  // frameDurationNs
+        0,                // queryFrameNs
+        0,                // encodeNs
+    });
+
+    auto framework = ndk::SharedRefBase::make<FakeCameraFramework>();
+    auto session = ndk::SharedRefBase::make<CameraDeviceSession>(nullptr, framework,
+                                                                 hwCamera);
+
+    const StreamConfiguration cfg =
+        makeReprocessConfig(jpegFails ? kTooSmallJpegBufferSize : kJpegBufferSize);
+    std::vector<HalStream> halStreams;
+    ASSERT_TRUE(session->configureStreams(cfg, &halStreams).isOk());
+    ASSERT_TRUE(framework->allocateBuffers(cfg.streams, halStreams));
+    const size_t numInputBuffers = framework->getNumFreeBuffers(kInputStreamId);
+    ASSERT_GT(numInputBuffers, 0U);
+
+    const CameraMetadata settings = makeReprocessSettings();
+    const std::vector<int32_t> outputs[] = {
+        {kJpegStreamId},
+        {kYuvStreamId, kJpegStreamId},
+        {kYuvStreamId},
+    };
+
+    size_t numJpegOutputs = 0;
+    for (int i = 0; i < kNumRequests; ++i) {
+        const std::vector<int32_t>& streamIds = outputs[i % std::size(outputs)];
+
+        // the input buffers are few, wait for one to come back
+        const auto deadline = std::chrono::steady_clock::now() + kTimeout;
+        while (!framework->submitReprocess(*session, kInputStreamId, streamIds, settings)) {
+            ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+            std::this_thread::sleep_for(1ms);
+        }
+
+        numJpegOutputs += std::count(streamIds.begin(), streamIds.end(), kJpegStreamId);
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    while ((framework->getNumBuffersInFlight() > 0) &&
+           (std::chrono::steady_clock::now() < deadline)) {
+        std::this_thread::sleep_for(1ms);
+    }
+
+    EXPECT_EQ(framework->getNumBuffersInFlight(), 0U);
+    EXPECT_EQ(framework->getNumUnexpectedBuffers(), 0U);
+    EXPECT_EQ(framework->getNumFreeBuffers(kInputStreamId), numInputBuffers);
+    EXPECT_EQ(framework->getNumFailedBuffers(), jpegFails ? numJpegOutputs : 0U);
+
+    EXPECT_TRUE(session->close().isOk());
+}
+
+INSTANTIATE_TEST_SUITE_P(JpegOutcome, ReprocessTest, ::testing::Values(false, true),
+                         [](const ::testing::TestParamInfo<bool>& info) {
+                             return info.param ? "JpegFails" : "JpegSucceeds";
+                         });
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <aidlcommonsupport/NativeHandle.h>
+#include <benchmark/benchmark.h>
+#include <ui/GraphicBuffer.h>
+
+#include "StreamBufferCache.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace provider {
+namespace implementation {
+namespace {
+
+constexpr int32_t kNumStreams = 3;  // preview, record and still
+constexpr int32_t kMaxBuffers = 8;
+
+// The framework side: gralloc buffers of every stream and their StreamBuffer
+// objects as they come in capture requests (with the handles).
+struct FakeStreamBuffers {
+    FakeStreamBuffers() {
+        int64_t bufferId = 1;
+        for (int32_t streamId = 0; streamId < kNumStreams; ++streamId) {
+            for (int32_t i = 0; i < kMaxBuffers; ++i, ++bufferId) {
+                sp<GraphicBuffer> gb = sp<GraphicBuffer>::make(
+                    64, 64, PIXEL_FORMAT_RGBA_8888, 1,
+                    GraphicBuffer::USAGE_SW_WRITE_OFTEN, "StreamBufferCacheBenchmark");
+                if (gb->initCheck() != NO_ERROR) {
+                    return;
+                }
+
+                StreamBuffer sb;
+                sb.streamId = streamId;
+                sb.bufferId = bufferId;
+                sb.buffer = dupToAidl(gb->handle);
+
+                buffers.push_back(std::move(gb));
+                streamBuffers.push_back(std::move(sb));
+            }
+        }
+    }
+
+    bool ok() const { return streamBuffers.size() == (kNumStreams * kMaxBuffers); }
+
+    std::vector<sp<GraphicBuffer>> buffers;
+    std::vector<StreamBuffer> streamBuffers;
+};
+
+// Every frame looks up a cached buffer of each stream and returns it.
+void BM_StreamBufferCacheLookup(benchmark::State& state) {
+    const FakeStreamBuffers fsb;
+    if (!fsb.ok()) {
+        state.SkipWithError("could not allocate buffers");
+        return;
+    }
+
+    StreamBufferCache cache;
+    for (int32_t streamId = 0; streamId < kNumStreams; ++streamId) {
+        cache.reserve(streamId, kMaxBuffers);
+    }
+    for (const StreamBuffer& sb : fsb.streamBuffers) {
+        cache.update(sb)->finish(true);
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        for (int32_t streamId = 0; streamId < kNumStreams; ++streamId) {
+            const StreamBuffer& sb = fsb.streamBuffers[streamId * kMaxBuffers + i];
+            benchmark::DoNotOptimize(cache.update(sb)->finish(true));
+        }
+        i = (i + 1) % kMaxBuffers;
+    }
+
+    state.SetItemsProcessed(state.iterations() * kNumStreams);
+}
+
+BENCHMARK(BM_StreamBufferCacheLookup);
+
+// The framework drops the buffers of one stream (signalStreamFlush or a new
+// buffer pool) and sends new ones, they are imported again.
+void BM_StreamBufferCacheChurn(benchmark::State& state) {
+    const FakeStreamBuffers fsb;
+    if (!fsb.ok()) {
+        state.SkipWithError("could not allocate buffers");
+        return;
+    }
+
+    StreamBufferCache cache;
+    for (const StreamBuffer& sb : fsb.streamBuffers) {
+        cache.update(sb)->finish(true);
+    }
+
+    int32_t streamId = 0;
+    std::vector<BufferCache> caches(kMaxBuffers);
+    for (auto _ : state) {
+        const StreamBuffer* sbs = &fsb.streamBuffers[streamId * kMaxBuffers];
+        for (int32_t i = 0; i < kMaxBuffers; ++i) {
+            caches[i].streamId = streamId;
+            caches[i].bufferId = sbs[i].bufferId;
+        }
+
+        cache.remove(caches);
+        for (int32_t i = 0; i < kMaxBuffers; ++i) {
+            cache.update(sbs[i])->finish(true);
+        }
+
+        streamId = (streamId + 1) % kNumStreams;
+    }
+
+    state.SetItemsProcessed(state.iterations() * kMaxBuffers);
+}
+
+BENCHMARK(BM_StreamBufferCacheChurn);
+
+}  // namespace
+}  // namespace implementation
+}  // namespace provider
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android